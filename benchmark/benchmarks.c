@@ -25,14 +25,22 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
+#include <argp.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
+#include "config.h"
 #include "utils.h"
 #include "trace_debugger.h"
 #include "disassembly.h"
 #include "serialize.h"
+#include "generator.h"
 
 struct result {
     char *name;
@@ -185,7 +193,698 @@ fail:
     return status;
 }
 
-int main()
+/* Compress @p trace_path with different resync intervals and report how many
+ * bits per instruction that costs against how many instructions have to be
+ * decoded on average and at most after seeking to a random instruction, since
+ * decompression has to start at the preceding sync packet.
+ */
+int resync_tradeoff(const char *trace_path)
+{
+    int status           = 0;
+    struct trdb_ctx *ctx = trdb_new();
+
+    struct trdb_instr_head instr_list;
+    TAILQ_INIT(&instr_list);
+
+    const uint64_t intervals[] = {0, 16384, 4096, 1024, 256, 64};
+
+    if (!ctx) {
+        fprintf(stderr, "Library context allocation failed.\n");
+        status = -1;
+        goto fail;
+    }
+
+    size_t instrcnt = 0;
+    status = trdb_cvs_to_trace_list(ctx, trace_path, &instr_list, &instrcnt);
+    if (status < 0) {
+        fprintf(stderr, "CVS to tr_instr failed\n");
+        status = -1;
+        goto fail;
+    }
+
+    printf("Resync trade-off of test: %s\n", trace_path);
+    printf("%10s %10s %8s %12s %12s %12s\n", "interval", "packets", "syncs",
+           "bpi (pulp)", "avg seek", "max seek");
+
+    for (unsigned j = 0; j < TRDB_ARRAY_SIZE(intervals); j++) {
+        trdb_reset_compression(ctx);
+        trdb_set_full_address(ctx, false);
+        trdb_set_pulp_extra_packet(ctx, false);
+        trdb_set_implicit_ret(ctx, false);
+        trdb_set_compress_branch_map(ctx, true);
+        trdb_set_resync_interval(ctx, intervals[j]);
+
+        /* seek distances are measured in instructions from the last sync */
+        size_t syncs     = 0;
+        size_t last_sync = 0;
+        size_t max_gap   = 0;
+        double sum_sq    = 0;
+        size_t i         = 0;
+
+        struct tr_instr *instr;
+        TAILQ_FOREACH (instr, &instr_list, list) {
+            struct tr_packet packet = {0};
+            int step = trdb_compress_trace_step(ctx, &packet, instr);
+            if (step < 0) {
+                fprintf(stderr, "Compress trace failed\n");
+                status = -1;
+                goto fail;
+            }
+            if (step == 1 && packet.format == F_SYNC) {
+                size_t gap = i - last_sync;
+                sum_sq += (double)gap * gap;
+                max_gap   = gap > max_gap ? gap : max_gap;
+                last_sync = i;
+                syncs++;
+            }
+            i++;
+        }
+        size_t gap = i - last_sync;
+        sum_sq += (double)gap * gap;
+        max_gap = gap > max_gap ? gap : max_gap;
+
+        size_t instrs = trdb_get_instrcnt(ctx);
+        printf("%10" PRIu64 " %10zu %8zu %12lf %12.1lf %12zu\n", intervals[j],
+               trdb_get_packetcnt(ctx), syncs,
+               trdb_get_pulpbits(ctx) / (double)instrs, sum_sq / (2.0 * i),
+               max_gap);
+    }
+    printf("\n");
+
+fail:
+    trdb_free_instr_list(&instr_list);
+    trdb_free(ctx);
+    return status;
+}
+
+/* Throughput measurements. Each stage runs over a trace that has been prepared
+ * beforehand, so that only the stage itself is timed.
+ */
+enum bench_format { BENCH_TEXT, BENCH_JSON, BENCH_CSV };
+
+struct bench_opts {
+    unsigned repeat;
+    unsigned warmup;
+    unsigned scale;
+    unsigned threads;
+    size_t generate;
+    enum bench_format format;
+    FILE *fp;
+    size_t reported;
+};
+
+struct bench_input {
+    const char *name;
+    const char *trace; /* NULL if the trace is generated from elf */
+    const char *elf; /* NULL if there is no binary to decompress with */
+    bool cvs;
+};
+
+/* a trace prepared for the stages and their discarded outputs */
+struct bench_data {
+    struct trdb_ctx *ctx;
+    const struct bench_input *input;
+    unsigned threads;
+    size_t generate; /* length of generated traces */
+    bfd *abfd;
+    size_t trace_bytes;
+    struct tr_instr *samples;
+    size_t samplecnt;
+    size_t tilecnt; /* instructions in one copy of the trace */
+    struct trdb_packet_vec packets;
+    uint8_t *bin;
+    size_t binsize;
+    /* outputs of a single run */
+    struct tr_instr *out_samples;
+    struct tr_packet *out_packets;
+    uint8_t *out_bin;
+    struct trdb_packet_vec out_vec;
+    struct trdb_instr_vec out_instrs;
+};
+
+/* A stage reports how many instructions it processed and the size of the data
+ * it consumed or produced in bytes, which is the trace file for parsing and the
+ * serialized packets otherwise.
+ */
+struct bench_stage {
+    const char *name;
+    bool needs_elf;
+    int (*run)(struct bench_data *d, size_t *instrs, size_t *bytes);
+};
+
+static void bench_configure(struct bench_data *d)
+{
+    if (d->input->cvs) {
+        trdb_set_full_address(d->ctx, false);
+        trdb_set_pulp_extra_packet(d->ctx, false);
+        trdb_set_implicit_ret(d->ctx, true);
+        trdb_set_compress_branch_map(d->ctx, true);
+    } else {
+        trdb_set_full_address(d->ctx, true);
+    }
+}
+
+static void bench_restart(struct bench_data *d)
+{
+    trdb_reset_compression(d->ctx);
+    bench_configure(d);
+}
+
+static void bench_discard(struct bench_data *d)
+{
+    free(d->out_samples);
+    free(d->out_packets);
+    free(d->out_bin);
+    trdb_free_packet_vec(&d->out_vec);
+    trdb_free_instr_vec(&d->out_instrs);
+    d->out_samples = NULL;
+    d->out_packets = NULL;
+    d->out_bin     = NULL;
+}
+
+static int stage_parse(struct bench_data *d, size_t *instrs, size_t *bytes)
+{
+    int status;
+    size_t cnt = 0;
+
+    if (d->input->cvs)
+        status = trdb_cvs_to_trace_parallel(d->ctx, d->input->trace,
+                                            &d->out_samples, &cnt, d->threads);
+    else
+        status = trdb_stimuli_to_trace_parallel(
+            d->ctx, d->input->trace, &d->out_samples, &cnt, d->threads);
+
+    *instrs = cnt;
+    *bytes  = d->trace_bytes;
+    return status;
+}
+
+/* generated traces are walked with some traps, which exercises more packet
+ * types than the defaults
+ */
+static void bench_gen_config(struct trdb_gen_config *config)
+{
+    trdb_gen_default_config(config);
+    config->exception_rate = 0.0005;
+    config->interrupt_rate = 0.001;
+}
+
+static int stage_generate(struct bench_data *d, size_t *instrs, size_t *bytes)
+{
+    struct trdb_gen_config config;
+
+    bench_gen_config(&config);
+    *instrs = d->generate;
+    *bytes  = d->generate * sizeof(struct tr_instr);
+    return trdb_generate_trace(d->ctx, d->abfd, &config, d->generate,
+                               &d->out_samples);
+}
+
+static int stage_compress_step(struct bench_data *d, size_t *instrs,
+                               size_t *bytes)
+{
+    for (size_t i = 0; i < d->samplecnt; i++) {
+        struct tr_packet packet;
+        if (i % d->tilecnt == 0)
+            bench_restart(d);
+        int status = trdb_compress_trace_step(d->ctx, &packet, &d->samples[i]);
+        if (status < 0)
+            return status;
+    }
+    *instrs = d->samplecnt;
+    *bytes  = d->binsize;
+    return 0;
+}
+
+#define BENCH_BLOCK_PACKETS 4096
+
+static int stage_compress_block(struct bench_data *d, size_t *instrs,
+                                size_t *bytes)
+{
+    int status = 0;
+
+    d->out_packets = malloc(BENCH_BLOCK_PACKETS * sizeof(*d->out_packets));
+    if (!d->out_packets)
+        return -trdb_nomem;
+
+    for (size_t i = 0; i < d->samplecnt;) {
+        size_t consumed = 0;
+        size_t produced = 0;
+        size_t left     = d->tilecnt - i % d->tilecnt;
+        if (left == d->tilecnt)
+            bench_restart(d);
+        status = trdb_compress_trace_block(d->ctx, left, &d->samples[i],
+                                           BENCH_BLOCK_PACKETS, d->out_packets,
+                                           &consumed, &produced);
+        if (status < 0)
+            return status;
+        i += consumed;
+    }
+    *instrs = d->samplecnt;
+    *bytes  = d->binsize;
+    return 0;
+}
+
+static int stage_serialize(struct bench_data *d, size_t *instrs, size_t *bytes)
+{
+    size_t pos  = 0;
+    size_t size = (d->packets.size + 1) * sizeof(union trdb_pack);
+
+    d->out_bin = malloc(size);
+    if (!d->out_bin)
+        return -trdb_nomem;
+
+    /* the vector is stored in blocks, each of them is serialized at once */
+    for (size_t i = 0; i < d->packets.size; i += TRDB_VEC_BLOCK) {
+        size_t len      = d->packets.size - i;
+        size_t consumed = 0;
+        size_t written  = 0;
+        len             = len < TRDB_VEC_BLOCK ? len : TRDB_VEC_BLOCK;
+        int status      = trdb_pulp_serialize_packets(
+            d->ctx, len, TRDB_VEC_AT(&d->packets, i), size - pos,
+            &d->out_bin[pos], NULL, &consumed, &written);
+        if (status < 0)
+            return status;
+        pos += written;
+    }
+    *instrs = d->samplecnt;
+    *bytes  = pos;
+    return 0;
+}
+
+static int stage_read_packets(struct bench_data *d, size_t *instrs,
+                              size_t *bytes)
+{
+    struct trdb_packet_map map = {.data = d->bin, .size = d->binsize};
+
+    int status =
+        trdb_pulp_read_mapped_packets(d->ctx, &map, 0, map.size, &d->out_vec);
+    if (status < 0)
+        return status;
+    if (d->out_vec.size != d->packets.size)
+        return -trdb_bad_packet;
+
+    *instrs = d->samplecnt;
+    *bytes  = d->binsize;
+    return 0;
+}
+
+static int stage_decompress(struct bench_data *d, size_t *instrs, size_t *bytes)
+{
+    trdb_reset_decompression(d->ctx);
+    bench_configure(d);
+
+    int status = trdb_decompress_trace_vec(d->ctx, d->abfd, &d->packets,
+                                           &d->out_instrs);
+    if (status < 0)
+        return status;
+
+    *instrs = d->out_instrs.size;
+    *bytes  = d->binsize;
+    return 0;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Linux allows resetting the peak resident set size of a process, which makes
+ * it attributable to a single stage. Without that this is the peak of the whole
+ * run so far.
+ */
+static void reset_peak_rss(void)
+{
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (!fp)
+        return;
+    fputs("5", fp);
+    fclose(fp);
+}
+
+static long peak_rss_kib(void)
+{
+    char line[128];
+    long kib = -1;
+    FILE *fp = fopen("/proc/self/status", "r");
+
+    if (fp) {
+        while (fgets(line, sizeof(line), fp))
+            if (sscanf(line, "VmHWM: %ld kB", &kib) == 1)
+                break;
+        fclose(fp);
+    }
+    if (kib < 0) {
+        struct rusage usage;
+        if (!getrusage(RUSAGE_SELF, &usage))
+            kib = usage.ru_maxrss;
+    }
+    return kib;
+}
+
+static void report_result(struct bench_opts *opts, const char *trace,
+                          unsigned scale, const char *stage, size_t instrs,
+                          size_t bytes, double min, double mean, long rss)
+{
+    FILE *fp    = opts->fp;
+    double ips  = min > 0 ? instrs / min : 0;
+    double mbps = min > 0 ? bytes / min / 1e6 : 0;
+
+    switch (opts->format) {
+    case BENCH_TEXT:
+        if (!opts->reported)
+            fprintf(fp, "%-20s %5s %-15s %10s %10s %10s %14s %10s %10s\n",
+                    "trace", "scale", "stage", "instrs", "bytes", "min [s]",
+                    "instrs/s", "MB/s", "rss [KiB]");
+        fprintf(fp,
+                "%-20s %5u %-15s %10zu %10zu %10.6lf %14.0lf %10.2lf %10ld\n",
+                trace, scale, stage, instrs, bytes, min, ips, mbps, rss);
+        break;
+    case BENCH_JSON:
+        fprintf(fp,
+                "%s  {\"trace\": \"%s\", \"scale\": %u, \"stage\": \"%s\", "
+                "\"instrs\": %zu, \"bytes\": %zu, \"repeat\": %u, "
+                "\"min_s\": %.9lf, \"mean_s\": %.9lf, \"instrs_per_s\": %.1lf, "
+                "\"mb_per_s\": %.3lf, \"peak_rss_kib\": %ld}",
+                opts->reported ? ",\n" : "", trace, scale, stage, instrs,
+                bytes, opts->repeat, min, mean, ips, mbps, rss);
+        break;
+    case BENCH_CSV:
+        if (!opts->reported)
+            fprintf(fp, "trace,scale,stage,instrs,bytes,repeat,min_s,mean_s,"
+                        "instrs_per_s,mb_per_s,peak_rss_kib\n");
+        fprintf(fp, "%s,%u,%s,%zu,%zu,%u,%.9lf,%.9lf,%.1lf,%.3lf,%ld\n", trace,
+                scale, stage, instrs, bytes, opts->repeat, min, mean, ips, mbps,
+                rss);
+        break;
+    }
+    opts->reported++;
+}
+
+static int run_stage(struct bench_opts *opts, struct bench_data *d,
+                     unsigned scale, const struct bench_stage *stage)
+{
+    int status    = 0;
+    size_t instrs = 0;
+    size_t bytes  = 0;
+    double min    = 0;
+    double sum    = 0;
+
+    reset_peak_rss();
+    for (unsigned i = 0; i < opts->warmup + opts->repeat; i++) {
+        double start = now_seconds();
+        status       = stage->run(d, &instrs, &bytes);
+        double t     = now_seconds() - start;
+        bench_discard(d);
+        if (status < 0) {
+            fprintf(stderr, "%s of %s failed: %s\n", stage->name,
+                    d->input->name, trdb_errstr(trdb_errcode(status)));
+            return -1;
+        }
+        if (i < opts->warmup)
+            continue;
+        min = (i == opts->warmup || t < min) ? t : min;
+        sum += t;
+    }
+    report_result(opts, d->input->name, scale, stage->name, instrs, bytes, min,
+                  sum / opts->repeat, peak_rss_kib());
+    return 0;
+}
+
+/* Parse or generate, compress and serialize the trace of @p d once, repeated
+ * @p scale times, and put the results into @p d as the input of the stages.
+ * Each copy is compressed from a reset state, so it starts with its own sync
+ * packet and the scaled up trace stays decompressible.
+ */
+static int prepare_trace(struct bench_data *d, unsigned scale)
+{
+    int status         = 0;
+    struct tr_instr *s = NULL;
+    size_t cnt         = 0;
+
+    if (!d->input->trace) {
+        struct trdb_gen_config config;
+        bench_gen_config(&config);
+        status = trdb_generate_trace(d->ctx, d->abfd, &config, d->generate, &s);
+        cnt    = d->generate;
+    } else if (d->input->cvs)
+        status = trdb_cvs_to_trace_parallel(d->ctx, d->input->trace, &s, &cnt,
+                                            d->threads);
+    else
+        status = trdb_stimuli_to_trace_parallel(d->ctx, d->input->trace, &s,
+                                                &cnt, d->threads);
+    if (status < 0)
+        goto fail;
+
+    d->samples = malloc(scale * cnt * sizeof(*d->samples));
+    if (!d->samples) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    for (unsigned i = 0; i < scale; i++)
+        memcpy(&d->samples[i * cnt], s, cnt * sizeof(*s));
+    d->samplecnt = scale * cnt;
+    d->tilecnt   = cnt;
+
+    for (size_t i = 0; i < d->samplecnt; i++) {
+        if (i % cnt == 0)
+            bench_restart(d);
+        status = trdb_compress_trace_step_vec(d->ctx, &d->packets,
+                                              &d->samples[i]);
+        if (status < 0)
+            goto fail;
+    }
+
+    size_t i;
+    struct tr_packet *packet;
+    d->bin = malloc((d->packets.size + 1) * sizeof(union trdb_pack));
+    if (!d->bin) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    TRDB_VEC_FOREACH(packet, i, &d->packets)
+    {
+        size_t bitcnt = 0;
+        status        = trdb_pulp_serialize_packet(d->ctx, packet, &bitcnt, 0,
+                                                   &d->bin[d->binsize]);
+        if (status < 0)
+            goto fail;
+        d->binsize += bitcnt / 8 + (bitcnt % 8 != 0);
+    }
+    status = 0;
+
+fail:
+    free(s);
+    return status;
+}
+
+static void release_trace(struct bench_data *d)
+{
+    free(d->samples);
+    free(d->bin);
+    trdb_free_packet_vec(&d->packets);
+    d->samples   = NULL;
+    d->samplecnt = 0;
+    d->bin       = NULL;
+    d->binsize   = 0;
+}
+
+static int throughput(struct bench_opts *opts)
+{
+    int status = 0;
+
+    const struct bench_input inputs[] = {
+        {"trdb_stimuli", "data/trdb_stimuli", "data/interrupt", false},
+        {"dhrystone", "riscv-traces-32/dhrystone.riscv.cvs",
+         "riscv-traces-32/dhrystone.riscv", true},
+        {"median", "riscv-traces-32/median.riscv.cvs",
+         "riscv-traces-32/median.riscv", true},
+        {"qsort", "riscv-traces-32/qsort.riscv.cvs",
+         "riscv-traces-32/qsort.riscv", true},
+        {"towers", "riscv-traces-32/towers.riscv.cvs",
+         "riscv-traces-32/towers.riscv", true},
+        {"vvadd", "riscv-traces-32/vvadd.riscv.cvs",
+         "riscv-traces-32/vvadd.riscv", true},
+        {"spike-dhrystone", "data/cvs/dhrystone.spike_trace", NULL, true},
+        {"spike-mm", "data/cvs/mm.spike_trace", NULL, true},
+        {"spike-qsort", "data/cvs/qsort.spike_trace", NULL, true},
+        {"generated", NULL, "data/interrupt", false}};
+
+    const struct bench_stage stages[] = {
+        {"parse", false, stage_parse},
+        {"generate", true, stage_generate},
+        {"compress_step", false, stage_compress_step},
+        {"compress_block", false, stage_compress_block},
+        {"serialize", false, stage_serialize},
+        {"read_packets", false, stage_read_packets},
+        {"decompress", true, stage_decompress}};
+
+    if (opts->format == BENCH_JSON)
+        fprintf(opts->fp, "[\n");
+
+    bfd_init();
+    for (unsigned j = 0; j < TRDB_ARRAY_SIZE(inputs); j++) {
+        struct bench_data d = {.input    = &inputs[j],
+                               .threads  = opts->threads,
+                               .generate = opts->generate};
+        struct stat st;
+
+        if (!d.input->trace && !opts->generate)
+            continue;
+        if ((d.input->trace && stat(d.input->trace, &st)) ||
+            (d.input->elf && access(d.input->elf, R_OK))) {
+            fprintf(stderr, "File not found, skipping benchmark of %s\n",
+                    d.input->name);
+            continue;
+        }
+        d.trace_bytes = d.input->trace ? st.st_size : 0;
+
+        d.ctx = trdb_new();
+        if (!d.ctx) {
+            fprintf(stderr, "Library context allocation failed.\n");
+            status = -1;
+            break;
+        }
+        if (d.input->elf) {
+            d.abfd = bfd_openr(d.input->elf, NULL);
+            if (!(d.abfd && bfd_check_format(d.abfd, bfd_object))) {
+                bfd_perror("throughput");
+                status = -1;
+                goto next;
+            }
+        }
+
+        /* the parser works on the file, the other stages also on the scaled up
+         * trace */
+        unsigned scales[] = {1, opts->scale};
+        for (unsigned k = 0; k < TRDB_ARRAY_SIZE(scales); k++) {
+            if (k > 0 && scales[k] <= 1)
+                break;
+            int prep = prepare_trace(&d, scales[k]);
+            if (prep < 0) {
+                fprintf(stderr, "Preparing %s failed: %s\n", d.input->name,
+                        trdb_errstr(trdb_errcode(prep)));
+                status = -1;
+                release_trace(&d);
+                goto next;
+            }
+            for (unsigned i = 0; i < TRDB_ARRAY_SIZE(stages); i++) {
+                bool parse    = stages[i].run == stage_parse;
+                bool generate = stages[i].run == stage_generate;
+                if ((k > 0 && (parse || generate)) ||
+                    (parse && !d.input->trace) ||
+                    (generate && d.input->trace) ||
+                    (stages[i].needs_elf && !d.abfd))
+                    continue;
+                if (run_stage(opts, &d, scales[k], &stages[i]))
+                    status = -1;
+            }
+            release_trace(&d);
+        }
+
+    next:
+        if (d.abfd)
+            bfd_close(d.abfd);
+        trdb_free(d.ctx);
+    }
+
+    if (opts->format == BENCH_JSON)
+        fprintf(opts->fp, "%s]\n", opts->reported ? "\n" : "");
+
+    return status;
+}
+
+const char *argp_program_version     = "benchmarks " PACKAGE_VERSION;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+static char doc[] = "benchmarks -- Compression ratio and throughput of trdb";
+
+static struct argp_option options[] = {
+    {"throughput", 't', 0, 0,
+     "Measure the throughput of parsing, compression, serialization, packet "
+     "reading and decompression instead of the compression ratio"},
+    {"repeat", 'r', "N", 0, "Time each stage N times (default 5)"},
+    {"warmup", 'w', "N", 0, "Run each stage N times before timing it "
+                            "(default 1)"},
+    {"scale", 's', "N", 0,
+     "Also measure the traces repeated N times, 1 disables this (default 8)"},
+    {"threads", 'j', "N", 0, "Parse with N threads, 0 for all cpus "
+                             "(default 1)"},
+    {"format", 'f', "FORMAT", 0, "Print results as text, json or csv"},
+    {"output", 'o', "FILE", 0, "Write results to FILE instead of stdout"},
+    {"generate", 'g', "N", 0,
+     "Also measure a trace of N instructions generated from data/interrupt, "
+     "including the generator itself"},
+    {0}};
+
+struct arguments {
+    bool throughput;
+    struct bench_opts opts;
+    char *output;
+};
+
+static unsigned parse_count(struct argp_state *state, const char *arg,
+                            unsigned min)
+{
+    char *end;
+    errno               = 0;
+    unsigned long count = strtoul(arg, &end, 0);
+    if (errno || *end != '\0' || *arg == '-' || count < min || count > UINT_MAX)
+        argp_error(state, "invalid count %s", arg);
+    return count;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+    switch (key) {
+    case 't':
+        arguments->throughput = true;
+        break;
+    case 'r':
+        arguments->opts.repeat = parse_count(state, arg, 1);
+        break;
+    case 'w':
+        arguments->opts.warmup = parse_count(state, arg, 0);
+        break;
+    case 's':
+        arguments->opts.scale = parse_count(state, arg, 1);
+        break;
+    case 'j':
+        arguments->opts.threads = parse_count(state, arg, 0);
+        break;
+    case 'f':
+        if (!strcmp(arg, "text"))
+            arguments->opts.format = BENCH_TEXT;
+        else if (!strcmp(arg, "json"))
+            arguments->opts.format = BENCH_JSON;
+        else if (!strcmp(arg, "csv"))
+            arguments->opts.format = BENCH_CSV;
+        else
+            argp_error(state, "unknown output format %s", arg);
+        break;
+    case 'o':
+        arguments->output = arg;
+        break;
+    case 'g':
+        arguments->opts.generate = parse_count(state, arg, 1);
+        break;
+    case ARGP_KEY_ARG:
+        argp_usage(state);
+        break;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = {options, parse_opt, 0, doc};
+
+/* Bits per instruction of the traces compared to the results of the ultra
+ * trace encoder.
+ */
+static int compression_ratio(void)
 {
     int status = EXIT_SUCCESS;
 
@@ -218,6 +917,8 @@ int main()
         }
         if (compress_cvs_trace(stim, cmp_results + j))
             status = EXIT_FAILURE;
+        if (resync_tradeoff(stim))
+            status = EXIT_FAILURE;
     }
 
     const char *mibench_cvs[] = {
@@ -238,3 +939,30 @@ int main()
 
     return status;
 }
+
+int main(int argc, char *argv[argc + 1])
+{
+    struct arguments arguments = {
+        .opts = {.repeat = 5, .warmup = 1, .scale = 8, .threads = 1}};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if (!arguments.throughput)
+        return compression_ratio();
+
+    arguments.opts.fp = stdout;
+    if (arguments.output) {
+        arguments.opts.fp = fopen(arguments.output, "w");
+        if (!arguments.opts.fp) {
+            perror("fopen");
+            return EXIT_FAILURE;
+        }
+    }
+
+    int status = throughput(&arguments.opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    if (arguments.output && fclose(arguments.opts.fp)) {
+        perror("fclose");
+        status = EXIT_FAILURE;
+    }
+    return status;
+}
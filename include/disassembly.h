@@ -53,6 +53,9 @@ struct disassembler_unit {
 #define TRDB_INLINES 128
 
 struct trdb_ctx;
+struct trdb_image;
+struct trdb_line_index;
+struct tr_instr;
 
 /**
  * Store disassembly configuration and context.
@@ -91,6 +94,10 @@ struct trdb_disasm_aux {
     bool with_function_context; /**< show when instruction lands on symbol value
                                    of a function */
     bool unwind_inlines;        /**< Print all inlines for source line */
+    bool shared_symbols;        /**< symbols are borrowed from a trdb_image */
+
+    /** line information looked up ahead of time, see trdb_set_line_index() */
+    const struct trdb_line_index *lines;
 };
 
 /* The number of zeroes we want to see before we start skipping them. The number
@@ -172,9 +179,28 @@ int trdb_init_disassembler_unit(struct disassembler_unit *dunit, bfd *abfd,
  */
 int trdb_alloc_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
                               struct disassembler_unit *dunit);
+
+/**
+ * Like trdb_alloc_dinfo_with_bfd(), but borrow the symbol table that
+ * trdb_image_new() already read and sorted instead of reading it again.
+ * @p image must outlive @p dunit. Release @p dunit with
+ * trdb_free_dinfo_with_bfd().
+ *
+ * @param c the trace debugger context containing settings
+ * @param image the program image of the binary
+ * @param dunit filled with information from @p image
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p image or @p dunit is NULL
+ * @return -trdb_nomem if out of memory
+ * @return -trdb_arch_support if architecture is not supported
+ */
+int trdb_alloc_dinfo_with_image(struct trdb_ctx *c,
+                                const struct trdb_image *image,
+                                struct disassembler_unit *dunit);
+
 /**
  * Free the memory allocated to @p abfd and @p dunit by a call to
- * trdb_alloc_dinfo_with_bfd().
+ * trdb_alloc_dinfo_with_bfd() or trdb_alloc_dinfo_with_image().
  *
  * @param c the trace debugger context containing settings
  * @param abfd the bfd representing the binary
@@ -349,4 +375,146 @@ void trdb_disassemble_instruction_with_bfd(struct trdb_ctx *c, bfd *abfd,
                                            bfd_vma addr,
                                            struct disassembler_unit *dunit);
 
+/**
+ * Create a table of the file, function and line of every instruction address
+ * in the code sections of @p abfd. The debug information is read once, after
+ * that a lookup is a binary search over runs of addresses that share their
+ * line. Attach the table to a disassembler with trdb_set_line_index() to
+ * speed up the line numbers and source code of trdb_set_disassembly_conf().
+ * The table is never modified, so disassemblers in different threads can
+ * share it.
+ *
+ * @param c the trace debugger context, used for logging
+ * @param abfd the bfd whose debug information to read
+ * @param index written with the table, release with trdb_line_index_free()
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p abfd or @p index is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_line_index_new(struct trdb_ctx *c, bfd *abfd,
+                        struct trdb_line_index **index);
+
+/**
+ * Release @p index.
+ *
+ * @param index the table, may be NULL
+ */
+void trdb_line_index_free(struct trdb_line_index *index);
+
+/**
+ * Return the number of address runs in @p index.
+ *
+ * @param index the table, may be NULL
+ * @return number of runs
+ */
+size_t trdb_line_index_size(const struct trdb_line_index *index);
+
+/**
+ * Look up @p vma in @p index, like bfd_find_nearest_line_discriminator() would
+ * in the debug information. The strings belong to @p index.
+ *
+ * @param index the table
+ * @param vma the address to look up
+ * @param filename written with the source file or NULL if unknown
+ * @param functionname written with the function or NULL if unknown
+ * @param linenumber written with the line
+ * @param discriminator written with the discriminator
+ * @return 1 if something is known about @p vma, 0 if not
+ * @return -trdb_invalid if any argument is NULL
+ */
+int trdb_line_index_lookup(const struct trdb_line_index *index, bfd_vma vma,
+                           const char **filename, const char **functionname,
+                           unsigned int *linenumber,
+                           unsigned int *discriminator);
+
+/**
+ * Make @p dunit look up line information in @p index instead of the debug
+ * information. @p index must belong to the same bfd and outlive @p dunit, pass
+ * NULL to detach it again.
+ *
+ * @param dunit the disassembler, set up by trdb_alloc_dinfo_with_bfd() or
+ * trdb_alloc_dinfo_with_image()
+ * @param index the table or NULL
+ */
+void trdb_set_line_index(struct disassembler_unit *dunit,
+                         const struct trdb_line_index *index);
+
+/**
+ * Memoized disassembly of traces, see trdb_disasm_cache_new().
+ */
+struct trdb_disasm_cache;
+
+/**
+ * Create a cache that disassembles each distinct pc of a trace only once.
+ * trdb_disasm_cache_instr() renders an instruction the first time its address
+ * shows up, afterwards the text is reused. With @p abfd the result is the
+ * same as that of trdb_disassemble_instr_with_bfd(), where also the symbol and
+ * line lookups are memoized, otherwise that of trdb_disassemble_instr().
+ *
+ * The output is collected and handed to fprintf_func in
+ * #disassembler_unit.dinfo in large chunks, call trdb_disasm_cache_flush()
+ * before writing anything else to its stream. Unlike without the cache, the
+ * line numbers and source code enabled with trdb_set_disassembly_conf() go to
+ * that stream as well instead of to stdout.
+ *
+ * @param c the trace debugger context
+ * @param abfd the bfd which contains the instructions or NULL
+ * @param dunit the configured disassembler, must outlive the cache
+ * @param cache written with the cache, release with trdb_disasm_cache_free()
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p dunit, its dinfo or @p cache is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_disasm_cache_new(struct trdb_ctx *c, bfd *abfd,
+                          struct disassembler_unit *dunit,
+                          struct trdb_disasm_cache **cache);
+
+/**
+ * Disassemble @p instr through @p cache. The instruction is identified by its
+ * #iaddr and #instr, the exception marker is added for each occurrence.
+ *
+ * @param cache the cache
+ * @param instr instruction to disassemble
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p cache or @p instr is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_disasm_cache_instr(struct trdb_disasm_cache *cache,
+                            const struct tr_instr *instr);
+
+/**
+ * Disassemble the @p len instructions of @p trace through @p cache, see
+ * trdb_disasm_cache_instr().
+ *
+ * @param cache the cache
+ * @param len length of @p trace
+ * @param trace the instructions
+ * @return 0 on success, a negative error code otherwise
+ * @return any error of trdb_disasm_cache_instr()
+ */
+int trdb_disasm_cache_trace(struct trdb_disasm_cache *cache, size_t len,
+                            const struct tr_instr *trace);
+
+/**
+ * Hand the collected output of @p cache to fprintf_func.
+ *
+ * @param cache the cache, may be NULL
+ */
+void trdb_disasm_cache_flush(struct trdb_disasm_cache *cache);
+
+/**
+ * Return the number of distinct instructions @p cache rendered so far.
+ *
+ * @param cache the cache, may be NULL
+ * @return number of cached instructions
+ */
+size_t trdb_disasm_cache_size(const struct trdb_disasm_cache *cache);
+
+/**
+ * Flush and release @p cache.
+ *
+ * @param cache the cache, may be NULL
+ */
+void trdb_disasm_cache_free(struct trdb_disasm_cache *cache);
+
 #endif
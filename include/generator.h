@@ -0,0 +1,147 @@
+/*
+ * trdb - Trace Debugger Software for the PULP platform
+ *
+ * Copyright (C) 2024 Robert Balas
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file generator.h
+ * @author Robert Balas (balasr@student.ethz.ch)
+ * @brief Generate synthetic instruction traces of arbitrary length
+ */
+
+#ifndef __GENERATOR_H__
+#define __GENERATOR_H__
+
+#include "trace_debugger.h"
+
+/**
+ * Parameters of the control flow walk of a trdb_gen. Initialize with
+ * trdb_gen_default_config() and adjust.
+ */
+struct trdb_gen_config {
+    uint64_t seed;            /**< seed of the random number generator */
+    double branch_taken;      /**< probability a forward branch is taken */
+    double loop_taken;        /**< probability a backward branch is taken */
+    unsigned max_call_depth;  /**< calls nested deeper are forgotten */
+    double exception_rate;    /**< per instruction probability of a trap */
+    double interrupt_rate;    /**< per instruction probability of an irq */
+    uint32_t exception_cause; /**< cause reported for exceptions */
+    uint32_t interrupt_cause; /**< cause reported for interrupts */
+    addr_t start;             /**< walk start, zero for the elf entry */
+    addr_t trap_vector;       /**< trap target, zero for the start address */
+};
+
+/**
+ * What a trdb_gen did so far, see trdb_gen_get_stats().
+ */
+struct trdb_gen_stats {
+    size_t instrs;      /**< generated instructions */
+    size_t compressed;  /**< of which are compressed */
+    size_t branches;    /**< conditional branches */
+    size_t taken;       /**< of which were taken */
+    size_t calls;       /**< function calls */
+    size_t returns;     /**< function returns */
+    size_t exceptions;  /**< exceptions taken */
+    size_t interrupts;  /**< interrupts taken */
+    size_t restarts;    /**< walks that ran off the program and restarted */
+    unsigned max_depth; /**< deepest remembered call nesting */
+};
+
+/**
+ * A random walk over the control flow graph of a program, see trdb_gen_new().
+ */
+struct trdb_gen;
+
+/**
+ * Fill @p config with the defaults: forward branches are taken half of the
+ * time, loops run ten iterations on average, calls nest up to 64 deep and
+ * there are no traps.
+ *
+ * @param config configuration to initialize
+ */
+void trdb_gen_default_config(struct trdb_gen_config *config);
+
+/**
+ * Create a generator of instruction traces that walks the code of @p abfd.
+ * Conditional branches are decided randomly, calls and returns are matched
+ * like on a real machine and indirect jumps go to previously seen call
+ * targets. Whenever the walk can't continue in a way that a trace of the real
+ * program could, e.g. when leaving the code or returning from the outermost
+ * function, the instruction traps and the walk restarts. The generated trace
+ * thus always decompresses with @p abfd. The encoding of the instructions, and
+ * thus the mix of compressed instructions, is the one of the program.
+ *
+ * @param c trace debugger context, used for logging
+ * @param abfd the program to walk, must outlive the generator
+ * @param config parameters of the walk, NULL for the defaults
+ * @param gen written with the generator, release with trdb_gen_free()
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p abfd or @p gen is NULL or @p config is
+ * out of range
+ * @return -trdb_bad_vma if the start address is not in a code section
+ * @return -trdb_section_empty if the code could not be loaded
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_gen_new(struct trdb_ctx *c, bfd *abfd,
+                 const struct trdb_gen_config *config, struct trdb_gen **gen);
+
+/**
+ * Generate the next @p len instructions of the walk into @p instrs. Calls can
+ * be repeated to produce traces of any length without holding them in memory.
+ *
+ * @param gen generator
+ * @param len number of instructions to generate
+ * @param instrs written with the instructions
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p gen or @p instrs is NULL
+ * @return -trdb_bad_instr if even the start address holds no instruction
+ */
+int trdb_gen_next(struct trdb_gen *gen, size_t len, struct tr_instr instrs[len]);
+
+/**
+ * Get what @p gen generated so far.
+ *
+ * @param gen generator
+ * @param stats written with the statistics
+ */
+void trdb_gen_get_stats(const struct trdb_gen *gen,
+                        struct trdb_gen_stats *stats);
+
+/**
+ * Release @p gen.
+ *
+ * @param gen generator, may be NULL
+ */
+void trdb_gen_free(struct trdb_gen *gen);
+
+/**
+ * Generate a trace of @p count instructions of @p abfd into a newly allocated
+ * array, see trdb_gen_new(). The caller has to free @p samples.
+ *
+ * @param c trace debugger context
+ * @param abfd the program to walk
+ * @param config parameters of the walk, NULL for the defaults
+ * @param count number of instructions to generate
+ * @param samples written with the trace
+ * @return 0 on success, a negative error code otherwise, see trdb_gen_new()
+ * and trdb_gen_next()
+ */
+int trdb_generate_trace(struct trdb_ctx *c, bfd *abfd,
+                        const struct trdb_gen_config *config, size_t count,
+                        struct tr_instr **samples);
+
+#endif
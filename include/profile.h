@@ -0,0 +1,160 @@
+/*
+ * trdb - Trace Debugger Software for the PULP platform
+ *
+ * Copyright (C) 2024 Robert Balas
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file profile.h
+ * @author Robert Balas (balasr@student.ethz.ch)
+ * @brief Aggregate decompressed traces into execution profiles and coverage
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdio.h>
+#include "trace_debugger.h"
+
+/**
+ * Execution counts of a basic block, see trdb_profile_get_block().
+ */
+struct trdb_block_profile {
+    uint64_t visits;    /**< times the block was entered */
+    uint64_t instrs;    /**< instructions executed in the block */
+    uint64_t taken;     /**< times a conditional branch was taken */
+    uint64_t not_taken; /**< times it fell through instead */
+};
+
+/**
+ * Output formats of trdb_profile_write().
+ */
+enum trdb_profile_format {
+    TRDB_PROFILE_FLAT,      /**< functions by instructions, like gprof */
+    TRDB_PROFILE_CALLGRIND, /**< for callgrind_annotate and kcachegrind */
+    TRDB_PROFILE_FOLDED     /**< one line per call stack, for flamegraphs */
+};
+
+/**
+ * Execution counts of the blocks, functions and calls of a program, see
+ * trdb_profile_new().
+ */
+struct trdb_profile;
+
+/**
+ * Create an empty profile of the program of @p cfg. Feed it the visited
+ * blocks of a trace with trdb_profile_packet() or by passing
+ * trdb_profile_block_fn() and the profile to trdb_decompress_packet_blocks().
+ * Only counts are kept, never the instructions themselves.
+ *
+ * Functions are the code symbols of the image of @p cfg, each block belongs to
+ * the closest one at or before its start. A call block followed by its target
+ * pushes a frame onto a shadow call stack of the profile, a return block
+ * followed by the return address of a frame pops up to that frame. A jump to
+ * the start of another function is a tail call, whose frame returns together
+ * with the one below. The call graph is made up of those frames, code
+ * reached otherwise, e.g. by a trap, shows up as called by the current frame.
+ *
+ * @param c trace debugger context, used for logging
+ * @param cfg the basic blocks of the program, must outlive the profile
+ * @param profile written with the new profile, release with
+ * trdb_profile_free()
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p cfg or @p profile is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_profile_new(struct trdb_ctx *c, const struct trdb_cfg *cfg,
+                     struct trdb_profile **profile);
+
+/**
+ * Release @p profile.
+ *
+ * @param profile the profile to release, may be NULL
+ */
+void trdb_profile_free(struct trdb_profile *profile);
+
+/**
+ * A trdb_decompress_packet_blocks() callback which accounts the visit of @p
+ * block to the profile passed as @p data. A visit that was split in two by
+ * the end of a packet is counted once.
+ *
+ * @param c the context of the decompression
+ * @param block a block of the graph of the profile
+ * @param instrs number of instructions executed in @p block
+ * @param data the profile
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_profile_block_fn(struct trdb_ctx *c, const struct trdb_block *block,
+                          size_t instrs, void *data);
+
+/**
+ * Decompress @p packet with trdb_decompress_packet_blocks() into @p profile.
+ *
+ * @param c the context/state of the trace debugger
+ * @param profile the profile to add to
+ * @param packet the next packet of the compressed instruction trace
+ * @return 0 on success, a negative error code otherwise, see
+ * trdb_decompress_packet_blocks()
+ */
+int trdb_profile_packet(struct trdb_ctx *c, struct trdb_profile *profile,
+                        struct tr_packet *packet);
+
+/**
+ * Get the counts of block @p id of the graph of @p profile.
+ *
+ * @param profile the profile
+ * @param id index of the block in trdb_cfg_blocks()
+ * @param counts written with the counts of the block
+ */
+void trdb_profile_get_block(const struct trdb_profile *profile, size_t id,
+                            struct trdb_block_profile *counts);
+
+/**
+ * Get the number of instructions accounted to @p profile.
+ *
+ * @param profile the profile
+ * @return the number of instructions
+ */
+uint64_t trdb_profile_instrs(const struct trdb_profile *profile);
+
+/**
+ * Write @p profile to @p fp. Calls which did not return yet count up to the
+ * last instruction.
+ *
+ * #TRDB_PROFILE_FLAT lists the functions by the instructions executed in them
+ * with their number of calls and the instructions per call without and with
+ * their callees, followed by the block and branch coverage.
+ *
+ * #TRDB_PROFILE_CALLGRIND writes the callgrind format with the events Ir
+ * (instructions), Bc (conditional branches) and Bt (taken conditional
+ * branches) at the block start and branch addresses, and the call graph.
+ *
+ * #TRDB_PROFILE_FOLDED writes a line of the semicolon separated call stack
+ * and its instructions for each call stack, as read by flamegraph.pl.
+ *
+ * @param profile the profile
+ * @param format the output format
+ * @param fp where to write to
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p profile or @p fp is NULL or @p format is unknown
+ * @return -trdb_nomem if out of memory
+ * @return -trdb_file_write if writing failed
+ */
+int trdb_profile_write(const struct trdb_profile *profile,
+                       enum trdb_profile_format format, FILE *fp);
+
+#endif
@@ -23,8 +23,148 @@
  * @brief Read binary data into packets
  */
 
+#ifndef __SERIALIZE_H__
+#define __SERIALIZE_H__
+
 #include "trace_debugger.h"
 
+/**
+ * A read-only memory mapping of a file of PULP packets, see
+ * trdb_pulp_map_packets().
+ */
+struct trdb_packet_map {
+    const uint8_t *data; /**< file contents, NULL if the file is empty */
+    size_t size;         /**< file size in bytes */
+};
+
+/**
+ * Magic bytes at the start of a trace container, see trdb_container_create().
+ */
+#define TRDB_CONTAINER_MAGIC "TRDBCONT"
+
+/**
+ * Magic bytes at the very end of a trace container, following the block index.
+ */
+#define TRDB_CONTAINER_INDEX_MAGIC "TRDBINDX"
+
+/**
+ * Version of the trace container layout.
+ */
+#define TRDB_CONTAINER_VERSION 3
+
+/**
+ * Entry of the block index of a trace container. A block is a run of PULP
+ * packets which starts with a F_SYNC packet, so decompression can begin there.
+ */
+struct trdb_container_block {
+    uint64_t offset;       /**< file offset of the first packet */
+    uint64_t first_instr;  /**< number of the first instruction in the block */
+    uint64_t first_pc;     /**< address of the first instruction */
+    uint64_t timestamp;    /**< last W_TIMER value before the block, or zero */
+    uint64_t state_offset; /**< file offset of the state snapshot, or zero */
+    uint64_t state_len;    /**< size of the state snapshot, zero if none */
+    /* where trdb_container_resume() continues */
+    uint64_t steps;        /**< input instructions up to the sync packet */
+    uint64_t retired;      /**< instructions numbered up to then */
+    uint64_t before_thisc; /**< counters of trdb_container_compress_step() */
+    uint64_t before_nextc;
+};
+
+/**
+ * State of a trace container that is being written, see
+ * trdb_container_create().
+ */
+struct trdb_container_writer {
+    FILE *fp;
+    uint64_t offset;       /**< bytes written so far */
+    uint64_t block_instrs; /**< minimum number of instructions per block */
+    uint64_t timestamp;    /**< last W_TIMER value written */
+    struct trdb_container_block *blocks;
+    size_t nblocks;
+    size_t capacity;
+    /* state snapshots of the blocks, see trdb_container_set_snapshots() */
+    bool snapshots;
+    uint8_t *states;
+    size_t states_len;
+    size_t states_cap;
+    /* instruction numbering for trdb_container_compress_step() */
+    uint64_t steps;
+    uint64_t retired;
+    uint64_t before_thisc;
+    uint64_t before_nextc;
+};
+
+/**
+ * A trace container opened for reading, see trdb_container_open().
+ */
+struct trdb_container {
+    struct trdb_packet_map map; /**< the whole file */
+    bool full_address;          /**< packets were written with full addresses */
+    bool ras_tracking; /**< packets were written with trdb_set_ras_tracking() */
+    uint32_t version;           /**< layout version of the file */
+    size_t packets_end;         /**< offset past the last packet */
+    struct trdb_container_block *blocks;
+    size_t nblocks;
+};
+
+/**
+ * Magic bytes at the start of a binary instruction trace, see
+ * trdb_trace_writer_open().
+ */
+#define TRDB_TRACE_MAGIC "TRDBINST"
+
+/**
+ * Version of the binary instruction trace layout.
+ */
+#define TRDB_TRACE_VERSION 1
+
+/**
+ * Flag of trdb_trace_writer_open() to store each instruction address as the
+ * difference to the previous one, which compresses better with general purpose
+ * compressors.
+ */
+#define TRDB_TRACE_DELTA_IADDR 1
+
+/**
+ * Size of the header of a binary instruction trace in bytes.
+ */
+#define TRDB_TRACE_HEADER_LEN 16
+
+/**
+ * Size of each instruction record of a binary instruction trace in bytes.
+ */
+#define TRDB_TRACE_RECORD_LEN (4 + ILEN / 8 + 2 * XLEN / 8)
+
+/**
+ * State of a binary instruction trace that is being written, see
+ * trdb_trace_writer_open().
+ */
+struct trdb_trace_writer {
+    FILE *fp;
+    uint32_t flags;    /**< TRDB_TRACE_* flags of the file */
+    addr_t last_iaddr; /**< for TRDB_TRACE_DELTA_IADDR */
+    uint64_t count;    /**< number of records written */
+};
+
+/**
+ * Default buffer size of a trdb_bit_sink in bytes.
+ */
+#define TRDB_BIT_SINK_SIZE (64 * 1024)
+
+/**
+ * Buffered output of serialized packets, see trdb_bit_sink_open(). Packets are
+ * serialized right into the buffer, which is only written out once it is
+ * nearly full.
+ */
+struct trdb_bit_sink {
+    FILE *fp;         /**< where the buffer is flushed to */
+    uint8_t *buf;     /**< serialized packets not yet flushed */
+    size_t size;      /**< capacity of buf in bytes */
+    size_t bits;      /**< number of valid bits in buf */
+    bool packed;      /**< packets are not padded to a full byte */
+    uint64_t written; /**< bytes flushed to fp so far */
+};
+
 /**
  * Packs the @p packet into an array @p bin, aligned by @p align and writes the
  * packet length in bits into @p bitcnt. This function is specific to the PULP
@@ -44,6 +184,33 @@
 int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
                                size_t *bitcnt, uint8_t align, uint8_t bin[]);
 
+/**
+ * Serialize the array @p packets back to back into @p buf the way
+ * trdb_pulp_write_single_packet() does, bit exact with calling
+ * trdb_pulp_serialize_packet() on each of them. Serialization stops early when
+ * the next packet doesn't fit into @p buf, the remaining packets can be
+ * passed in the next call.
+ *
+ * @param c trace debugger context
+ * @param len number of packets in @p packets
+ * @param packets the packets to serialize
+ * @param size size of @p buf in bytes
+ * @param buf where the serialized packets are written to
+ * @param offsets if not NULL written with the byte offset of each serialized
+ * packet in @p buf
+ * @param consumed written with the number of serialized packets, on failure
+ * the index of the offending packet
+ * @param written written with the number of bytes put into @p buf
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p consumed or @p written is NULL or @p
+ * packets or @p buf is NULL while not empty
+ * @return -trdb_bad_packet if a packet is longer than 16 bytes or unknown
+ */
+int trdb_pulp_serialize_packets(struct trdb_ctx *c, size_t len,
+                                struct tr_packet packets[len], size_t size,
+                                uint8_t buf[size], size_t offsets[],
+                                size_t *consumed, size_t *written);
+
 /**
  * Read a packet from @p fp stored in the PULP binary format.
  *
@@ -78,6 +245,152 @@ int trdb_pulp_read_single_packet(struct trdb_ctx *c, FILE *fp,
 int trdb_pulp_read_all_packets(struct trdb_ctx *c, const char *path,
                                struct trdb_packet_head *packet_list);
 
+/**
+ * Like trdb_pulp_read_all_packets() but appends the packets to the vector @p
+ * packets.
+ *
+ * @param c trace debugger context
+ * @param path file from which to read packet data
+ * @param packets appened with read packets
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p path or @p packets is NULL
+ * @return -trdb_file_open if file at @p path could not be found
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_pulp_read_all_packets_vec(struct trdb_ctx *c, const char *path,
+                                   struct trdb_packet_vec *packets);
+
+/**
+ * Map the PULP packet file at @p path into memory, so that packets can be
+ * decoded in place without copying them through stdio. Release with
+ * trdb_pulp_unmap_packets().
+ *
+ * @param c trace debugger context
+ * @param path file holding the packets
+ * @param map written with the mapping
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p path or @p map is NULL
+ * @return -trdb_file_open if file at @p path could not be opened
+ * @return -trdb_file_size if the size of the file could not be determined
+ * @return -trdb_file_read if file at @p path could not be mapped
+ */
+int trdb_pulp_map_packets(struct trdb_ctx *c, const char *path,
+                          struct trdb_packet_map *map);
+
+/**
+ * Unmap a mapping created by trdb_pulp_map_packets().
+ *
+ * @param map mapping to release
+ */
+void trdb_pulp_unmap_packets(struct trdb_packet_map *map);
+
+/**
+ * Decode the packet at byte @p offset of @p map and advance @p offset to the
+ * next packet.
+ *
+ * @param c trace debugger context
+ * @param map mapped packet file
+ * @param offset byte offset of the packet, advanced on success
+ * @param packet filled out with the decoded packet
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p map, @p offset or @p packet is NULL
+ * @return -trdb_bad_packet if there is no complete packet at @p offset
+ * @return -trdb_bad_config if the decoding assumptions don't hold because of
+ * contradictionary data in the packet
+ */
+int trdb_pulp_next_mapped_packet(struct trdb_ctx *c,
+                                 const struct trdb_packet_map *map,
+                                 size_t *offset, struct tr_packet *packet);
+
+/**
+ * Decode up to @p len PULP packets stored back to back in @p data into @p
+ * packets, the same way trdb_pulp_next_mapped_packet() decodes them one by
+ * one. Decoding stops at the end of @p data or at an incomplete packet.
+ *
+ * @param c trace debugger context
+ * @param size size of @p data in bytes
+ * @param data the serialized packets
+ * @param len capacity of @p packets
+ * @param packets filled out with the decoded packets
+ * @param offsets if not NULL written with the byte offset of each decoded
+ * packet in @p data
+ * @param decoded written with the number of decoded packets, on failure the
+ * index of the offending packet
+ * @param consumed written with the number of bytes of the decoded packets
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p decoded or @p consumed is NULL or @p data
+ * or @p packets is NULL while not empty
+ * @return -trdb_bad_packet if a packet has an unknown message type
+ * @return -trdb_bad_config if the decoding assumptions don't hold because of
+ * contradictionary data in a packet
+ */
+int trdb_pulp_decode_packets(struct trdb_ctx *c, size_t size,
+                             const uint8_t data[size], size_t len,
+                             struct tr_packet packets[len], size_t offsets[],
+                             size_t *decoded, size_t *consumed);
+
+/**
+ * Build an index of the byte offsets at which the complete packets in @p map
+ * start. This only looks at the length field of each packet, so it is cheap
+ * and allows seeking to a packet or splitting the file among workers. A
+ * trailing incomplete packet is not indexed. The caller has to free @p offsets.
+ *
+ * @param c trace debugger context
+ * @param map mapped packet file
+ * @param offsets written with the array of packet offsets
+ * @param count written with the number of packets
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p map, @p offsets or @p count is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_pulp_index_packets(struct trdb_ctx *c,
+                            const struct trdb_packet_map *map,
+                            size_t **offsets, size_t *count);
+
+/**
+ * Decode the packets starting in the byte range [@p begin, @p end) of @p map
+ * and append them to @p packets. Like trdb_pulp_read_all_packets() this stops
+ * at the first packet that can't be decoded and keeps all the good packets
+ * before it.
+ *
+ * @param c trace debugger context
+ * @param map mapped packet file
+ * @param begin offset of the first packet
+ * @param end offset past the last packet, clamped to the size of @p map
+ * @param packets appended with the decoded packets
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p map or @p packets is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_pulp_read_mapped_packets(struct trdb_ctx *c,
+                                  const struct trdb_packet_map *map,
+                                  size_t begin, size_t end,
+                                  struct trdb_packet_vec *packets);
+
+/**
+ * Decode the packets starting in the byte range [@p begin, @p end) of @p map
+ * and feed them straight to trdb_decompress_packet(), which must have been
+ * prepared with trdb_decompress_open(). No packet is kept in memory. Decoding
+ * stops at the first packet that can't be decoded, see
+ * trdb_pulp_read_mapped_packets().
+ *
+ * @param c trace debugger context
+ * @param map mapped packet file
+ * @param begin offset of the first packet
+ * @param end offset past the last packet, clamped to the size of @p map
+ * @param instr_fn called with each reconstructed instruction
+ * @param data passed to @p instr_fn
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p map or @p instr_fn is NULL
+ * @return any error of trdb_decompress_packet()
+ */
+int trdb_pulp_decompress_mapped_packets(
+    struct trdb_ctx *c, const struct trdb_packet_map *map, size_t begin,
+    size_t end,
+    int (*instr_fn)(struct trdb_ctx *c, const struct tr_instr *instr,
+                    void *data),
+    void *data);
+
 /**
  * Serialize a single packet, like the PULP trace debugger.
  * @param c trace debugger context
@@ -91,6 +404,104 @@ int trdb_pulp_read_all_packets(struct trdb_ctx *c, const char *path,
 int trdb_pulp_write_single_packet(struct trdb_ctx *c, struct tr_packet *packet,
                                   FILE *fp);
 
+/**
+ * Compress the array @p instrs and serialize the generated packets into @p buf
+ * the same way trdb_pulp_write_single_packet() does. Compression stops early
+ * when @p buf could not hold one more packet, the remaining instructions can
+ * be passed in the next call.
+ *
+ * @param c trace debugger context
+ * @param len number of instructions in @p instrs
+ * @param instrs the next instructions to compress
+ * @param size size of @p buf in bytes
+ * @param buf where the serialized packets are written to
+ * @param consumed written with the number of instructions of @p instrs that
+ * were compressed, on failure the index of the offending instruction
+ * @param written written with the number of bytes put into @p buf
+ * @return 0 on success, a negative error code otherwise, see
+ * trdb_compress_trace_step()
+ * @return -trdb_invalid if @p c, @p consumed or @p written is NULL or @p
+ * instrs or @p buf is NULL while not empty
+ * @return -trdb_bad_packet if a generated packet is malformed
+ */
+int trdb_pulp_compress_trace_block(struct trdb_ctx *c, size_t len,
+                                   struct tr_instr instrs[len], size_t size,
+                                   uint8_t buf[size], size_t *consumed,
+                                   size_t *written);
+
+/**
+ * Prepare @p sink for writing serialized packets to @p fp.
+ *
+ * By default each packet starts at a byte boundary, like
+ * trdb_pulp_write_single_packet() writes them. If @p packed is set the packets
+ * are stitched together bit by bit with the @p align parameter of
+ * trdb_pulp_serialize_packet(), the same layout trdb_write_packets() produces.
+ * Note that such a stream can't be read back by trdb_pulp_read_single_packet().
+ *
+ * @param sink written with the sink state
+ * @param fp file to flush to, not closed by trdb_bit_sink_close()
+ * @param size buffer size in bytes, 0 selects TRDB_BIT_SINK_SIZE
+ * @param packed whether to pack packets without padding
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p sink or @p fp is NULL or @p size can't hold a
+ * single packet
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_bit_sink_open(struct trdb_bit_sink *sink, FILE *fp, size_t size,
+                       bool packed);
+
+/**
+ * Serialize @p packet into @p sink, flushing the buffer first if it might not
+ * fit.
+ *
+ * @param c trace debugger context
+ * @param sink an open sink
+ * @param packet packet to serialize
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p sink or @p packet is NULL
+ * @return -trdb_file_write if flushing failed
+ * @return -trdb_bad_packet if @p packet is malformed
+ */
+int trdb_bit_sink_put_packet(struct trdb_ctx *c, struct trdb_bit_sink *sink,
+                             struct tr_packet *packet);
+
+/**
+ * Write all complete bytes of @p sink to its file. In packed mode an
+ * incomplete last byte stays in the buffer.
+ *
+ * @param sink an open sink
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p sink is NULL
+ * @return -trdb_file_write if the file could not be fully written
+ */
+int trdb_bit_sink_flush(struct trdb_bit_sink *sink);
+
+/**
+ * Flush everything, padding an incomplete last byte with zeros, and release
+ * the resources of @p sink. @p sink is released even on failure.
+ *
+ * @param sink an open sink
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p sink is NULL
+ * @return -trdb_file_write if the file could not be fully written
+ */
+int trdb_bit_sink_close(struct trdb_bit_sink *sink);
+
+/**
+ * Run trdb_compress_trace_step() on @p instr and serialize the generated packet
+ * right into @p sink, so no packet has to be kept around.
+ *
+ * @param c trace debugger context
+ * @param sink an open sink
+ * @param instr the next instruction to compress
+ * @return 0 or a positive number of generated packets on success, a negative
+ * error code otherwise, see trdb_compress_trace_step() and
+ * trdb_bit_sink_put_packet()
+ */
+int trdb_compress_trace_step_sink(struct trdb_ctx *c,
+                                  struct trdb_bit_sink *sink,
+                                  struct tr_instr *instr);
+
 /**
  * Write a list of tr_packets to a file located at @p path.
  *
@@ -108,6 +519,219 @@ int trdb_pulp_write_single_packet(struct trdb_ctx *c, struct tr_packet *packet,
 int trdb_write_packets(struct trdb_ctx *c, const char *path,
                        struct trdb_packet_head *packet_list);
 
+/**
+ * Start writing a trace container to @p fp. A container holds byte aligned PULP
+ * packets, like trdb_pulp_write_single_packet() produces, cut into blocks that
+ * each start at a F_SYNC packet. trdb_container_finish() appends an index which
+ * maps each block to its file offset, the number and address of its first
+ * instruction and the last timestamp seen, so that a window of instructions
+ * can be decompressed without scanning the packets before it. Blocks only
+ * start at sync packets, so the compression should emit them regularly, see
+ * trdb_set_resync_interval().
+ *
+ * The layout is a header of #TRDB_CONTAINER_MAGIC, a 32 bit version and 32
+ * bits of flags (bit 0 is set for full addresses, bit 1 for
+ * trdb_set_ras_tracking()), followed by the packets and
+ * the state snapshots of trdb_container_set_snapshots(). After that comes the
+ * index as an array of struct trdb_container_block and a trailer of the index
+ * offset, the number of blocks and #TRDB_CONTAINER_INDEX_MAGIC. All integers
+ * are little-endian. Containers of version 1 have no snapshots and the index
+ * entries end after the timestamp, those of version 2 after the snapshot
+ * size. Both can still be read but not resumed.
+ *
+ * @param c trace debugger context, the full address and ras tracking settings
+ * are recorded
+ * @param fp file to write to, the offsets in the index are relative to the
+ * current position
+ * @param block_instrs start a new block at the first sync packet after that
+ * many instructions, 0 starts one at every sync packet
+ * @param w written with the writer state
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p fp or @p w is NULL
+ * @return -trdb_file_write if the header could not be written
+ */
+int trdb_container_create(struct trdb_ctx *c, FILE *fp, uint64_t block_instrs,
+                          struct trdb_container_writer *w);
+
+/**
+ * Set whether each block of the container stores a snapshot of the state of the
+ * writing context, see trdb_save_state(). The snapshot is taken right after the
+ * compression step that produced the sync packet starting the block.
+ * trdb_container_decompress_window() uses it to start with the return address
+ * stack the decompression has at that point, which implicit returns need
+ * unless trdb_set_ras_tracking() is on. trdb_container_resume() uses it
+ * together with the input position and instruction counters of the block to
+ * continue a finished container, e.g. once more of the trace is available or
+ * after the compression was stopped.
+ *
+ * @param w container writer
+ * @param snapshots whether to store snapshots (default false)
+ */
+void trdb_container_set_snapshots(struct trdb_container_writer *w,
+                                  bool snapshots);
+
+/**
+ * Append @p packet to the container. W_TIMER packets update the timestamp that
+ * is recorded for the following blocks.
+ *
+ * @param c trace debugger context
+ * @param w container writer
+ * @param packet packet to serialize
+ * @param instr number of the first instruction @p packet reconstructs, only
+ * used for F_SYNC packets which might start a block
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p w or @p packet is NULL
+ * @return -trdb_nomem if out of memory
+ * @return any error of trdb_pulp_write_single_packet()
+ * @return any error of trdb_save_state()
+ */
+int trdb_container_write_packet(struct trdb_ctx *c,
+                                struct trdb_container_writer *w,
+                                struct tr_packet *packet, uint64_t instr);
+
+/**
+ * Run trdb_compress_trace_step() on @p instr and write the produced packet to
+ * the container. This keeps track of the number of each instruction the way
+ * the decompression produces them, that is invalid and trapping instructions
+ * are not counted, and of the instructions passed in so far, which the blocks
+ * record for trdb_container_resume().
+ *
+ * @param c trace debugger context
+ * @param w container writer
+ * @param instr next instruction of the trace
+ * @return 0 if no packet was produced, 1 if a packet was written, a negative
+ * error code otherwise, see trdb_compress_trace_step() and
+ * trdb_container_write_packet()
+ */
+int trdb_container_compress_step(struct trdb_ctx *c,
+                                 struct trdb_container_writer *w,
+                                 struct tr_instr *instr);
+
+/**
+ * Write the block index and flush the container. The file is not closed. The
+ * resources of @p w are released even on failure.
+ *
+ * @param c trace debugger context
+ * @param w container writer
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c or @p w is NULL
+ * @return -trdb_file_write if the index could not be written
+ */
+int trdb_container_finish(struct trdb_ctx *c, struct trdb_container_writer *w);
+
+/**
+ * Map the trace container at @p path and read its block index. The packets in
+ * it have to be decoded with the full address setting in @p ct.
+ *
+ * @param c trace debugger context
+ * @param path location of the container
+ * @param ct written with the opened container
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p path or @p ct is NULL
+ * @return -trdb_bad_container if the file is not a container or the index is
+ * inconsistent
+ * @return -trdb_nomem if out of memory
+ * @return any error of trdb_pulp_map_packets()
+ */
+int trdb_container_open(struct trdb_ctx *c, const char *path,
+                        struct trdb_container *ct);
+
+/**
+ * Release a container opened with trdb_container_open().
+ *
+ * @param ct container to close
+ */
+void trdb_container_close(struct trdb_container *ct);
+
+/**
+ * Find the block from which decompression has to start to reach instruction
+ * number @p instr, that is the last one whose first instruction is not after
+ * @p instr.
+ *
+ * @param ct opened container
+ * @param instr instruction number to look for
+ * @return index into the blocks of @p ct, 0 if @p instr comes before all blocks
+ */
+size_t trdb_container_find_block(const struct trdb_container *ct,
+                                 uint64_t instr);
+
+/**
+ * Restore the state snapshot stored with @p block of @p ct into @p c, see
+ * trdb_container_set_snapshots() and trdb_restore_state().
+ *
+ * @param c trace debugger context
+ * @param ct opened container
+ * @param block index into the blocks of @p ct
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c or @p ct is NULL or @p block is out of range
+ * @return -trdb_bad_container if @p block has no snapshot
+ * @return any error of trdb_restore_state()
+ */
+int trdb_container_restore_block(struct trdb_ctx *c,
+                                 const struct trdb_container *ct, size_t block);
+
+/**
+ * Continue writing @p ct into @p fp from @p block on. This copies the packets
+ * up to and including the sync packet starting @p block and the index entries
+ * and snapshots of the blocks up to it, restores the snapshot of @p block into
+ * @p c and sets up @p w as if the original writer just wrote that sync packet.
+ * The compression goes on with trdb_container_compress_step() on the input
+ * following the first steps of @p block, those have been consumed already.
+ * Configure @p c like the original writer before. @p fp must not be the file
+ * of @p ct, which stays mapped.
+ *
+ * @param c trace debugger context
+ * @param ct opened container of the current version
+ * @param block index into the blocks of @p ct, usually the last one
+ * @param fp file to write to
+ * @param block_instrs see trdb_container_create()
+ * @param w written with the writer state
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p ct, @p fp or @p w is NULL or @p block is
+ * out of range
+ * @return -trdb_bad_config if the full address or ras tracking setting of @p c
+ * differs from the one of @p ct
+ * @return -trdb_bad_container if @p ct is of an older version, @p block has no
+ * snapshot or its sync packet is cut off
+ * @return -trdb_nomem if out of memory
+ * @return -trdb_file_write if writing to @p fp failed
+ * @return any error of trdb_restore_state()
+ */
+int trdb_container_resume(struct trdb_ctx *c, const struct trdb_container *ct,
+                          size_t block, FILE *fp, uint64_t block_instrs,
+                          struct trdb_container_writer *w);
+
+/**
+ * Decompress the instructions numbered [@p begin, @p end) from @p ct. This
+ * looks up the block containing @p begin in the index, decompresses from
+ * there and stops as soon as @p end is reached, so the cost doesn't depend on
+ * where the window is in the trace. @p c must have been prepared with
+ * trdb_decompress_open(). If the block has a snapshot the decompression starts
+ * with the return address stack from it, see trdb_restore_sync_state(),
+ * otherwise @p c should not have decompressed anything before and implicit
+ * returns to calls before the block fail with -trdb_bad_ras unless
+ * trdb_set_ras_tracking() is on.
+ *
+ * @param c trace debugger context
+ * @param ct opened container
+ * @param begin number of the first instruction passed to @p instr_fn
+ * @param end number past the last instruction passed to @p instr_fn
+ * @param instr_fn called with each reconstructed instruction in the window
+ * @param data passed to @p instr_fn
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p ct or @p instr_fn is NULL
+ * @return -trdb_bad_config if the full address or ras tracking setting of @p c
+ * differs from the one of @p ct
+ * @return any error of trdb_restore_sync_state()
+ * @return any error of trdb_decompress_packet()
+ */
+int trdb_container_decompress_window(
+    struct trdb_ctx *c, const struct trdb_container *ct, uint64_t begin,
+    uint64_t end,
+    int (*instr_fn)(struct trdb_ctx *c, const struct tr_instr *instr,
+                    void *data),
+    void *data);
+
 /**
  * Read a stimuli file at @p path into a list of tr_instr. This function
  * allocates the struts in a sequential fashion.
@@ -141,6 +765,24 @@ int trdb_stimuli_to_trace_list(struct trdb_ctx *c, const char *path,
 int trdb_stimuli_to_trace(struct trdb_ctx *c, const char *path,
                           struct tr_instr **samples, size_t *count);
 
+/**
+ * Like trdb_stimuli_to_trace() but the file is cut at line boundaries into
+ * pieces which are parsed by up to @p threads threads in parallel. Each record
+ * has to be on a line of its own for this, which is how they are generated.
+ *
+ * @param c the context/state of the trace debugger
+ * @param path where the stimuli file is located at
+ * @param samples where to write the read array of tr_instr
+ * @param count written with the number of produced tr_instr
+ * @param threads number of threads to use, 0 for as many as there are online
+ * cpus
+ * @return 0 on success, a negative error code otherwise, see
+ * trdb_stimuli_to_trace()
+ */
+int trdb_stimuli_to_trace_parallel(struct trdb_ctx *c, const char *path,
+                                   struct tr_instr **samples, size_t *count,
+                                   unsigned threads);
+
 /**
  * Load cvs file, where each line represents an input vector to the trace
  * debugger, into a list of tr_instr.
@@ -160,3 +802,137 @@ int trdb_stimuli_to_trace(struct trdb_ctx *c, const char *path,
  */
 int trdb_cvs_to_trace_list(struct trdb_ctx *c, const char *path,
                            struct trdb_instr_head *instrs, size_t *count);
+
+/**
+ * Like trdb_cvs_to_trace_list() but appends the tr_instr to the vector @p
+ * instrs. On failure @p instrs is freed.
+ *
+ * @param c the context/state of the trace debugger
+ * @param path where the cvs file is located at
+ * @param instrs vector where to append the tr_instr to
+ * @param count written with the number of produced tr_instr
+ * @return 0 on success, a negative error code otherwise, see
+ * trdb_cvs_to_trace_list()
+ */
+int trdb_cvs_to_trace_vec(struct trdb_ctx *c, const char *path,
+                          struct trdb_instr_vec *instrs, size_t *count);
+
+/**
+ * Load the cvs file at @p path into an array of tr_instr, parsing pieces cut
+ * at line boundaries with up to @p threads threads in parallel.
+ *
+ * @param c the context/state of the trace debugger
+ * @param path where the cvs file is located at
+ * @param samples where to write the read array of tr_instr
+ * @param count written with the number of produced tr_instr
+ * @param threads number of threads to use, 0 for as many as there are online
+ * cpus
+ * @return 0 on success, a negative error code otherwise, see
+ * trdb_cvs_to_trace_list()
+ */
+int trdb_cvs_to_trace_parallel(struct trdb_ctx *c, const char *path,
+                               struct tr_instr **samples, size_t *count,
+                               unsigned threads);
+
+/**
+ * Start writing a binary instruction trace to @p fp.
+ *
+ * The file starts with a 16 byte header: TRDB_TRACE_MAGIC, a 16 bit version,
+ * XLEN and the 32 bit @p flags. Each tr_instr is then stored as a fixed width
+ * record, all fields little endian: a 32 bit word holding valid (bit 0),
+ * exception (bit 1), interrupt (bit 2), compressed (bit 3), priv (bits 4-6)
+ * and cause (bits 8-12), followed by the instruction, the instruction address
+ * and tval, each ILEN or XLEN bits wide. That makes 16 bytes per instruction
+ * on a 32 bit target compared to about 120 in a stimuli file.
+ *
+ * @param c the context/state of the trace debugger
+ * @param fp file to write to, not closed by trdb_trace_writer_close()
+ * @param flags zero or TRDB_TRACE_DELTA_IADDR
+ * @param w written with the writer state
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p fp or @p w is NULL
+ * @return -trdb_file_write if the header could not be written
+ */
+int trdb_trace_writer_open(struct trdb_ctx *c, FILE *fp, uint32_t flags,
+                           struct trdb_trace_writer *w);
+
+/**
+ * Append @p instr to the binary instruction trace of @p w.
+ *
+ * @param w an open writer
+ * @param instr instruction to write
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p w or @p instr is NULL
+ * @return -trdb_file_write if the record could not be written
+ */
+int trdb_trace_write_instr(struct trdb_trace_writer *w,
+                           const struct tr_instr *instr);
+
+/**
+ * Flush the binary instruction trace of @p w. The file is not closed.
+ *
+ * @param w an open writer
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p w is NULL
+ * @return -trdb_file_write if flushing failed
+ */
+int trdb_trace_writer_close(struct trdb_trace_writer *w);
+
+/**
+ * Check the header of a binary instruction trace, see trdb_trace_writer_open().
+ *
+ * @param c the context/state of the trace debugger
+ * @param header the first TRDB_TRACE_HEADER_LEN bytes of the trace
+ * @param flags written with the TRDB_TRACE_* flags of the trace, may be NULL
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_bad_trace_file if the magic, version or XLEN doesn't match
+ */
+int trdb_trace_check_header(struct trdb_ctx *c, const uint8_t *header,
+                            uint32_t *flags);
+
+/**
+ * Encode @p instr as a record of a binary instruction trace without
+ * TRDB_TRACE_DELTA_IADDR, see trdb_trace_writer_open(). This allows sending
+ * instructions through other channels than files in the same layout.
+ *
+ * @param instr instruction to encode
+ * @param rec written with the TRDB_TRACE_RECORD_LEN bytes of the record
+ */
+void trdb_trace_encode_instr(const struct tr_instr *instr, uint8_t *rec);
+
+/**
+ * Decode a record produced by trdb_trace_encode_instr().
+ *
+ * @param rec TRDB_TRACE_RECORD_LEN bytes of the record
+ * @param instr written with the decoded instruction
+ */
+void trdb_trace_decode_instr(const uint8_t *rec, struct tr_instr *instr);
+
+/**
+ * Check whether the file at @p path starts like a binary instruction trace.
+ *
+ * @param path file to look at
+ * @return true if it has the TRDB_TRACE_MAGIC, false otherwise or if it can't
+ * be read
+ */
+bool trdb_is_binary_trace(const char *path);
+
+/**
+ * Read the binary instruction trace at @p path into an array of tr_instr, see
+ * trdb_trace_writer_open() for the format.
+ *
+ * @param c the context/state of the trace debugger
+ * @param path where the trace is located at
+ * @param samples where to write the read array of tr_instr
+ * @param count written with the number of produced tr_instr
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p path, @p samples or @p count is NULL
+ * @return -trdb_file_open if file at @p path could not be opened
+ * @return -trdb_nomem if out of memory
+ * @return -trdb_bad_trace_file if the header doesn't match or the file is
+ * truncated
+ */
+int trdb_binary_to_trace(struct trdb_ctx *c, const char *path,
+                         struct tr_instr **samples, size_t *count);
+
+#endif
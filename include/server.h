@@ -0,0 +1,264 @@
+/*
+ * trdb - Trace Debugger Software for the PULP platform
+ *
+ * Copyright (C) 2024 Robert Balas
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file server.h
+ * @author Robert Balas (balasr@student.ethz.ch)
+ * @brief Compress instructions as they arrive over a ring or a socket and
+ * decompress packets as they arrive
+ */
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <signal.h>
+#include "trace_debugger.h"
+#include "serialize.h"
+
+/**
+ * Magic bytes at the start of an instruction ring, see trdb_ring_create().
+ */
+#define TRDB_RING_MAGIC "TRDBRING"
+
+/**
+ * Version of the instruction ring layout.
+ */
+#define TRDB_RING_VERSION 1
+
+/**
+ * A single producer, single consumer ring of instructions in shared memory,
+ * see trdb_ring_create().
+ */
+struct trdb_ring;
+
+/**
+ * What a server did so far, see trdb_serve_ring() and trdb_serve_fd().
+ */
+struct trdb_server_stats {
+    uint64_t instrs;           /**< instructions compressed */
+    uint64_t packets;          /**< packets written to the container */
+    uint64_t bytes;            /**< container bytes before the index */
+    uint64_t dropped;          /**< instructions dropped on a full ring */
+    uint64_t stalls;           /**< times the producer waited for space */
+    uint64_t batches;          /**< batches of instructions received */
+    uint64_t max_latency_ns;   /**< longest time to compress a batch */
+    uint64_t total_latency_ns; /**< time spent compressing all batches */
+    uint64_t elapsed_ns;       /**< time since the first instruction arrived */
+};
+
+/**
+ * What trdb_follow_fd() did so far.
+ */
+struct trdb_follow_stats {
+    uint64_t bytes;            /**< bytes read */
+    uint64_t packets;          /**< packets decompressed */
+    uint64_t instrs;           /**< instructions reconstructed */
+    uint64_t max_latency_ns;   /**< longest delay of a packet after its read */
+    uint64_t total_latency_ns; /**< the same summed over all packets */
+};
+
+/**
+ * Create an instruction ring of @p capacity records in the file at @p path,
+ * which is usually on a tmpfs such as /dev/shm, and map it. A producer in
+ * another process or thread attaches to it with trdb_ring_attach() and
+ * pushes instructions with trdb_ring_push() while the consumer takes them out
+ * with trdb_ring_pop(). Neither side takes a lock, each only advances its own
+ * counter.
+ *
+ * Records are stored in the layout of trdb_trace_encode_instr(), so producers
+ * that don't link against libtrdb can fill the ring too. The file starts with
+ * a 64 byte header of #TRDB_RING_MAGIC, a 32 bit version, the 32 bit record
+ * size, the 64 bit capacity and 32 bit flags (bit 0 is set for dropping). Each
+ * of the following 64 byte lines holds 64 bit counters: the producer owns the
+ * first line of head (records pushed), dropped, stalls and closed, the
+ * consumer owns the second one of tail (records popped). The records follow.
+ * All integers are in native byte order.
+ *
+ * @param c trace debugger context, used for logging
+ * @param path file to create, an existing file is replaced
+ * @param capacity number of records, rounded up to a power of two
+ * @param drop when the ring is full drop and count further instructions
+ * instead of making the producer wait
+ * @param ring written with the ring, release with trdb_ring_free()
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p path or @p ring is NULL or @p capacity is
+ * zero
+ * @return -trdb_file_open if the file could not be created or mapped
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_ring_create(struct trdb_ctx *c, const char *path, size_t capacity,
+                     bool drop, struct trdb_ring **ring);
+
+/**
+ * Map the instruction ring at @p path created by trdb_ring_create().
+ *
+ * @param c trace debugger context, used for logging
+ * @param path location of the ring
+ * @param ring written with the ring, release with trdb_ring_free()
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p path or @p ring is NULL
+ * @return -trdb_file_open if the file could not be opened or mapped
+ * @return -trdb_bad_ring if the file is not a ring of this XLEN
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_ring_attach(struct trdb_ctx *c, const char *path,
+                     struct trdb_ring **ring);
+
+/**
+ * Unmap @p ring. The file is not removed.
+ *
+ * @param ring ring, may be NULL
+ */
+void trdb_ring_free(struct trdb_ring *ring);
+
+/**
+ * Push @p len instructions into @p ring. This is the producer side, only one
+ * thread may push at a time. When the ring is full the call waits for the
+ * consumer unless the ring drops, in which case the instructions that don't
+ * fit are counted and discarded.
+ *
+ * @param ring ring
+ * @param len number of instructions
+ * @param instrs instructions to push
+ * @return the number of pushed instructions
+ */
+size_t trdb_ring_push(struct trdb_ring *ring, size_t len,
+                      const struct tr_instr instrs[len]);
+
+/**
+ * Tell the consumer of @p ring that no more instructions follow. The consumer
+ * still drains what is in the ring.
+ *
+ * @param ring ring
+ */
+void trdb_ring_close(struct trdb_ring *ring);
+
+/**
+ * Take up to @p cap instructions out of @p ring without waiting. This is the
+ * consumer side, only one thread may pop at a time.
+ *
+ * @param ring ring
+ * @param cap number of instructions that fit into @p instrs
+ * @param instrs written with the instructions
+ * @return the number of instructions taken out
+ */
+size_t trdb_ring_pop(struct trdb_ring *ring, size_t cap,
+                     struct tr_instr instrs[cap]);
+
+/**
+ * Whether the producer of @p ring closed it and all instructions were popped.
+ *
+ * @param ring ring
+ * @return true if nothing more is going to arrive
+ */
+bool trdb_ring_finished(const struct trdb_ring *ring);
+
+/**
+ * Compress the instructions arriving in @p ring into the container @p w until
+ * the producer closes the ring or @p stop is set. Packets are flushed each time
+ * the server caught up with the producer, so the container on disk lags behind
+ * by at most a batch.
+ *
+ * @param c trace debugger context/state
+ * @param ring ring to consume
+ * @param w container writer, see trdb_container_create()
+ * @param stop checked between batches, may be NULL
+ * @param stats written with what the server did, may be NULL
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p ring or @p w is NULL
+ * @return any error of trdb_container_compress_step()
+ */
+int trdb_serve_ring(struct trdb_ctx *c, struct trdb_ring *ring,
+                    struct trdb_container_writer *w,
+                    const volatile sig_atomic_t *stop,
+                    struct trdb_server_stats *stats);
+
+/**
+ * Like trdb_serve_ring() but read a binary instruction trace, as written by
+ * trdb_trace_writer_open(), from @p fd until the other end closes it. The
+ * stream applies back-pressure by itself, nothing is dropped. @p stop is
+ * checked whenever a read is interrupted by a signal.
+ *
+ * @param c trace debugger context/state
+ * @param fd file descriptor of a socket, pipe or file to read from
+ * @param w container writer, see trdb_container_create()
+ * @param stop checked between reads, may be NULL
+ * @param stats written with what the server did, may be NULL
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c or @p w is NULL or @p fd is negative
+ * @return -trdb_file_read if reading failed
+ * @return -trdb_bad_trace_file if the stream is not a binary instruction trace
+ * or ends in the middle of a record
+ * @return any error of trdb_container_compress_step()
+ */
+int trdb_serve_fd(struct trdb_ctx *c, int fd, struct trdb_container_writer *w,
+                  const volatile sig_atomic_t *stop,
+                  struct trdb_server_stats *stats);
+
+/**
+ * Decompress PULP packets from @p fd as they arrive and call @p instr_fn for
+ * each reconstructed instruction, like trdb_decompress_packet(), to which
+ * this hands each complete packet as soon as it was read. Only an incomplete
+ * packet is ever buffered and reads are a few kilobytes at most, so the time
+ * from reading a packet to reporting its instructions is bounded by the
+ * decompression of a single read. @p c must have been prepared with
+ * trdb_decompress_open().
+ *
+ * The input ends when the other end of a pipe or socket is closed. With @p
+ * tail a regular file is instead polled for new data once all of it was
+ * read, like tail -f does, until @p stop is set. A trailing incomplete packet
+ * is ignored like in trdb_pulp_read_all_packets().
+ *
+ * @param c trace debugger context/state
+ * @param fd file descriptor of a pipe, socket or file to read from
+ * @param tail keep waiting for a regular file to grow
+ * @param flush_fp flushed whenever all packets read so far were decompressed,
+ * may be NULL
+ * @param stop checked before each read, may be NULL
+ * @param instr_fn called with each reconstructed instruction
+ * @param data passed to @p instr_fn
+ * @param stats written with what was decompressed, may be NULL
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c or @p instr_fn is NULL or @p fd is negative
+ * @return -trdb_file_read if reading failed
+ * @return -trdb_nomem if out of memory
+ * @return any error of trdb_pulp_next_mapped_packet() and
+ * trdb_decompress_packet()
+ */
+int trdb_follow_fd(struct trdb_ctx *c, int fd, bool tail, FILE *flush_fp,
+                   const volatile sig_atomic_t *stop,
+                   int (*instr_fn)(struct trdb_ctx *c,
+                                   const struct tr_instr *instr, void *data),
+                   void *data, struct trdb_follow_stats *stats);
+
+/**
+ * Listen on @p address and accept a single connection. @p address is either
+ * unix:PATH for a unix domain socket or tcp:[HOST:]PORT for a TCP socket.
+ *
+ * @param c trace debugger context, used for logging
+ * @param address where to listen
+ * @param fd written with the connected socket, close it when done
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p address or @p fd is NULL or @p address is
+ * malformed
+ * @return -trdb_socket if listening or accepting failed
+ */
+int trdb_serve_accept(struct trdb_ctx *c, const char *address, int *fd);
+
+#endif
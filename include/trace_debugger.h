@@ -178,6 +178,47 @@ struct tr_packet {
  */
 TAILQ_HEAD(trdb_packet_head, tr_packet);
 
+/**
+ * Number of records in each block of a trdb_instr_vec or trdb_packet_vec.
+ */
+#define TRDB_VEC_BLOCK 4096
+
+/**
+ * A growable array of tr_instr, stored in blocks of TRDB_VEC_BLOCK records.
+ * Blocks are never moved, so pointers to records stay valid while the vector
+ * grows, and the whole vector is released at once with trdb_free_instr_vec().
+ * This avoids the per record allocation and list overhead of trdb_instr_head.
+ * The list anchor of the records is unused. Zero initialize before use.
+ */
+struct trdb_instr_vec {
+    struct tr_instr **blocks; /**< blocks of TRDB_VEC_BLOCK records */
+    size_t nblocks;           /**< number of allocated blocks */
+    size_t size;              /**< number of records */
+};
+
+/**
+ * A growable array of tr_packet, see trdb_instr_vec.
+ */
+struct trdb_packet_vec {
+    struct tr_packet **blocks; /**< blocks of TRDB_VEC_BLOCK records */
+    size_t nblocks;            /**< number of allocated blocks */
+    size_t size;               /**< number of records */
+};
+
+/**
+ * Pointer to the record at index @p i of the trdb_instr_vec or trdb_packet_vec
+ * @p vec. No bounds checking is done.
+ */
+#define TRDB_VEC_AT(vec, i)                                                    \
+    (&(vec)->blocks[(i) / TRDB_VEC_BLOCK][(i) % TRDB_VEC_BLOCK])
+
+/**
+ * Iterate over all records of the trdb_instr_vec or trdb_packet_vec @p vec in
+ * order, with @p var pointing to the record at index @p i.
+ */
+#define TRDB_VEC_FOREACH(var, i, vec)                                          \
+    for ((i) = 0; (i) < (vec)->size && ((var) = TRDB_VEC_AT(vec, i), 1); (i)++)
+
 /**
  * Keep information about generated packets.
  */
@@ -214,7 +255,12 @@ enum trdb_error_code {
     trdb_scan_state_invalid,
     trdb_arch_support,
     trdb_section_empty,
-    trdb_bad_vma
+    trdb_bad_vma,
+    trdb_bad_container,
+    trdb_bad_trace_file,
+    trdb_bad_ring,
+    trdb_socket,
+    trdb_bad_state
 };
 
 /**
@@ -267,6 +313,82 @@ void trdb_reset_compression(struct trdb_ctx *ctx);
  */
 void trdb_reset_decompression(struct trdb_ctx *ctx);
 
+/**
+ * Magic bytes at the start of a state snapshot, see trdb_save_state().
+ */
+#define TRDB_STATE_MAGIC "TRDBSTAT"
+
+/**
+ * Version of the state snapshot layout.
+ */
+#define TRDB_STATE_VERSION 2
+
+/**
+ * Upper bound of the size of a state snapshot in bytes.
+ */
+#define TRDB_STATE_MAX (256 + 2 * 8 * TRDB_RAS_MAX)
+
+/**
+ * Save where the compression and the decompression of @p ctx are to @p buf, so
+ * that trdb_restore_state() can continue from there later, in another context
+ * or process. This covers the cycle states and branch map of the compression,
+ * the return address stack it follows for the decompression, and the pc, privilege, last packet address, branch map and return address
+ * stack of the decompression, but neither the configuration nor the statistics
+ * or the opened binary. A block visit of trdb_decompress_packet_blocks() that
+ * is in progress is not saved either.
+ *
+ * The snapshot starts with #TRDB_STATE_MAGIC, a 32 bit version and the 32 bit
+ * XLEN, all integers are little-endian. Only the used entries of the return
+ * address stacks are stored, so it is usually much smaller than
+ * #TRDB_STATE_MAX.
+ *
+ * @param ctx trace debugger context
+ * @param buf written with the snapshot
+ * @param size bytes available in @p buf
+ * @param len written with the size of the snapshot, even if it didn't fit
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p ctx or @p len is NULL or the snapshot doesn't
+ * fit into @p size bytes
+ */
+int trdb_save_state(struct trdb_ctx *ctx, uint8_t *buf, size_t size,
+                    size_t *len);
+
+/**
+ * Continue compressing and decompressing with @p ctx where trdb_save_state()
+ * left off. Configure @p ctx like the saved context before, in particular the
+ * depth of the return address stack. An opened decompression stays open. On
+ * failure @p ctx is left unchanged.
+ *
+ * @param ctx trace debugger context
+ * @param buf snapshot of trdb_save_state()
+ * @param len size of the snapshot in bytes
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p ctx or @p buf is NULL
+ * @return -trdb_bad_state if @p buf is not a snapshot of this version and
+ * XLEN, is truncated or holds more return addresses than the stack of @p ctx
+ */
+int trdb_restore_state(struct trdb_ctx *ctx, const uint8_t *buf, size_t len);
+
+/**
+ * Prepare the decompression of @p ctx to start at a sync packet, given the
+ * snapshot trdb_save_state() took of the compression right after the step that
+ * produced it. The return address stack of the decompression becomes the one
+ * the compression followed up to the instruction of the sync packet, which the
+ * decompression needs with trdb_set_implicit_ret() unless
+ * trdb_set_ras_tracking() is on. The sync packet itself sets the pc and
+ * privilege, the compression of @p ctx is left alone. On failure @p ctx is
+ * left unchanged.
+ *
+ * @param ctx trace debugger context
+ * @param buf snapshot of trdb_save_state()
+ * @param len size of the snapshot in bytes
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p ctx or @p buf is NULL
+ * @return -trdb_bad_state see trdb_restore_state()
+ */
+int trdb_restore_sync_state(struct trdb_ctx *ctx, const uint8_t *buf,
+                            size_t len);
+
 /**
  * Creates trdb library/trace debugger context. Fills in default values. Set
  * $TRDB_LOG for different default logging level.
@@ -294,6 +416,47 @@ void trdb_set_log_fn(struct trdb_ctx *ctx,
                                     const char *file, int line, const char *fn,
                                     const char *format, va_list args));
 
+/**
+ * Kinds of events reported to the function set with trdb_set_event_fn().
+ */
+enum trdb_event_kind {
+    TRDB_EVENT_PACKET_EMIT,   /**< compression generated a packet */
+    TRDB_EVENT_PACKET_DECODE, /**< decompression is about to consume a packet */
+    TRDB_EVENT_INSTR_DECODE   /**< decompression reconstructed an instruction */
+};
+
+/**
+ * An event of the compression or decompression. The pointers are only valid
+ * during the call.
+ */
+struct trdb_event {
+    enum trdb_event_kind kind;
+    const struct tr_packet *packet; /**< the packet, NULL for instructions */
+    const struct tr_instr *instr;   /**< the instruction that was compressed or
+                                     * reconstructed, NULL when decoding a
+                                     * packet
+                                     */
+};
+
+/**
+ * Hook a function which is called for each packet and instruction passing
+ * through the compression and decompression of @p ctx. This is meant for tools
+ * which would otherwise have to parse debug messages. Without a hook an event
+ * costs a single pointer check and the debug messages can stay compiled out.
+ * trdb_decompress_trace_parallel() holds back the events of its threads and
+ * reports them with @p ctx from the calling thread, in the same order as
+ * trdb_decompress_trace_vec() and each once.
+ *
+ * @param ctx a trace debugger context
+ * @param event_fn function to call, NULL to disable
+ * @param data passed through to @p event_fn
+ */
+void trdb_set_event_fn(struct trdb_ctx *ctx,
+                       void (*event_fn)(struct trdb_ctx *ctx,
+                                        const struct trdb_event *event,
+                                        void *data),
+                       void *data);
+
 /**
  * Get the current logging priority. The value controls which messages are
  * logged.
@@ -373,6 +536,57 @@ bool trdb_get_implicit_ret(struct trdb_ctx *ctx);
  */
 void trdb_set_implicit_ret(struct trdb_ctx *ctx, bool implicit_ret);
 
+/**
+ * Upper bound of trdb_set_ras_depth().
+ */
+#define TRDB_RAS_MAX 256
+
+/**
+ * Get the number of return addresses the return address stack of the
+ * decompression holds.
+ *
+ * @param ctx a trace debugger context
+ * @return depth of the return address stack
+ */
+uint32_t trdb_get_ras_depth(struct trdb_ctx *ctx);
+
+/**
+ * Set the number of return addresses the return address stack of the
+ * decompression holds. Like in hardware the stack is circular, a call on a full
+ * stack overwrites the oldest entry. The compression follows the stack and
+ * sends the address of each return that finds it empty, so calls may nest
+ * deeper. Compression and decompression need to use the same depth. Set it
+ * before compressing or decompressing, it empties the stack.
+ *
+ * @param ctx a trace debugger context
+ * @param depth number of entries, clamped to [1, #TRDB_RAS_MAX] (default
+ * #TRDB_RAS_MAX)
+ */
+void trdb_set_ras_depth(struct trdb_ctx *ctx, uint32_t depth);
+
+/**
+ * Get whether the compression follows the return address stack of the
+ * decompression, see trdb_set_ras_tracking().
+ *
+ * @param ctx a trace debugger context
+ * @return whether ras tracking is enabled
+ */
+bool trdb_get_ras_tracking(struct trdb_ctx *ctx);
+
+/**
+ * Set whether each sync packet empties the return address stack of the
+ * compression and decompression, see trdb_set_ras_depth(), so that with
+ * implicit returns decompression can start at any sync packet. This changes
+ * the packets, so compression and decompression have to agree on it. It is off
+ * by default, which keeps the stack across sync packets. Either way a return
+ * that finds the stack empty, e.g. after calls nested deeper than it, carries
+ * its address.
+ *
+ * @param ctx a trace debugger context
+ * @param ras_tracking whether to enable ras tracking
+ */
+void trdb_set_ras_tracking(struct trdb_ctx *ctx, bool ras_tracking);
+
 /**
  * Get whether currently an extra packet is generated for an exception. This is
  * useful for the PULP platform since this allows us to figure out where the
@@ -412,6 +626,235 @@ bool trdb_get_compress_branch_map(struct trdb_ctx *ctx);
  */
 void trdb_set_compress_branch_map(struct trdb_ctx *ctx, bool compress);
 
+/**
+ * Get whether trdb_decompress_trace() memoizes decoded instructions.
+ *
+ * @param ctx a trace debugger context
+ * @return if the decode cache is enabled
+ */
+bool trdb_get_decode_cache(struct trdb_ctx *ctx);
+
+/**
+ * Set whether trdb_decompress_trace() should memoize decoded instructions. If
+ * enabled, each instruction of the binary is passed to libopcodes only once and
+ * afterwards its size, branch type, jump target and return address stack
+ * behaviour are taken from a per section table. The cache lasts from
+ * trdb_decompress_open() to trdb_decompress_close(), which also the
+ * trdb_decompress_trace() functions call, and is dropped by the reset functions
+ * and by disabling it. To keep decoded instructions across decompressions use
+ * a trdb_image, see trdb_image_new().
+ *
+ * @param ctx a trace debugger context
+ * @param enable whether to use the decode cache
+ */
+void trdb_set_decode_cache(struct trdb_ctx *ctx, bool enable);
+
+/**
+ * A read-only view of a program for decompression: its code sections, each
+ * instruction already decoded, and its sorted symbol table. It is built once
+ * with trdb_image_new() and can then be used by any number of trdb_ctx at the
+ * same time, see trdb_set_image().
+ */
+struct trdb_image;
+
+/**
+ * Build the program image of @p abfd. This reads @p abfd, so nothing else may
+ * use @p abfd at the same time. Afterwards the image only reads @p abfd's
+ * section descriptions, so @p abfd must stay open until trdb_image_free().
+ *
+ * @param c trace debugger context, used for logging
+ * @param abfd the program
+ * @param image written with the new image
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p abfd or @p image is NULL
+ * @return -trdb_nomem if out of memory
+ * @return -trdb_section_empty if section contents could not be be loaded
+ */
+int trdb_image_new(struct trdb_ctx *c, bfd *abfd, struct trdb_image **image);
+
+/**
+ * Release @p image. No trdb_ctx may use it anymore.
+ *
+ * @param image the image to release, may be NULL
+ */
+void trdb_image_free(struct trdb_image *image);
+
+/**
+ * Make @p ctx decompress traces of the image's bfd with @p image instead of
+ * loading and decoding the bfd itself. This makes trdb_decompress_open() nearly
+ * free, and since @p image is never modified, contexts in different threads can
+ * share it. Decompressing a different bfd works as before. Pass NULL to stop
+ * using an image.
+ *
+ * @param ctx a trace debugger context
+ * @param image the image to use, which must outlive its use by @p ctx
+ */
+void trdb_set_image(struct trdb_ctx *ctx, struct trdb_image *image);
+
+/**
+ * Get the image set with trdb_set_image().
+ *
+ * @param ctx a trace debugger context
+ * @return the image of @p ctx or NULL
+ */
+struct trdb_image *trdb_get_image(struct trdb_ctx *ctx);
+
+/**
+ * How the last instruction of a basic block leaves it.
+ */
+enum trdb_block_kind {
+    TRDB_BLOCK_FALLTHROUGH, /**< runs into the next block */
+    TRDB_BLOCK_BRANCH,      /**< conditional branch */
+    TRDB_BLOCK_JUMP,        /**< jump with a known target */
+    TRDB_BLOCK_CALL,        /**< function call */
+    TRDB_BLOCK_RETURN,      /**< function return */
+    TRDB_BLOCK_INDIRECT     /**< jump or trap return with an unknown target */
+};
+
+/**
+ * A basic block of a trdb_cfg, a sequence of instructions that is only entered
+ * at its first and only left after its last instruction, apart from traps.
+ */
+struct trdb_block {
+    addr_t start;              /**< address of the first instruction */
+    addr_t last;               /**< address of the last instruction */
+    addr_t taken;              /**< target of the last instruction if known */
+    addr_t fallthrough;        /**< address after the block, zero if control
+                                * never returns there
+                                */
+    uint32_t instrs;           /**< number of instructions */
+    enum trdb_block_kind kind; /**< what the last instruction does */
+};
+
+/**
+ * The control flow graph of a program, its basic blocks sorted by address, see
+ * trdb_cfg_new().
+ */
+struct trdb_cfg;
+
+/**
+ * Split the code of @p image into basic blocks. Blocks start at the beginning
+ * of a section, at every direct branch, jump or call target and after every
+ * instruction that changes the control flow. Like @p image, the graph is never
+ * modified and can be shared among threads.
+ *
+ * The instructions are found by walking each section linearly, so a block
+ * start that falls in the middle of a walked 32 bit instruction, e.g. because
+ * data in the section decodes as one, can't be honored. Execution reaching
+ * such an address is attributed to the block around it. trdb_cfg_hidden()
+ * tells how often that happened.
+ *
+ * @param c trace debugger context, used for logging
+ * @param image the program, must outlive the graph
+ * @param cfg written with the new graph, release with trdb_cfg_free()
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p image or @p cfg is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_cfg_new(struct trdb_ctx *c, const struct trdb_image *image,
+                 struct trdb_cfg **cfg);
+
+/**
+ * Release @p cfg.
+ *
+ * @param cfg the graph to release, may be NULL
+ */
+void trdb_cfg_free(struct trdb_cfg *cfg);
+
+/**
+ * Get the basic blocks of @p cfg. The index of a block in this array is its
+ * id.
+ *
+ * @param cfg the graph
+ * @param len written with the number of blocks
+ * @return the blocks sorted by address
+ */
+const struct trdb_block *trdb_cfg_blocks(const struct trdb_cfg *cfg,
+                                         size_t *len);
+
+/**
+ * Get the number of block starts that trdb_cfg_new() had to ignore because
+ * they lie inside another instruction.
+ *
+ * @param cfg the graph
+ * @return number of ignored block starts, zero for well formed code
+ */
+size_t trdb_cfg_hidden(const struct trdb_cfg *cfg);
+
+/**
+ * Find the basic block of @p cfg which contains the instruction at @p addr.
+ *
+ * @param cfg the graph
+ * @param addr instruction address
+ * @return the block or NULL if @p addr is not in any
+ */
+const struct trdb_block *trdb_cfg_find(const struct trdb_cfg *cfg,
+                                       addr_t addr);
+
+/**
+ * Get whether trdb_decompress_trace() classifies instructions without
+ * libopcodes.
+ *
+ * @param ctx a trace debugger context
+ * @return if the native instruction classifier is used
+ */
+bool trdb_get_native_decode(struct trdb_ctx *ctx);
+
+/**
+ * Set whether trdb_decompress_trace() should classify instructions with its own
+ * RISC-V decoder instead of disassembling them with libopcodes. The native
+ * decoder only figures out the instruction length, the kind of branch or jump
+ * and its target, which is all the decompression needs, and skips the text
+ * formatting. Libopcodes is still used if debug logging is enabled, since then
+ * the disassembly is actually printed. Enabled by default.
+ *
+ * @param ctx a trace debugger context
+ * @param enable whether to use the native instruction classifier
+ */
+void trdb_set_native_decode(struct trdb_ctx *ctx, bool enable);
+
+/**
+ * Get the number of instructions after which the compression emits a sync
+ * packet, see trdb_set_resync_interval().
+ *
+ * @param ctx a trace debugger context
+ * @return the resync interval in instructions or 0 if disabled
+ */
+uint64_t trdb_get_resync_interval(struct trdb_ctx *ctx);
+
+/**
+ * Set the number of instructions after which trdb_compress_trace_step() emits
+ * a sync packet carrying the full address and privilege level. Decompression
+ * can start at any such packet, which allows seeking in a trace and splitting
+ * it for trdb_decompress_trace_parallel(). Smaller intervals cost more bits per
+ * instruction but reduce the distance to the next sync packet. The counter is
+ * restarted by every sync packet, including the ones emitted for exceptions.
+ *
+ * @param ctx a trace debugger context
+ * @param instrs the resync interval in instructions, 0 disables it (default)
+ */
+void trdb_set_resync_interval(struct trdb_ctx *ctx, uint64_t instrs);
+
+/**
+ * Get the number of packets after which the compression emits a sync packet,
+ * see trdb_set_resync_packet_interval().
+ *
+ * @param ctx a trace debugger context
+ * @return the resync interval in packets or 0 if disabled
+ */
+uint64_t trdb_get_resync_packet_interval(struct trdb_ctx *ctx);
+
+/**
+ * Set the number of packets after which trdb_compress_trace_step() emits a sync
+ * packet. Works like trdb_set_resync_interval() but bounds the number of
+ * packets, instead of instructions, that have to be decoded after a seek. Both
+ * intervals can be enabled at the same time.
+ *
+ * @param ctx a trace debugger context
+ * @param packets the resync interval in packets, 0 disables it (default)
+ */
+void trdb_set_resync_packet_interval(struct trdb_ctx *ctx, uint64_t packets);
+
 /**
  * Get the current number of bits of all the payloads which were produced
  * by calling trdb_compress_trace_step().
@@ -468,6 +911,69 @@ size_t trdb_get_instrbits(struct trdb_ctx *ctx);
 void trdb_get_packet_stats(struct trdb_ctx *ctx,
                            struct trdb_packet_stats *stats);
 
+/**
+ * Hot path stages timed in trdb_perf_stats.
+ */
+enum trdb_perf_stage {
+    trdb_perf_parse,     /**< parsing stimuli, cvs and binary trace files */
+    trdb_perf_compress,  /**< trdb_compress_trace_step() or a block */
+    trdb_perf_serialize, /**< trdb_pulp_serialize_packet() */
+    trdb_perf_read,      /**< decoding packets read from a file or a map */
+    trdb_perf_decode,    /**< decoding an instruction while decompressing */
+    trdb_perf_ras,       /**< updating the return address stack */
+    trdb_perf_section,   /**< switching to the code section of the pc */
+    TRDB_PERF_STAGES
+};
+
+/**
+ * How often a trdb_perf_stage ran and for how long.
+ */
+struct trdb_perf_timer {
+    uint64_t calls; /**< number of times the stage ran */
+    uint64_t ns;    /**< total time spent in the stage */
+};
+
+/**
+ * Timings and counters of the hot paths, see trdb_get_perf_stats().
+ */
+struct trdb_perf_stats {
+    struct trdb_perf_timer stages[TRDB_PERF_STAGES];
+    uint64_t decode_hits;   /**< instructions taken from a decode cache */
+    uint64_t decode_misses; /**< instructions that had to be decoded */
+    uint64_t section_loads; /**< code sections read from a bfd */
+    uint64_t allocs;        /**< packets, instructions and tables allocated */
+};
+
+/**
+ * Return the name of @p stage, e.g. "compress".
+ */
+const char *trdb_perf_stage_name(enum trdb_perf_stage stage);
+
+/**
+ * Get the timings and counters of the hot paths collected since trdb_new() or
+ * the last trdb_reset_perf_stats(). Both cached decodes in a trdb_image and in
+ * the decode cache of trdb_set_decode_cache() count as hits. The stats are
+ * only collected when configured with --enable-perf-stats, otherwise not even
+ * the clock is read and the hot paths are the same as without instrumentation.
+ *
+ * @param ctx a trace debugger context
+ * @param stats written with the stats
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p ctx or @p stats is NULL
+ * @return -trdb_unimplemented if built without --enable-perf-stats, @p stats
+ * is zeroed
+ */
+int trdb_get_perf_stats(struct trdb_ctx *ctx, struct trdb_perf_stats *stats);
+
+/**
+ * Start collecting the stats of trdb_get_perf_stats() from scratch. Unlike the
+ * packet statistics they survive trdb_reset_compression() and
+ * trdb_reset_decompression(), so they can sum up a whole session.
+ *
+ * @param ctx a trace debugger context
+ */
+void trdb_reset_perf_stats(struct trdb_ctx *ctx);
+
 /**
  * Compute the number of equal (all ones or all zeros) leading bits in @p addr.
  *
@@ -521,6 +1027,52 @@ int trdb_compress_trace_step_add(struct trdb_ctx *ctx,
                                  struct trdb_packet_head *packet_list,
                                  struct tr_instr *instr);
 
+/**
+ * Like trdb_compress_trace_step_add() but appends the generated packet to the
+ * trdb_packet_vec @p packets, which is released with trdb_free_packet_vec().
+ *
+ * @param ctx trace debugger context/state
+ * @param packets vector to add packet to
+ * @param instr the next instruction to compress
+ * @return 0 or a positive number of generated packets on success, a negative
+ * error code otherwise
+ * @return -trdb_invalid if @p ctx, @p packets or @p instr is NULL
+ * @return -trdb_bad_instr if an unsupported instruction was passed through @p
+ * instr
+ * @return -trdb_unimplemented if an unimplemented variable generated a packet
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_compress_trace_step_vec(struct trdb_ctx *ctx,
+                                 struct trdb_packet_vec *packets,
+                                 struct tr_instr *instr);
+
+/**
+ * Run trdb_compress_trace_step() over the array @p instrs and write the
+ * generated packets to @p packets. This stops early when @p packets is full,
+ * the remaining instructions can be passed in the next call. There is no
+ * allocation per packet and the packets don't have to be copied out again.
+ * The arguments are checked and the block is timed only once.
+ *
+ * @param ctx trace debugger context/state
+ * @param len number of instructions in @p instrs
+ * @param instrs the next instructions to compress
+ * @param cap number of packets that fit into @p packets
+ * @param packets buffer for the generated packets
+ * @param consumed written with the number of instructions of @p instrs that
+ * were compressed, on failure the index of the offending instruction
+ * @param produced written with the number of packets put into @p packets
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p ctx, @p consumed or @p produced is NULL or @p
+ * instrs or @p packets is NULL while not empty
+ * @return -trdb_bad_instr if an unsupported instruction was passed through @p
+ * instrs
+ * @return -trdb_unimplemented if an unimplemented variable generated a packet
+ */
+int trdb_compress_trace_block(struct trdb_ctx *ctx, size_t len,
+                              struct tr_instr instrs[len], size_t cap,
+                              struct tr_packet packets[cap], size_t *consumed,
+                              size_t *produced);
+
 /**
  * Generate the original instruction sequence from a list of tr_packet, given
  * the binary from which the instruction sequence was produced.
@@ -546,6 +1098,141 @@ int trdb_decompress_trace(struct trdb_ctx *c, bfd *abfd,
                           struct trdb_packet_head *packet_list,
                           struct trdb_instr_head *instr_list);
 
+/**
+ * Like trdb_decompress_trace() but reads the packets from and writes the
+ * reconstructed instructions to vectors.
+ *
+ * @param c the context/state of the trace debugger
+ * @param abfd the binary from which the trace was captured
+ * @param packets the compressed instruction trace
+ * @param instrs vector to which the reconstruction instructions will be
+ * appended
+ * @return 0 on success, a negative error code otherwise, see
+ * trdb_decompress_trace()
+ */
+int trdb_decompress_trace_vec(struct trdb_ctx *c, bfd *abfd,
+                              struct trdb_packet_vec *packets,
+                              struct trdb_instr_vec *instrs);
+
+/**
+ * Like trdb_decompress_trace_vec() but decompresses on @p threads threads. The
+ * packets are split at F_SYNC packets, which carry a full address and serve as
+ * restart points, and the pieces are decompressed independently and stitched
+ * together in order. With trdb_set_ras_tracking() sync packets also empty the
+ * return address stack. Otherwise the stack at the start of a piece is
+ * unknown, so pieces are first decompressed with an empty one and redone
+ * sequentially with the real stack if an implicit return underflowed it.
+ * Either way the instructions, the events and the decompression state left in
+ * @p c are the same as those of trdb_decompress_trace_vec(). Traces compressed
+ * with a resync interval, see trdb_set_resync_interval(), have evenly spread
+ * restart points. The calling thread counts as one of @p threads. The logging
+ * function of @p c is called from all of them but never concurrently with
+ * itself or the event hook, which is only called from the calling thread, see
+ * trdb_set_event_fn().
+ *
+ * @param c the context/state of the trace debugger
+ * @param abfd the binary from which the trace was captured
+ * @param packets the compressed instruction trace
+ * @param instrs vector to which the reconstruction instructions will be
+ * appended
+ * @param threads number of threads to use, zero for one per online cpu
+ * @return 0 on success, a negative error code otherwise, see
+ * trdb_decompress_trace()
+ * @return -trdb_internal if no thread could be created
+ */
+int trdb_decompress_trace_parallel(struct trdb_ctx *c, bfd *abfd,
+                                   struct trdb_packet_vec *packets,
+                                   struct trdb_instr_vec *instrs,
+                                   unsigned threads);
+
+/**
+ * Prepare @p c for decompressing packets one at a time with
+ * trdb_decompress_packet(). The pc, current section and disassembler are kept
+ * in @p c until trdb_decompress_close() is called, so that a trace can be
+ * decompressed piece by piece without holding it in memory. Like with
+ * trdb_decompress_trace(), call trdb_reset_decompression() first when starting
+ * a new trace.
+ *
+ * All code sections of @p abfd are loaded and kept in @p c until
+ * trdb_decompress_close(), after which @p abfd may be closed. To load them once
+ * for many decompressions use a trdb_image, see trdb_set_image().
+ *
+ * @param c the context/state of the trace debugger
+ * @param abfd the binary from which the trace was captured
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c or @p abfd is NULL
+ * @return -trdb_bad_vma if the start address does not point to any section
+ * @return -trdb_nomem if out of memory
+ * @return -trdb_section_empty if section contents could not be be loaded
+ */
+int trdb_decompress_open(struct trdb_ctx *c, bfd *abfd);
+
+/**
+ * Decompress a single @p packet and call @p instr_fn for each reconstructed
+ * instruction, in order. The instruction passed to @p instr_fn is only valid
+ * for the duration of the call. A negative return value of @p instr_fn aborts
+ * the decompression and is passed through.
+ *
+ * @param c the context/state of the trace debugger
+ * @param packet the next packet of the compressed instruction trace
+ * @param instr_fn called with each reconstructed instruction
+ * @param data passed to @p instr_fn
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p c, @p packet or @p instr_fn is NULL or if
+ * trdb_decompress_open() has not been called
+ * @return -trdb_bad_vma if the vma does not point to any section
+ * @return -trdb_nomem if out of memory
+ * @return -trdb_section_empty if section contents could not be be loaded
+ * @return -trdb_bad_instr if an instruction was encountered that could not be
+ * decoded
+ * @return -trdb_bad_ras if an implicit return underflowed a return address
+ * stack that lacks the calls before the packets, see
+ * trdb_container_decompress_window()
+ * @return -trdb_bad_config if the decoding assumptions do not hold because of
+ * contradictionary data, e.g. assuming full_address=true when encountering a
+ * F_BRANCH_DIFF packet
+ */
+int trdb_decompress_packet(struct trdb_ctx *c, struct tr_packet *packet,
+                           int (*instr_fn)(struct trdb_ctx *c,
+                                           const struct tr_instr *instr,
+                                           void *data),
+                           void *data);
+
+/**
+ * Like trdb_decompress_packet() but report the executed basic blocks of @p cfg
+ * instead of single instructions. @p block_fn is called once per visit of a
+ * block with the number of instructions executed in it, which is less than
+ * the block's length if it was entered or left in the middle, e.g. by a trap.
+ * A visit spanning two packets is reported as two. Runs of instructions
+ * without control flow are skipped over as a whole, so this is considerably
+ * faster than looking at each instruction when decompressing with the
+ * trdb_image of @p cfg. No TRDB_EVENT_INSTR_DECODE events are reported.
+ *
+ * @param c the context/state of the trace debugger
+ * @param cfg the graph of the program that is being decompressed
+ * @param packet the next packet of the compressed instruction trace
+ * @param block_fn called with each visited block
+ * @param data passed to @p block_fn
+ * @return 0 on success, a negative error code otherwise, see
+ * trdb_decompress_packet()
+ * @return -trdb_invalid if @p cfg or @p block_fn is NULL or @p cfg belongs to
+ * a different program
+ */
+int trdb_decompress_packet_blocks(
+    struct trdb_ctx *c, const struct trdb_cfg *cfg, struct tr_packet *packet,
+    int (*block_fn)(struct trdb_ctx *c, const struct trdb_block *block,
+                    size_t instrs, void *data),
+    void *data);
+
+/**
+ * Release the resources acquired by trdb_decompress_open(). The return address
+ * stack and privilege level are kept until the next
+ * trdb_reset_decompression().
+ *
+ * @param c the context/state of the trace debugger
+ */
+void trdb_decompress_close(struct trdb_ctx *c);
+
 /**
  * Outputs disassembled trace using fprintf_func in #disassembler_unit.dinfo.
  *
@@ -677,6 +1364,44 @@ void trdb_free_packet_list(struct trdb_packet_head *packet_list);
  */
 void trdb_free_instr_list(struct trdb_instr_head *instr_list);
 
+/**
+ * Append a copy of @p instr to @p vec.
+ *
+ * @param vec vector to append to
+ * @param instr record to copy
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p vec or @p instr is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_instr_vec_push(struct trdb_instr_vec *vec,
+                        const struct tr_instr *instr);
+
+/**
+ * Append a copy of @p packet to @p vec.
+ *
+ * @param vec vector to append to
+ * @param packet record to copy
+ * @return 0 on success, a negative error code otherwise
+ * @return -trdb_invalid if @p vec or @p packet is NULL
+ * @return -trdb_nomem if out of memory
+ */
+int trdb_packet_vec_push(struct trdb_packet_vec *vec,
+                         const struct tr_packet *packet);
+
+/**
+ * Free all blocks of @p vec and leave it empty but usable.
+ *
+ * @param vec vector to free
+ */
+void trdb_free_instr_vec(struct trdb_instr_vec *vec);
+
+/**
+ * Free all blocks of @p vec and leave it empty but usable.
+ *
+ * @param vec vector to free
+ */
+void trdb_free_packet_vec(struct trdb_packet_vec *vec);
+
 /* struct packet0 {
  *     uint32_t format : 2;   // 00
  *     uint32_t branches : 5;
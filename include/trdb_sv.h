@@ -27,6 +27,17 @@
 
 #include "svdpi.h"
 
+/* Layout of a bit [127:0] instruction sample of trdb_sv_feed_trace_batch(),
+ * word 0 holds iaddr, word 1 instr, word 2 tval and word 3 the flags below
+ */
+#define TRDB_SV_SAMPLE_WORDS 4
+#define TRDB_SV_VALID (1u << 0)
+#define TRDB_SV_EXCEPTION (1u << 1)
+#define TRDB_SV_INTERRUPT (1u << 2)
+#define TRDB_SV_COMPRESSED (1u << 3)
+#define TRDB_SV_CAUSE_SHIFT 8
+#define TRDB_SV_PRIV_SHIFT 16
+
 /**
  * Allocate trdb library context. Ideally the simulator should hold the library
  * context handle but that functionality is still missing and so currently the
@@ -40,6 +51,19 @@ void trdb_sv_alloc();
  */
 void trdb_sv_set_full_address(int full_address);
 
+/**
+ * Configure whether each generated packet is printed to stdout. This is off by
+ * default since printing costs much more than the compression itself. The
+ * recent packets can still be dumped with trdb_sv_print_recent_packets().
+ */
+void trdb_sv_set_verbose(int enable);
+
+/**
+ * Print the most recently generated packets to stdout, e.g. when a testbench
+ * detects a mismatch. Only a bounded number of packets is kept.
+ */
+void trdb_sv_print_recent_packets();
+
 /**
  * Run the trace compression algorithm step by step. Each call is equivalent to
  * advancing one cycle in the RTL model. Normally we should pass a struct but
@@ -63,6 +87,25 @@ void trdb_sv_feed_trace(svLogic ivalid, svLogic iexception, svLogic interrupt,
                         int packet_max_len, svLogicVecVal *packet_bits,
                         svLogic *packet_valid);
 
+/**
+ * Run the trace compression algorithm over @p cnt cycles at once. This
+ * amortizes the cost of crossing the DPI boundary, which dominates when calling
+ * trdb_sv_feed_trace() each cycle. The instructions are passed in as 2-state
+ * samples in the layout of TRDB_SV_SAMPLE_WORDS.
+ *
+ * @param samples open array of bit [127:0] holding at least @p cnt samples
+ * @param cnt number of samples to compress
+ * @param packet_max_len number of bits of each element of @p packet_bits
+ * @param packet_bits open array written with the serialized packets, each
+ * cycle produces at most one packet so @p cnt elements always suffice
+ * @param packet_cnt written with the number of packets put into @p packet_bits
+ * @return 0 on success, -1 if some packet failed or didn't fit and was dropped
+ */
+int trdb_sv_feed_trace_batch(const svOpenArrayHandle samples, int cnt,
+                             int packet_max_len,
+                             const svOpenArrayHandle packet_bits,
+                             int *packet_cnt);
+
 /**
  * Free all resources of allocated by trdb_sv_alloc.
  *
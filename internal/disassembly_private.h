@@ -26,6 +26,22 @@
 #include <stdbool.h>
 #include "trace_debugger.h"
 
+struct trdb_disasm_aux;
+
+/* Read, filter and sort the symbols and dynamic relocs of @p abfd into @p aux,
+ * release them with trdb_release_symbols()
+ */
+int trdb_load_symbols(struct trdb_ctx *c, bfd *abfd,
+                      struct trdb_disasm_aux *aux);
+void trdb_release_symbols(struct trdb_disasm_aux *aux);
+
+/* The symbols loaded for @p image, see trdb_image_new() */
+const struct trdb_disasm_aux *
+trdb_image_symbols(const struct trdb_image *image);
+
+/* The image @p cfg was built from, see trdb_cfg_new() */
+const struct trdb_image *trdb_cfg_image(const struct trdb_cfg *cfg);
+
 /* define functions which help figure out what function we are dealing with */
 #define DECLARE_INSN(code, match, mask)                                        \
     static const uint32_t match_##code = match;                                \
@@ -57,9 +73,25 @@
 #define MASK_RS1 (OP_MASK_RS1 << OP_SH_RS1)
 
 #define RV_X(x, s, n) (((x) >> (s)) & ((1 << (n)) - 1))
+#define RV_IMM_SIGN(x) (-(((x) >> 31) & 1))
 #define ENCODE_ITYPE_IMM(x) (RV_X(x, 0, 12) << 20)
 #define MASK_IMM ENCODE_ITYPE_IMM(-1U)
 
+/* immediate decoding, same as in binutils' riscv-opc.h */
+#define EXTRACT_SBTYPE_IMM(x)                                                  \
+    ((RV_X(x, 8, 4) << 1) | (RV_X(x, 25, 6) << 5) | (RV_X(x, 7, 1) << 11) |    \
+     (RV_IMM_SIGN(x) << 12))
+#define EXTRACT_UJTYPE_IMM(x)                                                  \
+    ((RV_X(x, 21, 10) << 1) | (RV_X(x, 20, 1) << 11) |                         \
+     (RV_X(x, 12, 8) << 12) | (RV_IMM_SIGN(x) << 20))
+#define EXTRACT_RVC_B_IMM(x)                                                   \
+    ((RV_X(x, 3, 2) << 1) | (RV_X(x, 10, 2) << 3) | (RV_X(x, 2, 1) << 5) |     \
+     (RV_X(x, 5, 2) << 6) | (-RV_X(x, 12, 1) << 8))
+#define EXTRACT_RVC_J_IMM(x)                                                   \
+    ((RV_X(x, 3, 3) << 1) | (RV_X(x, 11, 1) << 4) | (RV_X(x, 2, 1) << 5) |     \
+     (RV_X(x, 7, 1) << 6) | (RV_X(x, 6, 1) << 7) | (RV_X(x, 9, 2) << 8) |      \
+     (RV_X(x, 8, 1) << 10) | (-RV_X(x, 12, 1) << 11))
+
 static bool is_really_c_jalr_instr(long instr)
 {
     /* we demand that rd is nonzero */
@@ -196,3 +228,58 @@ static inline unsigned int riscv_instr_len(uint64_t instr)
     /* Longer instructions not supported at the moment.  */
     return 2;
 }
+
+/**
+ * Classify @p instr at @p pc the same way libopcodes does in its insn_type
+ * field, but without disassembling it to text. Only the classes trace
+ * reconstruction cares about are distinguished: conditional branches, jumps and
+ * everything else. Loads and stores are reported as dis_nonbranch.
+ *
+ * @param instr the instruction bits
+ * @param pc the address of @p instr
+ * @param target written with the jump target if it is encoded in @p instr,
+ * zero otherwise
+ * @return the enum dis_insn_type of @p instr
+ */
+static enum dis_insn_type riscv_classify_instr(insn_t instr, addr_t pc,
+                                               addr_t *target)
+{
+    *target = 0;
+
+    if (instr == 0)
+        return dis_noninsn;
+
+    if (is_beq_instr(instr) || is_bne_instr(instr) || is_blt_instr(instr) ||
+        is_bge_instr(instr) || is_bltu_instr(instr) || is_bgeu_instr(instr) ||
+        is_p_bneimm_instr(instr) || is_p_beqimm_instr(instr)) {
+        *target = pc + EXTRACT_SBTYPE_IMM(instr);
+        return dis_condbranch;
+    }
+    if (is_c_beqz_instr(instr) || is_c_bnez_instr(instr)) {
+        *target = pc + EXTRACT_RVC_B_IMM(instr);
+        return dis_condbranch;
+    }
+    if (is_jal_instr(instr)) {
+        *target = pc + EXTRACT_UJTYPE_IMM(instr);
+        return (instr & MASK_RD) ? dis_jsr : dis_branch;
+    }
+    if (is_c_j_instr(instr)) {
+        *target = pc + EXTRACT_RVC_J_IMM(instr);
+        return dis_branch;
+    }
+#ifndef TRDB_ARCH64
+    if (is_c_jal_instr(instr)) {
+        *target = pc + EXTRACT_RVC_J_IMM(instr);
+        return dis_jsr;
+    }
+#endif
+    /* target depends on register contents */
+    if (is_jalr_instr(instr))
+        return (instr & MASK_RD) ? dis_jsr : dis_branch;
+    if (is_really_c_jalr_instr(instr))
+        return dis_jsr;
+    if (is_really_c_jr_instr(instr))
+        return dis_branch;
+
+    return dis_nonbranch;
+}
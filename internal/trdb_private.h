@@ -26,3 +26,20 @@
 #include <stdint.h>
 
 uint32_t branch_map_len(uint32_t branches);
+
+struct trdb_ctx;
+struct tr_packet;
+struct tr_instr;
+
+/* trdb_compress_trace_step() without the argument checks and timing, for
+ * loops over whole blocks which do that once
+ */
+int trdb_compress_trace_step_unchecked(struct trdb_ctx *ctx,
+                                       struct tr_packet *packet,
+                                       struct tr_instr *instr);
+
+/* Tell the decompression of @p ctx that its return address stack lacks the
+ * calls from before the packets it gets next, so that implicit returns finding
+ * it empty fail with -trdb_bad_ras instead of being taken as sent ones
+ */
+void trdb_decompress_partial_stack(struct trdb_ctx *ctx);
@@ -56,7 +56,8 @@ static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
 /* { */
 /* } */
 
-void trdb_log_null(struct trdb_ctx *ctx, const char *format, ...);
+void trdb_log_null(struct trdb_ctx *ctx, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
 
 #define trdb_log_cond(ctx, prio, arg...)                                       \
     do {                                                                       \
@@ -64,18 +65,65 @@ void trdb_log_null(struct trdb_ctx *ctx, const char *format, ...);
             trdb_log(ctx, prio, __FILE__, __LINE__, __FUNCTION__, ##arg);      \
     } while (0)
 
+/* Compiled out messages are still type checked, but neither their arguments
+ * are evaluated nor is anything called.
+ */
+#define trdb_log_elide(ctx, arg...)                                            \
+    do {                                                                       \
+        if (0)                                                                 \
+            trdb_log_null(ctx, ##arg);                                         \
+    } while (0)
+
 #ifdef ENABLE_LOGGING
 #    ifdef ENABLE_DEBUG
 #        define dbg(ctx, arg...) trdb_log_cond(ctx, LOG_DEBUG, ##arg)
 #    else
-#        define dbg(ctx, arg...) trdb_log_null(ctx, ##arg)
+#        define dbg(ctx, arg...) trdb_log_elide(ctx, ##arg)
 #    endif
 #    define info(ctx, arg...) trdb_log_cond(ctx, LOG_INFO, ##arg)
 #    define err(ctx, arg...) trdb_log_cond(ctx, LOG_ERR, ##arg)
 #else
-#    define dbg(ctx, arg...) trdb_log_null(ctx, ##arg)
-#    define info(ctx, arg...) trdb_log_null(ctx, ##arg)
-#    define err(ctx, arg...) trdb_log_null(ctx, ##arg)
+#    define dbg(ctx, arg...) trdb_log_elide(ctx, ##arg)
+#    define info(ctx, arg...) trdb_log_elide(ctx, ##arg)
+#    define err(ctx, arg...) trdb_log_elide(ctx, ##arg)
+#endif
+
+/* Whether dbg() messages end up anywhere. Work that only serves to format
+ * debug messages should be guarded by this, so that it costs nothing when
+ * debug logging is disabled or compiled out.
+ */
+#if defined(ENABLE_LOGGING) && defined(ENABLE_DEBUG)
+#    define trdb_debug_enabled(ctx) (trdb_get_log_priority(ctx) >= LOG_DEBUG)
+#else
+#    define trdb_debug_enabled(ctx) ((void)(ctx), false)
+#endif
+
+/* Hot path instrumentation, see trdb_get_perf_stats(). trdb_perf_start()
+ * declares the start time @p t of a stage, trdb_perf_stop() accounts the time
+ * since then to @p stage. Without ENABLE_PERF_STATS all of it expands to
+ * nothing.
+ */
+#ifdef ENABLE_PERF_STATS
+struct trdb_perf_stats *trdb_perf(struct trdb_ctx *ctx);
+uint64_t trdb_perf_now(void);
+#    define trdb_perf_start(t) uint64_t t = trdb_perf_now()
+#    define trdb_perf_stop(ctx, stage, t)                                      \
+        do {                                                                   \
+            struct trdb_perf_timer *timer__ = &trdb_perf(ctx)->stages[stage];  \
+            timer__->calls++;                                                  \
+            timer__->ns += trdb_perf_now() - (t);                              \
+        } while (0)
+#    define trdb_perf_count(ctx, counter) (trdb_perf(ctx)->counter++)
+#else
+#    define trdb_perf_start(t)                                                 \
+        do {                                                                   \
+        } while (0)
+#    define trdb_perf_stop(ctx, stage, t)                                      \
+        do {                                                                   \
+        } while (0)
+#    define trdb_perf_count(ctx, counter)                                      \
+        do {                                                                   \
+        } while (0)
 #endif
 
 #ifdef HAVE_SECURE_GETENV
@@ -93,6 +93,30 @@ typedef struct {
     size_t alloc;
 } SFILE;
 
+/* What bfd_find_nearest_line_discriminator() knows about an address, see
+ * find_line()
+ */
+struct line_info {
+    const char *filename;
+    const char *functionname;
+    unsigned int linenumber;
+    unsigned int discriminator;
+    bfd_boolean reloc;
+    char *path;    /* relocated filename, if any */
+    char *inlines; /* the rendered chain of inliners, if any */
+};
+
+/* A disassembly rendered into a string instead of printed. The line
+ * information is not part of it since it depends on what was printed before,
+ * only its position in the string and the lookup are kept.
+ */
+struct disasm_capture {
+    SFILE *text;
+    size_t mark;
+    bool has_line;
+    struct line_info line;
+};
+
 static struct print_file_list *print_files;
 
 static int insn_width;
@@ -763,27 +787,10 @@ int trdb_symbol_at_address(bfd_vma vma, struct disassemble_info *inf)
     return (sym != NULL && (bfd_asymbol_value(sym) == vma));
 }
 
-int trdb_alloc_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
-                              struct disassembler_unit *dunit)
+int trdb_load_symbols(struct trdb_ctx *c, bfd *abfd,
+                      struct trdb_disasm_aux *aux)
 {
-    /* TODO: make this configurable */
-    char *machine              = NULL;
-    enum bfd_endian endian     = BFD_ENDIAN_UNKNOWN;
-    char *disassembler_options = NULL; /* TODO: take from context */
-    int status                 = 0;
-
-    if (!c || !abfd || !dunit)
-        return -trdb_invalid;
-
-    struct disassemble_info *dinfo = dunit->dinfo;
-    struct trdb_disasm_aux *aux    = malloc(sizeof(*aux));
-    if (!aux)
-        return -trdb_nomem;
-
-    /* make sure we properly initialize aux */
-    *aux = (struct trdb_disasm_aux){0};
-
-    struct bfd_target *xvec = NULL;
+    int status = 0;
 
     long symcount         = 0;
     long dynsymcount      = 0;
@@ -792,7 +799,9 @@ int trdb_alloc_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
     asymbol **sorted_syms = NULL;
     asymbol **syms        = slurp_symtab(c, abfd, &symcount);
     asymbol **dynsyms     = slurp_dynamic_symtab(c, abfd, &dynsymcount);
-    asymbol *synthsyms;
+    asymbol *synthsyms    = NULL;
+    arelent **dynrelbuf   = NULL;
+    long dynrelcount      = 0;
 
     synthcount = bfd_get_synthetic_symtab(abfd, symcount, syms, dynsymcount,
                                           dynsyms, &synthsyms);
@@ -821,11 +830,27 @@ int trdb_alloc_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
     /* Sort the symbols into section and symbol order.  */
     qsort(sorted_syms, sorted_symcount, sizeof(asymbol *), compare_symbols);
 
-    /* TODO: here init disassemble_info */
-    init_disassemble_info(dinfo, stdout, (fprintf_ftype)fprintf);
+    /* Pre-load the dynamic relocs as we may need them during the disassembly.
+     */
+    long relsize = bfd_get_dynamic_reloc_upper_bound(abfd);
+    if (relsize > 0) {
+        dynrelbuf = malloc(relsize);
+        if (!dynrelbuf) {
+            status = -trdb_nomem;
+            goto fail;
+        }
 
-    dinfo->application_data = aux;
+        dynrelcount = bfd_canonicalize_dynamic_reloc(abfd, dynrelbuf, dynsyms);
+        if (dynrelcount < 0) {
+            status = -trdb_nomem;
+            goto fail;
+        }
+
+        /* Sort the relocs by address.  */
+        qsort(dynrelbuf, dynrelcount, sizeof(arelent *), compare_relocs);
+    }
 
+    aux->abfd               = abfd;
     aux->symbols            = syms;
     aux->symcount           = symcount;
     aux->dynamic_symbols    = dynsyms;
@@ -834,11 +859,51 @@ int trdb_alloc_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
     aux->synthcount         = synthcount;
     aux->sorted_symcount    = sorted_symcount;
     aux->sorted_symbols     = sorted_syms;
+    aux->dynrelbuf          = dynrelbuf;
+    aux->dynrelcount        = dynrelcount;
+    return 0;
+
+fail:
+    free(dynrelbuf);
+    free(sorted_syms);
+    free(synthsyms);
+    free(dynsyms);
+    free(syms);
+    return status;
+}
+
+void trdb_release_symbols(struct trdb_disasm_aux *aux)
+{
+    free(aux->dynrelbuf);
+    free(aux->symbols);
+    free(aux->dynamic_symbols);
+    free(aux->synthethic_symbols);
+    free(aux->sorted_symbols);
+}
+
+/* Set up @p dunit to disassemble @p abfd using the symbols already in @p aux,
+ * which @p dunit takes over.
+ */
+static int init_dinfo_with_symbols(struct trdb_ctx *c, bfd *abfd,
+                                   struct disassembler_unit *dunit,
+                                   struct trdb_disasm_aux *aux)
+{
+    /* TODO: make this configurable */
+    char *machine              = NULL;
+    enum bfd_endian endian     = BFD_ENDIAN_UNKNOWN;
+    char *disassembler_options = NULL; /* TODO: take from context */
+    int status                 = 0;
+
+    struct disassemble_info *dinfo = dunit->dinfo;
+    struct bfd_target *xvec        = NULL;
+
+    /* TODO: here init disassemble_info */
+    init_disassemble_info(dinfo, stdout, (fprintf_ftype)fprintf);
+
+    dinfo->application_data = aux;
 
     aux->abfd        = abfd;
     aux->require_sec = FALSE;
-    aux->dynrelbuf   = NULL;
-    aux->dynrelcount = 0;
     aux->reloc       = NULL;
 
     dinfo->print_address_func     = trdb_print_address;
@@ -887,41 +952,77 @@ int trdb_alloc_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
     dinfo->skip_zeroes_at_end        = DEFAULT_SKIP_ZEROES_AT_END;
     dinfo->disassembler_needs_relocs = FALSE;
 
-    /* Pre-load the dynamic relocs as we may need them during the disassembly.
-     */
-    {
-        long relsize = bfd_get_dynamic_reloc_upper_bound(abfd);
+    dinfo->symtab      = aux->sorted_symbols;
+    dinfo->symtab_size = aux->sorted_symcount;
 
-        if (relsize > 0) {
-            aux->dynrelbuf = malloc(relsize);
-            if (!aux->dynrelbuf) {
-                status = -trdb_nomem;
-                goto fail;
-            }
+    return status;
+fail:
+    free(xvec);
+    dinfo->application_data = NULL;
+    return status;
+}
 
-            aux->dynrelcount =
-                bfd_canonicalize_dynamic_reloc(abfd, aux->dynrelbuf, dynsyms);
-            if (aux->dynrelcount < 0) {
-                status = -trdb_nomem;
-                goto fail;
-            }
+int trdb_alloc_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
+                              struct disassembler_unit *dunit)
+{
+    int status = 0;
 
-            /* Sort the relocs by address.  */
-            qsort(aux->dynrelbuf, aux->dynrelcount, sizeof(arelent *),
-                  compare_relocs);
-        }
+    if (!c || !abfd || !dunit)
+        return -trdb_invalid;
+
+    struct trdb_disasm_aux *aux = malloc(sizeof(*aux));
+    if (!aux)
+        return -trdb_nomem;
+
+    /* make sure we properly initialize aux */
+    *aux = (struct trdb_disasm_aux){0};
+
+    if ((status = trdb_load_symbols(c, abfd, aux)) < 0)
+        goto fail;
+    if ((status = init_dinfo_with_symbols(c, abfd, dunit, aux)) < 0) {
+        trdb_release_symbols(aux);
+        goto fail;
     }
-    dinfo->symtab      = sorted_syms;
-    dinfo->symtab_size = sorted_symcount;
+    return 0;
 
-    return status;
 fail:
-    free(xvec);
-    free(sorted_syms);
     free(aux);
     return status;
 }
 
+int trdb_alloc_dinfo_with_image(struct trdb_ctx *c,
+                                const struct trdb_image *image,
+                                struct disassembler_unit *dunit)
+{
+    int status = 0;
+
+    if (!c || !image || !dunit)
+        return -trdb_invalid;
+
+    const struct trdb_disasm_aux *symbols = trdb_image_symbols(image);
+    struct trdb_disasm_aux *aux           = malloc(sizeof(*aux));
+    if (!aux)
+        return -trdb_nomem;
+
+    /* borrow the symbols, everything else belongs to dunit */
+    *aux = (struct trdb_disasm_aux){
+        .symbols            = symbols->symbols,
+        .symcount           = symbols->symcount,
+        .dynamic_symbols    = symbols->dynamic_symbols,
+        .dynsymcount        = symbols->dynsymcount,
+        .synthethic_symbols = symbols->synthethic_symbols,
+        .synthcount         = symbols->synthcount,
+        .sorted_symbols     = symbols->sorted_symbols,
+        .sorted_symcount    = symbols->sorted_symcount,
+        .dynrelbuf          = symbols->dynrelbuf,
+        .dynrelcount        = symbols->dynrelcount,
+        .shared_symbols     = true};
+
+    if ((status = init_dinfo_with_symbols(c, symbols->abfd, dunit, aux)) < 0)
+        free(aux);
+    return status;
+}
+
 void trdb_free_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
                               struct disassembler_unit *dunit)
 
@@ -937,7 +1038,8 @@ void trdb_free_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
 
     if (dunit->dinfo) {
         aux = dunit->dinfo->application_data;
-        free(dunit->dinfo->symtab);
+        if (!(aux && aux->shared_symbols))
+            free(dunit->dinfo->symtab);
         /* this is allocated and freed in trdb_disassemble_section() itself*/
         /* free(dunit->dinfo->buffer); */
         dunit->dinfo->buffer_vma    = 0;
@@ -945,7 +1047,10 @@ void trdb_free_dinfo_with_bfd(struct trdb_ctx *c, bfd *abfd,
     }
 
     // TODO: free section in aux
-    if (aux) {
+    if (aux && aux->shared_symbols) {
+        /* the symbols belong to a trdb_image */
+        free(aux);
+    } else if (aux) {
         free(aux->dynrelbuf);
         free(aux->symbols);
         free(aux->dynamic_symbols);
@@ -1131,8 +1236,96 @@ static struct print_file_list *update_source_path(const char *filename)
     return NULL;
 }
 
+/* Return the source file @p filename, opening it if we haven't seen it yet.
+ * Files stay open, and files that can't be opened are remembered as such, so
+ * that each one is looked for only once.
+ */
+static struct print_file_list *find_source_file(const char *filename,
+                                                bfd_boolean reloc)
+{
+    struct print_file_list **pp, *p;
+
+    for (pp = &print_files; *pp != NULL; pp = &(*pp)->next)
+        if (filename_cmp((*pp)->filename, filename) == 0)
+            break;
+    p = *pp;
+
+    if (p != NULL) {
+        /* consecutive instructions mostly come from the same file */
+        *pp         = p->next;
+        p->next     = print_files;
+        print_files = p;
+        return p;
+    }
+
+    if (reloc)
+        filename = xstrdup(filename);
+    p = update_source_path(filename);
+    if (p != NULL)
+        return p;
+
+    p = xmalloc(sizeof(*p));
+    *p = (struct print_file_list){.filename = filename,
+                                  .modname  = filename,
+                                  .next     = print_files,
+                                  .first    = 1};
+    print_files = p;
+    return p;
+}
+
+/* vsprintf to a "stream".  */
+static int objdump_vsprintf(SFILE *f, const char *format, va_list args)
+{
+    size_t n;
+    va_list ap;
+
+    while (1) {
+        size_t space = f->alloc - f->pos;
+
+        va_copy(ap, args);
+        n = vsnprintf(f->buffer + f->pos, space, format, ap);
+        va_end(ap);
+
+        if (space > n)
+            break;
+
+        f->alloc  = (f->alloc + n) * 2;
+        f->buffer = (char *)xrealloc(f->buffer, f->alloc);
+    }
+    f->pos += n;
+
+    return n;
+}
+
+/* sprintf to a "stream".  */
+static int ATTRIBUTE_PRINTF_2 objdump_sprintf(SFILE *f, const char *format, ...)
+{
+    int n;
+    va_list args;
+
+    va_start(args, format);
+    n = objdump_vsprintf(f, format, args);
+    va_end(args);
+
+    return n;
+}
+
+/* Line information goes to stdout, unless it is memoized, then to @p out. */
+static void ATTRIBUTE_PRINTF_2 line_printf(SFILE *out, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    if (out)
+        objdump_vsprintf(out, format, args);
+    else
+        vprintf(format, args);
+    va_end(args);
+}
+
 /* Print a source file line.  */
-static void print_line(struct print_file_list *p, unsigned int linenum)
+static void print_line(struct print_file_list *p, unsigned int linenum,
+                       SFILE *out)
 {
     const char *l;
     size_t len;
@@ -1141,50 +1334,298 @@ static void print_line(struct print_file_list *p, unsigned int linenum)
     if (linenum >= p->maxline)
         return;
     l = p->linemap[linenum];
-    /* Test fwrite return value to quiet glibc warning.  */
     len = strcspn(l, "\n\r");
-    if (len == 0 || fwrite(l, len, 1, stdout) == 1)
-        putchar('\n');
+    line_printf(out, "%.*s\n", (int)len, l);
 }
 
 /* Print a range of source code lines. */
 static void dump_lines(struct print_file_list *p, unsigned int start,
-                       unsigned int end)
+                       unsigned int end, SFILE *out)
 {
     if (p->map == NULL)
         return;
-    printf("\n");
+    line_printf(out, "\n");
     while (start <= end) {
-        print_line(p, start);
+        print_line(p, start, out);
         start++;
     }
-    printf("\n");
+    line_printf(out, "\n");
 }
 
-/* Show the line number, or the source line, in a disassembly
-   listing.  */
-static void show_line(bfd *abfd, asection *section, asymbol **syms,
-                      bfd_vma addr_offset, struct trdb_disasm_aux *aux)
-{
+/* A run of addresses that share their line information */
+struct line_run {
+    bfd_vma start;
+    bool found;
     const char *filename;
     const char *functionname;
     unsigned int linenumber;
     unsigned int discriminator;
-    bfd_boolean reloc;
-    char *path = NULL;
+    const char *inlines;
+};
 
-    bool with_line_numbers = aux->with_line_numbers;
-    bool with_source_code  = aux->with_source_code;
-    bool unwind_inlines    = aux->unwind_inlines;
+struct trdb_line_index {
+    struct line_run *runs; /* sorted by start */
+    size_t len;
+    size_t cap;
+    char **strings; /* the names the runs point to */
+    size_t nstrings;
+    size_t strings_cap;
+};
 
-    if (!with_line_numbers && !with_source_code)
-        return;
+static bool same_str(const char *a, const char *b)
+{
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static bool same_run(const struct line_run *a, const struct line_run *b)
+{
+    return a->found == b->found && a->linenumber == b->linenumber &&
+           a->discriminator == b->discriminator &&
+           same_str(a->filename, b->filename) &&
+           same_str(a->functionname, b->functionname) &&
+           same_str(a->inlines, b->inlines);
+}
+
+/* Point @p str to a copy of itself owned by @p index, or to @p prev if that is
+ * the same string already
+ */
+static int own_str(struct trdb_line_index *index, const char **str,
+                   const char *prev)
+{
+    if (!*str)
+        return 0;
+    if (same_str(*str, prev)) {
+        *str = prev;
+        return 0;
+    }
+
+    if (index->nstrings == index->strings_cap) {
+        size_t cap     = index->strings_cap ? index->strings_cap * 2 : 64;
+        char **strings = realloc(index->strings, cap * sizeof(*strings));
+        if (!strings)
+            return -trdb_nomem;
+        index->strings     = strings;
+        index->strings_cap = cap;
+    }
+    char *copy = strdup(*str);
+    if (!copy)
+        return -trdb_nomem;
+    index->strings[index->nstrings++] = copy;
+    *str                              = copy;
+    return 0;
+}
+
+/* Append @p run to @p index, its strings are copied unless they are the same
+ * as in @p prev
+ */
+static int add_run(struct trdb_line_index *index, struct line_run run,
+                   const struct line_run *prev)
+{
+    /* @p prev may point into the runs we are about to move */
+    const char *filename     = prev ? prev->filename : NULL;
+    const char *functionname = prev ? prev->functionname : NULL;
+    const char *inlines      = prev ? prev->inlines : NULL;
+    int status               = 0;
+
+    if (index->len == index->cap) {
+        size_t cap            = index->cap ? index->cap * 2 : 256;
+        struct line_run *runs = realloc(index->runs, cap * sizeof(*runs));
+        if (!runs)
+            return -trdb_nomem;
+        index->runs = runs;
+        index->cap  = cap;
+    }
+
+    if ((status = own_str(index, &run.filename, filename)) < 0 ||
+        (status = own_str(index, &run.functionname, functionname)) < 0 ||
+        (status = own_str(index, &run.inlines, inlines)) < 0)
+        return status;
+
+    index->runs[index->len++] = run;
+    return 0;
+}
+
+static int compare_runs(const void *a, const void *b)
+{
+    const struct line_run *x = a;
+    const struct line_run *y = b;
+    if (x->start != y->start)
+        return (x->start > y->start) - (x->start < y->start);
+    /* the end of a section comes before what starts right after it */
+    return x->found - y->found;
+}
+
+int trdb_line_index_new(struct trdb_ctx *c, bfd *abfd,
+                        struct trdb_line_index **index)
+{
+    struct trdb_disasm_aux aux = {0};
+    struct trdb_line_index *new;
+    int status = 0;
+
+    if (!c || !abfd || !index)
+        return -trdb_invalid;
+
+    new = calloc(1, sizeof(*new));
+    if (!new)
+        return -trdb_nomem;
+
+    /* the symbols fill in function names that the debug info lacks, like in
+     * show_line()
+     */
+    if ((status = trdb_load_symbols(c, abfd, &aux)) < 0)
+        goto fail;
+
+    for (asection *p = abfd->sections; p != NULL; p = p->next) {
+        if ((p->flags & (SEC_CODE | SEC_HAS_CONTENTS)) !=
+            (SEC_CODE | SEC_HAS_CONTENTS))
+            continue;
+
+        bfd_size_type size = bfd_section_size(p);
+        size_t first       = new->len;
+
+        /* instructions are at least halfword aligned */
+        for (bfd_vma off = 0; off < size; off += 2) {
+            struct line_run run = {.start = p->vma + off};
+            SFILE inlines       = {0};
+
+            run.found = bfd_find_nearest_line_discriminator(
+                abfd, p, aux.symbols, off, &run.filename, &run.functionname,
+                &run.linenumber, &run.discriminator);
+            if (run.found) {
+                const char *filename2;
+                const char *functionname2;
+                unsigned line2;
+                while (bfd_find_inliner_info(abfd, &filename2, &functionname2,
+                                             &line2))
+                    objdump_sprintf(&inlines, "inlined by %s:%u (%s)\n",
+                                    filename2, line2, functionname2);
+                run.inlines = inlines.buffer;
+            } else {
+                run = (struct line_run){.start = p->vma + off};
+            }
+
+            const struct line_run *prev =
+                new->len > first ? &new->runs[new->len - 1] : NULL;
+            if (!prev || !same_run(prev, &run))
+                status = add_run(new, run, prev);
+            free(inlines.buffer);
+            if (status < 0)
+                goto fail;
+        }
 
-    if (!bfd_find_nearest_line_discriminator(abfd, section, syms, addr_offset,
-                                             &filename, &functionname,
-                                             &linenumber, &discriminator))
+        /* nothing is known past the end of the section */
+        struct line_run end = {.start = p->vma + size};
+        if (new->len > first && (status = add_run(new, end, NULL)) < 0)
+            goto fail;
+    }
+
+    qsort(new->runs, new->len, sizeof(*new->runs), compare_runs);
+    dbg(c, "line index: %zu runs, %zu names\n", new->len, new->nstrings);
+
+    trdb_release_symbols(&aux);
+    *index = new;
+    return 0;
+
+fail:
+    trdb_release_symbols(&aux);
+    trdb_line_index_free(new);
+    return status;
+}
+
+void trdb_line_index_free(struct trdb_line_index *index)
+{
+    if (!index)
         return;
 
+    for (size_t i = 0; i < index->nstrings; i++)
+        free(index->strings[i]);
+    free(index->strings);
+    free(index->runs);
+    free(index);
+}
+
+size_t trdb_line_index_size(const struct trdb_line_index *index)
+{
+    return index ? index->len : 0;
+}
+
+/* The run of @p index containing @p vma or NULL if there is none */
+static const struct line_run *
+lookup_line_run(const struct trdb_line_index *index, bfd_vma vma)
+{
+    size_t lo = 0;
+    size_t hi = index->len;
+
+    /* find the last run starting at or before vma */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->runs[mid].start <= vma)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || !index->runs[lo - 1].found)
+        return NULL;
+    return &index->runs[lo - 1];
+}
+
+int trdb_line_index_lookup(const struct trdb_line_index *index, bfd_vma vma,
+                           const char **filename, const char **functionname,
+                           unsigned int *linenumber,
+                           unsigned int *discriminator)
+{
+    if (!index || !filename || !functionname || !linenumber || !discriminator)
+        return -trdb_invalid;
+
+    const struct line_run *run = lookup_line_run(index, vma);
+    if (!run)
+        return 0;
+
+    *filename      = run->filename;
+    *functionname  = run->functionname;
+    *linenumber    = run->linenumber;
+    *discriminator = run->discriminator;
+    return 1;
+}
+
+void trdb_set_line_index(struct disassembler_unit *dunit,
+                         const struct trdb_line_index *index)
+{
+    struct trdb_disasm_aux *aux = dunit->dinfo->application_data;
+    aux->lines                  = index;
+}
+
+/* Look up the file, function and line of @p addr_offset in @p section. Returns
+ * false if nothing is known about it. Release @p li with release_line().
+ */
+static bool find_line(bfd *abfd, asection *section, asymbol **syms,
+                      bfd_vma addr_offset, struct trdb_disasm_aux *aux,
+                      struct line_info *li)
+{
+    const char *filename;
+    const char *functionname;
+    unsigned int linenumber;
+    unsigned int discriminator;
+
+    *li = (struct line_info){0};
+
+    if (aux->lines) {
+        const struct line_run *run =
+            lookup_line_run(aux->lines, section->vma + addr_offset);
+        if (!run)
+            return false;
+        filename      = run->filename;
+        functionname  = run->functionname;
+        linenumber    = run->linenumber;
+        discriminator = run->discriminator;
+        if (aux->with_line_numbers && aux->unwind_inlines && run->inlines)
+            li->inlines = xstrdup(run->inlines);
+    } else if (!bfd_find_nearest_line_discriminator(
+                   abfd, section, syms, addr_offset, &filename, &functionname,
+                   &linenumber, &discriminator)) {
+        return false;
+    }
+
     if (filename != NULL && *filename == '\0')
         filename = NULL;
     if (functionname != NULL && *functionname == '\0')
@@ -1194,14 +1635,14 @@ static void show_line(bfd *abfd, asection *section, asymbol **syms,
         char *path_up;
         const char *fname = filename;
 
-        path = malloc(prefix_length + PATH_MAX + 1);
+        li->path = malloc(prefix_length + PATH_MAX + 1);
         /* TODO: improve this handling */
-        if (!path)
-            goto fail;
+        if (!li->path)
+            return false;
 
         if (prefix_length)
-            memcpy(path, prefix, prefix_length);
-        path_up = path + prefix_length;
+            memcpy(li->path, prefix, prefix_length);
+        path_up = li->path + prefix_length;
 
         /* Build relocated filename, stripping off leading directories
            from the initial filename if requested.  */
@@ -1221,55 +1662,76 @@ static void show_line(bfd *abfd, asection *section, asymbol **syms,
         strncpy(path_up, fname, PATH_MAX);
         path_up[PATH_MAX] = '\0';
 
-        filename = path;
-        reloc    = TRUE;
+        filename  = li->path;
+        li->reloc = TRUE;
     } else
-        reloc = FALSE;
+        li->reloc = FALSE;
+
+    li->filename      = filename;
+    li->functionname  = functionname;
+    li->linenumber    = linenumber;
+    li->discriminator = discriminator;
+
+    /* the inliners of the last lookup are only available right after it */
+    if (!aux->lines && aux->with_line_numbers && aux->unwind_inlines) {
+        const char *filename2;
+        const char *functionname2;
+        unsigned line2;
+        SFILE inlines = {0};
+        while (bfd_find_inliner_info(abfd, &filename2, &functionname2, &line2))
+            objdump_sprintf(&inlines, "inlined by %s:%u (%s)\n", filename2,
+                            line2, functionname2);
+        li->inlines = inlines.buffer;
+    }
+    return true;
+}
+
+static void release_line(struct line_info *li)
+{
+    free(li->path);
+    free(li->inlines);
+}
+
+/* Print the line number, or the source line, of @p li to @p out or stdout if
+ * @p out is NULL. What is printed depends on what was printed before.
+ */
+static void print_line_info(const struct line_info *li,
+                            struct trdb_disasm_aux *aux, SFILE *out)
+{
+    const char *filename       = li->filename;
+    const char *functionname   = li->functionname;
+    unsigned int linenumber    = li->linenumber;
+    unsigned int discriminator = li->discriminator;
+
+    bool with_line_numbers = aux->with_line_numbers;
+    bool with_source_code  = aux->with_source_code;
 
     if (with_line_numbers) {
         if (functionname != NULL &&
             (prev_functionname == NULL ||
              strcmp(functionname, prev_functionname) != 0)) {
-            printf("%s():\n", functionname);
+            line_printf(out, "%s():\n", functionname);
             prev_line = -1;
         }
         if (linenumber > 0 &&
             (linenumber != prev_line || discriminator != prev_discriminator)) {
             if (discriminator > 0)
-                printf("%s:%u (discriminator %u)\n",
-                       filename == NULL ? "???" : filename, linenumber,
-                       discriminator);
+                line_printf(out, "%s:%u (discriminator %u)\n",
+                            filename == NULL ? "???" : filename, linenumber,
+                            discriminator);
             else
-                printf("%s:%u\n", filename == NULL ? "???" : filename,
-                       linenumber);
-        }
-        if (unwind_inlines) {
-            const char *filename2;
-            const char *functionname2;
-            unsigned line2;
-            while (
-                bfd_find_inliner_info(abfd, &filename2, &functionname2, &line2))
-                printf("inlined by %s:%u (%s)\n", filename2, line2,
-                       functionname2);
+                line_printf(out, "%s:%u\n",
+                            filename == NULL ? "???" : filename, linenumber);
         }
+        if (li->inlines)
+            line_printf(out, "%s", li->inlines);
     }
 
     if (with_source_code && filename != NULL && linenumber > 0) {
-        struct print_file_list **pp, *p;
+        struct print_file_list *p = find_source_file(filename, li->reloc);
         unsigned l;
 
-        for (pp = &print_files; *pp != NULL; pp = &(*pp)->next)
-            if (filename_cmp((*pp)->filename, filename) == 0)
-                break;
-        p = *pp;
-
-        if (p == NULL) {
-            if (reloc)
-                filename = xstrdup(filename);
-            p = update_source_path(filename);
-        }
-
-        if (p != NULL && linenumber != p->last_line) {
+        if (linenumber != p->last_line) {
             if (file_start_context && p->first)
                 l = 1;
             else {
@@ -1283,7 +1745,7 @@ static void show_line(bfd *abfd, asection *section, asymbol **syms,
                         l = linenumber;
                 }
             }
-            dump_lines(p, l, linenumber);
+            dump_lines(p, l, linenumber, out);
             if (p->max_printed < linenumber)
                 p->max_printed = linenumber;
             p->last_line = linenumber;
@@ -1299,7 +1761,7 @@ static void show_line(bfd *abfd, asection *section, asymbol **syms,
         prev_functionname = malloc(strlen(functionname) + 1);
         /* TODO: improve this handling */
         if (!prev_functionname)
-            goto fail;
+            return;
 
         strcpy(prev_functionname, functionname);
     }
@@ -1309,45 +1771,32 @@ static void show_line(bfd *abfd, asection *section, asymbol **syms,
 
     if (discriminator != prev_discriminator)
         prev_discriminator = discriminator;
-
-fail:
-    if (path)
-        free(path);
-    /* TODO: not sure if we are not freeing bad pointers */
-    /* if(prev_functionname) */
-    /* 	free(prev_functionname); */
 }
 
-/* sprintf to a "stream".  */
-static int ATTRIBUTE_PRINTF_2 objdump_sprintf(SFILE *f, const char *format, ...)
+/* Show the line number, or the source line, in a disassembly
+   listing.  */
+static void show_line(bfd *abfd, asection *section, asymbol **syms,
+                      bfd_vma addr_offset, struct trdb_disasm_aux *aux)
 {
-    size_t n;
-    va_list args;
-
-    while (1) {
-        size_t space = f->alloc - f->pos;
-
-        va_start(args, format);
-        n = vsnprintf(f->buffer + f->pos, space, format, args);
-        va_end(args);
-
-        if (space > n)
-            break;
+    struct line_info li;
 
-        f->alloc  = (f->alloc + n) * 2;
-        f->buffer = (char *)xrealloc(f->buffer, f->alloc);
-    }
-    f->pos += n;
+    if (!aux->with_line_numbers && !aux->with_source_code)
+        return;
 
-    return n;
+    if (find_line(abfd, section, syms, addr_offset, aux, &li))
+        print_line_info(&li, aux, NULL);
+    release_line(&li);
 }
 
-/* Disassemble some data in memory between given values.  */
+/* Disassemble some data in memory between given values. With @p capture the
+ * line information is looked up but left out, see struct disasm_capture.
+ */
 static void trdb_disassemble_bytes(struct disassemble_info *inf,
                                    disassembler_ftype disassemble_fn,
                                    bfd_boolean insns, bfd_byte *data,
                                    bfd_vma start_offset, bfd_vma rel_offset,
-                                   arelent ***relppp, arelent **relppend)
+                                   arelent ***relppp, arelent **relppend,
+                                   struct disasm_capture *capture)
 {
     struct trdb_disasm_aux *aux;
     asection *section;
@@ -1400,6 +1849,10 @@ static void trdb_disassemble_bytes(struct disassemble_info *inf,
             skip_addr_chars = (skip_addr_chars - 1) & -4;
     }
 
+    /* Print to the stream the caller set up, not just stdout. */
+    fprintf_ftype fprintf_func = inf->fprintf_func;
+    void *stream               = inf->stream;
+
     inf->insn_info_valid = 0;
 
     addr_offset = start_offset;
@@ -1418,8 +1871,14 @@ static void trdb_disassemble_bytes(struct disassemble_info *inf,
     int bpc = 0;
     int pb  = 0;
 
-    if (with_line_numbers || with_source_code)
+    if (capture) {
+        capture->mark = capture->text->pos;
+        if (with_line_numbers || with_source_code)
+            capture->has_line = find_line(aux->abfd, section, aux->symbols,
+                                          addr_offset, aux, &capture->line);
+    } else if (with_line_numbers || with_source_code) {
         show_line(aux->abfd, section, aux->symbols, addr_offset, aux);
+    }
 
     if (!prefix_addresses) {
         char *s;
@@ -1429,12 +1888,12 @@ static void trdb_disassemble_bytes(struct disassemble_info *inf,
             *s = ' ';
         if (*s == '\0')
             *--s = '0';
-        printf("%s\t", buf + skip_addr_chars);
+        (*fprintf_func)(stream, "%s\t", buf + skip_addr_chars);
     } else {
         aux->require_sec = TRUE;
         trdb_print_address(section->vma + addr_offset, inf);
         aux->require_sec = FALSE;
-        putchar(' ');
+        (*fprintf_func)(stream, " ");
     }
 
     sfile.pos            = 0;
@@ -1477,16 +1936,17 @@ static void trdb_disassemble_bytes(struct disassemble_info *inf,
     octets = (*disassemble_fn)(section->vma + addr_offset, inf);
 
     inf->stop_vma     = 0;
-    inf->fprintf_func = (fprintf_ftype)fprintf;
-    inf->stream       = stdout;
+    inf->fprintf_func = fprintf_func;
+    inf->stream       = stream;
     if (insn_width == 0 && inf->bytes_per_line != 0)
         octets_per_line = inf->bytes_per_line;
     if (octets < (int)opb) {
         if (sfile.pos)
-            printf("%s\n", sfile.buffer);
+            (*fprintf_func)(stream, "%s\n", sfile.buffer);
         if (octets >= 0) {
             /* non_fatal (_("disassemble_fn returned length %d"), */
-            printf("disassemble_fn returned length %d", octets);
+            (*fprintf_func)(stream, "disassemble_fn returned length %d",
+                            octets);
             /* exit_status = 1; */
         }
         /* break; */
@@ -1511,12 +1971,12 @@ static void trdb_disassemble_bytes(struct disassemble_info *inf,
 
             if (bpc > 1 && inf->display_endian == BFD_ENDIAN_LITTLE) {
                 for (k = bpc - 1; k >= 0; k--)
-                    printf("%02x", (unsigned)data[j + k]);
-                putchar(' ');
+                    (*fprintf_func)(stream, "%02x", (unsigned)data[j + k]);
+                (*fprintf_func)(stream, " ");
             } else {
                 for (k = 0; k < bpc; k++)
-                    printf("%02x", (unsigned)data[j + k]);
-                putchar(' ');
+                    (*fprintf_func)(stream, "%02x", (unsigned)data[j + k]);
+                (*fprintf_func)(stream, " ");
             }
         }
 
@@ -1524,26 +1984,26 @@ static void trdb_disassemble_bytes(struct disassemble_info *inf,
             int k;
 
             for (k = 0; k < bpc; k++)
-                printf("  ");
-            putchar(' ');
+                (*fprintf_func)(stream, "  ");
+            (*fprintf_func)(stream, " ");
         }
 
         /* Separate raw data from instruction by extra space.  */
         if (insns)
-            putchar('\t');
+            (*fprintf_func)(stream, "\t");
         else
-            printf("    ");
+            (*fprintf_func)(stream, "    ");
     }
 
     if (sfile.pos)
-        printf("%s", sfile.buffer);
+        (*fprintf_func)(stream, "%s", sfile.buffer);
 
     if (prefix_addresses ? show_raw_insn > 0 : show_raw_insn >= 0) {
         while (pb < octets) {
             bfd_vma j;
             char *s;
 
-            putchar('\n');
+            (*fprintf_func)(stream, "\n");
             j = addr_offset * opb + pb;
 
             bfd_sprintf_vma(aux->abfd, buf, section->vma + j / opb);
@@ -1551,7 +2011,7 @@ static void trdb_disassemble_bytes(struct disassemble_info *inf,
                 *s = ' ';
             if (*s == '\0')
                 *--s = '0';
-            printf("%s:\t", buf + skip_addr_chars);
+            (*fprintf_func)(stream, "%s:\t", buf + skip_addr_chars);
 
             pb += octets_per_line;
             if (pb > octets)
@@ -1561,24 +2021,24 @@ static void trdb_disassemble_bytes(struct disassemble_info *inf,
 
                 if (bpc > 1 && inf->display_endian == BFD_ENDIAN_LITTLE) {
                     for (k = bpc - 1; k >= 0; k--)
-                        printf("%02x", (unsigned)data[j + k]);
-                    putchar(' ');
+                        (*fprintf_func)(stream, "%02x", (unsigned)data[j + k]);
+                    (*fprintf_func)(stream, " ");
                 } else {
                     for (k = 0; k < bpc; k++)
-                        printf("%02x", (unsigned)data[j + k]);
-                    putchar(' ');
+                        (*fprintf_func)(stream, "%02x", (unsigned)data[j + k]);
+                    (*fprintf_func)(stream, " ");
                 }
             }
         }
     }
 
     if (!wide_output)
-        putchar('\n');
+        (*fprintf_func)(stream, "\n");
     else
         need_nl = TRUE;
 
     if (need_nl)
-        printf("\n");
+        (*fprintf_func)(stream, "\n");
 
     addr_offset += octets / opb;
 
@@ -1587,9 +2047,10 @@ fail:
         free(sfile.buffer);
 }
 
-void trdb_disassemble_instruction_with_bfd(struct trdb_ctx *c, bfd *abfd,
-                                           bfd_vma addr,
-                                           struct disassembler_unit *dunit)
+static void disassemble_instruction_with_bfd(struct trdb_ctx *c, bfd *abfd,
+                                            bfd_vma addr,
+                                            struct disassembler_unit *dunit,
+                                            struct disasm_capture *capture)
 {
     const struct elf_backend_data *bed;
     bfd_vma sign_adjust            = 0;
@@ -1753,7 +2214,7 @@ void trdb_disassemble_instruction_with_bfd(struct trdb_ctx *c, bfd *abfd,
     }
 
     if (!prefix_addresses) {
-        if (with_function_context && bfd_asymbol_value(sym) == addr) {
+        if (with_function_context && sym && bfd_asymbol_value(sym) == addr) {
             pinfo->fprintf_func(pinfo->stream, "\n\n");
             trdb_print_addr_with_sym(abfd, section, sym, addr, pinfo, FALSE,
                                      do_demangle, display_file_offsets);
@@ -1809,7 +2270,8 @@ void trdb_disassemble_instruction_with_bfd(struct trdb_ctx *c, bfd *abfd,
         insns = FALSE;
 
     trdb_disassemble_bytes(pinfo, dunit->disassemble_fn, insns, pinfo->buffer,
-                           addr - section->vma, rel_offset, &rel_pp, rel_ppend);
+                           addr - section->vma, rel_offset, &rel_pp, rel_ppend,
+                           capture);
 
     addr_offset = nextstop_offset;
     sym         = nextsym;
@@ -1825,6 +2287,234 @@ fail:
         free(pinfo->buffer);
 }
 
+void trdb_disassemble_instruction_with_bfd(struct trdb_ctx *c, bfd *abfd,
+                                           bfd_vma addr,
+                                           struct disassembler_unit *dunit)
+{
+    disassemble_instruction_with_bfd(c, abfd, addr, dunit, NULL);
+}
+
+/* Output of a trdb_disasm_cache is written out in chunks of about this size */
+#define DISASM_CACHE_BUFFER (64 * 1024)
+
+/* The rendered disassembly of one pc. The exception marker, and with a bfd the
+ * line information, go to @p split.
+ */
+struct disasm_entry {
+    addr_t pc;
+    insn_t instr;
+    char *text;
+    size_t len;
+    size_t split;
+    bool has_line;
+    struct line_info line;
+};
+
+struct trdb_disasm_cache {
+    struct trdb_ctx *c;
+    bfd *abfd;
+    struct disassembler_unit *dunit;
+    struct disasm_entry *entries; /* open addressing, text is NULL if unused */
+    size_t cap;                   /* always a power of two */
+    size_t count;
+    SFILE out; /* pending output */
+};
+
+static size_t disasm_hash(addr_t pc, insn_t instr, size_t cap)
+{
+    uint64_t h = ((uint64_t)pc ^ ((uint64_t)instr << 17)) *
+                 UINT64_C(0x9e3779b97f4a7c15);
+    return (h >> 32) & (cap - 1);
+}
+
+static struct disasm_entry *disasm_slot(struct disasm_entry *entries,
+                                        size_t cap, addr_t pc, insn_t instr)
+{
+    size_t i = disasm_hash(pc, instr, cap);
+    while (entries[i].text &&
+           (entries[i].pc != pc || entries[i].instr != instr))
+        i = (i + 1) & (cap - 1);
+    return &entries[i];
+}
+
+static int disasm_grow(struct trdb_disasm_cache *cache)
+{
+    size_t cap                   = cache->cap ? cache->cap * 2 : 1024;
+    struct disasm_entry *entries = calloc(cap, sizeof(*entries));
+    if (!entries)
+        return -trdb_nomem;
+
+    for (size_t i = 0; i < cache->cap; i++) {
+        struct disasm_entry *e = &cache->entries[i];
+        if (e->text)
+            *disasm_slot(entries, cap, e->pc, e->instr) = *e;
+    }
+    free(cache->entries);
+    cache->entries = entries;
+    cache->cap     = cap;
+    return 0;
+}
+
+/* Render @p instr into @p e the way trdb_disassemble_instr_with_bfd() or
+ * without a bfd trdb_disassemble_instr() would print it
+ */
+static int disasm_render(struct trdb_disasm_cache *cache,
+                         const struct tr_instr *instr, struct disasm_entry *e)
+{
+    struct disassemble_info *dinfo = cache->dunit->dinfo;
+    fprintf_ftype fprintf_func     = dinfo->fprintf_func;
+    void *stream                   = dinfo->stream;
+    SFILE text                     = {0};
+    struct disasm_capture capture  = {.text = &text};
+
+    text.alloc  = 120;
+    text.buffer = malloc(text.alloc);
+    if (!text.buffer)
+        return -trdb_nomem;
+
+    dinfo->fprintf_func = (fprintf_ftype)objdump_sprintf;
+    dinfo->stream       = &text;
+    if (cache->abfd) {
+        disassemble_instruction_with_bfd(cache->c, cache->abfd, instr->iaddr,
+                                         cache->dunit, &capture);
+    } else {
+        objdump_sprintf(&text, "0x%08jx  0x%08jx  ", (uintmax_t)instr->iaddr,
+                        (uintmax_t)instr->instr);
+        capture.mark = text.pos;
+        trdb_disassemble_single_instruction(instr->instr, instr->iaddr,
+                                            cache->dunit);
+    }
+    dinfo->fprintf_func = fprintf_func;
+    dinfo->stream       = stream;
+
+    e->pc       = instr->iaddr;
+    e->instr    = instr->instr;
+    e->text     = text.buffer;
+    e->len      = text.pos;
+    e->split    = capture.mark;
+    e->has_line = capture.has_line;
+    e->line     = capture.line;
+    return 0;
+}
+
+static void disasm_write(struct trdb_disasm_cache *cache, const char *s,
+                         size_t len)
+{
+    SFILE *out = &cache->out;
+    if (out->alloc - out->pos < len) {
+        out->alloc  = out->pos + len + DISASM_CACHE_BUFFER;
+        out->buffer = xrealloc(out->buffer, out->alloc);
+    }
+    memcpy(out->buffer + out->pos, s, len);
+    out->pos += len;
+}
+
+int trdb_disasm_cache_new(struct trdb_ctx *c, bfd *abfd,
+                          struct disassembler_unit *dunit,
+                          struct trdb_disasm_cache **cache)
+{
+    if (!c || !dunit || !dunit->dinfo || !cache)
+        return -trdb_invalid;
+
+    struct trdb_disasm_cache *new = calloc(1, sizeof(*new));
+    if (!new)
+        return -trdb_nomem;
+
+    new->c          = c;
+    new->abfd       = abfd;
+    new->dunit      = dunit;
+    new->out.alloc  = DISASM_CACHE_BUFFER;
+    new->out.buffer = malloc(new->out.alloc);
+    if (!new->out.buffer || disasm_grow(new) < 0) {
+        free(new->out.buffer);
+        free(new);
+        return -trdb_nomem;
+    }
+    *cache = new;
+    return 0;
+}
+
+int trdb_disasm_cache_instr(struct trdb_disasm_cache *cache,
+                            const struct tr_instr *instr)
+{
+    if (!cache || !instr)
+        return -trdb_invalid;
+
+    struct disasm_entry *e =
+        disasm_slot(cache->entries, cache->cap, instr->iaddr, instr->instr);
+    if (!e->text) {
+        /* keep at least half of the slots free for short probes */
+        if (2 * (cache->count + 1) > cache->cap) {
+            if (disasm_grow(cache) < 0)
+                return -trdb_nomem;
+            e = disasm_slot(cache->entries, cache->cap, instr->iaddr,
+                            instr->instr);
+        }
+        if (disasm_render(cache, instr, e) < 0)
+            return -trdb_nomem;
+        cache->count++;
+    }
+
+    const char *trap = instr->exception ? "TRAP!  " : "";
+    if (cache->abfd)
+        disasm_write(cache, trap, strlen(trap));
+    disasm_write(cache, e->text, e->split);
+    if (e->has_line)
+        print_line_info(&e->line, cache->dunit->dinfo->application_data,
+                        &cache->out);
+    if (!cache->abfd)
+        disasm_write(cache, trap, strlen(trap));
+    disasm_write(cache, e->text + e->split, e->len - e->split);
+
+    if (cache->out.pos >= DISASM_CACHE_BUFFER)
+        trdb_disasm_cache_flush(cache);
+    return 0;
+}
+
+int trdb_disasm_cache_trace(struct trdb_disasm_cache *cache, size_t len,
+                            const struct tr_instr trace[len])
+{
+    for (size_t i = 0; i < len; i++) {
+        int status = trdb_disasm_cache_instr(cache, &trace[i]);
+        if (status < 0)
+            return status;
+    }
+    return 0;
+}
+
+void trdb_disasm_cache_flush(struct trdb_disasm_cache *cache)
+{
+    if (!cache || cache->out.pos == 0)
+        return;
+
+    struct disassemble_info *dinfo = cache->dunit->dinfo;
+    (*dinfo->fprintf_func)(dinfo->stream, "%.*s", (int)cache->out.pos,
+                           cache->out.buffer);
+    cache->out.pos = 0;
+}
+
+size_t trdb_disasm_cache_size(const struct trdb_disasm_cache *cache)
+{
+    return cache ? cache->count : 0;
+}
+
+void trdb_disasm_cache_free(struct trdb_disasm_cache *cache)
+{
+    if (!cache)
+        return;
+
+    trdb_disasm_cache_flush(cache);
+    for (size_t i = 0; i < cache->cap; i++) {
+        if (cache->entries[i].text) {
+            free(cache->entries[i].text);
+            release_line(&cache->entries[i].line);
+        }
+    }
+    free(cache->entries);
+    free(cache->out.buffer);
+    free(cache);
+}
+
 void trdb_dump_section_names(bfd *abfd)
 {
     bfd_map_over_sections(abfd, trdb_dump_section_header, NULL);
@@ -33,13 +33,27 @@
 #include "trace_debugger.h"
 #include "serialize.h"
 
-struct trdb_packet_head packets = TAILQ_HEAD_INITIALIZER(packets);
+/* Number of most recent packets we keep, see trdb_sv_print_recent_packets() */
+#define TRDB_SV_RING 64
+
+/* Samples converted and compressed at once, see trdb_sv_feed_trace_batch() */
+#define TRDB_SV_CHUNK 256
+
+/* The most recent packets, the oldest one at ring_head. Nothing is kept
+ * beyond that to not grow with the simulation time.
+ */
+static struct tr_packet ring[TRDB_SV_RING];
+static size_t ring_head;
+static size_t ring_len;
 
 /* TODO: send context to simulator per userdata methods */
 
 struct trdb_ctx *ctx;
 int packetcnt = 0;
 
+/* print each generated packet, set with trdb_sv_set_verbose() */
+static int verbose = 0;
+
 /* We print even errors to stdout since the simulator doesn't interleave stderr
  * and stdout
  */
@@ -61,12 +75,16 @@ void trdb_sv_alloc()
         return;
     }
     trdb_set_log_fn(ctx, log_stdout_dpi);
+    ring_head = 0;
+    ring_len  = 0;
+    packetcnt = 0;
 }
 
 void trdb_sv_free()
 {
-    trdb_free_packet_list(&packets);
-    free(ctx);
+    trdb_free(ctx);
+    ctx      = NULL;
+    ring_len = 0;
 }
 
 void trdb_sv_set_full_address(int full_address)
@@ -79,6 +97,66 @@ void trdb_sv_set_implicit_ret(int implicit_ret)
     trdb_set_implicit_ret(ctx, implicit_ret);
 }
 
+void trdb_sv_set_verbose(int enable)
+{
+    verbose = enable;
+}
+
+void trdb_sv_print_recent_packets()
+{
+    for (size_t i = 0; i < ring_len; i++)
+        trdb_print_packet(stdout, &ring[(ring_head + i) % TRDB_SV_RING]);
+}
+
+/* Slot in the ring for the next packet, dropping the oldest one if full */
+static struct tr_packet *ring_push()
+{
+    if (ring_len < TRDB_SV_RING)
+        return &ring[(ring_head + ring_len++) % TRDB_SV_RING];
+
+    struct tr_packet *slot = &ring[ring_head];
+    ring_head              = (ring_head + 1) % TRDB_SV_RING;
+    return slot;
+}
+
+/* Word @p w of the little endian @p bytes long @p buff, zero padded */
+static uint32_t packet_word(const uint8_t *buff, size_t bytes, size_t w)
+{
+    uint32_t word = 0;
+    for (size_t b = 0; b < 4 && 4 * w + b < bytes; b++)
+        word |= (uint32_t)buff[4 * w + b] << (8 * b);
+    return word;
+}
+
+/* Keep @p packet in the ring and serialize it into @p buff, returning the
+ * number of bytes or -1 if it doesn't fit into @p packet_max_len bits
+ */
+static int record_packet(const struct tr_packet *packet, int packet_max_len,
+                         uint8_t *buff)
+{
+    size_t bitcnt          = 0;
+    struct tr_packet *slot = ring_push();
+
+    *slot = *packet;
+    if (trdb_pulp_serialize_packet(ctx, slot, &bitcnt, 0, buff)) {
+        err(ctx, "failed to serialize packet, continuing...\n");
+    }
+    packetcnt++;
+    if (verbose) {
+        info(ctx, "ID: %d\n", packetcnt);
+        trdb_print_packet(stdout, slot);
+    }
+
+    /* this is just a integer divions (ceiling) of bitcount/8 */
+    size_t packet_bytes = (bitcnt / 8 + (bitcnt % 8 != 0));
+
+    if ((size_t)packet_max_len / 8 < packet_bytes) {
+        err(ctx, "packet size on the sv side is too small\n");
+        return -1;
+    }
+    return packet_bytes;
+}
+
 void trdb_sv_feed_trace(svLogic ivalid, svLogic iexception, svLogic interrupt,
                         const svLogicVecVal *cause, const svLogicVecVal *tval,
                         const svLogicVecVal *priv, const svLogicVecVal *iaddr,
@@ -108,51 +186,94 @@ void trdb_sv_feed_trace(svLogic ivalid, svLogic iexception, svLogic interrupt,
                                 .compressed = compressed};
 
     /* upper bounded local buffer for serialization */
-    size_t bitcnt                          = 0;
     uint8_t buff[sizeof(struct tr_packet)] = {0};
-    svLogicVecVal tmp                      = {0};
-    struct tr_packet *latest_packet        = NULL;
-
-    int p = trdb_compress_trace_step_add(ctx, &packets, &tr_instr);
+    struct tr_packet packet                = {0};
 
-    if (!TAILQ_EMPTY(&packets)) {
-        latest_packet = TAILQ_LAST(&packets, trdb_packet_head);
-    }
+    int p = trdb_compress_trace_step(ctx, &packet, &tr_instr);
 
-    if (p == -1)
+    if (p < 0)
         err(ctx, "compression step failed\n");
     if (p == 1) {
-        if (trdb_pulp_serialize_packet(ctx, latest_packet, &bitcnt, 0, buff)) {
-            err(ctx, "failed to serialize packet, continuing...\n");
+        int packet_bytes = record_packet(&packet, packet_max_len, buff);
+        if (packet_bytes < 0)
+            return;
+
+        /* fill in vector with packet and zero pad, a word at a time */
+        for (int w = 0; w < SV_PACKED_DATA_NELEMS(packet_max_len); w++) {
+            packet_bits[w].aval = packet_word(buff, packet_bytes, w);
+            packet_bits[w].bval = 0;
         }
-        packetcnt++;
-        // TODO: change that to debug
-        info(ctx, "ID: %d\n", packetcnt);
-        trdb_print_packet(stdout, latest_packet);
+        *packet_valid = 1;
+    }
+}
 
-        /* SV_PACKED_DATA_NELEMS returns the number ov svLogicVecVal's, which
-         * each have 4 bytes
-         */
-        size_t total_bytes = SV_PACKED_DATA_NELEMS(packet_max_len) * 4;
+/* Unpack the instruction sample @p s, see TRDB_SV_SAMPLE_WORDS */
+static void unpack_sample(const svBitVecVal *s, struct tr_instr *instr)
+{
+    uint32_t flags = s[3];
 
-        /* this is just a integer divions (ceiling) of bitcount/8 */
-        size_t packet_bytes = (bitcnt / 8 + (bitcnt % 8 != 0));
+    *instr = (struct tr_instr){
+        .valid      = flags & TRDB_SV_VALID,
+        .exception  = flags & TRDB_SV_EXCEPTION,
+        .interrupt  = flags & TRDB_SV_INTERRUPT,
+        .compressed = flags & TRDB_SV_COMPRESSED,
+        .cause      = (flags >> TRDB_SV_CAUSE_SHIFT) & MASK_FROM(CAUSELEN),
+        .priv       = (flags >> TRDB_SV_PRIV_SHIFT) & MASK_FROM(PRIVLEN),
+        .iaddr      = s[0], /* FIXME: bad size */
+        .instr      = s[1],
+        .tval       = s[2]};
+}
 
-        if ((size_t)packet_max_len / 8 < packet_bytes) {
-            err(ctx, "packet size on the sv side is too small\n");
-            return;
-        }
+int trdb_sv_feed_trace_batch(const svOpenArrayHandle samples, int cnt,
+                             int packet_max_len,
+                             const svOpenArrayHandle packet_bits,
+                             int *packet_cnt)
+{
+    struct tr_instr instrs[TRDB_SV_CHUNK];
+    struct tr_packet packets[TRDB_SV_CHUNK];
+    uint8_t buff[sizeof(struct tr_packet)] = {0};
+    int status                             = 0;
 
-        /* fill in vector with packet and zero pad */
-        for (size_t i = 0; i < total_bytes; i++) {
-            if (i < packet_bytes)
-                tmp.aval = buff[i];
-            else
-                tmp.aval = 0;
-            tmp.bval = 0;
+    int low      = svLow(samples, 1);
+    int out_low  = svLow(packet_bits, 1);
+    int capacity = svSize(packet_bits, 1);
+    int nwords   = SV_PACKED_DATA_NELEMS(packet_max_len);
 
-            svPutPartselLogic(packet_bits, tmp, i * 8, 8);
+    *packet_cnt = 0;
+
+    for (int done = 0; done < cnt;) {
+        size_t len = cnt - done < TRDB_SV_CHUNK ? cnt - done : TRDB_SV_CHUNK;
+        for (size_t i = 0; i < len; i++)
+            unpack_sample(svGetArrElemPtr1(samples, low + done + i),
+                          &instrs[i]);
+
+        size_t consumed = 0;
+        size_t produced = 0;
+        if (trdb_compress_trace_block(ctx, len, instrs, len, packets,
+                                      &consumed, &produced) < 0) {
+            err(ctx, "compression step failed\n");
+            status = -1;
         }
-        *packet_valid = 1;
+
+        for (size_t i = 0; i < produced; i++) {
+            int packet_bytes = record_packet(&packets[i], packet_max_len, buff);
+            if (packet_bytes < 0) {
+                status = -1;
+                continue;
+            }
+            if (*packet_cnt >= capacity) {
+                err(ctx, "more packets than fit into packet_bits, dropped\n");
+                status = -1;
+                continue;
+            }
+            svBitVecVal *bits =
+                svGetArrElemPtr1(packet_bits, out_low + (*packet_cnt)++);
+            for (int w = 0; w < nwords; w++)
+                bits[w] = packet_word(buff, packet_bytes, w);
+        }
+
+        /* on failure skip the offending instruction, like the single step */
+        done += consumed < len ? consumed + 1 : len;
     }
+    return status;
 }
@@ -77,6 +77,21 @@ const char *trdb_errstr(enum trdb_error_code err)
 
     case trdb_bad_vma:
         return "vma is pointing to no section";
+
+    case trdb_bad_container:
+        return "not a trace container or corrupt block index";
+
+    case trdb_bad_trace_file:
+        return "not a binary instruction trace or different XLEN";
+
+    case trdb_bad_ring:
+        return "not an instruction ring or different record layout";
+
+    case trdb_socket:
+        return "failed to set up or accept a socket connection";
+
+    case trdb_bad_state:
+        return "not a state snapshot or different XLEN";
     }
 
     return "missing error string";
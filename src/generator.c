@@ -0,0 +1,459 @@
+/*
+ * trdb - Trace Debugger Software for the PULP platform
+ *
+ * Copyright (C) 2024 Robert Balas
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Author: Robert Balas (balasr@student.ethz.ch)
+ * Description: Generate instruction traces by walking the code of a program
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "generator.h"
+#include "trace_debugger.h"
+#include "trdb_private.h"
+#include "disassembly_private.h"
+#include "utils.h"
+
+/* Number of call targets remembered as destinations of indirect jumps */
+#define GEN_TARGETS 256
+
+/* The compression needs a few cycles to get over a trap or a jump before the
+ * next trap
+ */
+#define GEN_TRAP_GAP 3
+
+/* A code section of the program */
+struct gen_section {
+    bfd_vma vma;
+    bfd_size_type size;
+    uint8_t *data;
+};
+
+struct trdb_gen {
+    struct trdb_ctx *ctx;
+    struct trdb_gen_config config;
+    struct gen_section *sections;
+    size_t nsections;
+    size_t last; /* section of the previous fetch */
+    uint64_t rng;
+    addr_t pc;
+    unsigned quiet; /* instructions since the last trap or jump */
+    /* return addresses, this mirrors the return address stack of the
+     * decompression so that implicit returns work */
+    addr_t *calls;
+    unsigned depth;
+    /* where mret and friends return to */
+    addr_t *traps;
+    unsigned ntraps;
+    addr_t targets[GEN_TARGETS];
+    size_t ntargets;
+    struct trdb_gen_stats stats;
+};
+
+void trdb_gen_default_config(struct trdb_gen_config *config)
+{
+    *config = (struct trdb_gen_config){.seed            = 1,
+                                       .branch_taken    = 0.5,
+                                       .loop_taken      = 0.9,
+                                       .max_call_depth  = 64,
+                                       .exception_rate  = 0,
+                                       .interrupt_rate  = 0,
+                                       .exception_cause = 2,
+                                       .interrupt_cause = 11,
+                                       .start           = 0,
+                                       .trap_vector     = 0};
+}
+
+/* xorshift64*, good enough to pick branch outcomes */
+static uint64_t gen_random(struct trdb_gen *g)
+{
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return g->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static bool gen_chance(struct trdb_gen *g, double p)
+{
+    return (gen_random(g) >> 11) * 0x1.0p-53 < p;
+}
+
+static struct gen_section *gen_find_section(struct trdb_gen *g, addr_t pc)
+{
+    struct gen_section *s = &g->sections[g->last];
+    if (pc >= s->vma && pc - s->vma < s->size)
+        return s;
+
+    for (size_t i = 0; i < g->nsections; i++) {
+        s = &g->sections[i];
+        if (pc >= s->vma && pc - s->vma < s->size) {
+            g->last = i;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Read the instruction at @p pc into @p instr and return its size, or zero if
+ * the walk can't go there, because there is no code or the compression would
+ * reject the instruction.
+ */
+static unsigned gen_fetch(struct trdb_gen *g, addr_t pc, insn_t *instr)
+{
+    struct gen_section *s = gen_find_section(g, pc);
+    if (!s || pc & 1)
+        return 0;
+
+    size_t off = pc - s->vma;
+    if (s->size - off < 2)
+        return 0;
+
+    uint64_t bits = s->data[off] | (uint64_t)s->data[off + 1] << 8;
+    unsigned size = riscv_instr_len(bits);
+    if (size == 4 && s->size - off >= 4)
+        bits |= (uint64_t)s->data[off + 2] << 16 |
+                (uint64_t)s->data[off + 3] << 24;
+    else if (size != 2)
+        return 0;
+
+    addr_t target;
+    if (riscv_classify_instr(bits, pc, &target) == dis_noninsn)
+        return 0;
+
+    /* no hardware loop support */
+    if (is_lp_setup_instr(bits) || is_lp_counti_instr(bits) ||
+        is_lp_count_instr(bits) || is_lp_endi_instr(bits) ||
+        is_lp_starti_instr(bits) || is_lp_setupi_instr(bits))
+        return 0;
+
+    *instr = bits;
+    return size;
+}
+
+static addr_t gen_start(const struct trdb_gen *g)
+{
+    return g->config.start;
+}
+
+static addr_t gen_trap_vector(const struct trdb_gen *g)
+{
+    return g->config.trap_vector ? g->config.trap_vector : g->config.start;
+}
+
+/* Destination of an indirect jump, which we don't know. Going to a function
+ * seen before looks like a call through a function pointer or a tail call.
+ */
+static addr_t gen_indirect_target(struct trdb_gen *g)
+{
+    if (!g->ntargets)
+        return gen_start(g);
+    size_t n = g->ntargets < GEN_TARGETS ? g->ntargets : GEN_TARGETS;
+    return g->targets[gen_random(g) % n];
+}
+
+static void gen_remember_target(struct trdb_gen *g, addr_t target)
+{
+    g->targets[g->ntargets++ % GEN_TARGETS] = target;
+}
+
+static void gen_trap(struct trdb_gen *g, struct tr_instr *instr,
+                     bool interrupt)
+{
+    instr->exception = true;
+    instr->interrupt = interrupt;
+    instr->cause =
+        interrupt ? g->config.interrupt_cause : g->config.exception_cause;
+}
+
+/* Produce the instruction at the current pc and advance to the next one */
+static int gen_step(struct trdb_gen *g, struct tr_instr *instr)
+{
+    const struct trdb_gen_config *cfg = &g->config;
+    insn_t bits                       = 0;
+    addr_t pc                         = g->pc;
+    addr_t target                     = 0;
+    unsigned size                     = gen_fetch(g, pc, &bits);
+
+    /* only the start and trap addresses are not checked beforehand */
+    if (!size) {
+        err(g->ctx, "no instruction at %" PRIxADDR " to generate\n", pc);
+        return -trdb_bad_instr;
+    }
+
+    enum dis_insn_type type = riscv_classify_instr(bits, pc, &target);
+    enum trdb_ras ras       = get_instr_ras_type(bits);
+    addr_t next             = pc + size;
+    bool spaced             = g->quiet >= GEN_TRAP_GAP;
+    bool can_trap           = spaced && g->ntraps < cfg->max_call_depth;
+
+    *instr = (struct tr_instr){.valid      = true,
+                               .priv       = 3,
+                               .iaddr      = pc,
+                               .instr      = bits,
+                               .compressed = size == 2};
+    g->stats.instrs++;
+    g->stats.compressed += size == 2;
+
+    /* traps don't retire the instruction, it runs again after mret */
+    bool interrupt = can_trap && gen_chance(g, cfg->interrupt_rate);
+    if (interrupt || (can_trap && gen_chance(g, cfg->exception_rate))) {
+        gen_trap(g, instr, interrupt);
+        g->traps[g->ntraps++] = pc;
+        g->stats.interrupts += interrupt;
+        g->stats.exceptions += !interrupt;
+        next = gen_trap_vector(g);
+        goto advance;
+    }
+
+    /* A sleeping core only wakes up through an interrupt. Otherwise the
+     * program is done and we run it again.
+     */
+    if (is_wfi_instr(bits) && can_trap && cfg->interrupt_rate > 0) {
+        gen_trap(g, instr, true);
+        g->traps[g->ntraps++] = pc + size;
+        g->stats.interrupts++;
+        next = gen_trap_vector(g);
+        goto advance;
+    } else if (is_wfi_instr(bits) && spaced) {
+        goto restart;
+    }
+
+    if (type == dis_condbranch) {
+        double p = target <= pc ? cfg->loop_taken : cfg->branch_taken;
+        g->stats.branches++;
+        if (gen_chance(g, p)) {
+            g->stats.taken++;
+            next = target;
+        }
+    } else if (is_mret_instr(bits) || is_sret_instr(bits) ||
+               is_uret_instr(bits)) {
+        next = g->ntraps ? g->traps[--g->ntraps] : gen_start(g);
+    } else if (ras == ret || ras == coret) {
+        if (!g->depth)
+            goto restart;
+        next = g->calls[--g->depth];
+        g->stats.returns++;
+        if (ras == coret)
+            g->calls[g->depth++] = pc + size;
+    } else if (ras == call) {
+        /* forget the outermost call, returning from it restarts the walk */
+        if (g->depth && g->depth == cfg->max_call_depth)
+            memmove(g->calls, g->calls + 1, --g->depth * sizeof(*g->calls));
+        if (g->depth < cfg->max_call_depth)
+            g->calls[g->depth++] = pc + size;
+        g->stats.calls++;
+        g->stats.max_depth =
+            g->depth > g->stats.max_depth ? g->depth : g->stats.max_depth;
+        if (target)
+            gen_remember_target(g, target);
+        next = target ? target : gen_indirect_target(g);
+    } else if (type == dis_branch || type == dis_jsr) {
+        next = target ? target : gen_indirect_target(g);
+    }
+
+    if (gen_fetch(g, next, &bits))
+        goto advance;
+
+restart:
+    /* The real program wouldn't go there, e.g. when returning from the
+     * outermost function. We need a trap to get away with continuing anywhere
+     * else.
+     */
+    dbg(g->ctx, "generator: restart at %" PRIxADDR "\n", pc);
+    gen_trap(g, instr, false);
+    g->stats.restarts++;
+    g->depth  = 0;
+    g->ntraps = 0;
+    next      = gen_start(g);
+
+advance:
+    g->quiet = instr->exception || next != pc + size ? 0 : g->quiet + 1;
+    g->pc    = next;
+    return 0;
+}
+
+static void free_sections(struct trdb_gen *g)
+{
+    for (size_t i = 0; i < g->nsections; i++)
+        free(g->sections[i].data);
+    free(g->sections);
+}
+
+static int load_sections(struct trdb_gen *g, bfd *abfd)
+{
+    size_t n = 0;
+    for (asection *s = abfd->sections; s; s = s->next)
+        n++;
+
+    g->sections = calloc(n ? n : 1, sizeof(*g->sections));
+    if (!g->sections)
+        return -trdb_nomem;
+
+    for (asection *s = abfd->sections; s; s = s->next) {
+        if ((s->flags & (SEC_CODE | SEC_HAS_CONTENTS)) !=
+                (SEC_CODE | SEC_HAS_CONTENTS) ||
+            !bfd_section_size(s))
+            continue;
+
+        struct gen_section *gs = &g->sections[g->nsections];
+        gs->vma                = bfd_section_vma(s);
+        gs->size               = bfd_section_size(s);
+        gs->data               = malloc(gs->size);
+        if (!gs->data)
+            return -trdb_nomem;
+        g->nsections++;
+
+        if (!bfd_get_section_contents(abfd, s, gs->data, 0, gs->size)) {
+            err(g->ctx, "loading section %s failed: %s\n", s->name,
+                bfd_errmsg(bfd_get_error()));
+            return -trdb_section_empty;
+        }
+    }
+    return g->nsections ? 0 : -trdb_section_empty;
+}
+
+static bool is_probability(double p)
+{
+    return p >= 0 && p <= 1;
+}
+
+int trdb_gen_new(struct trdb_ctx *c, bfd *abfd,
+                 const struct trdb_gen_config *config, struct trdb_gen **gen)
+{
+    int status        = 0;
+    struct trdb_gen *g = NULL;
+    insn_t instr;
+
+    if (!c || !abfd || !gen)
+        return -trdb_invalid;
+
+    struct trdb_gen_config defaults;
+    if (!config) {
+        trdb_gen_default_config(&defaults);
+        config = &defaults;
+    }
+    if (!is_probability(config->branch_taken) ||
+        !is_probability(config->loop_taken) ||
+        !is_probability(config->exception_rate) ||
+        !is_probability(config->interrupt_rate)) {
+        err(c, "generator probabilities must be within [0, 1]\n");
+        return -trdb_invalid;
+    }
+
+    g = calloc(1, sizeof(*g));
+    if (!g)
+        return -trdb_nomem;
+
+    g->ctx    = c;
+    g->config = *config;
+    if (!g->config.start)
+        g->config.start = abfd->start_address;
+    /* zero is a fixed point of xorshift */
+    g->rng = config->seed ? config->seed : 0x9e3779b97f4a7c15ULL;
+    g->pc  = g->config.start;
+
+    g->calls = malloc((config->max_call_depth + 1) * sizeof(*g->calls));
+    g->traps = malloc((config->max_call_depth + 1) * sizeof(*g->traps));
+    if (!g->calls || !g->traps) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+
+    if ((status = load_sections(g, abfd)) < 0)
+        goto fail;
+
+    if (!gen_fetch(g, gen_start(g), &instr) ||
+        !gen_fetch(g, gen_trap_vector(g), &instr)) {
+        err(c, "start address or trap vector holds no instruction\n");
+        status = -trdb_bad_vma;
+        goto fail;
+    }
+
+    *gen = g;
+    return 0;
+
+fail:
+    trdb_gen_free(g);
+    return status;
+}
+
+int trdb_gen_next(struct trdb_gen *gen, size_t len, struct tr_instr instrs[len])
+{
+    if (!gen || (len && !instrs))
+        return -trdb_invalid;
+
+    for (size_t i = 0; i < len; i++) {
+        int status = gen_step(gen, &instrs[i]);
+        if (status < 0)
+            return status;
+    }
+    return 0;
+}
+
+void trdb_gen_get_stats(const struct trdb_gen *gen,
+                        struct trdb_gen_stats *stats)
+{
+    *stats = gen->stats;
+}
+
+void trdb_gen_free(struct trdb_gen *gen)
+{
+    if (!gen)
+        return;
+
+    free_sections(gen);
+    free(gen->calls);
+    free(gen->traps);
+    free(gen);
+}
+
+int trdb_generate_trace(struct trdb_ctx *c, bfd *abfd,
+                        const struct trdb_gen_config *config, size_t count,
+                        struct tr_instr **samples)
+{
+    int status           = 0;
+    struct trdb_gen *gen = NULL;
+    struct tr_instr *s   = NULL;
+
+    if (!samples)
+        return -trdb_invalid;
+
+    if ((status = trdb_gen_new(c, abfd, config, &gen)) < 0)
+        return status;
+
+    s = malloc((count ? count : 1) * sizeof(*s));
+    if (!s) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+
+    if ((status = trdb_gen_next(gen, count, s)) < 0)
+        goto fail;
+
+    *samples = s;
+    s        = NULL;
+
+fail:
+    free(s);
+    trdb_gen_free(gen);
+    return status;
+}
@@ -0,0 +1,746 @@
+/*
+ * trdb - Trace Debugger Software for the PULP platform
+ *
+ * Copyright (C) 2024 Robert Balas
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Author: Robert Balas (balasr@student.ethz.ch)
+ * Description: Aggregate the visited basic blocks of a trace into a profile
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "profile.h"
+#include "trace_debugger.h"
+#include "disassembly.h"
+#include "disassembly_private.h"
+#include "utils.h"
+
+/* Calls nested deeper than this forget their outermost frame */
+#define PROF_MAX_DEPTH 4096
+
+/* Function id of the root of the call tree */
+#define PROF_NO_FUNC UINT32_MAX
+
+struct prof_func {
+    const char *name;
+    addr_t addr;
+    uint64_t self;      /* instructions executed in the function */
+    uint64_t calls;     /* calls to the function */
+    uint64_t inclusive; /* instructions of the finished outermost calls */
+    uint32_t active;    /* frames of the function on the call stack */
+};
+
+/* A call site and what it called */
+struct prof_edge {
+    uint32_t site;   /* block of the call */
+    uint32_t target; /* block the call entered */
+    uint64_t calls;
+    uint64_t inclusive; /* instructions of the finished calls */
+};
+
+/* A node of the call tree, i.e. a distinct call stack */
+struct prof_node {
+    uint32_t parent;
+    uint32_t func;
+    uint64_t self;
+};
+
+struct prof_frame {
+    addr_t ret;     /* where the call returns to */
+    uint32_t node;  /* call tree node of the callee */
+    uint32_t edge;  /* the call */
+    bool tail;      /* a tail call, which returns with the frame below */
+    uint64_t start; /* instructions executed before the call */
+};
+
+/* Open addressing index of pairs of ids */
+struct prof_slot {
+    uint64_t key;
+    uint32_t idx; /* index plus one, zero if the slot is empty */
+};
+
+struct prof_map {
+    struct prof_slot *slots;
+    size_t cap;
+    size_t len;
+};
+
+struct trdb_profile {
+    struct trdb_ctx *ctx;
+    const struct trdb_cfg *cfg;
+    const struct trdb_block *blocks;
+    size_t nblocks;
+    struct trdb_block_profile *counts;
+    uint32_t *block_func; /* function of each block */
+    struct prof_func *funcs;
+    size_t nfuncs;
+    struct prof_edge *edges;
+    size_t nedges, edges_cap;
+    struct prof_map edge_map;
+    struct prof_node *nodes;
+    size_t nnodes, nodes_cap;
+    struct prof_map node_map;
+    struct prof_frame *frames;
+    size_t depth, frames_cap;
+    uint64_t instrs;
+    const struct trdb_block *cur; /* block of the current visit */
+    uint64_t cur_instrs;          /* instructions of the current visit */
+    uint32_t cur_node;            /* call tree node of the current visit */
+};
+
+static size_t prof_hash(uint64_t key, size_t cap)
+{
+    return ((key * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (cap - 1);
+}
+
+static struct prof_slot *prof_slot(struct prof_slot *slots, size_t cap,
+                                   uint64_t key)
+{
+    size_t i = prof_hash(key, cap);
+    while (slots[i].idx && slots[i].key != key)
+        i = (i + 1) & (cap - 1);
+    return &slots[i];
+}
+
+static int map_grow(struct prof_map *m)
+{
+    size_t cap              = m->cap ? m->cap * 2 : 256;
+    struct prof_slot *slots = calloc(cap, sizeof(*slots));
+    if (!slots)
+        return -trdb_nomem;
+
+    for (size_t i = 0; i < m->cap; i++) {
+        if (m->slots[i].idx)
+            *prof_slot(slots, cap, m->slots[i].key) = m->slots[i];
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->cap   = cap;
+    return 0;
+}
+
+/* Look up @p key in @p m and add it with index @p next if it is missing.
+ * Returns 1 if it was added, 0 if it was found and a negative error code
+ * otherwise.
+ */
+static int map_get(struct prof_map *m, uint64_t key, uint32_t next,
+                   uint32_t *idx)
+{
+    int status = 0;
+    if ((m->len + 1) * 2 > m->cap && (status = map_grow(m)) < 0)
+        return status;
+
+    struct prof_slot *slot = prof_slot(m->slots, m->cap, key);
+    if (slot->idx) {
+        *idx = slot->idx - 1;
+        return 0;
+    }
+    *slot = (struct prof_slot){.key = key, .idx = next + 1};
+    m->len++;
+    *idx = next;
+    return 1;
+}
+
+/* Make room for @p n elements of @p size in @p a of capacity @p cap. Returns
+ * the possibly moved array or NULL if out of memory.
+ */
+static void *prof_reserve(void *a, size_t *cap, size_t n, size_t size)
+{
+    if (n <= *cap)
+        return a;
+    size_t ncap = *cap ? *cap * 2 : 64;
+    while (ncap < n)
+        ncap *= 2;
+    void *tmp = realloc(a, ncap * size);
+    if (tmp)
+        *cap = ncap;
+    return tmp;
+}
+
+/* The call tree node of @p func below @p parent */
+static int get_node(struct trdb_profile *p, uint32_t parent, uint32_t func,
+                    uint32_t *node)
+{
+    struct prof_node *nodes = prof_reserve(p->nodes, &p->nodes_cap,
+                                           p->nnodes + 1, sizeof(*nodes));
+    if (!nodes)
+        return -trdb_nomem;
+    p->nodes = nodes;
+
+    uint64_t key = (uint64_t)parent << 32 | func;
+    int status   = map_get(&p->node_map, key, p->nnodes, node);
+    if (status > 0)
+        p->nodes[p->nnodes++] =
+            (struct prof_node){.parent = parent, .func = func};
+    return status < 0 ? status : 0;
+}
+
+/* The call from block @p site to block @p target */
+static int get_edge(struct trdb_profile *p, uint32_t site, uint32_t target,
+                    uint32_t *edge)
+{
+    struct prof_edge *edges = prof_reserve(p->edges, &p->edges_cap,
+                                           p->nedges + 1, sizeof(*edges));
+    if (!edges)
+        return -trdb_nomem;
+    p->edges = edges;
+
+    uint64_t key = (uint64_t)site << 32 | target;
+    int status   = map_get(&p->edge_map, key, p->nedges, edge);
+    if (status > 0)
+        p->edges[p->nedges++] =
+            (struct prof_edge){.site = site, .target = target};
+    return status < 0 ? status : 0;
+}
+
+static uint32_t block_id(const struct trdb_profile *p,
+                         const struct trdb_block *block)
+{
+    return block - p->blocks;
+}
+
+static void finish_call(struct trdb_profile *p, struct prof_frame *f)
+{
+    uint64_t cost            = p->instrs - f->start;
+    struct prof_func *callee = &p->funcs[p->nodes[f->node].func];
+
+    p->edges[f->edge].inclusive += cost;
+    /* recursive calls are already part of the outermost one */
+    if (--callee->active == 0)
+        callee->inclusive += cost;
+}
+
+/* Enter @p target through the call at the end of @p site, which with @p
+ * tail is a jump that returns where the current frame does
+ */
+static int push_call(struct trdb_profile *p, const struct trdb_block *site,
+                     const struct trdb_block *target, bool tail)
+{
+    int status    = 0;
+    uint32_t func = p->block_func[block_id(p, target)];
+    uint32_t node = 0;
+    uint32_t edge = 0;
+
+    if ((status = get_node(p, p->cur_node, func, &node)) < 0 ||
+        (status = get_edge(p, block_id(p, site), block_id(p, target),
+                           &edge)) < 0)
+        return status;
+
+    if (p->depth == PROF_MAX_DEPTH) {
+        p->funcs[p->nodes[p->frames[0].node].func].active--;
+        memmove(p->frames, p->frames + 1,
+                (p->depth - 1) * sizeof(*p->frames));
+        p->depth--;
+    }
+    struct prof_frame *frames = prof_reserve(
+        p->frames, &p->frames_cap, p->depth + 1, sizeof(*frames));
+    if (!frames)
+        return -trdb_nomem;
+    p->frames = frames;
+
+    addr_t ret = tail ? p->frames[p->depth - 1].ret : site->fallthrough;
+    p->frames[p->depth++] = (struct prof_frame){.ret   = ret,
+                                                .node  = node,
+                                                .edge  = edge,
+                                                .tail  = tail,
+                                                .start = p->instrs};
+    p->edges[edge].calls++;
+    p->funcs[func].calls++;
+    p->funcs[func].active++;
+    return 0;
+}
+
+/* Return to @p addr, which ends all calls up to the one returning there. A
+ * return to a call from before the start of the trace changes nothing.
+ */
+static void pop_return(struct trdb_profile *p, addr_t addr)
+{
+    size_t i = p->depth;
+    while (i > 0 && p->frames[i - 1].ret != addr)
+        i--;
+    if (i == 0)
+        return;
+
+    bool tail = false;
+    while (p->depth >= i || (tail && p->depth > 0)) {
+        struct prof_frame *f = &p->frames[--p->depth];
+        tail                 = f->tail;
+        finish_call(p, f);
+    }
+}
+
+/* Account the control flow from the current visit to @p next */
+static int leave_block(struct trdb_profile *p, const struct trdb_block *next)
+{
+    const struct trdb_block *b = p->cur;
+    uint32_t func              = p->block_func[block_id(p, next)];
+    int status                 = 0;
+
+    switch (b ? b->kind : TRDB_BLOCK_FALLTHROUGH) {
+    case TRDB_BLOCK_BRANCH: {
+        struct trdb_block_profile *counts = &p->counts[block_id(p, b)];
+        if (next->start == b->taken)
+            counts->taken++;
+        else if (next->start == b->fallthrough)
+            counts->not_taken++;
+        break;
+    }
+    case TRDB_BLOCK_CALL:
+        /* otherwise a trap got in between */
+        if (b->taken ? next->start == b->taken
+                     : next->start != b->fallthrough)
+            status = push_call(p, b, next, false);
+        break;
+    case TRDB_BLOCK_JUMP:
+        /* jumping to the start of another function from within a call */
+        if (p->depth && next->start == b->taken &&
+            next->start == p->funcs[func].addr &&
+            func != p->block_func[block_id(p, b)])
+            status = push_call(p, b, next, true);
+        break;
+    case TRDB_BLOCK_RETURN:
+        pop_return(p, next->start);
+        break;
+    default:
+        break;
+    }
+    if (status < 0)
+        return status;
+
+    /* code outside of the function of the frame, e.g. after a tail call or
+     * a trap, is shown as called by it
+     */
+    uint32_t top = p->depth ? p->frames[p->depth - 1].node : 0;
+    if (p->nodes[top].func == func) {
+        p->cur_node = top;
+        return 0;
+    }
+    return get_node(p, top, func, &p->cur_node);
+}
+
+int trdb_profile_block_fn(struct trdb_ctx *c, const struct trdb_block *block,
+                          size_t instrs, void *data)
+{
+    (void)c;
+    struct trdb_profile *p            = data;
+    struct trdb_block_profile *counts = &p->counts[block_id(p, block)];
+    int status                        = 0;
+
+    /* a visit continues in the next packet if it didn't get to the end of
+     * the block yet
+     */
+    if (block != p->cur || p->cur_instrs >= block->instrs ||
+        p->cur_instrs + instrs > block->instrs) {
+        if ((status = leave_block(p, block)) < 0)
+            return status;
+        p->cur        = block;
+        p->cur_instrs = 0;
+        counts->visits++;
+    }
+    p->cur_instrs += instrs;
+    counts->instrs += instrs;
+    p->funcs[p->block_func[block_id(p, block)]].self += instrs;
+    p->nodes[p->cur_node].self += instrs;
+    p->instrs += instrs;
+    return 0;
+}
+
+int trdb_profile_packet(struct trdb_ctx *c, struct trdb_profile *profile,
+                        struct tr_packet *packet)
+{
+    if (!profile)
+        return -trdb_invalid;
+    return trdb_decompress_packet_blocks(c, profile->cfg, packet,
+                                         trdb_profile_block_fn, profile);
+}
+
+/* Collect the code symbols of @p aux by address, one per address, followed
+ * by a stand-in for code before the first one
+ */
+static int load_funcs(struct trdb_profile *p,
+                      const struct trdb_disasm_aux *aux)
+{
+    p->funcs = calloc(aux->sorted_symcount + 1, sizeof(*p->funcs));
+    if (!p->funcs)
+        return -trdb_nomem;
+
+    for (long i = 0; i < aux->sorted_symcount; i++) {
+        asymbol *sym = aux->sorted_symbols[i];
+        addr_t addr  = bfd_asymbol_value(sym);
+        if (!(sym->section->flags & SEC_CODE) ||
+            (sym->flags & (BSF_SECTION_SYM | BSF_FILE | BSF_DEBUGGING)))
+            continue;
+        /* the symbols are sorted so that the most useful name comes first */
+        if (p->nfuncs && p->funcs[p->nfuncs - 1].addr == addr)
+            continue;
+        p->funcs[p->nfuncs++] =
+            (struct prof_func){.name = bfd_asymbol_name(sym), .addr = addr};
+    }
+    p->funcs[p->nfuncs++] = (struct prof_func){.name = "??"};
+    return 0;
+}
+
+/* Map each block to the closest function starting at or before it, both are
+ * sorted by address
+ */
+static void map_blocks(struct trdb_profile *p)
+{
+    uint32_t unknown = p->nfuncs - 1;
+    size_t f         = 0;
+    for (size_t i = 0; i < p->nblocks; i++) {
+        addr_t start = p->blocks[i].start;
+        while (f < unknown && p->funcs[f].addr <= start)
+            f++;
+        p->block_func[i] = f > 0 ? f - 1 : unknown;
+    }
+}
+
+int trdb_profile_new(struct trdb_ctx *c, const struct trdb_cfg *cfg,
+                     struct trdb_profile **profile)
+{
+    int status             = 0;
+    struct trdb_profile *p = NULL;
+
+    if (!c || !cfg || !profile)
+        return -trdb_invalid;
+
+    p = calloc(1, sizeof(*p));
+    if (!p) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    p->ctx    = c;
+    p->cfg    = cfg;
+    p->blocks = trdb_cfg_blocks(cfg, &p->nblocks);
+
+    if ((status = load_funcs(p, trdb_image_symbols(trdb_cfg_image(cfg)))) <
+        0)
+        goto fail;
+
+    p->counts     = calloc(p->nblocks, sizeof(*p->counts));
+    p->block_func = calloc(p->nblocks, sizeof(*p->block_func));
+    if (!p->counts || !p->block_func) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    map_blocks(p);
+
+    /* the root of the call tree */
+    p->nodes = prof_reserve(NULL, &p->nodes_cap, 1, sizeof(*p->nodes));
+    if (!p->nodes) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    p->nodes[p->nnodes++] = (struct prof_node){.func = PROF_NO_FUNC};
+
+    info(c, "profiling %zu blocks of %zu functions\n", p->nblocks,
+         p->nfuncs - 1);
+    *profile = p;
+    return 0;
+
+fail:
+    trdb_profile_free(p);
+    return status;
+}
+
+void trdb_profile_free(struct trdb_profile *profile)
+{
+    if (!profile)
+        return;
+    free(profile->counts);
+    free(profile->block_func);
+    free(profile->funcs);
+    free(profile->edges);
+    free(profile->edge_map.slots);
+    free(profile->nodes);
+    free(profile->node_map.slots);
+    free(profile->frames);
+    free(profile);
+}
+
+void trdb_profile_get_block(const struct trdb_profile *profile, size_t id,
+                            struct trdb_block_profile *counts)
+{
+    *counts = profile->counts[id];
+}
+
+uint64_t trdb_profile_instrs(const struct trdb_profile *profile)
+{
+    return profile->instrs;
+}
+
+/* Per call and per function inclusive instructions, with the calls that are
+ * still on the stack counting up to now
+ */
+struct prof_totals {
+    uint64_t *edges;
+    uint64_t *funcs;
+};
+
+static int sum_totals(const struct trdb_profile *p, struct prof_totals *t)
+{
+    t->edges   = calloc(p->nedges + 1, sizeof(*t->edges));
+    t->funcs   = calloc(p->nfuncs, sizeof(*t->funcs));
+    bool *seen = calloc(p->nfuncs, sizeof(*seen));
+    if (!t->edges || !t->funcs || !seen) {
+        free(seen);
+        return -trdb_nomem;
+    }
+
+    for (size_t i = 0; i < p->nedges; i++)
+        t->edges[i] = p->edges[i].inclusive;
+    for (size_t i = 0; i < p->nfuncs; i++)
+        t->funcs[i] = p->funcs[i].inclusive;
+
+    /* only the outermost frame of a function counts */
+    for (size_t i = 0; i < p->depth; i++) {
+        const struct prof_frame *f = &p->frames[i];
+        uint32_t func              = p->nodes[f->node].func;
+        uint64_t cost              = p->instrs - f->start;
+        t->edges[f->edge] += cost;
+        if (!seen[func])
+            t->funcs[func] += cost;
+        seen[func] = true;
+    }
+    free(seen);
+    return 0;
+}
+
+static void free_totals(struct prof_totals *t)
+{
+    free(t->edges);
+    free(t->funcs);
+}
+
+static int compare_funcs(const void *ap, const void *bp)
+{
+    const struct prof_func *a = *(const struct prof_func **)ap;
+    const struct prof_func *b = *(const struct prof_func **)bp;
+
+    if (a->self != b->self)
+        return a->self > b->self ? -1 : 1;
+    if (a->calls != b->calls)
+        return a->calls > b->calls ? -1 : 1;
+    return a->addr < b->addr ? -1 : a->addr > b->addr;
+}
+
+static int write_flat(const struct trdb_profile *p, FILE *fp)
+{
+    int status                 = 0;
+    struct prof_totals totals  = {0};
+    const struct prof_func **f = calloc(p->nfuncs, sizeof(*f));
+    size_t len                 = 0;
+
+    if (!f || (status = sum_totals(p, &totals)) < 0) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < p->nfuncs; i++) {
+        if (p->funcs[i].self || p->funcs[i].calls)
+            f[len++] = &p->funcs[i];
+    }
+    qsort(f, len, sizeof(*f), compare_funcs);
+
+    fprintf(fp, "Flat profile of %" PRIu64 " instructions:\n\n", p->instrs);
+    fprintf(fp, "%7s %12s %10s %12s %12s  %s\n", "%self", "self", "calls",
+            "self/call", "total/call", "name");
+    for (size_t i = 0; i < len; i++) {
+        double share = p->instrs ? 100.0 * f[i]->self / p->instrs : 0;
+        fprintf(fp, "%7.2f %12" PRIu64 " ", share, f[i]->self);
+        if (f[i]->calls)
+            fprintf(fp, "%10" PRIu64 " %12.1f %12.1f", f[i]->calls,
+                    (double)f[i]->self / f[i]->calls,
+                    (double)totals.funcs[f[i] - p->funcs] / f[i]->calls);
+        else
+            fprintf(fp, "%10s %12s %12s", "", "", "");
+        fprintf(fp, "  %s\n", f[i]->name);
+    }
+
+    size_t blocks = 0, executed = 0;
+    size_t branches = 0, reached = 0, both = 0, taken = 0, not_taken = 0;
+    for (size_t i = 0; i < p->nblocks; i++) {
+        const struct trdb_block_profile *counts = &p->counts[i];
+        blocks++;
+        executed += counts->visits > 0;
+        if (p->blocks[i].kind != TRDB_BLOCK_BRANCH)
+            continue;
+        branches++;
+        reached += counts->taken || counts->not_taken;
+        both += counts->taken && counts->not_taken;
+        taken += counts->taken && !counts->not_taken;
+        not_taken += !counts->taken && counts->not_taken;
+    }
+    fprintf(fp, "\nCoverage:\n");
+    fprintf(fp, "  blocks   %zu of %zu executed\n", executed, blocks);
+    fprintf(fp,
+            "  branches %zu of %zu executed, %zu both ways, %zu only taken, "
+            "%zu only not taken\n",
+            reached, branches, both, taken, not_taken);
+
+fail:
+    free(f);
+    free_totals(&totals);
+    return status;
+}
+
+/* Print a callgrind name compressed function reference */
+static void write_fn_name(const struct trdb_profile *p, FILE *fp,
+                          const char *field, uint32_t func, bool *named)
+{
+    if (named[func]) {
+        fprintf(fp, "%s=(%" PRIu32 ")\n", field, func + 1);
+        return;
+    }
+    fprintf(fp, "%s=(%" PRIu32 ") %s\n", field, func + 1, p->funcs[func].name);
+    named[func] = true;
+}
+
+/* Order the calls by their site, then by their target */
+static int compare_edges(const void *ap, const void *bp)
+{
+    const struct prof_edge *a = *(const struct prof_edge **)ap;
+    const struct prof_edge *b = *(const struct prof_edge **)bp;
+
+    if (a->site != b->site)
+        return a->site < b->site ? -1 : 1;
+    return a->target < b->target ? -1 : a->target > b->target;
+}
+
+static int write_callgrind(const struct trdb_profile *p, FILE *fp)
+{
+    int status                     = 0;
+    struct prof_totals totals      = {0};
+    const struct prof_edge **order = calloc(p->nedges + 1, sizeof(*order));
+    bool *named                    = calloc(p->nfuncs, sizeof(*named));
+    uint64_t branches = 0, taken = 0;
+
+    if (!order || !named || (status = sum_totals(p, &totals)) < 0) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < p->nedges; i++)
+        order[i] = &p->edges[i];
+    qsort(order, p->nedges, sizeof(*order), compare_edges);
+
+    fprintf(fp, "# callgrind format\n");
+    fprintf(fp, "version: 1\n");
+    fprintf(fp, "creator: trdb\n");
+    fprintf(fp, "positions: instr\n");
+    fprintf(fp, "event: Ir : Instructions\n");
+    fprintf(fp, "event: Bc : Conditional branches\n");
+    fprintf(fp, "event: Bt : Taken conditional branches\n");
+    fprintf(fp, "events: Ir Bc Bt\n\n");
+    fprintf(fp, "fl=???\n");
+
+    uint32_t cur_func = PROF_NO_FUNC;
+    size_t e          = 0;
+    for (size_t i = 0; i < p->nblocks; i++) {
+        const struct trdb_block *b              = &p->blocks[i];
+        const struct trdb_block_profile *counts = &p->counts[i];
+        if (!counts->visits)
+            continue;
+
+        if (p->block_func[i] != cur_func) {
+            cur_func = p->block_func[i];
+            write_fn_name(p, fp, "fn", cur_func, named);
+        }
+        fprintf(fp, "0x%08" PRIxADDR " %" PRIu64 "\n", b->start,
+                counts->instrs);
+        if (b->kind == TRDB_BLOCK_BRANCH &&
+            (counts->taken || counts->not_taken)) {
+            fprintf(fp, "0x%08" PRIxADDR " 0 %" PRIu64 " %" PRIu64 "\n",
+                    b->last, counts->taken + counts->not_taken,
+                    counts->taken);
+            branches += counts->taken + counts->not_taken;
+            taken += counts->taken;
+        }
+
+        for (; e < p->nedges && order[e]->site == i; e++) {
+            const struct prof_edge *edge = order[e];
+            write_fn_name(p, fp, "cfn", p->block_func[edge->target], named);
+            fprintf(fp, "calls=%" PRIu64 " 0x%08" PRIxADDR "\n", edge->calls,
+                    p->blocks[edge->target].start);
+            fprintf(fp, "0x%08" PRIxADDR " %" PRIu64 "\n", b->last,
+                    totals.edges[edge - p->edges]);
+        }
+    }
+    fprintf(fp, "\ntotals: %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", p->instrs,
+            branches, taken);
+
+fail:
+    free(order);
+    free(named);
+    free_totals(&totals);
+    return status;
+}
+
+static int write_folded(const struct trdb_profile *p, FILE *fp)
+{
+    uint32_t *stack = calloc(p->nnodes, sizeof(*stack));
+    if (!stack)
+        return -trdb_nomem;
+
+    for (size_t i = 1; i < p->nnodes; i++) {
+        if (!p->nodes[i].self)
+            continue;
+        size_t depth = 0;
+        for (uint32_t n = i; n != 0; n = p->nodes[n].parent)
+            stack[depth++] = n;
+        while (depth > 0) {
+            uint32_t func = p->nodes[stack[--depth]].func;
+            fprintf(fp, "%s%c", p->funcs[func].name, depth ? ';' : ' ');
+        }
+        fprintf(fp, "%" PRIu64 "\n", p->nodes[i].self);
+    }
+    free(stack);
+    return 0;
+}
+
+int trdb_profile_write(const struct trdb_profile *profile,
+                       enum trdb_profile_format format, FILE *fp)
+{
+    int status = 0;
+
+    if (!profile || !fp)
+        return -trdb_invalid;
+
+    switch (format) {
+    case TRDB_PROFILE_FLAT:
+        status = write_flat(profile, fp);
+        break;
+    case TRDB_PROFILE_CALLGRIND:
+        status = write_callgrind(profile, fp);
+        break;
+    case TRDB_PROFILE_FOLDED:
+        status = write_folded(profile, fp);
+        break;
+    default:
+        return -trdb_invalid;
+    }
+    if (status == 0 && ferror(fp)) {
+        err(profile->ctx, "failed to write profile\n");
+        status = -trdb_file_write;
+    }
+    return status;
+}
@@ -23,22 +23,29 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "serialize.h"
 #include "trace_debugger.h"
 #include "trdb_private.h"
 #include "utils.h"
 
-/* pulp specific packet serialization */
-int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
-                               size_t *bitcnt, uint8_t align, uint8_t bin[])
+/* Number of bits the PULP packet of @p packet takes, checking that it can be
+ * serialized at all
+ */
+static int packet_bitcnt(struct trdb_ctx *c, const struct tr_packet *packet,
+                         size_t *bitcnt)
 {
-    if (align >= 8) {
-        err(c, "bad alignment value: %" PRId8 "\n", align);
-        return -trdb_invalid;
+    /* timer packets only carry the time after the message type */
+    if (packet->msg_type == W_TIMER) {
+        *bitcnt = PULPPKTLEN + MSGTYPELEN + TIMELEN;
+        return 0;
     }
 
-    union trdb_pack data = {0};
     /* We put the number of bytes (without header) as the packet length. The
      * PULPPKTLEN, MSGTYPELEN and FORMATLEN are considered the header
      */
@@ -51,26 +58,20 @@ int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
     }
 
     switch (packet->format) {
+    case F_BRANCH_DIFF:
+        if (trdb_is_full_address(c)) {
+            err(c, "F_BRANCH_DIFF packet encountered but full_address set\n");
+            return -trdb_bad_config;
+        }
+        /* fall through */
     case F_BRANCH_FULL: {
         uint32_t len = branch_map_len(packet->branches);
 
-        /* we need enough space to do the packing it in uint128 */
-        assert(128 > PULPPKTLEN + FORMATLEN + MSGTYPELEN + 5 + 31 + XLEN);
-        /* TODO: assert branch map to overfull */
-        data.bits = byte_len | (packet->msg_type << PULPPKTLEN) |
-                    (packet->format << (PULPPKTLEN + MSGTYPELEN)) |
-                    (packet->branches << (PULPPKTLEN + MSGTYPELEN + FORMATLEN));
-        data.bits |= ((__uint128_t)packet->branch_map & MASK_FROM(len))
-                     << (PULPPKTLEN + MSGTYPELEN + FORMATLEN + BRANCHLEN);
-
         *bitcnt = PULPPKTLEN + MSGTYPELEN + FORMATLEN + BRANCHLEN + len;
 
         /* if we have a full branch we don't necessarily need to emit address */
         if (packet->branches > 0) {
-            data.bits |=
-                ((__uint128_t)packet->address
-                 << (PULPPKTLEN + MSGTYPELEN + FORMATLEN + BRANCHLEN + len));
-            if (trdb_is_full_address(c))
+            if (packet->format == F_BRANCH_FULL && trdb_is_full_address(c))
                 *bitcnt += XLEN;
             else
                 *bitcnt +=
@@ -86,18 +87,61 @@ int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
                 *bitcnt += (31 - sext + 1);
             }
         }
-        data.bits <<= align;
-        memcpy(bin, data.bin,
-               (*bitcnt + align) / 8 + ((*bitcnt + align) % 8 != 0));
+        return 0;
+    }
+
+    case F_ADDR_ONLY:
+        *bitcnt = PULPPKTLEN + MSGTYPELEN + FORMATLEN;
+        if (trdb_is_full_address(c))
+            *bitcnt += XLEN;
+        else
+            *bitcnt += (XLEN - sign_extendable_bits(packet->address) + 1);
+        return 0;
 
+    case F_SYNC:
+        *bitcnt = PULPPKTLEN + MSGTYPELEN + 2 * FORMATLEN + PRIVLEN;
+        switch (packet->subformat) {
+        case SF_START:
+            *bitcnt += 1 + XLEN;
+            break;
+        case SF_EXCEPTION:
+            *bitcnt += (1 + XLEN + CAUSELEN + 1);
+            break;
+        case SF_CONTEXT:
+            /* TODO: we still ignore the context field */
+            break;
+        }
         return 0;
     }
+    return -trdb_bad_packet;
+}
+
+/* Write the @p bitcnt bits of @p packet, as packet_bitcnt() computed them, to
+ * @p bin shifted by @p align. Only the bytes covering them are touched.
+ */
+static void pack_packet(const struct tr_packet *packet, size_t bitcnt,
+                        uint8_t align, uint8_t bin[])
+{
+    union trdb_pack data = {0};
+
+    if (packet->msg_type == W_TIMER) {
+        data.bits = (bitcnt / 8 + (bitcnt % 8 != 0) - 1) |
+                    (W_TIMER << PULPPKTLEN) |
+                    ((__uint128_t)(packet->time & MASK_FROM(TIMELEN))
+                     << (PULPPKTLEN + MSGTYPELEN));
+        data.bits <<= align;
+        memcpy(bin, data.bin,
+               (bitcnt + align) / 8 + ((bitcnt + align) % 8 != 0));
+        return;
+    }
+
+    uint32_t bits_without_header = packet->length - FORMATLEN;
+    uint32_t byte_len =
+        bits_without_header / 8 + (bits_without_header % 8 != 0);
 
+    switch (packet->format) {
+    case F_BRANCH_FULL:
     case F_BRANCH_DIFF: {
-        if (trdb_is_full_address(c)) {
-            err(c, "F_BRANCH_DIFF packet encountered but full_address set\n");
-            return -trdb_bad_config;
-        }
         uint32_t len = branch_map_len(packet->branches);
 
         /* we need enough space to do the packing it in uint128 */
@@ -109,50 +153,21 @@ int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
         data.bits |= ((__uint128_t)packet->branch_map & MASK_FROM(len))
                      << (PULPPKTLEN + MSGTYPELEN + FORMATLEN + BRANCHLEN);
 
-        *bitcnt = PULPPKTLEN + MSGTYPELEN + FORMATLEN + BRANCHLEN + len;
-
         /* if we have a full branch we don't necessarily need to emit address */
-        if (packet->branches > 0) {
+        if (packet->branches > 0)
             data.bits |=
                 ((__uint128_t)packet->address
                  << (PULPPKTLEN + MSGTYPELEN + FORMATLEN + BRANCHLEN + len));
-            *bitcnt += (XLEN - trdb_sign_extendable_bits(packet->address) + 1);
-        } else {
-            /* no address, but compress full branch map*/
-            if (trdb_get_compress_branch_map(c)) {
-                *bitcnt -= len;
-                uint32_t sext =
-                    trdb_sign_extendable_bits(packet->branch_map << 1);
-                if (sext > 31)
-                    sext = 31;
-                *bitcnt += (31 - sext + 1);
-            }
-        }
-
-        data.bits <<= align;
-        memcpy(bin, data.bin,
-               (*bitcnt + align) / 8 + ((*bitcnt + align) % 8 != 0));
-
-        return 0;
+        break;
     }
+
     case F_ADDR_ONLY:
         assert(128 > PULPPKTLEN + MSGTYPELEN + FORMATLEN + XLEN);
         data.bits = byte_len | (packet->msg_type << PULPPKTLEN) |
                     (packet->format << (PULPPKTLEN + MSGTYPELEN)) |
                     ((__uint128_t)packet->address
                      << (PULPPKTLEN + MSGTYPELEN + FORMATLEN));
-
-        *bitcnt = PULPPKTLEN + MSGTYPELEN + FORMATLEN;
-        if (trdb_is_full_address(c))
-            *bitcnt += XLEN;
-        else
-            *bitcnt += (XLEN - sign_extendable_bits(packet->address) + 1);
-
-        data.bits <<= align;
-        /* this cuts off superfluous bits */
-        memcpy(bin, data.bin,
-               (*bitcnt + align) / 8 + ((*bitcnt + align) % 8 != 0));
-        return 0;
+        break;
 
     case F_SYNC:
         assert(PRIVLEN == 3);
@@ -168,7 +183,6 @@ int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
             (packet->format << (PULPPKTLEN + MSGTYPELEN)) |
             (packet->subformat << (PULPPKTLEN + MSGTYPELEN + FORMATLEN)) |
             (packet->privilege << (PULPPKTLEN + MSGTYPELEN + 2 * FORMATLEN));
-        *bitcnt = PULPPKTLEN + MSGTYPELEN + 2 * FORMATLEN + PRIVLEN;
 
         /* to reduce repetition */
         uint32_t suboffset = PULPPKTLEN + MSGTYPELEN + 2 * FORMATLEN + PRIVLEN;
@@ -176,7 +190,6 @@ int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
         case SF_START:
             data.bits |= ((__uint128_t)packet->branch << suboffset) |
                          ((__uint128_t)packet->address << (suboffset + 1));
-            *bitcnt += 1 + XLEN;
             break;
 
         case SF_EXCEPTION:
@@ -189,56 +202,118 @@ int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
             // going to be zero anyway in our case
             //  | ((__uint128_t)packet->tval
             //   << (PULPPKTLEN + 4 + PRIVLEN + 1 + XLEN + CAUSELEN + 1));
-            *bitcnt += (1 + XLEN + CAUSELEN + 1);
             break;
 
         case SF_CONTEXT:
             /* TODO: we still ignore the context field */
             break;
         }
+        break;
+    }
 
-        data.bits <<= align;
-        memcpy(bin, data.bin,
-               (*bitcnt + align) / 8 + ((*bitcnt + align) % 8 != 0));
-        return 0;
+    data.bits <<= align;
+    /* this cuts off superfluous bits */
+    memcpy(bin, data.bin, (bitcnt + align) / 8 + ((bitcnt + align) % 8 != 0));
+}
+
+/* pulp specific packet serialization */
+static int serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
+                            size_t *bitcnt, uint8_t align, uint8_t bin[])
+{
+    if (align >= 8) {
+        err(c, "bad alignment value: %" PRId8 "\n", align);
+        return -trdb_invalid;
     }
-    return -trdb_bad_packet;
+
+    int status = packet_bitcnt(c, packet, bitcnt);
+    if (status < 0)
+        return status;
+
+    pack_packet(packet, *bitcnt, align, bin);
+    return 0;
 }
 
-int trdb_pulp_read_single_packet(struct trdb_ctx *c, FILE *fp,
-                                 struct tr_packet *packet, uint32_t *bytes)
+int trdb_pulp_serialize_packet(struct trdb_ctx *c, struct tr_packet *packet,
+                               size_t *bitcnt, uint8_t align, uint8_t bin[])
 {
-    uint8_t header          = 0;
-    union trdb_pack payload = {0};
-    if (!c || !fp || !packet)
+    trdb_perf_start(t);
+    int status = serialize_packet(c, packet, bitcnt, align, bin);
+    trdb_perf_stop(c, trdb_perf_serialize, t);
+    return status;
+}
+
+int trdb_pulp_serialize_packets(struct trdb_ctx *c, size_t len,
+                                struct tr_packet packets[len], size_t size,
+                                uint8_t buf[size], size_t offsets[],
+                                size_t *consumed, size_t *written)
+{
+    int status = 0;
+    if (!c || (len && !packets) || (size && !buf) || !consumed || !written)
         return -trdb_invalid;
 
-    if (fread(&header, 1, 1, fp) != 1) {
-        if (feof(fp))
-            return -trdb_bad_packet;
-        else if (ferror(fp))
-            return -trdb_file_read;
+    size_t i   = 0;
+    size_t off = 0;
 
-        return -trdb_internal; /* does not happen */
+    trdb_perf_start(t);
+    /* In runs of 64 packets first find out how long each one is and where it
+     * goes, that is the prefix sum of their byte lengths, until buf is full.
+     * Packing only writes the bytes a packet covers, so then each one goes
+     * straight to its place in buf.
+     */
+    size_t bitcnts[64];
+    bool full = false;
+    while (i < len && status == 0 && !full) {
+        size_t start = off;
+        size_t n     = 0;
+        for (; n < 64 && i + n < len; n++) {
+            status = packet_bitcnt(c, &packets[i + n], &bitcnts[n]);
+            if (status < 0)
+                break;
+            size_t bytes = bitcnts[n] / 8 + (bitcnts[n] % 8 != 0);
+            if (bytes > size - off) {
+                full = true;
+                break;
+            }
+            if (offsets)
+                offsets[i + n] = off;
+            off += bytes;
+        }
+
+        for (size_t k = 0; k < n; k++) {
+            pack_packet(&packets[i + k], bitcnts[k], 0, buf + start);
+            start += bitcnts[k] / 8 + (bitcnts[k] % 8 != 0);
+        }
+        i += n;
     }
+    trdb_perf_stop(c, trdb_perf_serialize, t);
 
-    /* read packet length it bits (including header) */
-    uint8_t len    = (header & MASK_FROM(PULPPKTLEN)) * 8 + 8;
-    payload.bin[0] = header;
-    /* compute how many bytes that is */
-    uint32_t byte_len = len / 8 + (len % 8 != 0 ? 1 : 0);
-    /* we have to exclude the header byte */
-    if (fread((payload.bin + 1), 1, byte_len - 1, fp) != byte_len - 1) {
-        if (feof(fp)) {
-            err(c, "incomplete packet read\n");
-            return -trdb_bad_packet;
-        } else if (ferror(fp))
-            return -trdb_file_read;
+    *consumed = i;
+    *written  = off;
+    return status;
+}
+
+/* Load the @p byte_len bytes long PULP packet at @p bin, in front of @p avail
+ * bytes of data. Decoding discards the bits past the packet length, so
+ * whenever possible we copy a whole trdb_pack instead of a variable number of
+ * bytes.
+ */
+static union trdb_pack load_packet(const uint8_t *bin, size_t avail,
+                                   uint32_t byte_len)
+{
+    union trdb_pack payload = {0};
+    if (avail >= sizeof(payload))
+        memcpy(payload.bin, bin, sizeof(payload));
+    else
+        memcpy(payload.bin, bin, byte_len);
+    return payload;
+}
+
+/* Decode the PULP packet loaded into @p payload into @p packet */
+static int decode_packet(struct trdb_ctx *c, union trdb_pack payload,
+                         struct tr_packet *packet)
+{
+    uint8_t header = payload.bin[0];
 
-        return -trdb_internal; /* does not happen */
-    }
-    /* since we succefully read a packet we can now set bytes */
-    *bytes = byte_len;
     /* make sure we start from a good state */
     *packet = (struct tr_packet){0};
 
@@ -337,414 +412,1804 @@ int trdb_pulp_read_single_packet(struct trdb_ctx *c, FILE *fp,
     return -trdb_bad_packet;
 }
 
-int trdb_pulp_read_all_packets(struct trdb_ctx *c, const char *path,
-                               struct trdb_packet_head *packet_list)
+int trdb_pulp_read_single_packet(struct trdb_ctx *c, FILE *fp,
+                                 struct tr_packet *packet, uint32_t *bytes)
 {
-    if (!c || !path || !packet_list)
+    uint8_t header          = 0;
+    union trdb_pack payload = {0};
+    if (!c || !fp || !packet)
         return -trdb_invalid;
 
+    if (fread(&header, 1, 1, fp) != 1) {
+        if (feof(fp))
+            return -trdb_bad_packet;
+        else if (ferror(fp))
+            return -trdb_file_read;
+
+        return -trdb_internal; /* does not happen */
+    }
+
+    /* read packet length it bits (including header) */
+    uint8_t len    = (header & MASK_FROM(PULPPKTLEN)) * 8 + 8;
+    payload.bin[0] = header;
+    /* compute how many bytes that is */
+    uint32_t byte_len = len / 8 + (len % 8 != 0 ? 1 : 0);
+    /* we have to exclude the header byte */
+    if (fread((payload.bin + 1), 1, byte_len - 1, fp) != byte_len - 1) {
+        if (feof(fp)) {
+            err(c, "incomplete packet read\n");
+            return -trdb_bad_packet;
+        } else if (ferror(fp))
+            return -trdb_file_read;
+
+        return -trdb_internal; /* does not happen */
+    }
+    /* since we succefully read a packet we can now set bytes */
+    *bytes = byte_len;
+
+    trdb_perf_start(t);
+    int status = decode_packet(c, payload, packet);
+    trdb_perf_stop(c, trdb_perf_read, t);
+    return status;
+}
+
+/* Read packets from @p path until EOF or an incomplete packet and pass each one
+ * to @p add.
+ */
+static int read_all_packets(struct trdb_ctx *c, const char *path,
+                            int (*add)(void *data,
+                                       const struct tr_packet *packet),
+                            void *data)
+{
+    int status = 0;
+
     FILE *fp = fopen(path, "rb");
     if (!fp)
         return -trdb_file_open;
 
     uint32_t total_bytes_read = 0;
-    struct tr_packet *packet  = NULL;
     struct tr_packet tmp      = {0};
     uint32_t bytes            = 0;
 
-    /* read the file and malloc entries into the given linked list head */
     while (trdb_pulp_read_single_packet(c, fp, &tmp, &bytes) == 0) {
-        packet = malloc(sizeof(*packet));
-        if (!packet)
-            return -trdb_nomem;
-        *packet = tmp;
+        if ((status = add(data, &tmp)) < 0)
+            goto fail;
         total_bytes_read += bytes;
-
-        TAILQ_INSERT_TAIL(packet_list, packet, list);
     }
     dbg(c, "total bytes read: %" PRIu32 "\n", total_bytes_read);
-    return 0;
+
+fail:
+    fclose(fp);
+    return status;
 }
 
-int trdb_pulp_write_single_packet(struct trdb_ctx *c, struct tr_packet *packet,
-                                  FILE *fp)
+static int add_packet_to_list(void *data, const struct tr_packet *packet)
 {
-    int status      = 0;
-    size_t bitcnt   = 0;
-    size_t bytecnt  = 0;
-    uint8_t bin[16] = {0};
-    if (!c || !fp || !packet)
-        return -trdb_invalid;
+    struct trdb_packet_head *packet_list = data;
 
-    status = trdb_pulp_serialize_packet(c, packet, &bitcnt, 0, bin);
-    if (status < 0)
-        return status;
+    struct tr_packet *add = malloc(sizeof(*add));
+    if (!add)
+        return -trdb_nomem;
+    *add = *packet;
 
-    bytecnt = bitcnt / 8 + (bitcnt % 8 != 0);
-    if (fwrite(bin, 1, bytecnt, fp) != bytecnt) {
-        if (feof(fp)) {
-            /* TODO: uhhh */
-        } else if (ferror(fp))
-            return -trdb_file_write;
-    }
+    TAILQ_INSERT_TAIL(packet_list, add, list);
     return 0;
 }
 
-int trdb_write_packets(struct trdb_ctx *c, const char *path,
-                       struct trdb_packet_head *packet_list)
+static int add_packet_to_vec(void *data, const struct tr_packet *packet)
+{
+    return trdb_packet_vec_push(data, packet);
+}
+
+int trdb_pulp_read_all_packets(struct trdb_ctx *c, const char *path,
+                               struct trdb_packet_head *packet_list)
 {
-    int status = 0;
     if (!c || !path || !packet_list)
         return -trdb_invalid;
 
-    FILE *fp = fopen(path, "wb");
-    if (!fp) {
-        status = -trdb_file_open;
-        goto fail;
-    }
+    /* read the file and malloc entries into the given linked list head */
+    return read_all_packets(c, path, add_packet_to_list, packet_list);
+}
 
-    uint8_t bin[sizeof(struct tr_packet)] = {0};
+int trdb_pulp_read_all_packets_vec(struct trdb_ctx *c, const char *path,
+                                   struct trdb_packet_vec *packets)
+{
+    if (!c || !path || !packets)
+        return -trdb_invalid;
+
+    return read_all_packets(c, path, add_packet_to_vec, packets);
+}
+
+int trdb_pulp_map_packets(struct trdb_ctx *c, const char *path,
+                          struct trdb_packet_map *map)
+{
+    if (!c || !path || !map)
+        return -trdb_invalid;
+
+    *map = (struct trdb_packet_map){0};
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -trdb_file_open;
+
+    struct stat st = {0};
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -trdb_file_size;
+    }
+
+    /* mmap refuses empty mappings, an empty file just has no packets */
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            err(c, "mmap: %s\n", strerror(errno));
+            close(fd);
+            return -trdb_file_read;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        map->data = data;
+        map->size = st.st_size;
+    }
+
+    /* the mapping stays valid without the descriptor */
+    close(fd);
+    return 0;
+}
+
+void trdb_pulp_unmap_packets(struct trdb_packet_map *map)
+{
+    if (!map)
+        return;
+
+    if (map->data)
+        munmap((void *)map->data, map->size);
+    *map = (struct trdb_packet_map){0};
+}
+
+int trdb_pulp_next_mapped_packet(struct trdb_ctx *c,
+                                 const struct trdb_packet_map *map,
+                                 size_t *offset, struct tr_packet *packet)
+{
+    if (!c || !map || !offset || !packet)
+        return -trdb_invalid;
+
+    if (*offset >= map->size)
+        return -trdb_bad_packet;
+
+    /* the length nibble counts the bytes following the header byte */
+    uint32_t byte_len = (map->data[*offset] & MASK_FROM(PULPPKTLEN)) + 1;
+    if (byte_len > map->size - *offset) {
+        err(c, "incomplete packet read\n");
+        return -trdb_bad_packet;
+    }
+
+    trdb_perf_start(t);
+    int status = decode_packet(
+        c, load_packet(map->data + *offset, map->size - *offset, byte_len),
+        packet);
+    trdb_perf_stop(c, trdb_perf_read, t);
+    if (status < 0)
+        return status;
+
+    *offset += byte_len;
+    return 0;
+}
+
+int trdb_pulp_decode_packets(struct trdb_ctx *c, size_t size,
+                             const uint8_t data[size], size_t len,
+                             struct tr_packet packets[len], size_t offsets[],
+                             size_t *decoded, size_t *consumed)
+{
+    int status = 0;
+    if (!c || (size && !data) || (len && !packets) || !decoded || !consumed)
+        return -trdb_invalid;
+
+    size_t i   = 0;
+    size_t off = 0;
+
+    trdb_perf_start(t);
+    for (; i < len && off < size; i++) {
+        /* the length nibble counts the bytes following the header byte */
+        uint32_t byte_len = (data[off] & MASK_FROM(PULPPKTLEN)) + 1;
+        if (byte_len > size - off)
+            break;
+
+        status = decode_packet(c, load_packet(data + off, size - off, byte_len),
+                               &packets[i]);
+        if (status < 0)
+            break;
+        if (offsets)
+            offsets[i] = off;
+        off += byte_len;
+    }
+    trdb_perf_stop(c, trdb_perf_read, t);
+
+    *decoded  = i;
+    *consumed = off;
+    return status;
+}
+
+int trdb_pulp_index_packets(struct trdb_ctx *c,
+                            const struct trdb_packet_map *map,
+                            size_t **offsets, size_t *count)
+{
+    if (!c || !map || !offsets || !count)
+        return -trdb_invalid;
+
+    size_t *index = NULL;
+    size_t cap    = 0;
+    size_t cnt    = 0;
+    size_t offset = 0;
+
+    /* we only need the header byte to skip to the next packet */
+    while (offset < map->size) {
+        uint32_t byte_len = (map->data[offset] & MASK_FROM(PULPPKTLEN)) + 1;
+        if (byte_len > map->size - offset)
+            break;
+
+        if (cnt == cap) {
+            cap          = cap ? cap * 2 : 1024;
+            size_t *grow = realloc(index, cap * sizeof(*index));
+            if (!grow) {
+                free(index);
+                return -trdb_nomem;
+            }
+            index = grow;
+        }
+        index[cnt++] = offset;
+        offset += byte_len;
+    }
+
+    *offsets = index;
+    *count   = cnt;
+    return 0;
+}
+
+int trdb_pulp_read_mapped_packets(struct trdb_ctx *c,
+                                  const struct trdb_packet_map *map,
+                                  size_t begin, size_t end,
+                                  struct trdb_packet_vec *packets)
+{
+    int status = 0;
+    if (!c || !map || !packets)
+        return -trdb_invalid;
+
+    size_t offset = begin;
+    size_t read   = begin;
+    end           = end < map->size ? end : map->size;
+
+    struct tr_packet chunk[64];
+    size_t offsets[64];
+    while (offset < end) {
+        size_t decoded  = 0;
+        size_t consumed = 0;
+        /* the last packet may start before end and reach up to a trdb_pack
+         * past it
+         */
+        size_t avail = map->size - offset;
+        if (avail > end - offset + sizeof(union trdb_pack) - 1)
+            avail = end - offset + sizeof(union trdb_pack) - 1;
+        int bad = trdb_pulp_decode_packets(c, avail, map->data + offset, 64,
+                                           chunk, offsets, &decoded,
+                                           &consumed);
+        for (size_t i = 0; i < decoded && offsets[i] < end - offset; i++) {
+            if ((status = trdb_packet_vec_push(packets, &chunk[i])) < 0)
+                return status;
+            read = offset + (i + 1 < decoded ? offsets[i + 1] : consumed);
+        }
+        offset += consumed;
+        /* like trdb_pulp_read_all_packets() we stop at the first bad packet */
+        if (bad < 0 || decoded < 64)
+            break;
+    }
+    dbg(c, "total bytes read: %zu\n", read - begin);
+    return 0;
+}
+
+int trdb_pulp_decompress_mapped_packets(
+    struct trdb_ctx *c, const struct trdb_packet_map *map, size_t begin,
+    size_t end,
+    int (*instr_fn)(struct trdb_ctx *c, const struct tr_instr *instr,
+                    void *data),
+    void *data)
+{
+    int status = 0;
+    if (!c || !map || !instr_fn)
+        return -trdb_invalid;
+
+    size_t offset        = begin;
+    struct tr_packet tmp = {0};
+    end                  = end < map->size ? end : map->size;
+
+    while (offset < end &&
+           trdb_pulp_next_mapped_packet(c, map, &offset, &tmp) == 0) {
+        if ((status = trdb_decompress_packet(c, &tmp, instr_fn, data)) < 0)
+            return status;
+    }
+    return 0;
+}
+
+int trdb_pulp_write_single_packet(struct trdb_ctx *c, struct tr_packet *packet,
+                                  FILE *fp)
+{
+    int status      = 0;
+    size_t bitcnt   = 0;
+    size_t bytecnt  = 0;
+    uint8_t bin[16] = {0};
+    if (!c || !fp || !packet)
+        return -trdb_invalid;
+
+    status = trdb_pulp_serialize_packet(c, packet, &bitcnt, 0, bin);
+    if (status < 0)
+        return status;
+
+    bytecnt = bitcnt / 8 + (bitcnt % 8 != 0);
+    if (fwrite(bin, 1, bytecnt, fp) != bytecnt) {
+        if (feof(fp)) {
+            /* TODO: uhhh */
+        } else if (ferror(fp))
+            return -trdb_file_write;
+    }
+    return 0;
+}
+
+int trdb_pulp_compress_trace_block(struct trdb_ctx *c, size_t len,
+                                   struct tr_instr instrs[len], size_t size,
+                                   uint8_t buf[size], size_t *consumed,
+                                   size_t *written)
+{
+    int status = 0;
+    if (!c || (len && !instrs) || (size && !buf) || !consumed || !written)
+        return -trdb_invalid;
+
+    size_t i   = 0;
+    size_t off = 0;
+    struct tr_packet packets[64];
+    size_t from[64]; /* instruction that produced each packet */
+
+    /* a serialized packet never exceeds a trdb_pack, so we compress as many
+     * packets at a time as surely fit into the rest of buf and then serialize
+     * them right into it
+     */
+    while (i < len && status == 0) {
+        size_t cap = (size - off) / sizeof(union trdb_pack);
+        if (cap == 0)
+            break;
+        if (cap > 64)
+            cap = 64;
+
+        size_t n = 0;
+        trdb_perf_start(tc);
+        for (; i < len && n < cap; i++) {
+            status = trdb_compress_trace_step_unchecked(c, &packets[n],
+                                                        &instrs[i]);
+            if (status < 0)
+                break;
+            from[n] = i;
+            n += status;
+            status = 0;
+        }
+        trdb_perf_stop(c, trdb_perf_compress, tc);
+
+        trdb_perf_start(ts);
+        for (size_t k = 0; k < n; k++) {
+            size_t bitcnt = 0;
+            int ret = serialize_packet(c, &packets[k], &bitcnt, 0, buf + off);
+            if (ret < 0) {
+                status = ret;
+                i      = from[k];
+                break;
+            }
+            off += bitcnt / 8 + (bitcnt % 8 != 0);
+        }
+        trdb_perf_stop(c, trdb_perf_serialize, ts);
+    }
+
+    *consumed = i;
+    *written  = off;
+    return status;
+}
+
+int trdb_bit_sink_open(struct trdb_bit_sink *sink, FILE *fp, size_t size,
+                       bool packed)
+{
+    if (!sink || !fp)
+        return -trdb_invalid;
+
+    if (size == 0)
+        size = TRDB_BIT_SINK_SIZE;
+
+    /* a packet plus the incomplete byte in front of it must fit */
+    if (size < sizeof(union trdb_pack) + 1)
+        return -trdb_invalid;
+
+    *sink = (struct trdb_bit_sink){.fp = fp, .size = size, .packed = packed};
+
+    sink->buf = malloc(size);
+    if (!sink->buf)
+        return -trdb_nomem;
+
+    return 0;
+}
+
+int trdb_bit_sink_put_packet(struct trdb_ctx *c, struct trdb_bit_sink *sink,
+                             struct tr_packet *packet)
+{
+    int status = 0;
+    if (!c || !sink || !packet)
+        return -trdb_invalid;
+
+    if (sink->size - sink->bits / 8 < sizeof(union trdb_pack) + 1) {
+        if ((status = trdb_bit_sink_flush(sink)) < 0)
+            return status;
+    }
+
+    /* serializing overwrites whole bytes, so we have to keep the bits of the
+     * previous packet which share the first byte
+     */
+    size_t off    = sink->bits / 8;
+    uint8_t align = sink->bits % 8;
+    uint8_t carry = sink->buf[off] & MASK_FROM(align);
+    size_t bitcnt = 0;
+
+    status = trdb_pulp_serialize_packet(c, packet, &bitcnt, align,
+                                        sink->buf + off);
+    if (status < 0)
+        return status;
+
+    sink->buf[off] |= carry;
+
+    if (sink->packed)
+        sink->bits += bitcnt;
+    else
+        sink->bits += (bitcnt / 8 + (bitcnt % 8 != 0)) * 8;
+
+    return 0;
+}
+
+int trdb_bit_sink_flush(struct trdb_bit_sink *sink)
+{
+    if (!sink)
+        return -trdb_invalid;
+
+    size_t good = sink->bits / 8;
+    if (good && fwrite(sink->buf, 1, good, sink->fp) != good)
+        return -trdb_file_write;
+
+    /* keep the incomplete byte for the next packet */
+    sink->buf[0] = sink->buf[good];
+    sink->bits %= 8;
+    sink->written += good;
+    return 0;
+}
+
+int trdb_bit_sink_close(struct trdb_bit_sink *sink)
+{
+    int status = 0;
+    if (!sink)
+        return -trdb_invalid;
+
+    if (sink->buf) {
+        /* serializing can leave stray bits past the end of a packet */
+        if (sink->bits % 8) {
+            sink->buf[sink->bits / 8] &= MASK_FROM(sink->bits % 8);
+            sink->bits += 8 - sink->bits % 8;
+        }
+        status     = trdb_bit_sink_flush(sink);
+        if (status == 0 && fflush(sink->fp))
+            status = -trdb_file_write;
+    }
+
+    free(sink->buf);
+    *sink = (struct trdb_bit_sink){0};
+    return status;
+}
+
+int trdb_compress_trace_step_sink(struct trdb_ctx *c,
+                                  struct trdb_bit_sink *sink,
+                                  struct tr_instr *instr)
+{
+    if (!c || !sink || !instr)
+        return -trdb_invalid;
+
+    struct tr_packet packet;
+    int status = trdb_compress_trace_step(c, &packet, instr);
+    if (status == 1) {
+        int put = trdb_bit_sink_put_packet(c, sink, &packet);
+        if (put < 0)
+            return put;
+    }
+    return status;
+}
+
+int trdb_write_packets(struct trdb_ctx *c, const char *path,
+                       struct trdb_packet_head *packet_list)
+{
+    int status = 0;
+    if (!c || !path || !packet_list)
+        return -trdb_invalid;
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        status = -trdb_file_open;
+        goto fail;
+    }
+
+    uint8_t bin[sizeof(struct tr_packet)] = {0};
     size_t bitcnt                         = 0;
     uint32_t alignment                    = 0;
     uint8_t carry                         = 0;
     size_t good                           = 0;
     size_t rest                           = 0;
 
-    struct tr_packet *packet;
-    /* TODO: do we need the rever version? I think we do*/
-    TAILQ_FOREACH_REVERSE (packet, packet_list, trdb_packet_head, list) {
-        status = trdb_pulp_serialize_packet(c, packet, &bitcnt, alignment, bin);
-        if (status < 0) {
+    struct tr_packet *packet;
+    /* TODO: do we need the rever version? I think we do*/
+    TAILQ_FOREACH_REVERSE (packet, packet_list, trdb_packet_head, list) {
+        status = trdb_pulp_serialize_packet(c, packet, &bitcnt, alignment, bin);
+        if (status < 0) {
+            goto fail;
+        }
+        /* stitch two consecutive packets together */
+        bin[0] |= carry;
+        rest = (bitcnt + alignment) % 8;
+        good = (bitcnt + alignment) / 8;
+
+        /* write as many bytes as we can i.e. withouth the potentially
+         * intersecting ones
+         */
+        if (fwrite(bin, 1, good, fp) != good) {
+            status = -trdb_file_write;
+            goto fail;
+        }
+        /* we keep that for the next packet */
+        carry     = bin[good] & MASK_FROM(rest);
+        alignment = rest;
+    }
+    /* done, write remaining carry */
+    if (!fwrite(&bin[good], 1, 1, fp)) {
+        status = -trdb_file_write;
+    }
+fail:
+    if (fp)
+        fclose(fp);
+    return status;
+}
+
+/* sizes of the fixed parts of a trace container, see trdb_container_create() */
+#define CONTAINER_HEADER_LEN 16
+#define CONTAINER_ENTRY_LEN 80
+#define CONTAINER_V2_ENTRY_LEN 48
+#define CONTAINER_V1_ENTRY_LEN 32
+#define CONTAINER_TRAILER_LEN 24
+
+static void put_le(uint8_t *p, uint64_t v, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le(const uint8_t *p, unsigned bytes)
+{
+    uint64_t v = 0;
+    for (unsigned i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+int trdb_container_create(struct trdb_ctx *c, FILE *fp, uint64_t block_instrs,
+                          struct trdb_container_writer *w)
+{
+    if (!c || !fp || !w)
+        return -trdb_invalid;
+
+    *w = (struct trdb_container_writer){0};
+
+    uint8_t header[CONTAINER_HEADER_LEN] = {0};
+    memcpy(header, TRDB_CONTAINER_MAGIC, 8);
+    put_le(header + 8, TRDB_CONTAINER_VERSION, 4);
+    put_le(header + 12,
+           (trdb_is_full_address(c) ? 1 : 0) |
+               (trdb_get_ras_tracking(c) ? 2 : 0),
+           4);
+
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header))
+        return -trdb_file_write;
+
+    w->fp           = fp;
+    w->offset       = sizeof(header);
+    w->block_instrs = block_instrs;
+    return 0;
+}
+
+void trdb_container_set_snapshots(struct trdb_container_writer *w,
+                                  bool snapshots)
+{
+    w->snapshots = snapshots;
+}
+
+/* Append the state of @p c to the snapshots of @p w, they are written out by
+ * trdb_container_finish(). Until then the offset in @p block is relative to
+ * the first snapshot.
+ */
+static int add_snapshot(struct trdb_ctx *c, struct trdb_container_writer *w,
+                        struct trdb_container_block *block)
+{
+    if (w->states_cap - w->states_len < TRDB_STATE_MAX) {
+        size_t cap    = 2 * w->states_cap + TRDB_STATE_MAX;
+        uint8_t *grow = realloc(w->states, cap);
+        if (!grow)
+            return -trdb_nomem;
+        w->states     = grow;
+        w->states_cap = cap;
+    }
+
+    size_t len = 0;
+    int status = trdb_save_state(c, w->states + w->states_len,
+                                 w->states_cap - w->states_len, &len);
+    if (status < 0)
+        return status;
+
+    block->state_offset = w->states_len;
+    block->state_len    = len;
+    w->states_len += len;
+    return 0;
+}
+
+int trdb_container_write_packet(struct trdb_ctx *c,
+                                struct trdb_container_writer *w,
+                                struct tr_packet *packet, uint64_t instr)
+{
+    int status      = 0;
+    size_t bitcnt   = 0;
+    uint8_t bin[16] = {0};
+    if (!c || !w || !w->fp || !packet)
+        return -trdb_invalid;
+
+    if (packet->msg_type == W_TIMER)
+        w->timestamp = packet->time;
+
+    struct trdb_container_block *last =
+        w->nblocks ? &w->blocks[w->nblocks - 1] : NULL;
+
+    if (packet->msg_type == W_TRACE && packet->format == F_SYNC &&
+        (!last || instr - last->first_instr >= w->block_instrs)) {
+        if (w->nblocks == w->capacity) {
+            size_t cap = w->capacity ? w->capacity * 2 : 256;
+            struct trdb_container_block *grow =
+                realloc(w->blocks, cap * sizeof(*grow));
+            if (!grow)
+                return -trdb_nomem;
+            w->blocks   = grow;
+            w->capacity = cap;
+        }
+        w->blocks[w->nblocks++] =
+            (struct trdb_container_block){.offset       = w->offset,
+                                          .first_instr  = instr,
+                                          .first_pc     = packet->address,
+                                          .timestamp    = w->timestamp,
+                                          .steps        = w->steps,
+                                          .retired      = w->retired,
+                                          .before_thisc = w->before_thisc,
+                                          .before_nextc = w->before_nextc};
+        if (w->snapshots) {
+            status = add_snapshot(c, w, &w->blocks[w->nblocks - 1]);
+            if (status < 0)
+                return status;
+        }
+    }
+
+    /* like trdb_pulp_write_single_packet() but we need the byte count */
+    status = trdb_pulp_serialize_packet(c, packet, &bitcnt, 0, bin);
+    if (status < 0)
+        return status;
+
+    size_t bytecnt = bitcnt / 8 + (bitcnt % 8 != 0);
+    if (fwrite(bin, 1, bytecnt, w->fp) != bytecnt)
+        return -trdb_file_write;
+
+    w->offset += bytecnt;
+    return 0;
+}
+
+int trdb_container_compress_step(struct trdb_ctx *c,
+                                 struct trdb_container_writer *w,
+                                 struct tr_instr *instr)
+{
+    if (!c || !w || !instr)
+        return -trdb_invalid;
+
+    struct tr_packet packet = {0};
+    int status              = trdb_compress_trace_step(c, &packet, instr);
+    if (status < 0)
+        return status;
+    w->steps++;
+
+    /* The compression looks one instruction ahead, so a packet is about the
+     * previous valid instruction. Trapping instructions are not reconstructed
+     * by the decompression, so they don't get a number.
+     */
+    if (instr->valid) {
+        w->before_thisc = w->before_nextc;
+        w->before_nextc = w->retired;
+        if (!instr->exception)
+            w->retired++;
+    }
+
+    if (status == 1) {
+        int ret = trdb_container_write_packet(c, w, &packet, w->before_thisc);
+        if (ret < 0)
+            return ret;
+    }
+    return status;
+}
+
+int trdb_container_finish(struct trdb_ctx *c, struct trdb_container_writer *w)
+{
+    int status = 0;
+    if (!c || !w)
+        return -trdb_invalid;
+
+    if (!w->fp) {
+        status = -trdb_invalid;
+        goto fail;
+    }
+
+    /* the snapshots go between the packets and the index */
+    if (w->states_len &&
+        fwrite(w->states, 1, w->states_len, w->fp) != w->states_len) {
+        status = -trdb_file_write;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < w->nblocks; i++) {
+        struct trdb_container_block *block = &w->blocks[i];
+        uint8_t entry[CONTAINER_ENTRY_LEN];
+        put_le(entry, block->offset, 8);
+        put_le(entry + 8, block->first_instr, 8);
+        put_le(entry + 16, block->first_pc, 8);
+        put_le(entry + 24, block->timestamp, 8);
+        put_le(entry + 32,
+               block->state_len ? w->offset + block->state_offset : 0, 8);
+        put_le(entry + 40, block->state_len, 8);
+        put_le(entry + 48, block->steps, 8);
+        put_le(entry + 56, block->retired, 8);
+        put_le(entry + 64, block->before_thisc, 8);
+        put_le(entry + 72, block->before_nextc, 8);
+        if (fwrite(entry, 1, sizeof(entry), w->fp) != sizeof(entry)) {
+            status = -trdb_file_write;
+            goto fail;
+        }
+    }
+
+    uint8_t trailer[CONTAINER_TRAILER_LEN];
+    put_le(trailer, w->offset + w->states_len, 8);
+    put_le(trailer + 8, w->nblocks, 8);
+    memcpy(trailer + 16, TRDB_CONTAINER_INDEX_MAGIC, 8);
+    if (fwrite(trailer, 1, sizeof(trailer), w->fp) != sizeof(trailer))
+        status = -trdb_file_write;
+
+    dbg(c, "wrote container with %zu blocks\n", w->nblocks);
+
+fail:
+    if (w->fp && fflush(w->fp) && status == 0)
+        status = -trdb_file_write;
+    free(w->blocks);
+    free(w->states);
+    *w = (struct trdb_container_writer){0};
+    return status;
+}
+
+int trdb_container_open(struct trdb_ctx *c, const char *path,
+                        struct trdb_container *ct)
+{
+    int status = 0;
+    if (!c || !path || !ct)
+        return -trdb_invalid;
+
+    *ct = (struct trdb_container){0};
+
+    if ((status = trdb_pulp_map_packets(c, path, &ct->map)) < 0)
+        return status;
+
+    const uint8_t *data = ct->map.data;
+    size_t size         = ct->map.size;
+
+    if (size < CONTAINER_HEADER_LEN + CONTAINER_TRAILER_LEN ||
+        memcmp(data, TRDB_CONTAINER_MAGIC, 8) ||
+        memcmp(data + size - 8, TRDB_CONTAINER_INDEX_MAGIC, 8)) {
+        err(c, "%s is not a trace container\n", path);
+        status = -trdb_bad_container;
+        goto fail;
+    }
+
+    uint32_t version = get_le(data + 8, 4);
+    if (version < 1 || version > TRDB_CONTAINER_VERSION) {
+        err(c, "unsupported container version %" PRIu32 "\n", version);
+        status = -trdb_bad_container;
+        goto fail;
+    }
+    ct->full_address = get_le(data + 12, 4) & 1;
+    ct->ras_tracking = get_le(data + 12, 4) & 2;
+    ct->version      = version;
+
+    const uint8_t *trailer = data + size - CONTAINER_TRAILER_LEN;
+    uint64_t index_offset  = get_le(trailer, 8);
+    uint64_t nblocks       = get_le(trailer + 8, 8);
+    size_t index_end       = size - CONTAINER_TRAILER_LEN;
+    size_t entry_len       = CONTAINER_ENTRY_LEN;
+    if (version == 1)
+        entry_len = CONTAINER_V1_ENTRY_LEN;
+    else if (version == 2)
+        entry_len = CONTAINER_V2_ENTRY_LEN;
+
+    if (index_offset < CONTAINER_HEADER_LEN || index_offset > index_end ||
+        (index_end - index_offset) / entry_len != nblocks ||
+        (index_end - index_offset) % entry_len != 0) {
+        err(c, "corrupt container index\n");
+        status = -trdb_bad_container;
+        goto fail;
+    }
+
+    if (nblocks > 0) {
+        ct->blocks = malloc(nblocks * sizeof(*ct->blocks));
+        if (!ct->blocks) {
+            status = -trdb_nomem;
+            goto fail;
+        }
+    }
+
+    /* the packets end where the first snapshot starts */
+    size_t packets_end = index_offset;
+    for (size_t i = 0; i < nblocks; i++) {
+        const uint8_t *entry = data + index_offset + i * entry_len;
+        struct trdb_container_block *block = &ct->blocks[i];
+
+        *block              = (struct trdb_container_block){0};
+        block->offset       = get_le(entry, 8);
+        block->first_instr  = get_le(entry + 8, 8);
+        block->first_pc     = get_le(entry + 16, 8);
+        block->timestamp    = get_le(entry + 24, 8);
+        if (version >= 2) {
+            block->state_offset = get_le(entry + 32, 8);
+            block->state_len    = get_le(entry + 40, 8);
+        }
+        if (version >= 3) {
+            block->steps        = get_le(entry + 48, 8);
+            block->retired      = get_le(entry + 56, 8);
+            block->before_thisc = get_le(entry + 64, 8);
+            block->before_nextc = get_le(entry + 72, 8);
+        }
+
+        if (block->state_len &&
+            (block->state_offset < CONTAINER_HEADER_LEN ||
+             block->state_offset > index_offset ||
+             block->state_len > index_offset - block->state_offset)) {
+            err(c, "corrupt container snapshot %zu\n", i);
+            status = -trdb_bad_container;
+            goto fail;
+        }
+        if (block->state_len && block->state_offset < packets_end)
+            packets_end = block->state_offset;
+    }
+
+    for (size_t i = 0; i < nblocks; i++) {
+        struct trdb_container_block *block = &ct->blocks[i];
+
+        /* blocks have to be in order for the binary search */
+        bool ordered = i == 0 || (block->offset > block[-1].offset &&
+                                  block->first_instr >= block[-1].first_instr);
+        if (!ordered || block->offset < CONTAINER_HEADER_LEN ||
+            block->offset >= packets_end) {
+            err(c, "corrupt container index entry %zu\n", i);
+            status = -trdb_bad_container;
+            goto fail;
+        }
+    }
+
+    ct->nblocks     = nblocks;
+    ct->packets_end = packets_end;
+    return 0;
+
+fail:
+    trdb_container_close(ct);
+    return status;
+}
+
+void trdb_container_close(struct trdb_container *ct)
+{
+    if (!ct)
+        return;
+
+    trdb_pulp_unmap_packets(&ct->map);
+    free(ct->blocks);
+    *ct = (struct trdb_container){0};
+}
+
+size_t trdb_container_find_block(const struct trdb_container *ct,
+                                 uint64_t instr)
+{
+    if (!ct || ct->nblocks == 0)
+        return 0;
+
+    /* last block with first_instr <= instr */
+    size_t lo = 0;
+    size_t hi = ct->nblocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ct->blocks[mid].first_instr <= instr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int trdb_container_restore_block(struct trdb_ctx *c,
+                                 const struct trdb_container *ct, size_t block)
+{
+    if (!c || !ct || block >= ct->nblocks)
+        return -trdb_invalid;
+
+    const struct trdb_container_block *b = &ct->blocks[block];
+    if (!b->state_len) {
+        err(c, "block %zu has no state snapshot\n", block);
+        return -trdb_bad_container;
+    }
+    return trdb_restore_state(c, ct->map.data + b->state_offset, b->state_len);
+}
+
+int trdb_container_resume(struct trdb_ctx *c, const struct trdb_container *ct,
+                          size_t block, FILE *fp, uint64_t block_instrs,
+                          struct trdb_container_writer *w)
+{
+    int status = 0;
+    if (!c || !ct || !fp || !w || block >= ct->nblocks)
+        return -trdb_invalid;
+
+    if (trdb_is_full_address(c) != ct->full_address ||
+        trdb_get_ras_tracking(c) != ct->ras_tracking) {
+        err(c, "container was written with other settings\n");
+        return -trdb_bad_config;
+    }
+    if (ct->version < 3) {
+        err(c, "container version %" PRIu32 " can't be resumed\n",
+            ct->version);
+        return -trdb_bad_container;
+    }
+
+    /* the sync packet starting the block was produced before the snapshot */
+    const struct trdb_container_block *last = &ct->blocks[block];
+    size_t end                              = last->offset;
+    struct tr_packet packet                 = {0};
+    status = trdb_pulp_next_mapped_packet(c, &ct->map, &end, &packet);
+    if (status < 0 || end > ct->packets_end) {
+        err(c, "sync packet of block %zu is cut off\n", block);
+        return -trdb_bad_container;
+    }
+
+    if ((status = trdb_container_restore_block(c, ct, block)) < 0)
+        return status;
+
+    if ((status = trdb_container_create(c, fp, block_instrs, w)) < 0)
+        return status;
+
+    size_t len = end - CONTAINER_HEADER_LEN;
+    if (fwrite(ct->map.data + CONTAINER_HEADER_LEN, 1, len, fp) != len) {
+        status = -trdb_file_write;
+        goto fail;
+    }
+    w->offset += len;
+
+    w->blocks = malloc((block + 1) * sizeof(*w->blocks));
+    if (!w->blocks) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    w->capacity = block + 1;
+
+    /* the offsets of the snapshots are relative again until we finish */
+    for (size_t i = 0; i <= block; i++) {
+        struct trdb_container_block b = ct->blocks[i];
+        if (b.state_len) {
+            size_t need = w->states_len + b.state_len;
+            if (need > w->states_cap) {
+                size_t cap    = 2 * w->states_cap + b.state_len;
+                uint8_t *grow = realloc(w->states, cap);
+                if (!grow) {
+                    status = -trdb_nomem;
+                    goto fail;
+                }
+                w->states     = grow;
+                w->states_cap = cap;
+            }
+            memcpy(w->states + w->states_len, ct->map.data + b.state_offset,
+                   b.state_len);
+            b.state_offset = w->states_len;
+            w->states_len  = need;
+        }
+        w->blocks[w->nblocks++] = b;
+    }
+
+    w->snapshots    = true;
+    w->timestamp    = last->timestamp;
+    w->steps        = last->steps;
+    w->retired      = last->retired;
+    w->before_thisc = last->before_thisc;
+    w->before_nextc = last->before_nextc;
+
+    dbg(c, "resuming container at block %zu after %" PRIu64 " steps\n", block,
+        w->steps);
+    return 0;
+
+fail:
+    free(w->blocks);
+    free(w->states);
+    *w = (struct trdb_container_writer){0};
+    return status;
+}
+
+/* forwards only the instructions within a window */
+struct window_filter {
+    uint64_t begin;
+    uint64_t end;
+    uint64_t next; /* number of the next reconstructed instruction */
+    int (*instr_fn)(struct trdb_ctx *c, const struct tr_instr *instr,
+                    void *data);
+    void *data;
+};
+
+static int filter_window_instr(struct trdb_ctx *c,
+                               const struct tr_instr *instr, void *data)
+{
+    struct window_filter *window = data;
+    int status                   = 0;
+
+    if (window->next >= window->begin && window->next < window->end)
+        status = window->instr_fn(c, instr, window->data);
+    window->next++;
+    return status;
+}
+
+int trdb_container_decompress_window(
+    struct trdb_ctx *c, const struct trdb_container *ct, uint64_t begin,
+    uint64_t end,
+    int (*instr_fn)(struct trdb_ctx *c, const struct tr_instr *instr,
+                    void *data),
+    void *data)
+{
+    int status = 0;
+    if (!c || !ct || !instr_fn)
+        return -trdb_invalid;
+
+    if (trdb_is_full_address(c) != ct->full_address) {
+        err(c, "container was written with full_address = %s\n",
+            ct->full_address ? "true" : "false");
+        return -trdb_bad_config;
+    }
+    if (trdb_get_ras_tracking(c) != ct->ras_tracking) {
+        err(c, "container was written with ras_tracking = %s\n",
+            ct->ras_tracking ? "true" : "false");
+        return -trdb_bad_config;
+    }
+
+    if (ct->nblocks == 0 || begin >= end)
+        return 0;
+
+    size_t b = trdb_container_find_block(ct, begin);
+    if (ct->blocks[b].state_len) {
+        status = trdb_restore_sync_state(
+            c, ct->map.data + ct->blocks[b].state_offset,
+            ct->blocks[b].state_len);
+        if (status < 0)
+            return status;
+    } else if (b > 0) {
+        /* the calls before the block are unknown */
+        trdb_decompress_partial_stack(c);
+    }
+
+    struct window_filter window = {.begin    = begin,
+                                   .end      = end,
+                                   .next     = ct->blocks[b].first_instr,
+                                   .instr_fn = instr_fn,
+                                   .data     = data};
+
+    dbg(c, "starting at block %zu with instruction %" PRIu64 "\n", b,
+        window.next);
+
+    size_t offset           = ct->blocks[b].offset;
+    struct tr_packet packet = {0};
+    while (window.next < end && offset < ct->packets_end) {
+        status = trdb_pulp_next_mapped_packet(c, &ct->map, &offset, &packet);
+        if (status < 0)
+            return status;
+        status = trdb_decompress_packet(c, &packet, filter_window_instr,
+                                        &window);
+        if (status < 0)
+            return status;
+    }
+    return 0;
+}
+
+/* The text trace formats are parsed with the hand written scanners below,
+ * which work on a memory mapping of the whole file. Going through fscanf() or
+ * strtok() and sscanf() per field is many times slower. The scanners accept
+ * what the scanf formats we used before accepted in practice: any whitespace
+ * between the fields and hex numbers with or without 0x.
+ */
+static int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && isspace((unsigned char)*p))
+        p++;
+    return p;
+}
+
+/* like %x, returns NULL if there is no number at @p p */
+static const char *scan_hex(const char *p, const char *end, uint64_t *v)
+{
+    uint64_t x = 0;
+    int d      = 0;
+
+    p = skip_space(p, end);
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') &&
+        hex_value(p[2]) >= 0)
+        p += 2;
+
+    const char *start = p;
+    while (p < end && (d = hex_value(*p)) >= 0) {
+        x = x << 4 | d;
+        p++;
+    }
+    *v = x;
+    return p == start ? NULL : p;
+}
+
+/* like %d, returns NULL if there is no number at @p p */
+static const char *scan_dec(const char *p, const char *end, uint64_t *v)
+{
+    uint64_t x = 0;
+    bool neg   = false;
+
+    p = skip_space(p, end);
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9')
+        x = x * 10 + (*p++ - '0');
+    *v = neg ? -x : x;
+    return p == start ? NULL : p;
+}
+
+/* fields of a stimuli record in the order they appear */
+static const struct {
+    const char *key;
+    size_t len;
+    bool hex;
+} stimuli_fields[] = {
+    {"valid=", 6, false},       {"exception=", 10, false},
+    {"interrupt=", 10, false},  {"cause=", 6, true},
+    {"tval=", 5, true},         {"priv=", 5, true},
+    {"compressed=", 11, false}, {"addr=", 5, true},
+    {"instr=", 6, true},
+};
+
+/* Parse the stimuli record at @p p into @p instr. Returns where the record
+ * ends or NULL if it is malformed.
+ */
+static const char *scan_stimuli(const char *p, const char *end,
+                                struct tr_instr *instr)
+{
+    uint64_t v[9];
+    for (size_t i = 0; i < 9; i++) {
+        p = skip_space(p, end);
+        if ((size_t)(end - p) < stimuli_fields[i].len ||
+            memcmp(p, stimuli_fields[i].key, stimuli_fields[i].len))
+            return NULL;
+        p += stimuli_fields[i].len;
+        p = stimuli_fields[i].hex ? scan_hex(p, end, &v[i])
+                                  : scan_dec(p, end, &v[i]);
+        if (!p)
+            return NULL;
+    }
+
+    *instr            = (struct tr_instr){0};
+    instr->valid      = v[0];
+    instr->exception  = v[1];
+    instr->interrupt  = v[2];
+    instr->cause      = v[3];
+    instr->tval       = v[4];
+    instr->priv       = v[5];
+    instr->compressed = v[6];
+    instr->iaddr      = v[7];
+    instr->instr      = v[8];
+    return p;
+}
+
+static const char *skip_blank(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+/* Parse the cvs line [@p p, @p eol) into @p instr. The columns are VALID,
+ * ADDRESS, INSN, PRIVILEGE, EXCEPTION, ECAUSE, TVAL and INTERRUPT, where the
+ * last one may be missing.
+ */
+static int scan_cvs(struct trdb_ctx *c, const char *p, const char *eol,
+                    struct tr_instr *instr)
+{
+    uint64_t v[8] = {0};
+    size_t i      = 0;
+
+    for (; i < 8; i++) {
+        p = skip_blank(p, eol);
+        if (p == eol)
+            break;
+        p = (i == 0 || i == 4 || i == 7) ? scan_dec(p, eol, &v[i])
+                                         : scan_hex(p, eol, &v[i]);
+        if (!p) {
+            err(c, "bad value in column %zu\n", i);
+            return -trdb_scan_state_invalid;
+        }
+        p = skip_blank(p, eol);
+        if (p < eol && *p != ',') {
+            err(c, "bad value in column %zu\n", i);
+            return -trdb_scan_state_invalid;
+        }
+        p += p < eol;
+    }
+
+    if (i < 7) {
+        err(c, "wrong number of tokens on line, still %zu remaining\n", 7 - i);
+        return -trdb_scan_state_invalid;
+    }
+
+    while (p < eol && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    if (p != eol) {
+        err(c, "reading too many tokens per line\n");
+        return -trdb_scan_state_invalid;
+    }
+
+    *instr            = (struct tr_instr){0};
+    instr->valid      = v[0];
+    instr->iaddr      = v[1];
+    instr->instr      = v[2];
+    instr->compressed = ((v[2] & 3) != 3);
+    instr->priv       = v[3];
+    instr->exception  = v[4];
+    instr->cause      = v[5];
+    instr->tval       = v[6];
+    instr->interrupt  = v[7];
+    return 0;
+}
+
+/* smallest piece of a text trace we give to a thread */
+#define SCAN_CHUNK_MIN (256 * 1024)
+
+/* a piece of a text trace which is parsed on its own */
+struct scan_chunk {
+    struct trdb_ctx *c;
+    const char *base; /* start of the file, for error messages */
+    const char *begin;
+    const char *end;
+    bool cvs;
+    struct tr_instr *samples;
+    size_t cnt;
+    int status;
+};
+
+static int push_sample(struct scan_chunk *chunk, size_t *cap,
+                       const struct tr_instr *instr)
+{
+    if (chunk->cnt >= *cap) {
+        size_t size          = 2 * *cap;
+        struct tr_instr *tmp = realloc(chunk->samples, size * sizeof(*tmp));
+        if (!tmp)
+            return -trdb_nomem;
+        chunk->samples = tmp;
+        *cap           = size;
+    }
+    chunk->samples[chunk->cnt++] = *instr;
+    return 0;
+}
+
+static void *scan_chunk(void *arg)
+{
+    struct scan_chunk *chunk = arg;
+    const char *p            = chunk->begin;
+    const char *end          = chunk->end;
+    struct tr_instr instr;
+
+    /* a stimuli record is about 100 bytes, a cvs line about 30 */
+    size_t cap     = (end - p) / (chunk->cvs ? 24 : 96) + 16;
+    chunk->samples = malloc(cap * sizeof(*chunk->samples));
+    if (!chunk->samples) {
+        chunk->status = -trdb_nomem;
+        return NULL;
+    }
+
+    while ((p = skip_space(p, end)) < end) {
+        const char *next = NULL;
+        if (chunk->cvs) {
+            next = memchr(p, '\n', end - p);
+            next = next ? next : end;
+            if ((chunk->status = scan_cvs(chunk->c, p, next, &instr)) < 0)
+                break;
+        } else if (!(next = scan_stimuli(p, end, &instr))) {
+            chunk->status = -trdb_scan_file;
+            break;
+        }
+        if ((chunk->status = push_sample(chunk, &cap, &instr)) < 0)
+            return NULL;
+        p = next;
+    }
+
+    if (chunk->status < 0)
+        err(chunk->c, "malformed %s trace at byte %zu\n",
+            chunk->cvs ? "cvs" : "stimuli", (size_t)(p - chunk->base));
+    return NULL;
+}
+
+/* Parse the stimuli or cvs file at @p path into an array, with up to
+ * @p threads threads that each take a piece cut at line boundaries.
+ */
+static int scan_text_trace(struct trdb_ctx *c, const char *path, bool cvs,
+                           unsigned threads, struct tr_instr **samples,
+                           size_t *count)
+{
+    int status                 = 0;
+    struct trdb_packet_map map = {0};
+    struct scan_chunk *chunks  = NULL;
+    pthread_t *workers         = NULL;
+    size_t nchunks             = 0;
+    unsigned nworkers          = 0;
+
+    *count   = 0;
+    *samples = NULL;
+
+    trdb_perf_start(t);
+    /* the mapping is just as good for text */
+    if ((status = trdb_pulp_map_packets(c, path, &map)) < 0)
+        return status;
+
+    const char *begin = (const char *)map.data;
+    const char *end   = begin + map.size;
+
+    if (cvs) {
+        /* the header line names the columns, which have a fixed order */
+        const char *eol = map.size ? memchr(begin, '\n', map.size) : NULL;
+        if (!eol) {
+            status = -trdb_bad_cvs_header;
             goto fail;
         }
-        /* stitch two consecutive packets together */
-        bin[0] |= carry;
-        rest = (bitcnt + alignment) % 8;
-        good = (bitcnt + alignment) / 8;
+        begin = eol + 1;
+    }
 
-        /* write as many bytes as we can i.e. withouth the potentially
-         * intersecting ones
-         */
-        if (fwrite(bin, 1, good, fp) != good) {
-            status = -trdb_file_write;
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads     = online > 0 ? online : 1;
+    }
+
+    /* pieces smaller than this aren't worth a thread */
+    size_t len = end - begin;
+    nchunks    = len / SCAN_CHUNK_MIN + 1;
+    if (nchunks > threads)
+        nchunks = threads;
+
+    chunks = calloc(nchunks, sizeof(*chunks));
+    if (!chunks) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+
+    const char *p = begin;
+    for (size_t k = 0; k < nchunks; k++) {
+        const char *cut = k + 1 < nchunks ? begin + (k + 1) * (len / nchunks)
+                                          : end;
+        if (cut < p)
+            cut = p;
+        if (cut < end) {
+            const char *eol = memchr(cut, '\n', end - cut);
+            cut             = eol ? eol + 1 : end;
+        }
+        chunks[k] = (struct scan_chunk){
+            .c = c, .base = (const char *)map.data, .begin = p, .end = cut,
+            .cvs = cvs};
+        p = cut;
+    }
+
+    if (nchunks > 1) {
+        workers = malloc((nchunks - 1) * sizeof(*workers));
+        if (!workers) {
+            status = -trdb_nomem;
             goto fail;
         }
-        /* we keep that for the next packet */
-        carry     = bin[good] & MASK_FROM(rest);
-        alignment = rest;
     }
-    /* done, write remaining carry */
-    if (!fwrite(&bin[good], 1, 1, fp)) {
-        status = -trdb_file_write;
+    /* we take the first piece ourselves, if a thread can't be spawned we
+     * also do its piece
+     */
+    for (size_t k = 1; k < nchunks; k++) {
+        if (pthread_create(&workers[nworkers], NULL, scan_chunk, &chunks[k]))
+            scan_chunk(&chunks[k]);
+        else
+            nworkers++;
+    }
+    scan_chunk(&chunks[0]);
+    for (unsigned i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+
+    size_t total = 0;
+    for (size_t k = 0; k < nchunks; k++) {
+        if (chunks[k].status < 0) {
+            status = chunks[k].status;
+            goto fail;
+        }
+        total += chunks[k].cnt;
+    }
+
+    if (nchunks == 1) {
+        *samples          = chunks[0].samples;
+        chunks[0].samples = NULL;
+    } else {
+        *samples = malloc((total ? total : 1) * sizeof(**samples));
+        if (!*samples) {
+            status = -trdb_nomem;
+            goto fail;
+        }
+        size_t at = 0;
+        for (size_t k = 0; k < nchunks; k++) {
+            memcpy(*samples + at, chunks[k].samples,
+                   chunks[k].cnt * sizeof(**samples));
+            at += chunks[k].cnt;
+        }
     }
+    *count = total;
+
 fail:
-    if (fp)
-        fclose(fp);
+    for (size_t k = 0; k < nchunks; k++)
+        free(chunks[k].samples);
+    free(chunks);
+    free(workers);
+    trdb_pulp_unmap_packets(&map);
+    trdb_perf_stop(c, trdb_perf_parse, t);
     return status;
 }
 
 int trdb_stimuli_to_trace_list(struct trdb_ctx *c, const char *path,
                                struct trdb_instr_head *instrs, size_t *count)
 {
-    int status = 0;
-    FILE *fp   = NULL;
+    int status               = 0;
+    struct tr_instr *samples = NULL;
 
     *count = 0;
 
-    if (!c || !path || !instrs) {
-        status = -trdb_invalid;
-        goto fail;
-    }
-    struct tr_instr *sample = NULL;
+    if (!c || !path || !instrs)
+        return -trdb_invalid;
 
-    fp = fopen(path, "r");
-    if (!fp) {
-        status = -trdb_file_open;
-        goto fail;
-    }
     size_t scnt = 0;
+    if ((status = scan_text_trace(c, path, false, 1, &samples, &scnt)) < 0)
+        return status;
 
-    int ret        = 0;
-    int valid      = 0;
-    int exception  = 0;
-    int interrupt  = 0;
-    uint32_t cause = 0;
-    addr_t tval    = 0;
-    uint32_t priv  = 0;
-    addr_t iaddr   = 0;
-    insn_t instr   = 0;
-    int compressed = 0;
-
-    while ((ret = fscanf(fp,
-                         "valid= %d exception= %d interrupt= %d cause= %" SCNx32
-                         " tval= %" SCNxADDR " priv= %" SCNx32
-                         " compressed= %d addr= %" SCNxADDR " instr= %" SCNxINSN
-                         " \n",
-                         &valid, &exception, &interrupt, &cause, &tval, &priv,
-                         &compressed, &iaddr, &instr)) != EOF) {
-        // TODO: make this configurable so that we don't have to store so
-        // much data
-        /* if (!valid) { */
-        /*     continue; */
-        /* } */
-        sample = malloc(sizeof(*sample));
+    for (size_t i = 0; i < scnt; i++) {
+        struct tr_instr *sample = malloc(sizeof(*sample));
         if (!sample) {
             status = -trdb_nomem;
             goto fail;
         }
-
-        *sample            = (struct tr_instr){0};
-        sample->valid      = valid;
-        sample->exception  = exception;
-        sample->interrupt  = interrupt;
-        sample->cause      = cause;
-        sample->tval       = tval;
-        sample->priv       = priv;
-        sample->iaddr      = iaddr;
-        sample->instr      = instr;
-        sample->compressed = compressed;
-
+        trdb_perf_count(c, allocs);
+        *sample = samples[i];
         TAILQ_INSERT_TAIL(instrs, sample, list);
-
-        scnt++;
-    }
-
-    if (ferror(fp)) {
-        status = -trdb_scan_file;
-        goto fail;
     }
 
     *count = scnt;
-out:
-    if (fp)
-        fclose(fp);
+    free(samples);
+    return 0;
 
-    return status;
 fail:
     // TODO: it's maybe better to not free the whole list, but just the part
     // where failed
     trdb_free_instr_list(instrs);
-    goto out;
+    free(samples);
+    return status;
 }
 
 int trdb_stimuli_to_trace(struct trdb_ctx *c, const char *path,
                           struct tr_instr **samples, size_t *count)
 {
-    int status = 0;
-    FILE *fp   = NULL;
+    return trdb_stimuli_to_trace_parallel(c, path, samples, count, 1);
+}
 
+int trdb_stimuli_to_trace_parallel(struct trdb_ctx *c, const char *path,
+                                   struct tr_instr **samples, size_t *count,
+                                   unsigned threads)
+{
     *count = 0;
 
     if (!c || !path || !samples)
         return -trdb_invalid;
 
-    fp = fopen(path, "r");
-    if (!fp) {
-        status = -trdb_file_open;
-        goto fail;
-    }
-    size_t scnt = 0;
+    return scan_text_trace(c, path, false, threads, samples, count);
+}
 
-    int ret        = 0;
-    int valid      = 0;
-    int exception  = 0;
-    int interrupt  = 0;
-    uint32_t cause = 0;
-    addr_t tval    = 0;
-    uint32_t priv  = 0;
-    addr_t iaddr   = 0;
-    insn_t instr   = 0;
-    int compressed = 0;
-
-    size_t size = 128;
-    *samples    = malloc(size * sizeof(**samples));
-    if (!*samples) {
-        status = -trdb_nomem;
-        goto fail;
-    }
+int trdb_cvs_to_trace_parallel(struct trdb_ctx *c, const char *path,
+                               struct tr_instr **samples, size_t *count,
+                               unsigned threads)
+{
+    if (!c || !path || !samples || !count)
+        return -trdb_invalid;
 
-    while ((ret = fscanf(fp,
-                         "valid= %d exception= %d interrupt= %d cause= %" SCNx32
-                         " tval= %" SCNxADDR " priv= %" SCNx32
-                         " compressed= %d addr= %" SCNxADDR " instr= %" SCNxINSN
-                         " \n",
-                         &valid, &exception, &interrupt, &cause, &tval, &priv,
-                         &compressed, &iaddr, &instr)) != EOF) {
-        // TODO: make this configurable so that we don't have to store so much
-        // data
-        /* if (!valid) { */
-        /*     continue; */
-        /* } */
-        if (scnt >= size) {
-            size                 = 2 * size;
-            struct tr_instr *tmp = realloc(*samples, size * sizeof(**samples));
-            if (!tmp) {
-                status = -trdb_nomem;
-                goto fail;
-            }
-            *samples = tmp;
-        }
-        (*samples)[scnt]            = (struct tr_instr){0};
-        (*samples)[scnt].valid      = valid;
-        (*samples)[scnt].exception  = exception;
-        (*samples)[scnt].interrupt  = interrupt;
-        (*samples)[scnt].cause      = cause;
-        (*samples)[scnt].tval       = tval;
-        (*samples)[scnt].priv       = priv;
-        (*samples)[scnt].iaddr      = iaddr;
-        (*samples)[scnt].instr      = instr;
-        (*samples)[scnt].compressed = compressed;
-        scnt++;
-    }
-    /* initialize the remaining unitialized memory */
-    memset((*samples) + scnt, 0, size - scnt);
-
-    if (ferror(fp)) {
-        status = -trdb_scan_file;
-        goto fail;
+    return scan_text_trace(c, path, true, threads, samples, count);
+}
+
+/* Parse the cvs file at @p path and pass each line as tr_instr to @p add. */
+static int cvs_to_trace(struct trdb_ctx *c, const char *path,
+                        int (*add)(void *data, const struct tr_instr *instr),
+                        void *data, size_t *count)
+{
+    int status               = 0;
+    struct tr_instr *samples = NULL;
+    size_t scnt              = 0;
+
+    *count = 0;
+
+    if ((status = scan_text_trace(c, path, true, 1, &samples, &scnt)) < 0)
+        return status;
+
+    for (size_t i = 0; i < scnt; i++) {
+        if ((status = add(data, &samples[i])) < 0)
+            goto fail;
     }
 
     *count = scnt;
-out:
-    if (fp)
-        fclose(fp);
-    return status;
 fail:
-    free(*samples);
-    samples = NULL;
-    goto out;
+    free(samples);
+    return status;
+}
+
+static int add_instr_to_list(void *data, const struct tr_instr *instr)
+{
+    struct trdb_instr_head *instrs = data;
+
+    struct tr_instr *add = malloc(sizeof(*add));
+    if (!add)
+        return -trdb_nomem;
+    *add = *instr;
+
+    TAILQ_INSERT_TAIL(instrs, add, list);
+    return 0;
+}
+
+static int add_instr_to_vec(void *data, const struct tr_instr *instr)
+{
+    return trdb_instr_vec_push(data, instr);
 }
 
 int trdb_cvs_to_trace_list(struct trdb_ctx *c, const char *path,
                            struct trdb_instr_head *instrs, size_t *count)
 {
+    if (!c || !path || !instrs || !count)
+        return -trdb_invalid;
 
-    FILE *fp                = NULL;
-    int status              = 0;
-    struct tr_instr *sample = NULL;
+    int status = cvs_to_trace(c, path, add_instr_to_list, instrs, count);
+    // TODO: it's maybe better to not free the whole list, but just the part
+    // where failed
+    if (status < 0)
+        trdb_free_instr_list(instrs);
+    return status;
+}
 
-    *count = 0;
+int trdb_cvs_to_trace_vec(struct trdb_ctx *c, const char *path,
+                          struct trdb_instr_vec *instrs, size_t *count)
+{
+    if (!c || !path || !instrs || !count)
+        return -trdb_invalid;
 
-    if (!c || !path || !instrs)
-        status = -trdb_invalid;
+    int status = cvs_to_trace(c, path, add_instr_to_vec, instrs, count);
+    if (status < 0)
+        trdb_free_instr_vec(instrs);
+    return status;
+}
 
-    fp = fopen(path, "r");
-    if (!fp) {
-        status = -trdb_file_open;
-        goto fail;
-    }
-    size_t scnt = 0;
+/* offsets of the parts of a binary instruction trace record */
+#define TRACE_INSTR_AT 4
+#define TRACE_IADDR_AT (TRACE_INSTR_AT + ILEN / 8)
+#define TRACE_TVAL_AT (TRACE_IADDR_AT + XLEN / 8)
 
-    int valid      = 0;
-    int exception  = 0;
-    int interrupt  = 0;
-    uint32_t cause = 0;
-    addr_t tval    = 0;
-    uint32_t priv  = 0;
-    addr_t iaddr   = 0;
-    insn_t instr   = 0;
+void trdb_trace_encode_instr(const struct tr_instr *instr, uint8_t *rec)
+{
+    uint32_t meta = instr->valid | instr->exception << 1 |
+                    instr->interrupt << 2 | instr->compressed << 3 |
+                    (instr->priv & MASK_FROM(PRIVLEN)) << 4 |
+                    (instr->cause & MASK_FROM(CAUSELEN)) << 8;
+
+    put_le(rec, meta, 4);
+    put_le(rec + TRACE_INSTR_AT, instr->instr, ILEN / 8);
+    put_le(rec + TRACE_IADDR_AT, instr->iaddr, XLEN / 8);
+    put_le(rec + TRACE_TVAL_AT, instr->tval, XLEN / 8);
+}
 
-    char *line = NULL;
-    size_t len = 0;
+void trdb_trace_decode_instr(const uint8_t *rec, struct tr_instr *instr)
+{
+    uint32_t meta = get_le(rec, 4);
+
+    *instr            = (struct tr_instr){0};
+    instr->valid      = meta & 1;
+    instr->exception  = meta >> 1 & 1;
+    instr->interrupt  = meta >> 2 & 1;
+    instr->compressed = meta >> 3 & 1;
+    instr->priv       = meta >> 4 & MASK_FROM(PRIVLEN);
+    instr->cause      = meta >> 8 & MASK_FROM(CAUSELEN);
+    instr->instr      = get_le(rec + TRACE_INSTR_AT, ILEN / 8);
+    instr->iaddr      = get_le(rec + TRACE_IADDR_AT, XLEN / 8);
+    instr->tval       = get_le(rec + TRACE_TVAL_AT, XLEN / 8);
+}
 
-    /* reading header line */
-    if (getline(&line, &len, fp) == -1) {
-        status = -trdb_bad_cvs_header;
-        goto fail;
+int trdb_trace_check_header(struct trdb_ctx *c, const uint8_t *header,
+                            uint32_t *flags)
+{
+    if (memcmp(header, TRDB_TRACE_MAGIC, 8)) {
+        err(c, "not a binary instruction trace\n");
+        return -trdb_bad_trace_file;
     }
 
-    if (!strcmp(line, "VALID,ADDRESS,INSN,PRIVILEGE,"
-                      "EXCEPTION,ECAUSE,TVAL,INTERRUPT")) {
-        status = -trdb_bad_cvs_header;
-        goto fail;
+    uint32_t version = get_le(header + 8, 2);
+    uint32_t xlen    = get_le(header + 10, 2);
+    if (version != TRDB_TRACE_VERSION || xlen != XLEN) {
+        err(c, "unsupported binary trace: version %" PRIu32 ", xlen %" PRIu32
+               "\n",
+            version, xlen);
+        return -trdb_bad_trace_file;
     }
 
-    /* parse data into tr_instr list */
-    while (getline(&line, &len, fp) != -1) {
+    if (flags)
+        *flags = get_le(header + 12, 4);
+    return 0;
+}
 
-        sample = malloc(sizeof(*sample));
-        if (!sample) {
-            status = -trdb_nomem;
-            goto fail;
-        }
-        *sample = (struct tr_instr){0};
+int trdb_trace_writer_open(struct trdb_ctx *c, FILE *fp, uint32_t flags,
+                           struct trdb_trace_writer *w)
+{
+    if (!c || !fp || !w)
+        return -trdb_invalid;
 
-        int ele = 7;
-        const char *tok;
-        for (tok = strtok(line, ","); tok && *tok; tok = strtok(NULL, ",\n")) {
+    *w = (struct trdb_trace_writer){0};
 
-            if (ele < 0) {
-                err(c, "reading too many tokens per line\n");
-                status = -trdb_scan_state_invalid;
-                goto fail;
-            }
+    uint8_t header[TRDB_TRACE_HEADER_LEN] = {0};
+    memcpy(header, TRDB_TRACE_MAGIC, 8);
+    put_le(header + 8, TRDB_TRACE_VERSION, 2);
+    put_le(header + 10, XLEN, 2);
+    put_le(header + 12, flags, 4);
 
-            switch (ele) {
-            case 7:
-                sscanf(tok, "%d", &valid);
-                sample->valid = valid;
-                break;
-            case 6:
-                sscanf(tok, "%" SCNxADDR "", &iaddr);
-                sample->iaddr = iaddr;
-                break;
-            case 5:
-                sscanf(tok, "%" SCNxINSN "", &instr);
-                sample->instr      = instr;
-                sample->compressed = ((instr & 3) != 3);
-                break;
-            case 4:
-                sscanf(tok, "%" SCNx32 "", &priv);
-                sample->priv = priv;
-                break;
-            case 3:
-                sscanf(tok, "%d", &exception);
-                sample->exception = exception;
-                break;
-            case 2:
-                sscanf(tok, "%" SCNx32 "", &cause);
-                sample->cause = cause;
-                break;
-            case 1:
-                sscanf(tok, "%" SCNxADDR "", &tval);
-                sample->tval = tval;
-                break;
-            case 0:
-                sscanf(tok, "%d", &interrupt);
-                sample->interrupt = interrupt;
-                break;
-            }
-            ele--;
-        }
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header))
+        return -trdb_file_write;
 
-        if (ele > 0) {
-            err(c, "wrong number of tokens on line, still %d remaining\n", ele);
-            status = -trdb_scan_state_invalid;
-            goto fail;
-        }
+    w->fp    = fp;
+    w->flags = flags;
+    return 0;
+}
 
-        TAILQ_INSERT_TAIL(instrs, sample, list);
+int trdb_trace_write_instr(struct trdb_trace_writer *w,
+                           const struct tr_instr *instr)
+{
+    if (!w || !instr)
+        return -trdb_invalid;
 
-        scnt++;
+    uint8_t rec[TRDB_TRACE_RECORD_LEN];
+    trdb_trace_encode_instr(instr, rec);
+
+    if (w->flags & TRDB_TRACE_DELTA_IADDR) {
+        put_le(rec + TRACE_IADDR_AT, instr->iaddr - w->last_iaddr, XLEN / 8);
+        w->last_iaddr = instr->iaddr;
     }
 
-    free(line);
+    if (fwrite(rec, 1, sizeof(rec), w->fp) != sizeof(rec))
+        return -trdb_file_write;
+
+    w->count++;
+    return 0;
+}
+
+int trdb_trace_writer_close(struct trdb_trace_writer *w)
+{
+    if (!w)
+        return -trdb_invalid;
+
+    int status = 0;
+    if (w->fp && fflush(w->fp))
+        status = -trdb_file_write;
+
+    *w = (struct trdb_trace_writer){0};
+    return status;
+}
+
+bool trdb_is_binary_trace(const char *path)
+{
+    char magic[8];
+    if (!path)
+        return false;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    bool is = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+              !memcmp(magic, TRDB_TRACE_MAGIC, sizeof(magic));
+    fclose(fp);
+    return is;
+}
+
+int trdb_binary_to_trace(struct trdb_ctx *c, const char *path,
+                         struct tr_instr **samples, size_t *count)
+{
+    int status                 = 0;
+    struct trdb_packet_map map = {0};
+
+    if (!c || !path || !samples || !count)
+        return -trdb_invalid;
 
-    if (ferror(fp)) {
-        status = -trdb_scan_file;
+    *samples = NULL;
+    *count   = 0;
+
+    if ((status = trdb_pulp_map_packets(c, path, &map)) < 0)
+        return status;
+
+    const uint8_t *data = map.data;
+    uint32_t flags      = 0;
+    if (map.size < TRDB_TRACE_HEADER_LEN) {
+        err(c, "%s is not a binary instruction trace\n", path);
+        status = -trdb_bad_trace_file;
+        goto fail;
+    }
+    if ((status = trdb_trace_check_header(c, data, &flags)) < 0)
+        goto fail;
+    if ((map.size - TRDB_TRACE_HEADER_LEN) % TRDB_TRACE_RECORD_LEN) {
+        err(c, "truncated binary trace %s: size %zu\n", path, map.size);
+        status = -trdb_bad_trace_file;
         goto fail;
     }
 
-    *count = scnt;
+    size_t cnt = (map.size - TRDB_TRACE_HEADER_LEN) / TRDB_TRACE_RECORD_LEN;
+    *samples   = malloc((cnt ? cnt : 1) * sizeof(**samples));
+    if (!*samples) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+
+    trdb_perf_start(t);
+    addr_t last_iaddr = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        const uint8_t *rec =
+            data + TRDB_TRACE_HEADER_LEN + i * TRDB_TRACE_RECORD_LEN;
+        struct tr_instr *instr = &(*samples)[i];
+
+        trdb_trace_decode_instr(rec, instr);
+        if (flags & TRDB_TRACE_DELTA_IADDR) {
+            instr->iaddr += last_iaddr;
+            last_iaddr = instr->iaddr;
+        }
+    }
+    trdb_perf_stop(c, trdb_perf_parse, t);
+
+    *count = cnt;
+    trdb_pulp_unmap_packets(&map);
+    return 0;
 
-out:
-    if (fp)
-        fclose(fp);
-    return status;
 fail:
-    // TODO: it's maybe better to not free the whole list, but just the part
-    // where failed
-    free(sample);
-    trdb_free_instr_list(instrs);
-    goto out;
+    free(*samples);
+    *samples = NULL;
+    trdb_pulp_unmap_packets(&map);
+    return status;
 }
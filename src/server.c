@@ -0,0 +1,676 @@
+/*
+ * trdb - Trace Debugger Software for the PULP platform
+ *
+ * Copyright (C) 2024 Robert Balas
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Author: Robert Balas (balasr@student.ethz.ch)
+ * Description: Compress instructions online as they arrive over a shared
+ * memory ring or a socket, decompress packets as they arrive
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+#include "serialize.h"
+#include "trace_debugger.h"
+#include "utils.h"
+
+/* Instructions compressed at once by the servers */
+#define SERVE_CHUNK 4096
+
+/* Bytes of packets read at once by trdb_follow_fd(), which bounds the work
+ * between reading a packet and reporting its instructions
+ */
+#define FOLLOW_BUF 4096
+
+/* How long trdb_follow_fd() waits before looking for more data in a file */
+#define FOLLOW_POLL_NS 10000000
+
+/* Busy polls before a waiting side of a ring starts to sleep */
+#define RING_SPINS 64
+
+/* How long a waiting side of a ring sleeps between polls */
+#define RING_SLEEP_NS 50000
+
+#define RING_DROP 1
+
+/* The shared part of a ring, see trdb_ring_create(). The producer and the
+ * consumer each write to their own cache line only.
+ */
+struct ring_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_len;
+    uint64_t capacity;
+    uint32_t flags;
+    uint8_t pad0[36];
+    /* producer */
+    uint64_t head;
+    uint64_t dropped;
+    uint64_t stalls;
+    uint64_t closed;
+    uint8_t pad1[32];
+    /* consumer */
+    uint64_t tail;
+    uint8_t pad2[56];
+};
+
+_Static_assert(sizeof(struct ring_header) == 192, "ring header layout");
+
+struct trdb_ring {
+    struct trdb_ctx *ctx;
+    struct ring_header *hdr;
+    uint8_t *records;
+    size_t size; /* of the mapping */
+    uint64_t mask;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Wait a bit for the other side of a ring, first by spinning then sleeping */
+static void ring_backoff(unsigned *spins)
+{
+    if (*spins < RING_SPINS) {
+        (*spins)++;
+        sched_yield();
+        return;
+    }
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = RING_SLEEP_NS};
+    nanosleep(&ts, NULL);
+}
+
+static int map_ring(struct trdb_ctx *c, int fd, size_t size,
+                    struct trdb_ring **ring)
+{
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        err(c, "mmap: %s\n", strerror(errno));
+        return -trdb_file_open;
+    }
+
+    struct trdb_ring *r = malloc(sizeof(*r));
+    if (!r) {
+        munmap(map, size);
+        return -trdb_nomem;
+    }
+    r->ctx     = c;
+    r->hdr     = map;
+    r->records = (uint8_t *)map + sizeof(struct ring_header);
+    r->size    = size;
+    r->mask    = 0;
+    *ring      = r;
+    return 0;
+}
+
+int trdb_ring_create(struct trdb_ctx *c, const char *path, size_t capacity,
+                     bool drop, struct trdb_ring **ring)
+{
+    int status = 0;
+
+    if (!c || !path || !ring || capacity == 0)
+        return -trdb_invalid;
+
+    uint64_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+    size_t size = sizeof(struct ring_header) + cap * TRDB_TRACE_RECORD_LEN;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        err(c, "open %s: %s\n", path, strerror(errno));
+        return -trdb_file_open;
+    }
+    if (ftruncate(fd, size)) {
+        err(c, "ftruncate %s: %s\n", path, strerror(errno));
+        status = -trdb_file_open;
+        goto fail;
+    }
+    if ((status = map_ring(c, fd, size, ring)) < 0)
+        goto fail;
+
+    struct ring_header *h = (*ring)->hdr;
+    h->version            = TRDB_RING_VERSION;
+    h->record_len         = TRDB_TRACE_RECORD_LEN;
+    h->capacity           = cap;
+    h->flags              = drop ? RING_DROP : 0;
+    (*ring)->mask         = cap - 1;
+    /* producers only attach once the layout is complete */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, TRDB_RING_MAGIC, sizeof(h->magic));
+
+fail:
+    close(fd);
+    return status;
+}
+
+int trdb_ring_attach(struct trdb_ctx *c, const char *path,
+                     struct trdb_ring **ring)
+{
+    int status = 0;
+    struct stat st;
+
+    if (!c || !path || !ring)
+        return -trdb_invalid;
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &st)) {
+        err(c, "open %s: %s\n", path, strerror(errno));
+        status = -trdb_file_open;
+        goto fail;
+    }
+    if ((size_t)st.st_size < sizeof(struct ring_header)) {
+        err(c, "%s is not an instruction ring\n", path);
+        status = -trdb_bad_ring;
+        goto fail;
+    }
+    if ((status = map_ring(c, fd, st.st_size, ring)) < 0)
+        goto fail;
+
+    struct ring_header *h = (*ring)->hdr;
+    uint64_t cap          = h->capacity;
+    if (memcmp(h->magic, TRDB_RING_MAGIC, sizeof(h->magic)) ||
+        h->version != TRDB_RING_VERSION ||
+        h->record_len != TRDB_TRACE_RECORD_LEN || cap == 0 ||
+        (cap & (cap - 1)) ||
+        (size_t)st.st_size !=
+            sizeof(struct ring_header) + cap * TRDB_TRACE_RECORD_LEN) {
+        err(c, "unsupported instruction ring %s\n", path);
+        trdb_ring_free(*ring);
+        *ring  = NULL;
+        status = -trdb_bad_ring;
+        goto fail;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    (*ring)->mask = cap - 1;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    return status;
+}
+
+void trdb_ring_free(struct trdb_ring *ring)
+{
+    if (!ring)
+        return;
+    munmap(ring->hdr, ring->size);
+    free(ring);
+}
+
+size_t trdb_ring_push(struct trdb_ring *ring, size_t len,
+                      const struct tr_instr instrs[len])
+{
+    struct ring_header *h = ring->hdr;
+    uint64_t head         = h->head;
+    unsigned spins        = 0;
+    bool stalled          = false;
+    size_t done           = 0;
+
+    while (done < len) {
+        uint64_t tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+        uint64_t room = h->capacity - (head - tail);
+
+        if (room == 0) {
+            if (h->flags & RING_DROP) {
+                __atomic_fetch_add(&h->dropped, len - done, __ATOMIC_RELAXED);
+                break;
+            }
+            if (!stalled)
+                __atomic_fetch_add(&h->stalls, 1, __ATOMIC_RELAXED);
+            stalled = true;
+            ring_backoff(&spins);
+            continue;
+        }
+
+        size_t n = len - done < room ? len - done : room;
+        for (size_t i = 0; i < n; i++)
+            trdb_trace_encode_instr(&instrs[done + i],
+                                    ring->records + ((head + i) & ring->mask) *
+                                                        TRDB_TRACE_RECORD_LEN);
+        head += n;
+        done += n;
+        spins = 0;
+        __atomic_store_n(&h->head, head, __ATOMIC_RELEASE);
+    }
+    return done;
+}
+
+void trdb_ring_close(struct trdb_ring *ring)
+{
+    __atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+}
+
+size_t trdb_ring_pop(struct trdb_ring *ring, size_t cap,
+                     struct tr_instr instrs[cap])
+{
+    struct ring_header *h = ring->hdr;
+    uint64_t tail         = h->tail;
+    uint64_t head         = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+    size_t n = head - tail < cap ? head - tail : cap;
+    for (size_t i = 0; i < n; i++)
+        trdb_trace_decode_instr(ring->records + ((tail + i) & ring->mask) *
+                                                    TRDB_TRACE_RECORD_LEN,
+                                &instrs[i]);
+
+    __atomic_store_n(&h->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+bool trdb_ring_finished(const struct trdb_ring *ring)
+{
+    const struct ring_header *h = ring->hdr;
+
+    /* the producer advances head before closing */
+    if (!__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE))
+        return false;
+    return __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Compress a batch of @p len instructions that arrived at @p arrival. Flush
+ * the container if the server caught up with the producer.
+ */
+static int serve_batch(struct trdb_ctx *c, struct trdb_container_writer *w,
+                       size_t len, struct tr_instr *instrs, bool caught_up,
+                       uint64_t arrival, struct trdb_server_stats *stats)
+{
+    for (size_t i = 0; i < len; i++) {
+        int status = trdb_container_compress_step(c, w, &instrs[i]);
+        if (status < 0)
+            return status;
+        stats->packets += status;
+    }
+    if (caught_up && fflush(w->fp))
+        return -trdb_file_write;
+
+    uint64_t latency = now_ns() - arrival;
+    stats->instrs += len;
+    stats->batches++;
+    stats->total_latency_ns += latency;
+    if (latency > stats->max_latency_ns)
+        stats->max_latency_ns = latency;
+    return 0;
+}
+
+int trdb_serve_ring(struct trdb_ctx *c, struct trdb_ring *ring,
+                    struct trdb_container_writer *w,
+                    const volatile sig_atomic_t *stop,
+                    struct trdb_server_stats *stats)
+{
+    int status                     = 0;
+    struct trdb_server_stats local = {0};
+    uint64_t first                 = 0;
+    unsigned spins                 = 0;
+
+    if (!c || !ring || !w)
+        return -trdb_invalid;
+
+    struct tr_instr *chunk = malloc(SERVE_CHUNK * sizeof(*chunk));
+    if (!chunk)
+        return -trdb_nomem;
+
+    while (!(stop && *stop)) {
+        size_t n = trdb_ring_pop(ring, SERVE_CHUNK, chunk);
+        if (n == 0) {
+            if (trdb_ring_finished(ring))
+                break;
+            ring_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+
+        uint64_t arrival = now_ns();
+        if (!first)
+            first = arrival;
+        status = serve_batch(c, w, n, chunk, n < SERVE_CHUNK, arrival, &local);
+        if (status < 0)
+            break;
+    }
+
+    local.bytes   = w->offset;
+    local.dropped = __atomic_load_n(&ring->hdr->dropped, __ATOMIC_RELAXED);
+    local.stalls  = __atomic_load_n(&ring->hdr->stalls, __ATOMIC_RELAXED);
+    if (first)
+        local.elapsed_ns = now_ns() - first;
+    if (stats)
+        *stats = local;
+    free(chunk);
+    return status;
+}
+
+/* Read exactly @p len bytes unless the stream ends, return how many were read
+ * or a negative error code
+ */
+static ssize_t read_full(struct trdb_ctx *c, int fd, uint8_t *buf, size_t len,
+                         const volatile sig_atomic_t *stop)
+{
+    size_t have = 0;
+    while (have < len && !(stop && *stop)) {
+        ssize_t r = read(fd, buf + have, len - have);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            err(c, "read: %s\n", strerror(errno));
+            return -trdb_file_read;
+        }
+        if (r == 0)
+            break;
+        have += r;
+    }
+    return have;
+}
+
+int trdb_serve_fd(struct trdb_ctx *c, int fd, struct trdb_container_writer *w,
+                  const volatile sig_atomic_t *stop,
+                  struct trdb_server_stats *stats)
+{
+    int status                            = 0;
+    struct trdb_server_stats local        = {0};
+    uint8_t header[TRDB_TRACE_HEADER_LEN] = {0};
+    uint32_t flags                        = 0;
+    addr_t last_iaddr                     = 0;
+    uint64_t first                        = 0;
+    size_t have                           = 0;
+    size_t cap                            = SERVE_CHUNK * TRDB_TRACE_RECORD_LEN;
+    uint8_t *buf                          = NULL;
+    struct tr_instr *chunk                = NULL;
+
+    if (!c || fd < 0 || !w)
+        return -trdb_invalid;
+
+    ssize_t r = read_full(c, fd, header, sizeof(header), stop);
+    if (r < 0)
+        return r;
+    /* nothing sent at all is an empty trace */
+    if (r == 0)
+        goto out;
+    if (r != sizeof(header)) {
+        err(c, "stream ended in the binary trace header\n");
+        return -trdb_bad_trace_file;
+    }
+    if ((status = trdb_trace_check_header(c, header, &flags)) < 0)
+        return status;
+
+    buf   = malloc(cap);
+    chunk = malloc(SERVE_CHUNK * sizeof(*chunk));
+    if (!buf || !chunk) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+
+    while (!(stop && *stop)) {
+        r = read(fd, buf + have, cap - have);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            err(c, "read: %s\n", strerror(errno));
+            status = -trdb_file_read;
+            goto fail;
+        }
+        if (r == 0) {
+            if (have) {
+                err(c, "stream ended in the middle of a record\n");
+                status = -trdb_bad_trace_file;
+            }
+            break;
+        }
+
+        uint64_t arrival = now_ns();
+        if (!first)
+            first = arrival;
+        /* a short read means nothing more is pending right now */
+        bool caught_up = have + r < cap;
+        have += r;
+
+        size_t n = have / TRDB_TRACE_RECORD_LEN;
+        for (size_t i = 0; i < n; i++) {
+            trdb_trace_decode_instr(buf + i * TRDB_TRACE_RECORD_LEN,
+                                    &chunk[i]);
+            if (flags & TRDB_TRACE_DELTA_IADDR) {
+                chunk[i].iaddr += last_iaddr;
+                last_iaddr = chunk[i].iaddr;
+            }
+        }
+        have -= n * TRDB_TRACE_RECORD_LEN;
+        memmove(buf, buf + n * TRDB_TRACE_RECORD_LEN, have);
+
+        status = serve_batch(c, w, n, chunk, caught_up, arrival, &local);
+        if (status < 0)
+            goto fail;
+    }
+
+out:
+    local.bytes = w->offset;
+    if (first)
+        local.elapsed_ns = now_ns() - first;
+    if (stats)
+        *stats = local;
+fail:
+    free(buf);
+    free(chunk);
+    return status;
+}
+
+/* trdb_follow_fd() counts the instructions it passes on */
+struct follow_output {
+    int (*instr_fn)(struct trdb_ctx *c, const struct tr_instr *instr,
+                    void *data);
+    void *data;
+    uint64_t instrs;
+};
+
+static int follow_instr(struct trdb_ctx *c, const struct tr_instr *instr,
+                        void *data)
+{
+    struct follow_output *out = data;
+    out->instrs++;
+    return out->instr_fn(c, instr, out->data);
+}
+
+int trdb_follow_fd(struct trdb_ctx *c, int fd, bool tail, FILE *flush_fp,
+                   const volatile sig_atomic_t *stop,
+                   int (*instr_fn)(struct trdb_ctx *c,
+                                   const struct tr_instr *instr, void *data),
+                   void *data, struct trdb_follow_stats *stats)
+{
+    struct stat st;
+    int status                     = 0;
+    struct trdb_follow_stats local = {0};
+    struct follow_output out       = {.instr_fn = instr_fn, .data = data};
+    struct tr_packet packet        = {0};
+    size_t have                    = 0;
+
+    if (!c || fd < 0 || !instr_fn)
+        return -trdb_invalid;
+
+    uint8_t *buf = malloc(FOLLOW_BUF);
+    if (!buf)
+        return -trdb_nomem;
+
+    bool regular = !fstat(fd, &st) && S_ISREG(st.st_mode);
+
+    while (!(stop && *stop)) {
+        ssize_t r = read(fd, buf + have, FOLLOW_BUF - have);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            err(c, "read: %s\n", strerror(errno));
+            status = -trdb_file_read;
+            break;
+        }
+        /* caught up with the input */
+        if (r == 0) {
+            if (!tail || !regular)
+                break;
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = FOLLOW_POLL_NS};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        uint64_t arrival = now_ns();
+        have += r;
+        local.bytes += r;
+
+        /* hand out each complete packet right away */
+        struct trdb_packet_map map = {.data = buf, .size = have};
+        size_t offset              = 0;
+        while (offset < have &&
+               (buf[offset] & MASK_FROM(PULPPKTLEN)) + 1 <= have - offset) {
+            status = trdb_pulp_next_mapped_packet(c, &map, &offset, &packet);
+            if (status < 0)
+                goto fail;
+            status = trdb_decompress_packet(c, &packet, follow_instr, &out);
+            if (status < 0)
+                goto fail;
+
+            uint64_t latency = now_ns() - arrival;
+            local.packets++;
+            local.total_latency_ns += latency;
+            if (latency > local.max_latency_ns)
+                local.max_latency_ns = latency;
+        }
+        have -= offset;
+        memmove(buf, buf + offset, have);
+
+        if (flush_fp)
+            fflush(flush_fp);
+    }
+    if (have)
+        info(c, "ignoring %zu bytes of an incomplete packet\n", have);
+
+fail:
+    local.instrs = out.instrs;
+    if (stats)
+        *stats = local;
+    free(buf);
+    return status;
+}
+
+static int listen_unix(struct trdb_ctx *c, const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        err(c, "socket path too long: %s\n", path);
+        return -trdb_invalid;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fd, 1)) {
+        err(c, "listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -trdb_socket;
+    }
+    return fd;
+}
+
+static int listen_tcp(struct trdb_ctx *c, const char *address)
+{
+    struct addrinfo hints = {.ai_family   = AF_UNSPEC,
+                             .ai_socktype = SOCK_STREAM,
+                             .ai_flags    = AI_PASSIVE};
+    struct addrinfo *res  = NULL;
+    char *host            = strdup(address);
+    int fd                = -trdb_socket;
+
+    if (!host)
+        return -trdb_nomem;
+
+    /* [HOST:]PORT, the host may contain colons itself */
+    char *port = strrchr(host, ':');
+    if (port)
+        *port++ = '\0';
+    else
+        port = host;
+    const char *node = port == host || !*host ? NULL : host;
+
+    int gai = getaddrinfo(node, port, &hints, &res);
+    if (gai) {
+        err(c, "getaddrinfo %s: %s\n", address, gai_strerror(gai));
+        free(host);
+        return -trdb_invalid;
+    }
+
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        int one = 1;
+        int s   = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s < 0)
+            continue;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!bind(s, ai->ai_addr, ai->ai_addrlen) && !listen(s, 1)) {
+            fd = s;
+            break;
+        }
+        close(s);
+    }
+    if (fd < 0)
+        err(c, "listen on %s: %s\n", address, strerror(errno));
+
+    freeaddrinfo(res);
+    free(host);
+    return fd;
+}
+
+int trdb_serve_accept(struct trdb_ctx *c, const char *address, int *fd)
+{
+    int lfd = -trdb_invalid;
+
+    if (!c || !address || !fd)
+        return -trdb_invalid;
+
+    if (!strncmp(address, "unix:", 5))
+        lfd = listen_unix(c, address + 5);
+    else if (!strncmp(address, "tcp:", 4))
+        lfd = listen_tcp(c, address + 4);
+    else
+        err(c, "unknown address %s\n", address);
+    if (lfd < 0)
+        return lfd;
+
+    info(c, "waiting for a connection on %s\n", address);
+    *fd = accept(lfd, NULL, NULL);
+    close(lfd);
+    if (*fd < 0) {
+        err(c, "accept on %s: %s\n", address, strerror(errno));
+        return -trdb_socket;
+    }
+    return 0;
+}
@@ -35,6 +35,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <sys/queue.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "trace_debugger.h"
 #include "trdb_private.h"
 #include "disassembly.h"
@@ -57,10 +59,14 @@ struct trdb_config {
     /* addressing mode */
     bool arch64;
 
+    /* emit a sync packet after that many instructions or packets, UINT64_MAX
+     * disables periodic resynchronization
+     */
+    uint64_t resync_max;
+    uint64_t resync_packets_max;
     /* TODO: Unused, inspect iaddress-lsb-p, implicit-except,
      * set-trace
      */
-    uint64_t resync_max;
     /* bool iaddress_lsb_p; */
     /* bool implicit_except; */
     /* bool set_trace; */
@@ -78,10 +84,20 @@ struct trdb_config {
     bool use_pulp_sext;
     /* Don't regard ret's as unpredictable discontinuity */
     bool implicit_ret;
+    /* entries of the return address stack, see trdb_set_ras_depth() */
+    uint32_t ras_depth;
+    /* the compression follows the return address stack of the decompression
+     * and sync packets empty it, see trdb_set_ras_tracking()
+     */
+    bool ras_tracking;
     /* Use additional packets to jump over vector table, a hack for PULP */
     bool pulp_vector_table_packet;
     /* whether we compress full branch maps */
     bool compress_full_branch_map;
+    /* remember decoded instructions instead of calling libopcodes each time */
+    bool decode_cache;
+    /* classify instructions ourselves when no disassembly text is needed */
+    bool native_decode;
 };
 
 /* Records the state of the CPU. The compression routine looks at a sequence of
@@ -130,19 +146,45 @@ struct filter_state {
     bool trace_privilege;
     uint32_t privilege;
 
-    /* TODO: look at those variables */
+    /* instructions and packets since the last sync packet */
     uint64_t resync_cnt;
+    uint64_t resync_packet_cnt;
+    /* a sync packet is due */
     bool resync_pend;
-    /* uint32_t resync_nh = 0;  */
+    /* the last cycle emitted a packet, so a sync packet emitted now doesn't
+     * skip over untraced instructions
+     */
+    bool flushed;
+};
+
+/* Return address stack with the capacity of the hardware one. A push onto a
+ * full stack overwrites the oldest entry, so nothing is allocated and copying
+ * it is all there is to a snapshot.
+ */
+struct trdb_stack {
+    addr_t addrs[TRDB_RAS_MAX];
+    uint32_t top; /* index of the next push */
+    uint32_t len; /* number of valid entries */
 };
 
+/* The cpu state of the last, this and the next cycle are kept in a ring so
+ * that advancing a cycle only moves the index cur, which points to the last
+ * cycle.
+ */
 struct trdb_compress {
-    struct trdb_state lastc;
-    struct trdb_state thisc;
-    struct trdb_state nextc;
+    struct trdb_state states[3];
+    unsigned cur;
     struct branch_map_state branch_map;
     struct filter_state filter;
     addr_t last_iaddr; /* TODO: make this work with 64 bit */
+    /* return address stack of the decompression before the instruction of
+     * lastc, which is only applied once the next step comes along if
+     * ras_pend is set. That way a snapshot after a sync packet holds the
+     * stack the decompression needs to start at it. Only kept with
+     * implicit_ret.
+     */
+    struct trdb_stack ras;
+    bool ras_pend;
 };
 
 /* Current state of the cpu during decompression. Allows one to precisely emit a
@@ -155,18 +197,111 @@ struct trdb_compress {
  * figure out in which loop number we got interrupted
  */
 
-/* stack vector for return addresses */
-kvec_nt(trdb_stack, addr_t);
-
 struct trdb_decompress {
     /* TODO: hw loop addresses handling*/
     /* TODO: nested interrupt stacks for each privilege mode*/
     struct trdb_stack call_stack;
+    /* call_stack misses the entries from before the first packet, see
+     * trdb_decompress_trace_parallel()
+     */
+    bool partial_stack;
+    uint32_t underflows; /* pops that found call_stack empty */
     /* record current privilege level */
     uint32_t privilege : PRIVLEN;
     /* needed for address compression */
     addr_t last_packet_addr;
     struct branch_map_state branch_map;
+    /* where we are between trdb_decompress_packet() calls, abfd is NULL if
+     * there is no open decompression
+     */
+    bfd *abfd;
+    asection *section;
+    struct trdb_section_table *sections; /* where section is from */
+    struct trdb_code_section *code;      /* the loaded section */
+    bfd_vma stop_offset;
+    bfd_vma pc;
+    struct disassembler_unit dunit;
+    struct disassemble_info dinfo;
+    /* block level decompression, see trdb_decompress_packet_blocks() */
+    const struct trdb_cfg *cfg;
+    const struct trdb_block *block; /* visit in progress or NULL */
+    size_t block_instrs;            /* instructions of it executed so far */
+    bfd_vma block_next;             /* address continuing the visit */
+    int (*block_fn)(struct trdb_ctx *c, const struct trdb_block *block,
+                    size_t instrs, void *data);
+    void *block_data;
+};
+
+/* Everything the decompression loop needs to know about an instruction. This is
+ * what we memoize in the decode cache so that reconstructing a trace becomes a
+ * table walk instead of calling libopcodes for each instruction.
+ */
+struct trdb_decoded {
+    insn_t instr;
+    addr_t target;     /* jump target if known, else zero */
+    uint8_t size;      /* instruction length in bytes, zero if not decoded */
+    uint8_t insn_type; /* enum dis_insn_type */
+    uint8_t ras;       /* enum trdb_ras */
+    uint8_t run;       /* instructions from here on that just fall through */
+};
+
+/* Decoded instructions of a single section, indexed by (pc - vma) >> 1 since
+ * instructions are at least two byte aligned.
+ */
+struct trdb_section_cache {
+    asection *section;
+    bfd_vma vma;
+    size_t len;
+    struct trdb_decoded *entries;
+};
+
+kvec_nt(trdb_section_caches, struct trdb_section_cache);
+
+/* Per-ELF decode cache. The entries are filled lazily as we encounter the
+ * instructions during decompression.
+ */
+struct trdb_decode_cache {
+    bfd *abfd;
+    struct trdb_section_caches sections;
+};
+
+/* A code section of the ELF whose contents we loaded */
+struct trdb_code_section {
+    asection *section;
+    bfd_vma vma;
+    bfd_size_type size;
+    bfd_byte *data;
+    /* every halfword decoded ahead of time, only in a trdb_image */
+    struct trdb_decoded *decoded;
+};
+
+/* Per-ELF table of all code sections sorted by vma. They are loaded once, so
+ * that switching sections during decompression (e.g. between .text and
+ * .vectors on every interrupt) is a binary search instead of a reload.
+ */
+struct trdb_section_table {
+    bfd *abfd;
+    size_t len;
+    struct trdb_code_section *sections;
+};
+
+/* Everything decompression needs to know about an ELF, see trdb_image_new().
+ * Apart from the lock nothing changes after creation.
+ */
+struct trdb_image {
+    bfd *abfd;
+    struct trdb_section_table sections;
+    struct trdb_disasm_aux symbols;
+    /* serializes falling back to libopcodes among the contexts */
+    pthread_mutex_t lock;
+};
+
+/* Basic blocks of a trdb_image, see trdb_cfg_new() */
+struct trdb_cfg {
+    const struct trdb_image *image;
+    size_t len;
+    struct trdb_block *blocks;
+    size_t hidden; /* block starts inside other instructions */
 };
 
 /* struct to record statistics about compression and decompression of traces */
@@ -203,10 +338,26 @@ struct trdb_ctx {
     struct disassembler_unit *dunit;
     /* compression statistics */
     struct trdb_stats stats;
+    /* hot path timings and counters, see trdb_get_perf_stats() */
+    struct trdb_perf_stats perf;
     /* desired logging level and custom logging hook*/
     int log_priority;
     void (*log_fn)(struct trdb_ctx *ctx, int priority, const char *file,
                    int line, const char *fn, const char *format, va_list args);
+    /* structured events for tooling, see trdb_set_event_fn() */
+    void (*event_fn)(struct trdb_ctx *ctx, const struct trdb_event *event,
+                     void *data);
+    void *event_data;
+    /* memoized instruction decoding, see trdb_set_decode_cache() */
+    struct trdb_decode_cache *dcache;
+    /* loaded code sections, kept across decompression runs on the same bfd */
+    struct trdb_section_table *stable;
+    /* shared code sections and symbols, see trdb_set_image() */
+    struct trdb_image *image;
+    /* serializes bfd and libopcodes access if we share abfd among threads */
+    pthread_mutex_t *bfd_lock;
+    /* serializes log_fn and event_fn if several threads call them */
+    pthread_mutex_t *hook_lock;
 };
 
 void trdb_log(struct trdb_ctx *ctx, int priority, const char *file, int line,
@@ -215,7 +366,11 @@ void trdb_log(struct trdb_ctx *ctx, int priority, const char *file, int line,
     va_list args;
 
     va_start(args, format);
+    if (ctx->hook_lock)
+        pthread_mutex_lock(ctx->hook_lock);
     ctx->log_fn(ctx, priority, file, line, fn, format, args);
+    if (ctx->hook_lock)
+        pthread_mutex_unlock(ctx->hook_lock);
     va_end(args);
 }
 
@@ -241,6 +396,9 @@ static void log_stdout_quiet(struct trdb_ctx *ctx, int priority,
     vfprintf(stdout, format, args);
 }
 
+static void free_decode_cache(struct trdb_decode_cache *dcache);
+static void free_section_table(struct trdb_section_table *stable);
+
 static int log_priority(const char *priority)
 {
     char *endptr;
@@ -261,30 +419,41 @@ static int log_priority(const char *priority)
 void trdb_reset_compression(struct trdb_ctx *ctx)
 {
     ctx->config = (struct trdb_config){.resync_max               = UINT64_MAX,
+                                       .resync_packets_max       = UINT64_MAX,
                                        .full_address             = true,
                                        .pulp_vector_table_packet = true,
-                                       .full_statistics          = true};
+                                       .full_statistics          = true,
+                                       .native_decode            = true};
+    ctx->config.ras_depth = TRDB_RAS_MAX;
 
-    ctx->cmp->lastc      = (struct trdb_state){.privilege = 7};
-    ctx->cmp->thisc      = (struct trdb_state){.privilege = 7};
-    ctx->cmp->nextc      = (struct trdb_state){.privilege = 7};
+    for (size_t i = 0; i < 3; i++)
+        ctx->cmp->states[i] = (struct trdb_state){.privilege = 7};
+    ctx->cmp->cur        = 0;
     ctx->cmp->branch_map = (struct branch_map_state){0};
     ctx->cmp->filter     = (struct filter_state){0};
     ctx->cmp->last_iaddr = 0;
+    ctx->cmp->ras        = (struct trdb_stack){0};
+    ctx->cmp->ras_pend   = false;
     ctx->stats           = (struct trdb_stats){0};
+
+    /* the decode cache is disabled again */
+    free_decode_cache(ctx->dcache);
+    ctx->dcache = NULL;
 }
 
 void trdb_reset_decompression(struct trdb_ctx *ctx)
 {
     ctx->config = (struct trdb_config){.resync_max               = UINT64_MAX,
+                                       .resync_packets_max       = UINT64_MAX,
                                        .full_address             = true,
                                        .pulp_vector_table_packet = true,
-                                       .full_statistics          = true};
+                                       .full_statistics          = true,
+                                       .native_decode            = true};
+    ctx->config.ras_depth = TRDB_RAS_MAX;
 
-    *ctx->dec            = (struct trdb_decompress){0};
-    ctx->dec->branch_map = (struct branch_map_state){0};
-    kv_destroy(ctx->dec->call_stack);
-    kv_init(ctx->dec->call_stack);
+    trdb_decompress_close(ctx);
+    *ctx->dec                  = (struct trdb_decompress){0};
+    ctx->dec->branch_map       = (struct branch_map_state){0};
     ctx->dec->privilege        = 7;
     ctx->dec->last_packet_addr = 0;
 
@@ -293,6 +462,281 @@ void trdb_reset_decompression(struct trdb_ctx *ctx)
     ctx->stats = (struct trdb_stats){0};
 }
 
+/* Cursor over a state snapshot, see trdb_save_state(). Writes past the end are
+ * only counted, reads past it set bad.
+ */
+struct state_buf {
+    uint8_t *data;
+    const uint8_t *in;
+    size_t size;
+    size_t pos;
+    bool bad;
+};
+
+static void state_put(struct state_buf *b, uint64_t v, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; i++, b->pos++) {
+        if (b->pos < b->size)
+            b->data[b->pos] = v >> (8 * i);
+    }
+}
+
+static uint64_t state_get(struct state_buf *b, unsigned bytes)
+{
+    uint64_t v = 0;
+    if (b->size - b->pos < bytes) {
+        b->bad = true;
+        return 0;
+    }
+    for (unsigned i = 0; i < bytes; i++)
+        v |= (uint64_t)b->in[b->pos++] << (8 * i);
+    return v;
+}
+
+static void save_branch_map(struct state_buf *b,
+                            const struct branch_map_state *map)
+{
+    state_put(b, map->bits, 4);
+    state_put(b, map->cnt, 1);
+    state_put(b, map->full, 1);
+}
+
+static void restore_branch_map(struct state_buf *b,
+                               struct branch_map_state *map)
+{
+    map->bits = state_get(b, 4);
+    map->cnt  = state_get(b, 1);
+    map->full = state_get(b, 1);
+    if (map->cnt > 31)
+        b->bad = true;
+}
+
+static void save_cycle(struct state_buf *b, const struct trdb_state *st)
+{
+    const struct tr_instr *instr = &st->instr;
+    state_put(b,
+              st->halt | st->unhalted << 1 | st->context_change << 2 |
+                  st->qualified << 3 | st->unqualified << 4 |
+                  st->exception << 5 | st->unpred_disc << 6 |
+                  st->emitted_exception_sync << 7 |
+                  st->privilege_change << 8,
+              2);
+    state_put(b, st->privilege, 1);
+    state_put(b,
+              instr->valid | instr->exception << 1 | instr->interrupt << 2 |
+                  instr->compressed << 3,
+              1);
+    state_put(b, instr->cause, 4);
+    state_put(b, instr->tval, 8);
+    state_put(b, instr->priv, 1);
+    state_put(b, instr->iaddr, 8);
+    state_put(b, instr->instr, 8);
+}
+
+static void restore_cycle(struct state_buf *b, struct trdb_state *st)
+{
+    struct tr_instr *instr = &st->instr;
+    uint64_t flags         = state_get(b, 2);
+
+    st->halt                   = flags & 1;
+    st->unhalted               = flags >> 1 & 1;
+    st->context_change         = flags >> 2 & 1;
+    st->qualified              = flags >> 3 & 1;
+    st->unqualified            = flags >> 4 & 1;
+    st->exception              = flags >> 5 & 1;
+    st->unpred_disc            = flags >> 6 & 1;
+    st->emitted_exception_sync = flags >> 7 & 1;
+    st->privilege_change       = flags >> 8 & 1;
+    st->privilege              = state_get(b, 1);
+
+    flags             = state_get(b, 1);
+    instr->valid      = flags & 1;
+    instr->exception  = flags >> 1 & 1;
+    instr->interrupt  = flags >> 2 & 1;
+    instr->compressed = flags >> 3 & 1;
+    instr->cause      = state_get(b, 4);
+    instr->tval       = state_get(b, 8);
+    instr->priv       = state_get(b, 1);
+    instr->iaddr      = state_get(b, 8);
+    instr->instr      = state_get(b, 8);
+}
+
+/* size of a snapshot without the return addresses: the header, three cycles,
+ * the rest of the compression and the rest of the decompression
+ */
+#define STATE_FIXED_LEN (16 + 3 * 33 + 37 + 27)
+static_assert(STATE_FIXED_LEN + 2 * 8 * TRDB_RAS_MAX <= TRDB_STATE_MAX,
+              "TRDB_STATE_MAX too small");
+
+/* only the used entries of a return address stack, from the oldest one on */
+static void save_stack(struct state_buf *b, const struct trdb_stack *ras,
+                       uint32_t depth)
+{
+    state_put(b, ras->len, 4);
+    for (uint32_t i = 0; i < ras->len; i++)
+        state_put(b, ras->addrs[(ras->top + depth - ras->len + i) % depth], 8);
+}
+
+static void restore_stack(struct state_buf *b, struct trdb_stack *ras,
+                          uint32_t depth)
+{
+    ras->len = state_get(b, 4);
+    if (ras->len > depth) {
+        b->bad = true;
+        return;
+    }
+    for (uint32_t i = 0; i < ras->len; i++)
+        ras->addrs[i] = state_get(b, 8);
+    ras->top = ras->len % depth;
+}
+
+static void save_state(struct trdb_ctx *ctx, struct state_buf *b)
+{
+    struct trdb_compress *cmp   = ctx->cmp;
+    struct trdb_decompress *dec = ctx->dec;
+    struct filter_state *filter = &cmp->filter;
+
+    for (unsigned i = 0; i < 8; i++)
+        state_put(b, TRDB_STATE_MAGIC[i], 1);
+    state_put(b, TRDB_STATE_VERSION, 4);
+    state_put(b, XLEN, 4);
+
+    /* compression, the cycles starting with the last one */
+    for (unsigned i = 0; i < 3; i++)
+        save_cycle(b, &cmp->states[(cmp->cur + i) % 3]);
+    save_branch_map(b, &cmp->branch_map);
+    state_put(b,
+              filter->enable_timestamps | filter->trace_privilege << 1 |
+                  filter->resync_pend << 2 | filter->flushed << 3,
+              1);
+    state_put(b, filter->privilege, 1);
+    state_put(b, filter->resync_cnt, 8);
+    state_put(b, filter->resync_packet_cnt, 8);
+    state_put(b, cmp->last_iaddr, 8);
+    state_put(b, cmp->ras_pend, 1);
+    save_stack(b, &cmp->ras, ctx->config.ras_depth);
+
+    /* decompression */
+    state_put(b, dec->pc, 8);
+    state_put(b, dec->privilege, 1);
+    state_put(b, dec->last_packet_addr, 8);
+    save_branch_map(b, &dec->branch_map);
+    save_stack(b, &dec->call_stack, ctx->config.ras_depth);
+}
+
+int trdb_save_state(struct trdb_ctx *ctx, uint8_t *buf, size_t size,
+                    size_t *len)
+{
+    if (!ctx || !len)
+        return -trdb_invalid;
+
+    struct state_buf b = {.data = buf, .size = buf ? size : 0};
+    save_state(ctx, &b);
+
+    *len = b.pos;
+    return b.pos <= b.size ? 0 : -trdb_invalid;
+}
+
+/* the parts of the decompression a snapshot holds */
+struct saved_decompress {
+    addr_t pc;
+    uint32_t privilege;
+    addr_t last_packet_addr;
+    struct branch_map_state branch_map;
+    struct trdb_stack call_stack;
+};
+
+static int load_state(struct trdb_ctx *ctx, const uint8_t *buf, size_t len,
+                      struct trdb_compress *cmp, struct saved_decompress *dec)
+{
+    struct state_buf b         = {.in = buf, .size = len};
+    struct filter_state filter = {0};
+    uint32_t depth             = ctx->config.ras_depth;
+
+    if (len < 16 || memcmp(buf, TRDB_STATE_MAGIC, 8))
+        goto bad;
+    b.pos = 8;
+    if (state_get(&b, 4) != TRDB_STATE_VERSION || state_get(&b, 4) != XLEN)
+        goto bad;
+
+    cmp->cur = 0;
+    for (unsigned i = 0; i < 3; i++)
+        restore_cycle(&b, &cmp->states[i]);
+    restore_branch_map(&b, &cmp->branch_map);
+
+    uint64_t flags           = state_get(&b, 1);
+    filter.enable_timestamps = flags & 1;
+    filter.trace_privilege   = flags >> 1 & 1;
+    filter.resync_pend       = flags >> 2 & 1;
+    filter.flushed           = flags >> 3 & 1;
+    filter.privilege         = state_get(&b, 1);
+    filter.resync_cnt        = state_get(&b, 8);
+    filter.resync_packet_cnt = state_get(&b, 8);
+
+    cmp->filter     = filter;
+    cmp->last_iaddr = state_get(&b, 8);
+    cmp->ras_pend   = state_get(&b, 1);
+    restore_stack(&b, &cmp->ras, depth);
+
+    dec->pc               = state_get(&b, 8);
+    dec->privilege        = state_get(&b, 1);
+    dec->last_packet_addr = state_get(&b, 8);
+    restore_branch_map(&b, &dec->branch_map);
+    restore_stack(&b, &dec->call_stack, depth);
+    if (b.bad || b.pos != len)
+        goto bad;
+    return 0;
+
+bad:
+    err(ctx, "bad state snapshot\n");
+    return -trdb_bad_state;
+}
+
+int trdb_restore_state(struct trdb_ctx *ctx, const uint8_t *buf, size_t len)
+{
+    if (!ctx || !buf)
+        return -trdb_invalid;
+
+    struct trdb_compress cmp    = {0};
+    struct saved_decompress dec = {0};
+    int status                  = load_state(ctx, buf, len, &cmp, &dec);
+    if (status < 0)
+        return status;
+
+    *ctx->cmp                  = cmp;
+    ctx->dec->pc               = dec.pc;
+    ctx->dec->privilege        = dec.privilege;
+    ctx->dec->last_packet_addr = dec.last_packet_addr;
+    ctx->dec->branch_map       = dec.branch_map;
+    ctx->dec->call_stack       = dec.call_stack;
+    ctx->dec->partial_stack    = false;
+    return 0;
+}
+
+int trdb_restore_sync_state(struct trdb_ctx *ctx, const uint8_t *buf,
+                            size_t len)
+{
+    if (!ctx || !buf)
+        return -trdb_invalid;
+
+    struct trdb_compress cmp    = {0};
+    struct saved_decompress dec = {0};
+    int status                  = load_state(ctx, buf, len, &cmp, &dec);
+    if (status < 0)
+        return status;
+
+    /* the sync packet sets the rest */
+    ctx->dec->branch_map    = (struct branch_map_state){0};
+    ctx->dec->call_stack    = cmp.ras;
+    ctx->dec->partial_stack = false;
+    return 0;
+}
+
+void trdb_decompress_partial_stack(struct trdb_ctx *ctx)
+{
+    ctx->dec->partial_stack = true;
+}
+
 struct trdb_ctx *trdb_new()
 {
     const char *env;
@@ -313,20 +757,22 @@ struct trdb_ctx *trdb_new()
     }
 
     ctx->config = (struct trdb_config){.resync_max               = UINT64_MAX,
+                                       .resync_packets_max       = UINT64_MAX,
                                        .full_address             = true,
                                        .pulp_vector_table_packet = true,
-                                       .full_statistics          = true};
-
-    *ctx->cmp            = (struct trdb_compress){0};
-    ctx->cmp->lastc      = (struct trdb_state){.privilege = 7};
-    ctx->cmp->thisc      = (struct trdb_state){.privilege = 7};
-    ctx->cmp->nextc      = (struct trdb_state){.privilege = 7};
+                                       .full_statistics          = true,
+                                       .native_decode            = true};
+    ctx->config.ras_depth = TRDB_RAS_MAX;
+
+    *ctx->cmp = (struct trdb_compress){0};
+    for (size_t i = 0; i < 3; i++)
+        ctx->cmp->states[i] = (struct trdb_state){.privilege = 7};
+    ctx->cmp->cur        = 0;
     ctx->cmp->branch_map = (struct branch_map_state){0};
     ctx->cmp->filter     = (struct filter_state){0};
     ctx->cmp->last_iaddr = 0;
 
     *ctx->dec = (struct trdb_decompress){0};
-    kv_init(ctx->dec->call_stack);
 
     *ctx->dis_instr = (struct tr_instr){0};
 
@@ -354,8 +800,7 @@ void trdb_free(struct trdb_ctx *ctx)
 
     free(ctx->dis_instr);
     free(ctx->cmp);
-    if (ctx->dec)
-        kv_destroy(ctx->dec->call_stack);
+    trdb_decompress_close(ctx);
     free(ctx->dec);
     free(ctx);
 }
@@ -369,6 +814,32 @@ void trdb_set_log_fn(struct trdb_ctx *ctx,
     info(ctx, "custom logging function %p registered\n", log_fn);
 }
 
+void trdb_set_event_fn(struct trdb_ctx *ctx,
+                       void (*event_fn)(struct trdb_ctx *ctx,
+                                        const struct trdb_event *event,
+                                        void *data),
+                       void *data)
+{
+    ctx->event_fn   = event_fn;
+    ctx->event_data = data;
+}
+
+/* Report an event if someone listens, this is all the cost when no one does */
+static inline void fire_event(struct trdb_ctx *c, enum trdb_event_kind kind,
+                              const struct tr_packet *packet,
+                              const struct tr_instr *instr)
+{
+    if (__builtin_expect(c->event_fn != NULL, 0)) {
+        struct trdb_event event = {
+            .kind = kind, .packet = packet, .instr = instr};
+        if (c->hook_lock)
+            pthread_mutex_lock(c->hook_lock);
+        c->event_fn(c, &event, c->event_data);
+        if (c->hook_lock)
+            pthread_mutex_unlock(c->hook_lock);
+    }
+}
+
 int trdb_get_log_priority(struct trdb_ctx *ctx)
 {
     return ctx->log_priority;
@@ -409,6 +880,34 @@ bool trdb_get_implicit_ret(struct trdb_ctx *ctx)
     return ctx->config.implicit_ret;
 }
 
+void trdb_set_ras_depth(struct trdb_ctx *ctx, uint32_t depth)
+{
+    if (depth < 1)
+        depth = 1;
+    if (depth > TRDB_RAS_MAX)
+        depth = TRDB_RAS_MAX;
+    ctx->config.ras_depth    = depth;
+    ctx->cmp->ras.top        = 0;
+    ctx->cmp->ras.len        = 0;
+    ctx->dec->call_stack.top = 0;
+    ctx->dec->call_stack.len = 0;
+}
+
+uint32_t trdb_get_ras_depth(struct trdb_ctx *ctx)
+{
+    return ctx->config.ras_depth;
+}
+
+void trdb_set_ras_tracking(struct trdb_ctx *ctx, bool ras_tracking)
+{
+    ctx->config.ras_tracking = ras_tracking;
+}
+
+bool trdb_get_ras_tracking(struct trdb_ctx *ctx)
+{
+    return ctx->config.ras_tracking;
+}
+
 void trdb_set_pulp_extra_packet(struct trdb_ctx *ctx, bool extra_packet)
 {
     ctx->config.pulp_vector_table_packet = extra_packet;
@@ -430,6 +929,62 @@ bool trdb_get_compress_branch_map(struct trdb_ctx *ctx)
     return ctx->config.compress_full_branch_map;
 }
 
+void trdb_set_decode_cache(struct trdb_ctx *ctx, bool enable)
+{
+    ctx->config.decode_cache = enable;
+    if (!enable) {
+        free_decode_cache(ctx->dcache);
+        ctx->dcache = NULL;
+    }
+}
+
+bool trdb_get_decode_cache(struct trdb_ctx *ctx)
+{
+    return ctx->config.decode_cache;
+}
+
+void trdb_set_image(struct trdb_ctx *ctx, struct trdb_image *image)
+{
+    ctx->image = image;
+}
+
+struct trdb_image *trdb_get_image(struct trdb_ctx *ctx)
+{
+    return ctx->image;
+}
+
+void trdb_set_native_decode(struct trdb_ctx *ctx, bool enable)
+{
+    ctx->config.native_decode = enable;
+}
+
+bool trdb_get_native_decode(struct trdb_ctx *ctx)
+{
+    return ctx->config.native_decode;
+}
+
+void trdb_set_resync_interval(struct trdb_ctx *ctx, uint64_t instrs)
+{
+    ctx->config.resync_max = instrs ? instrs : UINT64_MAX;
+}
+
+uint64_t trdb_get_resync_interval(struct trdb_ctx *ctx)
+{
+    return ctx->config.resync_max == UINT64_MAX ? 0 : ctx->config.resync_max;
+}
+
+void trdb_set_resync_packet_interval(struct trdb_ctx *ctx, uint64_t packets)
+{
+    ctx->config.resync_packets_max = packets ? packets : UINT64_MAX;
+}
+
+uint64_t trdb_get_resync_packet_interval(struct trdb_ctx *ctx)
+{
+    return ctx->config.resync_packets_max == UINT64_MAX
+               ? 0
+               : ctx->config.resync_packets_max;
+}
+
 size_t trdb_get_payloadbits(struct trdb_ctx *ctx)
 {
     return ctx->stats.payloadbits;
@@ -469,6 +1024,66 @@ void trdb_get_packet_stats(struct trdb_ctx *ctx,
     stats->bmap_full_addr_packets = rstats->bmap_full_addr_packets;
 }
 
+const char *trdb_perf_stage_name(enum trdb_perf_stage stage)
+{
+    static const char *const names[TRDB_PERF_STAGES] = {
+        [trdb_perf_parse]     = "parse",
+        [trdb_perf_compress]  = "compress",
+        [trdb_perf_serialize] = "serialize",
+        [trdb_perf_read]      = "read",
+        [trdb_perf_decode]    = "decode",
+        [trdb_perf_ras]       = "ras",
+        [trdb_perf_section]   = "section"};
+
+    return stage < TRDB_PERF_STAGES ? names[stage] : "unknown";
+}
+
+#ifdef ENABLE_PERF_STATS
+struct trdb_perf_stats *trdb_perf(struct trdb_ctx *ctx)
+{
+    return &ctx->perf;
+}
+#endif
+
+int trdb_get_perf_stats(struct trdb_ctx *ctx, struct trdb_perf_stats *stats)
+{
+    if (!ctx || !stats)
+        return -trdb_invalid;
+
+#ifdef ENABLE_PERF_STATS
+    *stats = ctx->perf;
+    return 0;
+#else
+    *stats = (struct trdb_perf_stats){0};
+    return -trdb_unimplemented;
+#endif
+}
+
+void trdb_reset_perf_stats(struct trdb_ctx *ctx)
+{
+    ctx->perf = (struct trdb_perf_stats){0};
+}
+
+/* Add the stats of a worker context @p from to @p to, which other workers
+ * might add to at the same time
+ */
+static void add_perf_stats(struct trdb_perf_stats *to,
+                           const struct trdb_perf_stats *from)
+{
+    for (size_t i = 0; i < TRDB_PERF_STAGES; i++) {
+        __atomic_fetch_add(&to->stages[i].calls, from->stages[i].calls,
+                           __ATOMIC_RELAXED);
+        __atomic_fetch_add(&to->stages[i].ns, from->stages[i].ns,
+                           __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&to->decode_hits, from->decode_hits, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->decode_misses, from->decode_misses,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->section_loads, from->section_loads,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->allocs, from->allocs, __ATOMIC_RELAXED);
+}
+
 uint32_t trdb_sign_extendable_bits(addr_t addr)
 {
 
@@ -507,22 +1122,13 @@ static bool branch_taken(bool before_compressed, addr_t addr_before,
 
 uint32_t branch_map_len(uint32_t branches)
 {
-    assert(branches <= 31);
+    /* the branch map is sent in chunks of 1, 9, 17, 25 or 31 bits */
+    static const uint8_t len[32] = {
+        31, 1,  9,  9,  9,  9,  9,  9,  9,  9,  17, 17, 17, 17, 17, 17,
+        17, 17, 25, 25, 25, 25, 25, 25, 25, 25, 31, 31, 31, 31, 31, 31};
 
-    if (branches == 0) {
-        return 31;
-    } else if (branches <= 1) {
-        return 1;
-    } else if (branches <= 9) {
-        return 9;
-    } else if (branches <= 17) {
-        return 17;
-    } else if (branches <= 25) {
-        return 25;
-    } else if (branches <= 31) {
-        return 31;
-    }
-    return 0;
+    assert(branches <= 31);
+    return len[branches & 31];
 }
 
 /* Some jumps can't be predicted i.e. the jump address can only be figured out
@@ -547,6 +1153,54 @@ static bool is_unpred_discontinuity(insn_t instr, bool implicit_ret)
     return (jump || exception_ret) && not_ret;
 }
 
+static void ras_push(struct trdb_stack *stack, uint32_t depth, addr_t addr)
+{
+    stack->addrs[stack->top] = addr;
+    stack->top               = (stack->top + 1) % depth;
+    if (stack->len < depth)
+        stack->len++;
+}
+
+static bool ras_pop(struct trdb_stack *stack, uint32_t depth, addr_t *addr)
+{
+    if (stack->len == 0)
+        return false;
+    stack->top = (stack->top + depth - 1) % depth;
+    *addr      = stack->addrs[stack->top];
+    stack->len--;
+    return true;
+}
+
+/* Follow the return address stack of the decompression past @p instr, like
+ * ras_step() does it
+ */
+static void shadow_ras_step(struct trdb_compress *cmp,
+                            const struct tr_instr *instr, uint32_t depth)
+{
+    /* the instruction bits are the decompressed ones on PULP */
+    addr_t link = instr->iaddr + (instr->compressed ? 2 : 4);
+    addr_t ret_addr;
+
+    /* trapped instructions don't retire */
+    if (instr->exception)
+        return;
+
+    switch (get_instr_ras_type(instr->instr)) {
+    case none:
+        break;
+    case ret:
+        ras_pop(&cmp->ras, depth, &ret_addr);
+        break;
+    case coret:
+        ras_pop(&cmp->ras, depth, &ret_addr);
+        ras_push(&cmp->ras, depth, link);
+        break;
+    case call:
+        ras_push(&cmp->ras, depth, link);
+        break;
+    }
+}
+
 /* Just crash and error if we hit one of those */
 static bool is_unsupported(addr_t instr)
 {
@@ -604,15 +1258,9 @@ static bool differential_addr(int *lead, addr_t absolute, addr_t differential)
 
 static unsigned quantize_clz(unsigned x)
 {
-
-    if (x < 9)
-        return 0;
-    else if (x < 17)
-        return 9;
-    else if (x < 25)
-        return 17;
-    else
-        return 25;
+    /* round down to one of 0, 9, 17 and 25 without branching */
+    unsigned q = ((x - 1) & ~7u) + 1;
+    return x < 9 ? 0 : x > 25 ? 25 : q;
 }
 
 /* Does the same as differential_addr() but only considers byte boundaries */
@@ -666,6 +1314,14 @@ static void emit_exception_packet(struct trdb_ctx *c, struct tr_packet *tr,
     c->stats.exception_packets++;
 }
 
+/* A sync packet was emitted, restart the resync counters. */
+static void clear_resync(struct filter_state *filter)
+{
+    filter->resync_pend       = false;
+    filter->resync_cnt        = 0;
+    filter->resync_packet_cnt = 0;
+}
+
 /* Set @p tr to contain a start packet. */
 static void emit_start_packet(struct trdb_ctx *c, struct tr_packet *tr,
                               struct tr_instr *tc_instr,
@@ -859,17 +1515,24 @@ static void emit_full_branch_map(struct trdb_ctx *ctx, struct tr_packet *tr,
     ctx->stats.bmap_full_packets++;
 }
 
+/* Make this cycle the last one and the next cycle this one. The state of the
+ * old last cycle is reused for the next cycle, every field of which that
+ * matters is written by trdb_compress_trace_step() before being looked at.
+ */
+static void advance_cycle(struct trdb_compress *cmp)
+{
+    cmp->cur = (cmp->cur + 1) % 3;
+}
+
 /* Compress instruction traces the same way as we do it on the PULP trace
  * debugger, so this is meant to emulate that behaviour and not to be a generic
  * way how a trace encoder would do it.
  */
-int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
-                             struct tr_instr *instr)
+static int compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
+                               struct tr_instr *instr)
 {
 
     int status = 0;
-    if (!ctx || !packet || !instr)
-        return -trdb_invalid;
 
     struct trdb_stats *stats   = &ctx->stats;
     struct trdb_config *config = &ctx->config;
@@ -881,15 +1544,16 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
 
     /* for each cycle */
     // TODO: fix this hack by doing unqualified instead
-    struct trdb_state *lastc = &ctx->cmp->lastc;
-    struct trdb_state *thisc = &ctx->cmp->thisc;
-    struct trdb_state *nextc = &ctx->cmp->nextc;
+    struct trdb_compress *cmp = ctx->cmp;
+    struct trdb_state *lastc  = &cmp->states[cmp->cur];
+    struct trdb_state *thisc  = &cmp->states[(cmp->cur + 1) % 3];
+    struct trdb_state *nextc  = &cmp->states[(cmp->cur + 2) % 3];
 
     nextc->instr = *instr;
 
-    struct tr_instr *nc_instr = &ctx->cmp->nextc.instr;
-    struct tr_instr *tc_instr = &ctx->cmp->thisc.instr;
-    struct tr_instr *lc_instr = &ctx->cmp->lastc.instr;
+    struct tr_instr *nc_instr = &nextc->instr;
+    struct tr_instr *tc_instr = &thisc->instr;
+    struct tr_instr *lc_instr = &lastc->instr;
 
     struct branch_map_state *branch_map = &ctx->cmp->branch_map;
     struct filter_state *filter         = &ctx->cmp->filter;
@@ -901,7 +1565,6 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
     nextc->qualified   = true;
     nextc->unqualified = !nextc->qualified;
     nextc->exception   = instr->exception;
-    nextc->unpred_disc = is_unpred_discontinuity(instr->instr, implicit_ret);
     nextc->privilege   = instr->priv;
     nextc->privilege_change = (thisc->privilege != nextc->privilege);
 
@@ -922,13 +1585,24 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
         return 0;
     }
 
+    /* the instruction of lastc went past the decompression by now */
+    if (cmp->ras_pend) {
+        shadow_ras_step(cmp, lc_instr, config->ras_depth);
+        cmp->ras_pend = false;
+    }
+
     if (!thisc->qualified) {
         /* check if we even need to record anything */
-        *lastc = *thisc;
-        *thisc = *nextc;
+        advance_cycle(cmp);
         return 0; /* end of cycle */
     }
 
+    /* a return is only predictable if the return address stack of the
+     * decompression still holds its address
+     */
+    thisc->unpred_disc = is_unpred_discontinuity(
+        tc_instr->instr, implicit_ret && cmp->ras.len > 0);
+
     if (is_unsupported(tc_instr->instr)) {
         err(ctx,
             "Instruction is not supported for compression: 0x%" PRIxINSN
@@ -938,10 +1612,10 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
         goto fail;
     }
 
-    if (filter->resync_cnt++ == config->resync_max) {
+    /* periodically ask for a sync packet, see trdb_set_resync_interval() */
+    if (++filter->resync_cnt >= config->resync_max ||
+        filter->resync_packet_cnt >= config->resync_packets_max)
         filter->resync_pend = true;
-        filter->resync_cnt  = 0;
-    }
 
     if (is_branch(tc_instr->instr)) {
         /* update branch map */
@@ -970,7 +1644,7 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
         *last_iaddr = tc_instr->iaddr;
 
         thisc->emitted_exception_sync = true;
-        filter->resync_pend           = false; /* TODO: how to handle this */
+        clear_resync(filter);
 
         generated_packet = 1;
         /* end of cycle */
@@ -992,11 +1666,14 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
         emit_start_packet(ctx, packet, tc_instr, nc_instr);
         *last_iaddr = tc_instr->iaddr;
 
-        filter->resync_pend = false;
-        generated_packet    = 1;
+        clear_resync(filter);
+        generated_packet = 1;
 
     } else if (firstc_qualified || thisc->unhalted || thisc->privilege_change ||
-               (filter->resync_pend && branch_map->cnt == 0)) {
+               (filter->resync_pend && filter->flushed &&
+                !(config->ras_tracking
+                      ? is_unpred_discontinuity(tc_instr->instr, false)
+                      : thisc->unpred_disc))) {
 
         /* Start packet */
         /* Send te_inst:
@@ -1007,8 +1684,8 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
         emit_start_packet(ctx, packet, tc_instr, nc_instr);
         *last_iaddr = tc_instr->iaddr;
 
-        filter->resync_pend = false;
-        generated_packet    = 1;
+        clear_resync(filter);
+        generated_packet = 1;
 
     } else if (lastc->unpred_disc) {
         /* Send te_inst:
@@ -1024,8 +1701,12 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
         *last_iaddr      = tc_instr->iaddr;
         generated_packet = 1;
 
-    } else if (filter->resync_pend && branch_map->cnt > 0) {
-        /* we treat resync_pend && branches == 0 before */
+    } else if (filter->resync_pend) {
+        /* Flush everything up to here so that the sync packet of the next
+         * cycle doesn't leave a gap in the decompressed trace. We also end up
+         * here if this is a unpredictable discontinuity, since the sync packet
+         * can't tell where it jumps to.
+         */
         /* Send te_inst:
          * format 0/1/2
          */
@@ -1075,9 +1756,23 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
         goto fail;
     }
 
+    /* the decompression stops at the jump target of a discontinuity without
+     * emitting it, so such a packet doesn't count as a flush
+     */
+    filter->flushed = generated_packet &&
+                      (packet->format == F_SYNC || !lastc->unpred_disc);
+
+    /* sync packets empty the return address stack before this instruction */
+    if (config->ras_tracking && generated_packet &&
+        packet->format == F_SYNC) {
+        cmp->ras.len       = 0;
+        thisc->unpred_disc = is_unpred_discontinuity(tc_instr->instr, false);
+    }
+    /* only implicit returns ever look at the stack */
+    cmp->ras_pend = implicit_ret;
+
     /* update last cycle state */
-    *lastc = *thisc;
-    *thisc = *nextc;
+    advance_cycle(cmp);
 
     /* TODO: no 64 bit instr support */
     stats->instrbits += instr->compressed ? 16 : 32;
@@ -1086,6 +1781,8 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
         *branch_map = (struct branch_map_state){0};
         stats->payloadbits += (packet->length);
         stats->packets++;
+        if (packet->format != F_SYNC)
+            filter->resync_packet_cnt++;
 
         if (config->full_statistics) {
             /* figure out pulp payload by serializing and couting bits */
@@ -1101,11 +1798,12 @@ int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
 
     if (generated_packet) {
         trdb_log_packet(ctx, packet);
+        fire_event(ctx, TRDB_EVENT_PACKET_EMIT, packet, instr);
     }
 
     if (ctx->dunit) {
         /* TODO: unfortunately this ignores log_fn */
-        if (trdb_get_log_priority(ctx) == LOG_DEBUG) {
+        if (trdb_debug_enabled(ctx)) {
             trdb_disassemble_instr(instr, ctx->dunit);
         }
     } else {
@@ -1120,6 +1818,25 @@ fail:
         return status;
 }
 
+int trdb_compress_trace_step(struct trdb_ctx *ctx, struct tr_packet *packet,
+                             struct tr_instr *instr)
+{
+    if (!ctx || !packet || !instr)
+        return -trdb_invalid;
+
+    trdb_perf_start(t);
+    int status = compress_trace_step(ctx, packet, instr);
+    trdb_perf_stop(ctx, trdb_perf_compress, t);
+    return status;
+}
+
+int trdb_compress_trace_step_unchecked(struct trdb_ctx *ctx,
+                                       struct tr_packet *packet,
+                                       struct tr_instr *instr)
+{
+    return compress_trace_step(ctx, packet, instr);
+}
+
 /* this is just a different interface to trdb_compress_trace_step() where
  * packets generated packetes are appened to a given list header
  */
@@ -1133,6 +1850,7 @@ int trdb_compress_trace_step_add(struct trdb_ctx *ctx,
     struct tr_packet *packet = malloc(sizeof(*packet));
     if (!packet)
         return -trdb_nomem;
+    trdb_perf_count(ctx, allocs);
 
     int status = trdb_compress_trace_step(ctx, packet, instr);
     if (status < 0) {
@@ -1148,15 +1866,66 @@ int trdb_compress_trace_step_add(struct trdb_ctx *ctx,
     return status;
 }
 
-int trdb_pulp_model_step(struct trdb_ctx *ctx, struct tr_instr *instr,
-                         uint32_t *packet_word)
+int trdb_compress_trace_step_vec(struct trdb_ctx *ctx,
+                                 struct trdb_packet_vec *packets,
+                                 struct tr_instr *instr)
 {
-    (void)packet_word;
-    struct tr_packet packet;
-    int status = trdb_compress_trace_step(ctx, &packet, instr);
-    if (status < 0) {
-        /* some error */
-    }
+    if (!ctx || !packets || !instr)
+        return -trdb_invalid;
+
+    struct tr_packet packet = {0};
+    int status              = trdb_compress_trace_step(ctx, &packet, instr);
+    if (status < 0)
+        return status;
+
+    if (status == 1) {
+        int push = trdb_packet_vec_push(packets, &packet);
+        if (push < 0)
+            return push;
+    }
+
+    return status;
+}
+
+int trdb_compress_trace_block(struct trdb_ctx *ctx, size_t len,
+                              struct tr_instr instrs[len], size_t cap,
+                              struct tr_packet packets[cap], size_t *consumed,
+                              size_t *produced)
+{
+    int status = 0;
+    if (!ctx || (len && !instrs) || (cap && !packets) || !consumed ||
+        !produced)
+        return -trdb_invalid;
+
+    size_t i = 0;
+    size_t n = 0;
+    /* each step produces at most one packet, which goes straight into the
+     * caller's buffer
+     */
+    trdb_perf_start(t);
+    for (; i < len && n < cap; i++) {
+        status = compress_trace_step(ctx, &packets[n], &instrs[i]);
+        if (status < 0)
+            break;
+        n += status;
+        status = 0;
+    }
+    trdb_perf_stop(ctx, trdb_perf_compress, t);
+
+    *consumed = i;
+    *produced = n;
+    return status;
+}
+
+int trdb_pulp_model_step(struct trdb_ctx *ctx, struct tr_instr *instr,
+                         uint32_t *packet_word)
+{
+    (void)packet_word;
+    struct tr_packet packet;
+    int status = trdb_compress_trace_step(ctx, &packet, instr);
+    if (status < 0) {
+        /* some error */
+    }
 
     if (status == 1) {
         /* enqueue into fifo */
@@ -1169,43 +1938,71 @@ int trdb_pulp_model_step(struct trdb_ctx *ctx, struct tr_instr *instr,
 }
 
 /* try to update the return address stack*/
-static int update_ras(struct trdb_ctx *c, addr_t instr, addr_t addr,
-                      struct trdb_stack *stack, addr_t *ret_addr)
+static int ras_step(struct trdb_ctx *c, addr_t instr, addr_t addr,
+                    enum trdb_ras ras, struct trdb_stack *stack,
+                    addr_t *ret_addr)
 {
-    if (!stack)
-        return -trdb_invalid;
-
-    bool compressed   = (instr & 0x3) != 0x3;
-    enum trdb_ras ras = get_instr_ras_type(instr);
+    bool compressed = (instr & 0x3) != 0x3;
+    uint32_t depth  = c->config.ras_depth;
+    /* without ras_tracking the missing entries might have been predicted */
+    bool need_ras = c->dec->partial_stack && c->config.implicit_ret &&
+                    !c->config.ras_tracking;
 
     switch (ras) {
     case none:
         return none;
 
     case ret:
-        if (kv_size(*stack) == 0)
+        if (ras_pop(stack, depth, ret_addr)) {
+            dbg(c, "return to: %" PRIxADDR "\n", *ret_addr);
+            return ret;
+        }
+        c->dec->underflows++;
+        /* The compression sends the address of a return that finds the
+         * stack empty, either because it overflowed or because a sync packet
+         * cleared it with ras_tracking, so it is a plain jump. A stack that
+         * lacks older entries can't tell that apart from a predicted return.
+         */
+        if (need_ras)
             return -trdb_bad_ras;
-        *ret_addr = kv_pop(*stack);
-        dbg(c, "return to: %" PRIxADDR "\n", *ret_addr);
-        return ret;
+        return none;
 
     case coret:
         dbg(c, "coret call/ret: %" PRIxADDR "\n", addr + (compressed ? 2 : 4));
-        if (kv_size(*stack) == 0)
-            return -trdb_bad_ras;
-        *ret_addr = kv_pop(*stack);
-        kv_push(addr_t, *stack, addr + (compressed ? 2 : 4));
+        if (!ras_pop(stack, depth, ret_addr)) {
+            c->dec->underflows++;
+            if (need_ras)
+                return -trdb_bad_ras;
+        }
+        ras_push(stack, depth, addr + (compressed ? 2 : 4));
         return coret;
 
     case call:
         dbg(c, "pushing to stack: %" PRIxADDR "\n",
             addr + (compressed ? 2 : 4));
-        kv_push(addr_t, *stack, addr + (compressed ? 2 : 4));
+        ras_push(stack, depth, addr + (compressed ? 2 : 4));
         return call;
     }
     return none;
 }
 
+static int update_ras(struct trdb_ctx *c, addr_t instr, addr_t addr,
+                      enum trdb_ras ras, struct trdb_stack *stack,
+                      addr_t *ret_addr)
+{
+    if (!stack)
+        return -trdb_invalid;
+
+    /* most instructions leave the stack alone, that's not worth timing */
+    if (ras == none)
+        return none;
+
+    trdb_perf_start(t);
+    int status = ras_step(c, instr, addr, ras, stack, ret_addr);
+    trdb_perf_stop(c, trdb_perf_ras, t);
+    return status;
+}
+
 /* Try to read instruction at @p pc into @p instr. It uses read_memory_func()
  * which is set using libopcodes.
  */
@@ -1289,6 +2086,230 @@ static int disassemble_at_pc(struct trdb_ctx *c, bfd_vma pc,
     return instr_size;
 }
 
+static void free_decode_cache(struct trdb_decode_cache *dcache)
+{
+    if (!dcache)
+        return;
+
+    for (size_t i = 0; i < kv_size(dcache->sections); i++)
+        free(kv_A(dcache->sections, i).entries);
+    kv_destroy(dcache->sections);
+    free(dcache);
+}
+
+/* Make sure the decode cache of @p c belongs to @p abfd. We drop everything we
+ * learned from a different bfd.
+ */
+static int attach_decode_cache(struct trdb_ctx *c, bfd *abfd)
+{
+    if (c->dcache && c->dcache->abfd == abfd)
+        return 0;
+
+    free_decode_cache(c->dcache);
+    c->dcache = malloc(sizeof(*c->dcache));
+    if (!c->dcache)
+        return -trdb_nomem;
+
+    c->dcache->abfd = abfd;
+    kv_init(c->dcache->sections);
+    return 0;
+}
+
+/* Return the cache entry for @p pc in @p section, allocating the section table
+ * on first use. Returns NULL if the entry can't be cached, in which case we
+ * just decode without memoizing.
+ */
+static struct trdb_decoded *lookup_decode_cache(struct trdb_ctx *c,
+                                                asection *section, bfd_vma pc)
+{
+    struct trdb_decode_cache *dcache = c->dcache;
+    struct trdb_section_cache *scache = NULL;
+
+    if (!dcache || !section)
+        return NULL;
+
+    for (size_t i = 0; i < kv_size(dcache->sections); i++) {
+        if (kv_A(dcache->sections, i).section == section) {
+            scache = &kv_A(dcache->sections, i);
+            break;
+        }
+    }
+
+    if (!scache) {
+        struct trdb_section_cache new = {
+            .section = section,
+            .vma     = section->vma,
+            .len     = bfd_section_size(section) / 2 + 1};
+        new.entries = calloc(new.len, sizeof(*new.entries));
+        if (!new.entries) {
+            err(c, "decode cache: %s\n", strerror(errno));
+            return NULL;
+        }
+        trdb_perf_count(c, allocs);
+        kv_push(struct trdb_section_cache, dcache->sections, new);
+        scache = &kv_A(dcache->sections, kv_size(dcache->sections) - 1);
+        dbg(c, "decode cache: allocated %zu entries for %s\n", scache->len,
+            section->name);
+    }
+
+    size_t index = (pc - scache->vma) >> 1;
+    if (pc < scache->vma || index >= scache->len)
+        return NULL;
+
+    return &scache->entries[index];
+}
+
+/* The decompression loop prints the disassembly of each instruction through
+ * build_instr_fprintf(), which only ends up anywhere with debug logging.
+ */
+static bool wants_disassembly_text(struct trdb_ctx *c)
+{
+    return trdb_debug_enabled(c);
+}
+
+/* Fill in @p instr and @p decoded for the instruction at @p pc using
+ * riscv_classify_instr() instead of libopcodes. This skips all the text
+ * formatting.
+ */
+static int classify_at_pc(struct trdb_ctx *c, bfd_vma pc,
+                          struct tr_instr *instr,
+                          struct disassemble_info *dinfo,
+                          struct trdb_decoded *decoded, int *status)
+{
+    uint64_t instr_bits = 0;
+    addr_t target       = 0;
+
+    *status = 0;
+    if (read_memory_at_pc(pc, &instr_bits, dinfo)) {
+        err(c, "reading instr at pc failed\n");
+        *status = -trdb_bad_instr;
+        return 0;
+    }
+
+    int size                = riscv_instr_len(instr_bits);
+    enum dis_insn_type type = riscv_classify_instr(instr_bits, pc, &target);
+    if (type == dis_noninsn) {
+        err(c, "encountered invalid instruction at %" PRIxADDR "\n",
+            (addr_t)pc);
+        *status = -trdb_bad_instr;
+        return 0;
+    }
+
+    *instr   = (struct tr_instr){.valid      = true,
+                               .iaddr      = pc,
+                               .instr      = (insn_t)instr_bits,
+                               .compressed = size == 2};
+    *decoded = (struct trdb_decoded){.instr     = instr->instr,
+                                     .target    = target,
+                                     .size      = size,
+                                     .insn_type = type,
+                                     .ras = get_instr_ras_type(instr->instr)};
+    return size;
+}
+
+/* Neither bfd nor libopcodes are thread safe, so contexts decompressing in
+ * parallel take turns using them.
+ */
+static pthread_mutex_t *bfd_lock(struct trdb_ctx *c)
+{
+    return c->image ? &c->image->lock : c->bfd_lock;
+}
+
+static void lock_bfd(struct trdb_ctx *c)
+{
+    if (bfd_lock(c))
+        pthread_mutex_lock(bfd_lock(c));
+}
+
+static void unlock_bfd(struct trdb_ctx *c)
+{
+    if (bfd_lock(c))
+        pthread_mutex_unlock(bfd_lock(c));
+}
+
+/* Take the decoding of the instruction at @p pc from @p entry */
+static int use_decoded(const struct trdb_decoded *entry, bfd_vma pc,
+                       struct tr_instr *instr, struct trdb_decoded *decoded,
+                       int *status)
+{
+    *status  = 0;
+    *decoded = *entry;
+    *instr   = (struct tr_instr){.valid      = true,
+                               .iaddr      = pc,
+                               .instr      = entry->instr,
+                               .compressed = entry->size == 2};
+    return entry->size;
+}
+
+/* Decode the instruction at @p pc into @p instr and @p decoded. Sections of a
+ * trdb_image are already decoded. Otherwise, if enabled, we try to get the
+ * result from the decode cache first, else we classify the instruction
+ * ourselves or fall back to disassemble_at_pc() and remember the result.
+ */
+static int lookup_or_decode(struct trdb_ctx *c, bfd_vma pc,
+                            struct tr_instr *instr,
+                            struct disassembler_unit *dunit,
+                            struct trdb_decoded *decoded, int *status)
+{
+    struct disassemble_info *dinfo = dunit->dinfo;
+    struct trdb_decoded *entry     = NULL;
+    struct trdb_code_section *cs   = c->dec->code;
+
+    if (cs && cs->decoded && pc >= cs->vma && pc - cs->vma < cs->size &&
+        !wants_disassembly_text(c)) {
+        entry = &cs->decoded[(pc - cs->vma) >> 1];
+        if (entry->size) {
+            trdb_perf_count(c, decode_hits);
+            return use_decoded(entry, pc, instr, decoded, status);
+        }
+        entry = NULL;
+    }
+
+    if (c->config.decode_cache) {
+        entry = lookup_decode_cache(c, dinfo->section, pc);
+        if (entry && entry->size) {
+            trdb_perf_count(c, decode_hits);
+            return use_decoded(entry, pc, instr, decoded, status);
+        }
+    }
+
+    trdb_perf_count(c, decode_misses);
+    int size = 0;
+    if (c->config.native_decode && !wants_disassembly_text(c)) {
+        size = classify_at_pc(c, pc, instr, dinfo, decoded, status);
+        if (*status < 0)
+            return 0;
+    } else {
+        lock_bfd(c);
+        size = disassemble_at_pc(c, pc, instr, dunit, status);
+        unlock_bfd(c);
+        if (*status < 0)
+            return 0;
+
+        *decoded =
+            (struct trdb_decoded){.instr     = instr->instr,
+                                  .target    = dinfo->target,
+                                  .size      = size,
+                                  .insn_type = dinfo->insn_type,
+                                  .ras = get_instr_ras_type(instr->instr)};
+    }
+
+    if (entry)
+        *entry = *decoded;
+
+    return size;
+}
+
+static int decode_at_pc(struct trdb_ctx *c, bfd_vma pc, struct tr_instr *instr,
+                        struct disassembler_unit *dunit,
+                        struct trdb_decoded *decoded, int *status)
+{
+    trdb_perf_start(t);
+    int size = lookup_or_decode(c, pc, instr, dunit, decoded, status);
+    trdb_perf_stop(c, trdb_perf_decode, t);
+    return size;
+}
+
 /* Libopcodes only knows how to call a fprintf based callback function. We abuse
  * it by passing through the void pointer our custom data (instead of a stream).
  * This ugly hack doesn't seem to be used by just me.
@@ -1298,6 +2319,11 @@ static int build_instr_fprintf(void *stream, const char *format, ...)
     struct trdb_ctx *c = stream;
     char tmp[INSTR_STR_LEN];
     va_list args;
+
+    /* nobody would see the text */
+    if (!trdb_debug_enabled(c))
+        return 0;
+
     va_start(args, format);
     int rv = vsnprintf(tmp, INSTR_STR_LEN - 1, format, args);
     if (rv >= INSTR_STR_LEN) {
@@ -1313,769 +2339,1831 @@ static int build_instr_fprintf(void *stream, const char *format, ...)
     return rv;
 }
 
-/* Free up any resources we allocated for disassembling */
-static void free_section_for_debugging(struct disassemble_info *dinfo)
+static void release_section_table(struct trdb_section_table *stable)
+{
+    for (size_t i = 0; i < stable->len; i++) {
+        free(stable->sections[i].data);
+        free(stable->sections[i].decoded);
+    }
+    free(stable->sections);
+    *stable = (struct trdb_section_table){0};
+}
+
+static void free_section_table(struct trdb_section_table *stable)
 {
-    if (!dinfo)
+    if (!stable)
         return;
 
-    if (dinfo->buffer) {
-        free(dinfo->buffer);
-        dinfo->buffer        = NULL;
-        dinfo->buffer_vma    = 0;
-        dinfo->buffer_length = 0;
-        dinfo->section       = NULL;
-    }
+    release_section_table(stable);
+    free(stable);
 }
 
-/* Load the section given by @p section from @p abfd into @p dinfo. */
-static int alloc_section_for_debugging(struct trdb_ctx *c, bfd *abfd,
-                                       asection *section,
-                                       struct disassemble_info *dinfo)
+static int compare_code_section(const void *a, const void *b)
 {
-    if (!dinfo || !section)
-        return -trdb_invalid;
+    const struct trdb_code_section *x = a;
+    const struct trdb_code_section *y = b;
+    return (x->vma > y->vma) - (x->vma < y->vma);
+}
 
-    bfd_size_type section_size = bfd_section_size(section);
+/* Load all code sections of @p abfd into @p stable */
+static int load_section_table(struct trdb_ctx *c, bfd *abfd,
+                              struct trdb_section_table *stable)
+{
+    int status = 0;
+    asection *p;
 
-    bfd_byte *section_data = malloc(section_size);
-    if (!section_data)
-        return -trdb_nomem;
+    *stable      = (struct trdb_section_table){0};
+    stable->abfd = abfd;
 
-    if (!bfd_get_section_contents(abfd, section, section_data, 0,
-                                  section_size)) {
-        err(c, "bfd_get_section_contents: %s\n", bfd_errmsg(bfd_get_error()));
-        free(section_data);
-        return -trdb_section_empty;
+    size_t cnt = 0;
+    for (p = abfd->sections; p != NULL; p = p->next)
+        cnt++;
+    stable->sections = calloc(cnt ? cnt : 1, sizeof(*stable->sections));
+    if (!stable->sections) {
+        status = -trdb_nomem;
+        goto fail;
     }
 
-    dinfo->buffer        = section_data;
-    dinfo->buffer_vma    = section->vma;
-    dinfo->buffer_length = section_size;
-    dinfo->section       = section;
-    return 0;
-}
+    lock_bfd(c);
+    for (p = abfd->sections; p != NULL; p = p->next) {
+        if ((p->flags & (SEC_CODE | SEC_HAS_CONTENTS)) !=
+                (SEC_CODE | SEC_HAS_CONTENTS) ||
+            bfd_section_size(p) == 0)
+            continue;
 
-/* Allocate memory and the new instruction @p instr to @p instr_list. */
-static int add_trace(struct trdb_ctx *c, struct trdb_instr_head *instr_list,
-                     struct tr_instr *instr)
-{
-    (void)c;
-    struct tr_instr *add = malloc(sizeof(*add));
-    if (!add)
-        return -trdb_nomem;
+        struct trdb_code_section *cs = &stable->sections[stable->len];
+        cs->section                  = p;
+        cs->vma                      = p->vma;
+        cs->size                     = bfd_section_size(p);
+        cs->data                     = malloc(cs->size);
+        if (!cs->data) {
+            status = -trdb_nomem;
+            break;
+        }
+        stable->len++;
+        trdb_perf_count(c, allocs);
+        if (!bfd_get_section_contents(abfd, p, cs->data, 0, cs->size)) {
+            err(c, "bfd_get_section_contents: %s\n",
+                bfd_errmsg(bfd_get_error()));
+            status = -trdb_section_empty;
+            break;
+        }
+        trdb_perf_count(c, section_loads);
+        dbg(c, "section table: loaded %s\n", p->name);
+    }
+    unlock_bfd(c);
+    if (status < 0)
+        goto fail;
 
-    memcpy(add, instr, sizeof(*add));
-    TAILQ_INSERT_TAIL(instr_list, add, list);
+    qsort(stable->sections, stable->len, sizeof(*stable->sections),
+          compare_code_section);
     return 0;
+
+fail:
+    release_section_table(stable);
+    return status;
 }
 
-/* TODO: packet wise decompression with error events */
-int trdb_decompress_trace(struct trdb_ctx *c, bfd *abfd,
-                          struct trdb_packet_head *packet_list,
-                          struct trdb_instr_head *instr_list)
+/* Make sure the section table of @p c belongs to @p abfd, loading all code
+ * sections of @p abfd if it doesn't.
+ */
+static int attach_section_table(struct trdb_ctx *c, bfd *abfd)
 {
     int status = 0;
-    if (!c || !abfd || !packet_list || !instr_list)
-        return -trdb_invalid;
 
-    /* We assume our hw block in the pulp generated little endian
-     * addresses, thus we should make sure that before we interact
-     * with bfd addresses to convert this foreign format to the local
-     * host format
-     */
-    /* TODO: supports only statically linked elf executables */
-    struct trdb_config *config = &c->config;
-    bool full_address          = config->full_address;
-    bool implicit_ret          = config->implicit_ret;
+    if (c->stable && c->stable->abfd == abfd)
+        return 0;
 
-    /* define disassembler stuff */
-    struct disassembler_unit dunit = {0};
-    struct disassemble_info dinfo  = {0};
-    /*TODO: move this into trdb_ctx so that we can continuously decode pieces?*/
-    struct trdb_decompress *dec_ctx = c->dec;
-    struct trdb_stack *ras          = &c->dec->call_stack;
-    struct tr_instr *dis_instr      = c->dis_instr;
+    free_section_table(c->stable);
+    c->stable = calloc(1, sizeof(*c->stable));
+    if (!c->stable)
+        return -trdb_nomem;
 
-    /* find section belonging to start_address */
-    bfd_vma start_address = abfd->start_address;
-    asection *section     = trdb_get_section_for_vma(abfd, start_address);
-    if (!section) {
-        err(c, "VMA not pointing to any section\n");
-        status = -trdb_bad_vma;
-        goto fail;
+    if ((status = load_section_table(c, abfd, c->stable)) < 0) {
+        free(c->stable);
+        c->stable = NULL;
     }
-    info(c, "Section of start_address:%s\n", section->name);
+    return status;
+}
 
-    dunit.dinfo = &dinfo;
-    /* TODO: remove that stuff, goes into global context */
-    trdb_init_disassembler_unit(&dunit, abfd, "no-aliases");
-    /* advanced fprintf output handling */
-    dunit.dinfo->fprintf_func = build_instr_fprintf;
-    /* dunit.dinfo->stream = &instr; */
+/* Whether the decompression can just go on with the next instruction after
+ * @p decoded, i.e. it neither changes the control flow nor the return address
+ * stack.
+ */
+static bool falls_through(const struct trdb_decoded *decoded)
+{
+    return decoded->size != 0 &&
+           (decoded->insn_type == dis_nonbranch ||
+            decoded->insn_type == dis_dref) &&
+           decoded->ras == none &&
+           !is_unpred_discontinuity(decoded->instr, false);
+}
 
-    /* Alloc and config section data for disassembler */
-    bfd_vma stop_offset = bfd_section_size(section) / dinfo.octets_per_byte;
+/* Decode every halfword of @p cs ahead of time, so that decompression never
+ * needs to call libopcodes for it. Offsets that don't hold an instruction keep
+ * a zero size. Each entry also records how many instructions in a row, up to
+ * UINT8_MAX, fall through from it so that the decompression can emit them
+ * without looking at each one.
+ */
+static int predecode_code_section(struct trdb_code_section *cs)
+{
+    cs->decoded = calloc(cs->size / 2 + 1, sizeof(*cs->decoded));
+    if (!cs->decoded)
+        return -trdb_nomem;
 
-    if ((status = alloc_section_for_debugging(c, abfd, section, &dinfo)) < 0)
-        goto fail;
+    for (bfd_size_type off = 0; off + 2 <= cs->size; off += 2) {
+        uint64_t bits = bfd_getl16(cs->data + off);
+        int size      = riscv_instr_len(bits);
+        if (size == 4 && off + 4 <= cs->size)
+            bits |= (uint64_t)bfd_getl16(cs->data + off + 2) << 16;
+        else if (size != 2)
+            continue;
 
-    bfd_vma pc = start_address; /* TODO: well we get a sync packet anyway... */
+        addr_t target           = 0;
+        enum dis_insn_type type = riscv_classify_instr(bits, cs->vma + off,
+                                                       &target);
+        if (type == dis_noninsn)
+            continue;
 
-    struct tr_packet *packet = NULL;
+        cs->decoded[off / 2] =
+            (struct trdb_decoded){.instr     = (insn_t)bits,
+                                  .target    = target,
+                                  .size      = size,
+                                  .insn_type = type,
+                                  .ras       = get_instr_ras_type(bits)};
+    }
 
-    TAILQ_FOREACH (packet, packet_list, list) {
-        /* we ignore unknown or unused packets (TIMER, SW) */
-        if (packet->msg_type != W_TRACE) {
-            info(c, "skipped a packet\n");
+    /* backwards so that each entry can build on the one following it */
+    size_t n = cs->size / 2;
+    for (size_t i = n; i-- > 0;) {
+        struct trdb_decoded *d = &cs->decoded[i];
+        if (!falls_through(d))
             continue;
-        }
+        size_t next  = i + d->size / 2;
+        unsigned run = 1 + (next < n ? cs->decoded[next].run : 0);
+        d->run       = run < UINT8_MAX ? run : UINT8_MAX;
+    }
+    return 0;
+}
 
-        /* Sometimes we leave the current section (e.g. changing from
-         * the .start to the .text section), so let's load the
-         * appropriate section and remove the old one
-         */
-        if (pc >= section->vma + stop_offset || pc < section->vma) {
-            section = trdb_get_section_for_vma(abfd, pc);
-            if (!section) {
-                err(c, "VMA (PC) not pointing to any section\n");
-                status = -trdb_bad_vma;
-                goto fail;
-            }
-            stop_offset = bfd_section_size(section) / dinfo.octets_per_byte;
+int trdb_image_new(struct trdb_ctx *c, bfd *abfd, struct trdb_image **image)
+{
+    int status = 0;
 
-            free_section_for_debugging(&dinfo);
-            if ((status =
-                     alloc_section_for_debugging(c, abfd, section, &dinfo)) < 0)
-                goto fail;
+    if (!c || !abfd || !image)
+        return -trdb_invalid;
 
-            info(c, "switched to section:%s\n", section->name);
-        }
+    struct trdb_image *img = calloc(1, sizeof(*img));
+    if (!img)
+        return -trdb_nomem;
+    img->abfd = abfd;
 
-        switch (packet->format) {
-        case F_BRANCH_FULL:
-        case F_BRANCH_DIFF:
-            dec_ctx->branch_map.cnt  = packet->branches;
-            dec_ctx->branch_map.bits = packet->branch_map;
-            dec_ctx->branch_map.full =
-                (packet->branches == 31) || (packet->branches == 0);
-            break;
-        case F_SYNC:
-            break;
-        case F_ADDR_ONLY:
-            break;
-        default:
-            /* impossible */
-            status = -trdb_bad_packet;
+    if ((status = load_section_table(c, abfd, &img->sections)) < 0)
+        goto fail;
+    for (size_t i = 0; i < img->sections.len; i++) {
+        if ((status = predecode_code_section(&img->sections.sections[i])) < 0)
             goto fail;
-        }
+    }
+    if ((status = trdb_load_symbols(c, abfd, &img->symbols)) < 0)
+        goto fail;
 
-        trdb_log_packet(c, packet);
+    pthread_mutex_init(&img->lock, NULL);
+    info(c, "image of %s with %zu code sections and %ld symbols\n",
+         bfd_get_filename(abfd), img->sections.len,
+         img->symbols.sorted_symcount);
+    *image = img;
+    return 0;
 
-        if (packet->format == F_BRANCH_FULL) {
-            bool hit_address = false; /* TODO: for now we don't allow
-                                       * resync packets, see todo.org
-                                       */
-            /* We don't need to care about the address field if the branch map
-             * is full,(except if full and instr before last branch is
-             * discontinuity)
-             */
-            bool hit_discontinuity = dec_ctx->branch_map.full;
+fail:
+    release_section_table(&img->sections);
+    free(img);
+    return status;
+}
 
-            /* Remember last packet address to be able to compute differential
-             * address. Careful, a full branch map doesn't always have an
-             * address field
-             * TODO: edgecase where we sign extend from msb of branchmap
-             */
-            addr_t absolute_addr = packet->address;
+void trdb_image_free(struct trdb_image *image)
+{
+    if (!image)
+        return;
 
-            if (dec_ctx->branch_map.cnt > 0)
-                dec_ctx->last_packet_addr = absolute_addr;
+    release_section_table(&image->sections);
+    trdb_release_symbols(&image->symbols);
+    pthread_mutex_destroy(&image->lock);
+    free(image);
+}
 
-            /* this indicates we don't have a valid address but still a full
-             * branch map
-             */
-            if (dec_ctx->branch_map.cnt == 0)
-                dec_ctx->branch_map.cnt = 31;
-
-            while (!(dec_ctx->branch_map.cnt == 0 &&
-                     (hit_discontinuity || hit_address))) {
-
-                if (pc >= section->vma + stop_offset || pc < section->vma) {
-                    section = trdb_get_section_for_vma(abfd, pc);
-                    if (!section) {
-                        err(c, "VMA (PC) not pointing to any section\n");
-                        status = -trdb_bad_vma;
-                        goto fail;
-                    }
-                    stop_offset =
-                        bfd_section_size(section) / dinfo.octets_per_byte;
+const struct trdb_disasm_aux *
+trdb_image_symbols(const struct trdb_image *image)
+{
+    return &image->symbols;
+}
 
-                    free_section_for_debugging(&dinfo);
-                    if ((status = alloc_section_for_debugging(c, abfd, section,
-                                                              &dinfo)) < 0)
-                        goto fail;
+/* Binary search for the code section containing @p vma, NULL if there is
+ * none.
+ */
+static struct trdb_code_section *
+find_code_section(const struct trdb_section_table *stable, bfd_vma vma)
+{
+    size_t lo = 0;
+    size_t hi = stable->len;
+
+    while (lo < hi) {
+        size_t mid                   = lo + (hi - lo) / 2;
+        struct trdb_code_section *cs = &stable->sections[mid];
+        if (vma < cs->vma)
+            hi = mid;
+        else if (vma - cs->vma >= cs->size)
+            lo = mid + 1;
+        else
+            return cs;
+    }
+    return NULL;
+}
 
-                    info(c, "switched to section:%s\n", section->name);
-                }
+/* How the last instruction @p d of a basic block leaves it */
+static enum trdb_block_kind block_kind(const struct trdb_decoded *d)
+{
+    if (falls_through(d))
+        return TRDB_BLOCK_FALLTHROUGH;
+    if (d->ras == ret)
+        return TRDB_BLOCK_RETURN;
+    if (d->ras == call || d->ras == coret)
+        return TRDB_BLOCK_CALL;
+    if (d->insn_type == dis_condbranch)
+        return TRDB_BLOCK_BRANCH;
+    if ((d->insn_type == dis_branch || d->insn_type == dis_jsr) && d->target)
+        return TRDB_BLOCK_JUMP;
+    return TRDB_BLOCK_INDIRECT;
+}
 
-                int size = disassemble_at_pc(c, pc, dis_instr, &dunit, &status);
-                if (status < 0)
-                    goto fail;
+/* Whether execution goes on after a block of @p kind, for calls once they
+ * return
+ */
+static bool block_continues(enum trdb_block_kind kind)
+{
+    return kind == TRDB_BLOCK_FALLTHROUGH || kind == TRDB_BLOCK_BRANCH ||
+           kind == TRDB_BLOCK_CALL;
+}
 
-                /* TODO: test if packet addr valid first */
-                if (dec_ctx->branch_map.cnt == 0 && pc == absolute_addr)
-                    hit_address = true;
+/* Mark the halfword at @p addr as the start of a block if it is code */
+static void mark_leader(const struct trdb_section_table *stable,
+                        uint8_t **leaders, bfd_vma addr)
+{
+    struct trdb_code_section *cs = find_code_section(stable, addr);
+    if (cs)
+        leaders[cs - stable->sections][(addr - cs->vma) >> 1] = 1;
+}
 
-                /* handle decoding RAS */
-                addr_t ret_addr = 0;
+/* Split the instructions of @p cs, walked linearly from its start, into basic
+ * blocks which additionally start at the halfwords marked in @p leader. The
+ * blocks are written to @p blocks unless it is NULL. Returns their number and
+ * counts the marked halfwords in the middle of a walked instruction, which
+ * can't start a block, in @p hidden unless it is NULL.
+ */
+static size_t split_code_section(const struct trdb_code_section *cs,
+                                 const uint8_t *leader,
+                                 struct trdb_block *blocks, size_t *hidden)
+{
+    struct trdb_block blk = {0};
+    size_t cnt            = 0;
 
-                int ras_ret = update_ras(c, dis_instr->instr, dis_instr->iaddr,
-                                         ras, &ret_addr);
-                if (ras_ret < 0) {
-                    err(c, "return address stack in bad state: %s\n",
-                        trdb_errstr(trdb_errcode(status)));
-                    goto fail;
-                }
-                enum trdb_ras instr_ras_type = ras_ret;
+    for (bfd_size_type off = 0; off + 2 <= cs->size;) {
+        const struct trdb_decoded *d = &cs->decoded[off / 2];
+        if (!d->size) {
+            off += 2;
+            continue;
+        }
+
+        bfd_vma addr = cs->vma + off;
+        if (hidden && d->size == 4 && leader[off / 2 + 1])
+            (*hidden)++;
+        if (blk.instrs == 0)
+            blk.start = addr;
+        blk.last = addr;
+        blk.instrs++;
+        off += d->size;
+
+        /* a block also ends before the next leader or anything that isn't an
+         * instruction
+         */
+        if (falls_through(d) && off + 2 <= cs->size &&
+            cs->decoded[off / 2].size && !leader[off / 2])
+            continue;
+
+        blk.kind        = block_kind(d);
+        blk.taken       = blk.kind == TRDB_BLOCK_FALLTHROUGH ? 0 : d->target;
+        blk.fallthrough = block_continues(blk.kind) ? addr + d->size : 0;
+        if (blocks)
+            blocks[cnt] = blk;
+        cnt++;
+        blk = (struct trdb_block){0};
+    }
+    return cnt;
+}
+
+int trdb_cfg_new(struct trdb_ctx *c, const struct trdb_image *image,
+                 struct trdb_cfg **cfg)
+{
+    int status         = 0;
+    uint8_t **leaders  = NULL;
+    struct trdb_cfg *g = NULL;
+
+    if (!c || !image || !cfg)
+        return -trdb_invalid;
+
+    const struct trdb_section_table *stable = &image->sections;
+
+    g       = calloc(1, sizeof(*g));
+    leaders = calloc(stable->len ? stable->len : 1, sizeof(*leaders));
+    if (!g || !leaders) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    g->image = image;
+
+    for (size_t i = 0; i < stable->len; i++) {
+        leaders[i] = calloc(stable->sections[i].size / 2 + 1, 1);
+        if (!leaders[i]) {
+            status = -trdb_nomem;
+            goto fail;
+        }
+        leaders[i][0] = 1;
+    }
+
+    /* blocks start at jump targets and after each control flow instruction */
+    for (size_t i = 0; i < stable->len; i++) {
+        const struct trdb_code_section *cs = &stable->sections[i];
+        for (bfd_size_type off = 0; off + 2 <= cs->size;) {
+            const struct trdb_decoded *d = &cs->decoded[off / 2];
+            if (!d->size) {
+                off += 2;
+                continue;
+            }
+            if (!falls_through(d)) {
+                mark_leader(stable, leaders, cs->vma + off + d->size);
+                if (d->target)
+                    mark_leader(stable, leaders, d->target);
+            }
+            off += d->size;
+        }
+    }
+
+    for (size_t i = 0; i < stable->len; i++)
+        g->len += split_code_section(&stable->sections[i], leaders[i], NULL,
+                                     &g->hidden);
+    g->blocks = calloc(g->len ? g->len : 1, sizeof(*g->blocks));
+    if (!g->blocks) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    /* sections are sorted, so the blocks are too */
+    for (size_t i = 0, n = 0; i < stable->len; i++)
+        n += split_code_section(&stable->sections[i], leaders[i],
+                                &g->blocks[n], NULL);
+
+    info(c, "control flow graph of %s with %zu basic blocks\n",
+         bfd_get_filename(image->abfd), g->len);
+    if (g->hidden)
+        info(c, "%zu block starts lie inside other instructions, ignored\n",
+             g->hidden);
+    *cfg = g;
+    g    = NULL;
+
+fail:
+    for (size_t i = 0; leaders && i < stable->len; i++)
+        free(leaders[i]);
+    free(leaders);
+    trdb_cfg_free(g);
+    return status;
+}
+
+void trdb_cfg_free(struct trdb_cfg *cfg)
+{
+    if (!cfg)
+        return;
+
+    free(cfg->blocks);
+    free(cfg);
+}
+
+const struct trdb_block *trdb_cfg_blocks(const struct trdb_cfg *cfg,
+                                         size_t *len)
+{
+    *len = cfg->len;
+    return cfg->blocks;
+}
+
+const struct trdb_image *trdb_cfg_image(const struct trdb_cfg *cfg)
+{
+    return cfg->image;
+}
+
+size_t trdb_cfg_hidden(const struct trdb_cfg *cfg)
+{
+    return cfg->hidden;
+}
+
+const struct trdb_block *trdb_cfg_find(const struct trdb_cfg *cfg,
+                                       addr_t addr)
+{
+    size_t lo = 0;
+    size_t hi = cfg->len;
+
+    /* find the last block starting at or before addr */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cfg->blocks[mid].start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0 || addr > cfg->blocks[lo - 1].last)
+        return NULL;
+    return &cfg->blocks[lo - 1];
+}
+
+/* Point @p dinfo at the already loaded @p cs, or at nothing if NULL */
+static void use_code_section(struct disassemble_info *dinfo,
+                             struct trdb_code_section *cs)
+{
+    dinfo->buffer        = cs ? cs->data : NULL;
+    dinfo->buffer_vma    = cs ? cs->vma : 0;
+    dinfo->buffer_length = cs ? cs->size : 0;
+    dinfo->section       = cs ? cs->section : NULL;
+}
+
+/* Allocate memory and the new instruction @p instr to @p instr_list. */
+static int add_trace(struct trdb_ctx *c, struct trdb_instr_head *instr_list,
+                     const struct tr_instr *instr)
+{
+    (void)c;
+    struct tr_instr *add = malloc(sizeof(*add));
+    if (!add)
+        return -trdb_nomem;
+    trdb_perf_count(c, allocs);
+
+    memcpy(add, instr, sizeof(*add));
+    TAILQ_INSERT_TAIL(instr_list, add, list);
+    return 0;
+}
+
+/* Sometimes we leave the current section (e.g. changing from the .start to the
+ * .text section), so let's switch to the section @p pc points into.
+ */
+static int load_section_for_pc(struct trdb_ctx *c,
+                               struct trdb_decompress *dec_ctx, bfd_vma pc)
+{
+    asection *section = dec_ctx->section;
+    if (pc < section->vma + dec_ctx->stop_offset && pc >= section->vma)
+        return 0;
+
+    trdb_perf_start(t);
+    struct trdb_code_section *cs = find_code_section(dec_ctx->sections, pc);
+    if (!cs) {
+        err(c, "VMA (PC) not pointing to any section\n");
+        return -trdb_bad_vma;
+    }
+    dec_ctx->code        = cs;
+    dec_ctx->section     = cs->section;
+    dec_ctx->stop_offset = cs->size / dec_ctx->dinfo.octets_per_byte;
+    use_code_section(&dec_ctx->dinfo, cs);
+    trdb_perf_stop(c, trdb_perf_section, t);
+
+    info(c, "switched to section:%s\n", cs->section->name);
+    return 0;
+}
+
+int trdb_decompress_open(struct trdb_ctx *c, bfd *abfd)
+{
+    int status = 0;
+    if (!c || !abfd)
+        return -trdb_invalid;
+
+    /* We assume our hw block in the pulp generated little endian
+     * addresses, thus we should make sure that before we interact
+     * with bfd addresses to convert this foreign format to the local
+     * host format
+     */
+    /* TODO: supports only statically linked elf executables */
+    struct trdb_decompress *dec_ctx = c->dec;
+
+    /* don't leak a previous session */
+    trdb_decompress_close(c);
+
+    /* the code is either shared or loaded once per context */
+    struct trdb_section_table *sections = NULL;
+    if (c->image && c->image->abfd == abfd) {
+        sections = &c->image->sections;
+    } else {
+        if ((status = attach_section_table(c, abfd)) < 0)
+            return status;
+        sections = c->stable;
+    }
+
+    /* find section belonging to start_address */
+    bfd_vma start_address        = abfd->start_address;
+    struct trdb_code_section *cs = find_code_section(sections, start_address);
+    if (!cs) {
+        err(c, "VMA not pointing to any section\n");
+        return -trdb_bad_vma;
+    }
+    info(c, "Section of start_address:%s\n", cs->section->name);
+
+    if (c->config.decode_cache && (status = attach_decode_cache(c, abfd)) < 0)
+        return status;
+
+    /* define disassembler stuff */
+    dec_ctx->dunit       = (struct disassembler_unit){0};
+    dec_ctx->dinfo       = (struct disassemble_info){0};
+    dec_ctx->dunit.dinfo = &dec_ctx->dinfo;
+    lock_bfd(c);
+    trdb_init_disassembler_unit(&dec_ctx->dunit, abfd, "no-aliases");
+    unlock_bfd(c);
+    /* advanced fprintf output handling */
+    dec_ctx->dinfo.fprintf_func = build_instr_fprintf;
+
+    /* config section data for disassembler */
+    use_code_section(&dec_ctx->dinfo, cs);
+
+    dec_ctx->abfd        = abfd;
+    dec_ctx->sections    = sections;
+    dec_ctx->code        = cs;
+    dec_ctx->section     = cs->section;
+    dec_ctx->stop_offset = cs->size / dec_ctx->dinfo.octets_per_byte;
+    dec_ctx->pc = start_address; /* TODO: well we get a sync packet anyway... */
+
+    return 0;
+}
+
+/* Hand a reconstructed instruction to the caller of trdb_decompress_packet() */
+static inline int emit_instr(struct trdb_ctx *c, const struct tr_instr *instr,
+                             int (*instr_fn)(struct trdb_ctx *c,
+                                             const struct tr_instr *instr,
+                                             void *data),
+                             void *data)
+{
+    if (!c->dec->cfg)
+        fire_event(c, TRDB_EVENT_INSTR_DECODE, NULL, instr);
+    return instr_fn(c, instr, data);
+}
+
+/* Report the block visit in progress, if any */
+static int flush_block(struct trdb_ctx *c, struct trdb_decompress *dec_ctx)
+{
+    const struct trdb_block *block = dec_ctx->block;
+    size_t instrs                  = dec_ctx->block_instrs;
+
+    dec_ctx->block        = NULL;
+    dec_ctx->block_instrs = 0;
+    if (!block || !instrs)
+        return 0;
+    return dec_ctx->block_fn(c, block, instrs, dec_ctx->block_data);
+}
+
+/* Account @p instrs instructions from @p addr on, which continue at @p next,
+ * to the visit of their block. Instructions outside of any block are not
+ * reported.
+ */
+static int visit_block(struct trdb_ctx *c, struct trdb_decompress *dec_ctx,
+                       bfd_vma addr, size_t instrs, bfd_vma next)
+{
+    int status = 0;
+
+    if (!dec_ctx->block || addr != dec_ctx->block_next) {
+        if ((status = flush_block(c, dec_ctx)) < 0)
+            return status;
+        dec_ctx->block = trdb_cfg_find(dec_ctx->cfg, addr);
+        if (!dec_ctx->block)
+            return 0;
+    }
+    dec_ctx->block_instrs += instrs;
+    dec_ctx->block_next = next;
+
+    /* we executed the last instruction of the block */
+    if (next > dec_ctx->block->last)
+        return flush_block(c, dec_ctx);
+    return 0;
+}
+
+/* trdb_decompress_packet() callback of trdb_decompress_packet_blocks() */
+static int visit_instr(struct trdb_ctx *c, const struct tr_instr *instr,
+                       void *data)
+{
+    (void)data;
+    bfd_vma size = (instr->instr & 0x3) != 0x3 ? 2 : 4;
+    return visit_block(c, c->dec, instr->iaddr, 1, instr->iaddr + size);
+}
+
+/* Block level emit_straight_run(), which accounts the instructions of a block
+ * up to its terminating instruction at once if the run starts at the block.
+ */
+static int visit_straight_run(struct trdb_ctx *c,
+                              struct trdb_decompress *dec_ctx, bfd_vma *pc,
+                              bfd_vma stop)
+{
+    struct trdb_code_section *cs     = dec_ctx->code;
+    bfd_vma addr                     = *pc;
+    const struct trdb_decoded *entry = &cs->decoded[(addr - cs->vma) >> 1];
+    int status                       = 0;
+    int cnt                          = 0;
+
+    for (unsigned run = entry->run; run > 0 && addr != stop;) {
+        const struct trdb_block *b = dec_ctx->block;
+        if (!b || addr != dec_ctx->block_next)
+            b = trdb_cfg_find(dec_ctx->cfg, addr);
+
+        size_t instrs = 1;
+        bfd_vma next  = addr + entry->size;
+        if (b && addr == b->start) {
+            bool whole  = b->kind == TRDB_BLOCK_FALLTHROUGH;
+            size_t body = b->instrs - !whole;
+            bfd_vma end = whole ? b->fallthrough : b->last;
+            if (body > 0 && body <= run && !(stop >= addr && stop < end)) {
+                instrs = body;
+                next   = end;
+            }
+        }
+        if ((status = visit_block(c, dec_ctx, addr, instrs, next)) < 0)
+            break;
+        cnt += instrs;
+        run -= instrs;
+        addr  = next;
+        entry = &cs->decoded[(addr - cs->vma) >> 1];
+    }
+
+    *pc = addr;
+    return status < 0 ? status : cnt;
+}
+
+/* Don't stop a straight run before any address */
+#define NO_STOP ((bfd_vma)-1)
+
+/* Emit the instructions from @p pc on that fall through, using the run lengths
+ * precomputed in a trdb_image, and advance @p pc past them. Such a run can't
+ * consume branch map bits, hit a discontinuity or touch the return address
+ * stack, so it is skipped over in one go instead of per instruction. The run
+ * ends before @p stop. Requires load_section_for_pc() on @p pc.
+ *
+ * Returns the number of emitted instructions, zero if @p pc doesn't start a
+ * run or the code isn't predecoded, or a negative error code from @p instr_fn.
+ */
+static int emit_straight_run(struct trdb_ctx *c,
+                             struct trdb_decompress *dec_ctx, bfd_vma *pc,
+                             bfd_vma stop,
+                             int (*instr_fn)(struct trdb_ctx *c,
+                                             const struct tr_instr *instr,
+                                             void *data),
+                             void *data)
+{
+    struct trdb_code_section *cs = dec_ctx->code;
+    struct tr_instr *instr       = c->dis_instr;
+    int status                   = 0;
+    int cnt                      = 0;
+
+    if (!cs || !cs->decoded || wants_disassembly_text(c))
+        return 0;
+    if (dec_ctx->cfg)
+        return visit_straight_run(c, dec_ctx, pc, stop);
+
+    bfd_vma addr                     = *pc;
+    const struct trdb_decoded *entry = &cs->decoded[(addr - cs->vma) >> 1];
+
+    for (unsigned run = entry->run; run > 0 && addr != stop; run--) {
+        *instr = (struct tr_instr){.valid      = true,
+                                   .priv       = dec_ctx->privilege,
+                                   .iaddr      = addr,
+                                   .instr      = entry->instr,
+                                   .compressed = entry->size == 2};
+        if ((status = emit_instr(c, instr, instr_fn, data)) < 0)
+            break;
+        cnt++;
+        addr += entry->size;
+        entry += entry->size >> 1;
+    }
+
+    *pc = addr;
+    return status < 0 ? status : cnt;
+}
+
+int trdb_decompress_packet(struct trdb_ctx *c, struct tr_packet *packet,
+                           int (*instr_fn)(struct trdb_ctx *c,
+                                           const struct tr_instr *instr,
+                                           void *data),
+                           void *data)
+{
+    int status = 0;
+    if (!c || !packet || !instr_fn)
+        return -trdb_invalid;
+
+    struct trdb_decompress *dec_ctx = c->dec;
+    if (!dec_ctx->abfd) {
+        err(c, "decompression has not been opened\n");
+        return -trdb_invalid;
+    }
+
+    struct trdb_config *config = &c->config;
+    bool full_address          = config->full_address;
+    bool implicit_ret          = config->implicit_ret;
+
+    struct disassembler_unit *dunit = &dec_ctx->dunit;
+    struct trdb_decoded decoded     = {0};
+    struct trdb_stack *ras          = &dec_ctx->call_stack;
+    struct tr_instr *dis_instr      = c->dis_instr;
+
+    bfd_vma pc = dec_ctx->pc;
+
+    fire_event(c, TRDB_EVENT_PACKET_DECODE, packet, NULL);
+
+    /* we ignore unknown or unused packets (TIMER, SW) */
+    if (packet->msg_type != W_TRACE) {
+        info(c, "skipped a packet\n");
+        return 0;
+    }
+
+    if ((status = load_section_for_pc(c, dec_ctx, pc)) < 0)
+        goto fail;
+
+    switch (packet->format) {
+    case F_BRANCH_FULL:
+    case F_BRANCH_DIFF:
+        dec_ctx->branch_map.cnt  = packet->branches;
+        dec_ctx->branch_map.bits = packet->branch_map;
+        dec_ctx->branch_map.full =
+            (packet->branches == 31) || (packet->branches == 0);
+        break;
+    case F_SYNC:
+        break;
+    case F_ADDR_ONLY:
+        break;
+    default:
+        /* impossible */
+        status = -trdb_bad_packet;
+        goto fail;
+    }
+
+    trdb_log_packet(c, packet);
+
+    if (packet->format == F_BRANCH_FULL) {
+        /* set when we reach the address of a flush packet, which the
+         * compression emits before exceptions and resync packets
+         */
+        bool hit_address = false;
+        /* We don't need to care about the address field if the branch map
+         * is full,(except if full and instr before last branch is
+         * discontinuity)
+         */
+        bool hit_discontinuity = dec_ctx->branch_map.full;
+
+        /* Remember last packet address to be able to compute differential
+         * address. Careful, a full branch map doesn't always have an
+         * address field
+         * TODO: edgecase where we sign extend from msb of branchmap
+         */
+        addr_t absolute_addr = packet->address;
+
+        if (dec_ctx->branch_map.cnt > 0)
+            dec_ctx->last_packet_addr = absolute_addr;
+
+        /* this indicates we don't have a valid address but still a full
+         * branch map
+         */
+        if (dec_ctx->branch_map.cnt == 0)
+            dec_ctx->branch_map.cnt = 31;
+
+        while (!(dec_ctx->branch_map.cnt == 0 &&
+                 (hit_discontinuity || hit_address))) {
+
+            if ((status = load_section_for_pc(c, dec_ctx, pc)) < 0)
+                goto fail;
+
+            /* with an empty branch map we have to look out for the address */
+            int run = emit_straight_run(
+                c, dec_ctx, &pc,
+                dec_ctx->branch_map.cnt ? NO_STOP : absolute_addr, instr_fn,
+                data);
+            if (run < 0) {
+                status = run;
+                goto fail;
+            }
+            if (run > 0)
+                continue;
+
+            int size =
+                decode_at_pc(c, pc, dis_instr, dunit, &decoded, &status);
+            if (status < 0)
+                goto fail;
+
+            /* TODO: test if packet addr valid first */
+            if (dec_ctx->branch_map.cnt == 0 && pc == absolute_addr)
+                hit_address = true;
+
+            /* handle decoding RAS */
+            addr_t ret_addr = 0;
+
+            int ras_ret = update_ras(c, dis_instr->instr, dis_instr->iaddr,
+                                     decoded.ras, ras, &ret_addr);
+            if (ras_ret < 0) {
+                status = ras_ret;
+                err(c, "return address stack in bad state: %s\n",
+                    trdb_errstr(trdb_errcode(status)));
+                goto fail;
+            }
+            enum trdb_ras instr_ras_type = ras_ret;
 
-                if (instr_ras_type == coret) {
-                    err(c, "coret not implemented yet\n");
-                    goto fail;
+            if (instr_ras_type == coret) {
+                err(c, "coret not implemented yet\n");
+                status = -trdb_unimplemented;
+                goto fail;
+            }
+            /* generate decoded trace */
+            dis_instr->priv = dec_ctx->privilege;
+            if ((status = emit_instr(c, dis_instr, instr_fn, data)) < 0)
+                goto fail;
+
+            /* advance pc */
+            pc += size;
+
+            /* we hit a conditional branch, follow or not and update map */
+            switch (decoded.insn_type) {
+            case dis_nonbranch:
+                /* TODO: we need this hack since {m,s,u} ret are not
+                 * "classified" by libopcodes
+                 */
+                if (!is_unpred_discontinuity(dis_instr->instr,
+                                             implicit_ret)) {
+                    break;
                 }
-                /* generate decoded trace */
-                dis_instr->priv = dec_ctx->privilege;
-                if ((status = add_trace(c, instr_list, dis_instr)) < 0)
-                    goto fail;
-
-                /* advance pc */
-                pc += size;
-
-                /* we hit a conditional branch, follow or not and update map */
-                switch (dinfo.insn_type) {
-                case dis_nonbranch:
-                    /* TODO: we need this hack since {m,s,u} ret are not
-                     * "classified" by libopcodes
-                     */
-                    if (!is_unpred_discontinuity(dis_instr->instr,
-                                                 implicit_ret)) {
-                        break;
+                dbg(c, "detected mret, uret or sret\n");
+                /* fall through */
+            case dis_jsr: /* There is not real difference ... */
+
+                /* fall through */
+            case dis_branch: /* ... between those two */
+                /* we know that this instruction must have its jump target
+                 * encoded in the binary else we would have gotten a
+                 * non-predictable discontinuity packet. If
+                 * branch_map.cnt == 0 + jump target unknown and we are here
+                 * then we know that its actually a branch_map
+                 * flush + discontinuity packet.
+                 */
+                if (implicit_ret && instr_ras_type == ret) {
+                    dbg(c, "returning with stack value %" PRIxADDR "\n",
+                        ret_addr);
+                    pc = ret_addr;
+                    break;
+                }
+
+                /* this should never happen */
+                if (dec_ctx->branch_map.cnt > 1 && decoded.target == 0)
+                    err(c, "can't predict the jump target\n");
+
+                if (dec_ctx->branch_map.cnt == 1 && decoded.target == 0) {
+                    if (!dec_ctx->branch_map.full) {
+                        info(
+                            c,
+                            "we hit the not-full branch_map + address edge case, "
+                            "(branch following discontinuity is included in this "
+                            "packet)\n");
+                        /* TODO: should I poison addr? */
+                        pc = absolute_addr;
+                    } else {
+                        info(
+                            c,
+                            "we hit the full branch_map + address edge case\n");
+                        pc = absolute_addr;
                     }
-                    dbg(c, "detected mret, uret or sret\n");
-                    /* fall through */
-                case dis_jsr: /* There is not real difference ... */
-
-                    /* fall through */
-                case dis_branch: /* ... between those two */
-                    /* we know that this instruction must have its jump target
-                     * encoded in the binary else we would have gotten a
-                     * non-predictable discontinuity packet. If
-                     * branch_map.cnt == 0 + jump target unknown and we are here
-                     * then we know that its actually a branch_map
-                     * flush + discontinuity packet.
+                    hit_discontinuity = true;
+                } else if (dec_ctx->branch_map.cnt > 0 ||
+                           decoded.target != 0) {
+                    /* we should not hit unpredictable
+                     * discontinuities
                      */
-                    if (implicit_ret && instr_ras_type == ret) {
-                        dbg(c, "returning with stack value %" PRIxADDR "\n",
-                            ret_addr);
-                        pc = ret_addr;
-                        break;
-                    }
+                    pc = decoded.target;
+                } else {
+                    /* we finally hit a jump with unknown  destination,
+                     * thus the information in this packet  is used up
+                     */
+                    pc                = absolute_addr;
+                    hit_discontinuity = true;
+                    info(c, "found discontinuity\n");
+                }
+                break;
 
+            case dis_condbranch:
+                /* this case allows us to exhaust the branch bits */
+                {
+                    /* 32 would be undefined */
+                    bool branch_taken = !(dec_ctx->branch_map.bits & 1);
+                    dec_ctx->branch_map.bits >>= 1;
+                    dec_ctx->branch_map.cnt--;
                     /* this should never happen */
-                    if (dec_ctx->branch_map.cnt > 1 && dinfo.target == 0)
+                    if (decoded.target == 0)
                         err(c, "can't predict the jump target\n");
+                    if (branch_taken)
+                        pc = decoded.target;
+                    /* see in F_BRANCH_DIFF below why we need this */
+                    if (dec_ctx->branch_map.cnt == 0 &&
+                        dis_instr->iaddr == absolute_addr)
+                        hit_address = true;
+                    break;
+                }
+            case dis_dref:
+                /* err(c, "Don't know what to do with this type\n"); */
+                break;
 
-                    if (dec_ctx->branch_map.cnt == 1 && dinfo.target == 0) {
-                        if (!dec_ctx->branch_map.full) {
-                            info(
-                                c,
-                                "we hit the not-full branch_map + address edge case, "
-                                "(branch following discontinuity is included in this "
-                                "packet)\n");
-                            /* TODO: should I poison addr? */
-                            pc = absolute_addr;
-                        } else {
-                            info(
-                                c,
-                                "we hit the full branch_map + address edge case\n");
-                            pc = absolute_addr;
-                        }
-                        hit_discontinuity = true;
-                    } else if (dec_ctx->branch_map.cnt > 0 ||
-                               dinfo.target != 0) {
-                        /* we should not hit unpredictable
-                         * discontinuities
-                         */
-                        pc = dinfo.target;
-                    } else {
-                        /* we finally hit a jump with unknown  destination,
-                         * thus the information in this packet  is used up
-                         */
-                        pc                = absolute_addr;
-                        hit_discontinuity = true;
-                        info(c, "found discontinuity\n");
-                    }
+            case dis_dref2:
+            case dis_condjsr:
+            case dis_noninsn:
+                err(c, "invalid insn_type: %d\n", decoded.insn_type);
+                status = -trdb_bad_instr;
+                goto fail;
+            }
+        }
+    } else if (packet->format == F_BRANCH_DIFF) {
+        if (full_address) {
+            err(c,
+                "F_BRANCH_DIFF shouldn't happen, decoder configured with full_address\n");
+            status = -trdb_bad_config;
+            goto fail;
+        }
+
+        /* We have to find the instruction where we can apply the address
+         * information to. This might either be a discontinuity information
+         * or a sync up address. Furthermore we have to calculate the
+         * absolute address we are referring to.
+         */
+        bool hit_address = false;
+        /* We don't need to care about the address field if the branch map
+         * is full,(except if full and instr before last branch is
+         * discontinuity)
+         */
+        bool hit_discontinuity = dec_ctx->branch_map.full;
+
+        addr_t absolute_addr = dec_ctx->last_packet_addr - packet->address;
+
+        dbg(c,
+            "F_BRANCH_DIFF resolved address:%" PRIxADDR " from %" PRIxADDR
+            " - %" PRIxADDR "\n",
+            absolute_addr, dec_ctx->last_packet_addr, packet->address);
+
+        /* Remember last packet address to be able to compute differential
+         * address. Careful, a full branch map doesn't always have an
+         * address field
+         * TODO: edgecase where we sign extend from msb of branchmap
+         */
+        if (dec_ctx->branch_map.cnt > 0)
+            dec_ctx->last_packet_addr = absolute_addr;
+        /* this indicates we don't have a valid address but still a full
+         * branch map
+         */
+        if (dec_ctx->branch_map.cnt == 0)
+            dec_ctx->branch_map.cnt = 31;
+
+        while (!(dec_ctx->branch_map.cnt == 0 &&
+                 (hit_discontinuity || hit_address))) {
+
+            if ((status = load_section_for_pc(c, dec_ctx, pc)) < 0)
+                goto fail;
+
+            /* with an empty branch map we have to look out for the address */
+            int run = emit_straight_run(
+                c, dec_ctx, &pc,
+                dec_ctx->branch_map.cnt ? NO_STOP : absolute_addr, instr_fn,
+                data);
+            if (run < 0) {
+                status = run;
+                goto fail;
+            }
+            if (run > 0)
+                continue;
+
+            int size =
+                decode_at_pc(c, pc, dis_instr, dunit, &decoded, &status);
+            if (status < 0)
+                goto fail;
+
+            if (dec_ctx->branch_map.cnt == 0 && pc == absolute_addr)
+                hit_address = true;
+
+            /* handle decoding RAS */
+            addr_t ret_addr = 0;
+
+            int ras_ret = update_ras(c, dis_instr->instr, dis_instr->iaddr,
+                                     decoded.ras, ras, &ret_addr);
+            if (ras_ret < 0) {
+                status = ras_ret;
+                err(c, "return address stack in bad state: %s\n",
+                    trdb_errstr(trdb_errcode(status)));
+                goto fail;
+            }
+            enum trdb_ras instr_ras_type = ras_ret;
+
+            if (instr_ras_type == coret) {
+                err(c, "coret not implemented yet\n");
+                status = -trdb_unimplemented;
+                goto fail;
+            }
+
+            /* generate decoded trace */
+            dis_instr->priv = dec_ctx->privilege;
+            if ((status = emit_instr(c, dis_instr, instr_fn, data)) < 0)
+                goto fail;
+
+            /* advance pc */
+            pc += size;
+
+            /* we hit a conditional branch, follow or not and update map */
+            switch (decoded.insn_type) {
+            case dis_nonbranch:
+                /* TODO: we need this hack since {m,s,u} ret are not
+                 * "classified" by libopcodes
+                 */
+                if (!is_unpred_discontinuity(dis_instr->instr,
+                                             implicit_ret)) {
                     break;
+                }
+                dbg(c, "detected mret, uret or sret\n");
+                /* fall through */
+            case dis_jsr: /* There is not real difference ... */
 
-                case dis_condbranch:
-                    /* this case allows us to exhaust the branch bits */
-                    {
-                        /* 32 would be undefined */
-                        bool branch_taken = !(dec_ctx->branch_map.bits & 1);
-                        dec_ctx->branch_map.bits >>= 1;
-                        dec_ctx->branch_map.cnt--;
-                        /* this should never happen */
-                        if (dinfo.target == 0)
-                            err(c, "can't predict the jump target\n");
-                        if (branch_taken)
-                            pc = dinfo.target;
-                        /* see in F_BRANCH_DIFF below why we need this */
-                        if (dec_ctx->branch_map.cnt == 0 &&
-                            (pc - size) == absolute_addr)
-                            hit_address = true;
-                        break;
-                    }
-                case dis_dref:
-                    /* err(c, "Don't know what to do with this type\n"); */
+                /* fall through */
+            case dis_branch: /* ... between those two */
+                /* we know that this instruction must have its jump target
+                 * encoded in the binary else we would have gotten a
+                 * non-predictable discontinuity packet. If
+                 * branch_map.cnt == 0 + jump target unknown and we are here
+                 * then we know that its actually a branch_map
+                 * flush + discontinuity packet.
+                 */
+                if (implicit_ret && instr_ras_type == ret) {
+                    dbg(c, "returning with stack value %" PRIxADDR "\n",
+                        ret_addr);
+                    pc = ret_addr;
                     break;
+                }
 
-                case dis_dref2:
-                case dis_condjsr:
-                case dis_noninsn:
-                    err(c, "invalid insn_type: %d\n", dinfo.insn_type);
-                    status = -trdb_bad_instr;
-                    goto fail;
+                /* this should never happen */
+                if (dec_ctx->branch_map.cnt > 1 && decoded.target == 0)
+                    err(c, "can't predict the jump target\n");
+
+                if (dec_ctx->branch_map.cnt == 1 && decoded.target == 0) {
+                    if (!dec_ctx->branch_map.full) {
+                        info(
+                            c,
+                            "we hit the not-full branch_map + address edge case, "
+                            "(branch following discontinuity is included in this "
+                            "packet)\n");
+                        /* TODO: should I poison addr? */
+                        pc = absolute_addr;
+                    } else {
+                        info(
+                            c,
+                            "we hit the full branch_map + address edge case\n");
+                        pc = absolute_addr;
+                    }
+                    hit_discontinuity = true;
+                } else if (dec_ctx->branch_map.cnt > 0 ||
+                           decoded.target != 0) {
+                    /* we should not hit unpredictable discontinuities */
+                    pc = decoded.target;
+                } else {
+                    /* we finally hit a jump with unknown destination, thus
+                     * the information in this packet is used up
+                     */
+                    pc                = absolute_addr;
+                    hit_discontinuity = true;
+                    info(c, "found discontinuity\n");
                 }
-            }
-        } else if (packet->format == F_BRANCH_DIFF) {
-            if (full_address) {
-                err(c,
-                    "F_BRANCH_DIFF shouldn't happen, decoder configured with full_address\n");
-                status = -trdb_bad_config;
+                break;
+
+            case dis_condbranch:
+                /* this case allows us to exhaust the branch bits */
+                {
+                    /* 32 would be undefined */
+                    bool branch_taken = !(dec_ctx->branch_map.bits & 1);
+                    dec_ctx->branch_map.bits >>= 1;
+                    dec_ctx->branch_map.cnt--;
+                    /* this should never happen */
+                    if (decoded.target == 0)
+                        err(c, "can't predict the jump target\n");
+                    /* go to new address */
+                    if (branch_taken)
+                        pc = decoded.target;
+                    /* When dealing with exceptions or resync packets, a
+                     * "flush" packet can have its address set to a branch.
+                     * The branchmap counter will be incremented in that
+                     * case. The behaviour we want is that we want to
+                     * consume a branchmap entry and the address entry at
+                     * the same time. This we have to check here.
+                     *
+                     * Example:
+                     * 0x3c  [...]
+                     * [...] assume 3 branches seen
+                     * 0x40  bneq a0, a1, somewhere <- F_BRANCH_*
+                     *       with branchmap count = 3 + 1 and addr = 0x40
+                     * 0x100 first instruction of trap handler <- F_SYNC
+                     */
+                    if (dec_ctx->branch_map.cnt == 0 &&
+                        (dis_instr->iaddr == absolute_addr))
+                        hit_address = true;
+                    break;
+                }
+            case dis_dref:
+                /* err(c, "Don't know what to do with this type\n"); */
+                break;
+
+            case dis_dref2:
+            case dis_condjsr:
+            case dis_noninsn:
+                err(c, "invalid insn_type: %d\n", decoded.insn_type);
+                status = -trdb_bad_instr;
                 goto fail;
             }
+        }
 
-            /* We have to find the instruction where we can apply the address
-             * information to. This might either be a discontinuity information
-             * or a sync up address. Furthermore we have to calculate the
-             * absolute address we are referring to.
-             */
-            bool hit_address = false;
-            /* We don't need to care about the address field if the branch map
-             * is full,(except if full and instr before last branch is
-             * discontinuity)
-             */
-            bool hit_discontinuity = dec_ctx->branch_map.full;
+    } else if (packet->format == F_SYNC) {
+        /* Sync pc. */
+        dec_ctx->privilege = packet->privilege;
+        pc                 = packet->address;
+
+        /* Remember last packet address to be able to compute differential
+         * addresses
+         */
+        dec_ctx->last_packet_addr = packet->address;
 
-            addr_t absolute_addr = dec_ctx->last_packet_addr - packet->address;
+        /* with ras_tracking the compression starts over with an empty
+         * return address stack
+         */
+        if (c->config.ras_tracking) {
+            ras->top = 0;
+            ras->len = 0;
+        }
 
-            dbg(c,
-                "F_BRANCH_DIFF resolved address:%" PRIxADDR " from %" PRIxADDR
-                " - %" PRIxADDR "\n",
-                absolute_addr, dec_ctx->last_packet_addr, packet->address);
+        /* since we are abruptly changing the pc we have to check if we
+         * leave the section before we can disassemble
+         */
+        if ((status = load_section_for_pc(c, dec_ctx, pc)) < 0)
+            goto fail;
 
-            /* Remember last packet address to be able to compute differential
-             * address. Careful, a full branch map doesn't always have an
-             * address field
-             * TODO: edgecase where we sign extend from msb of branchmap
-             */
-            if (dec_ctx->branch_map.cnt > 0)
-                dec_ctx->last_packet_addr = absolute_addr;
-            /* this indicates we don't have a valid address but still a full
-             * branch map
-             */
-            if (dec_ctx->branch_map.cnt == 0)
-                dec_ctx->branch_map.cnt = 31;
-
-            while (!(dec_ctx->branch_map.cnt == 0 &&
-                     (hit_discontinuity || hit_address))) {
-
-                if (pc >= section->vma + stop_offset || pc < section->vma) {
-                    section = trdb_get_section_for_vma(abfd, pc);
-                    if (!section) {
-                        err(c, "VMA (PC) not pointing to any section\n");
-                        status = -trdb_bad_vma;
-                        goto fail;
-                    }
-                    stop_offset =
-                        bfd_section_size(section) / dinfo.octets_per_byte;
+        int size =
+            decode_at_pc(c, pc, dis_instr, dunit, &decoded, &status);
+        if (status < 0)
+            goto fail;
 
-                    free_section_for_debugging(&dinfo);
-                    if ((status = alloc_section_for_debugging(c, abfd, section,
-                                                              &dinfo)) < 0)
-                        goto fail;
+        /* periodic resync packets can land on calls, so keep the return
+         * address stack up to date
+         */
+        addr_t ret_addr = 0;
+
+        int ras_ret = update_ras(c, dis_instr->instr, dis_instr->iaddr,
+                                 decoded.ras, ras, &ret_addr);
+        if (ras_ret < 0) {
+            status = ras_ret;
+            err(c, "return address stack in bad state: %s\n",
+                trdb_errstr(trdb_errcode(status)));
+            goto fail;
+        }
+        enum trdb_ras instr_ras_type = ras_ret;
 
-                    info(c, "switched to section:%s\n", section->name);
-                }
+        if (instr_ras_type == coret) {
+            err(c, "coret not implemented yet\n");
+            status = -trdb_unimplemented;
+            goto fail;
+        }
 
-                int size = disassemble_at_pc(c, pc, dis_instr, &dunit, &status);
-                if (status < 0)
-                    goto fail;
-
-                if (dec_ctx->branch_map.cnt == 0 && pc == absolute_addr)
-                    hit_address = true;
-
-                /* handle decoding RAS */
-                addr_t ret_addr              = 0;
-                enum trdb_ras instr_ras_type = update_ras(
-                    c, dis_instr->instr, dis_instr->iaddr, ras, &ret_addr);
-                if (instr_ras_type < 0) {
-                    err(c, "return address stack in bad state: %s\n",
-                        trdb_errstr(trdb_errcode(status)));
-                    goto fail;
-                }
-                if (instr_ras_type == coret) {
-                    err(c, "coret not implemented yet\n");
-                    goto fail;
-                }
+        dis_instr->priv = dec_ctx->privilege;
+        if ((status = emit_instr(c, dis_instr, instr_fn, data)) < 0)
+            goto fail;
 
-                /* generate decoded trace */
-                dis_instr->priv = dec_ctx->privilege;
-                if ((status = add_trace(c, instr_list, dis_instr)) < 0)
-                    goto fail;
+        pc += size;
 
-                /* advance pc */
-                pc += size;
+        switch (decoded.insn_type) {
+        case dis_nonbranch:
+            /* TODO: we need this hack since {m,s,u} ret are not
+             * "classified"" in libopcodes
+             */
+            if (!is_unpred_discontinuity(dis_instr->instr, implicit_ret)) {
+                break;
+            }
+            dbg(c, "detected mret, uret or sret\n");
+            /* fall through */
+        case dis_jsr: /* There is not real difference ... */
+
+            /* fall through */
+        case dis_branch: /* ... between those two */
+            if (implicit_ret && instr_ras_type == ret) {
+                dbg(c, "returning with stack value %" PRIxADDR "\n",
+                    ret_addr);
+                pc = ret_addr;
+                break;
+            }
+            /* this should never happen */
+            if (decoded.target == 0)
+                err(c, "can't predict the jump target\n");
+            pc = decoded.target;
+            break;
 
-                /* we hit a conditional branch, follow or not and update map */
-                switch (dinfo.insn_type) {
-                case dis_nonbranch:
-                    /* TODO: we need this hack since {m,s,u} ret are not
-                     * "classified" by libopcodes
-                     */
-                    if (!is_unpred_discontinuity(dis_instr->instr,
-                                                 implicit_ret)) {
-                        break;
-                    }
-                    dbg(c, "detected mret, uret or sret\n");
-                    /* fall through */
-                case dis_jsr: /* There is not real difference ... */
-
-                    /* fall through */
-                case dis_branch: /* ... between those two */
-                    /* we know that this instruction must have its jump target
-                     * encoded in the binary else we would have gotten a
-                     * non-predictable discontinuity packet. If
-                     * branch_map.cnt == 0 + jump target unknown and we are here
-                     * then we know that its actually a branch_map
-                     * flush + discontinuity packet.
-                     */
-                    if (implicit_ret && instr_ras_type == ret) {
-                        dbg(c, "returning with stack value %" PRIxADDR "\n",
-                            ret_addr);
-                        pc = ret_addr;
-                        break;
-                    }
+        case dis_condbranch:
+            /* this should never happen */
+            if (decoded.target == 0)
+                err(c, "can't predict the jump target\n");
+            if (packet->branch == 0) {
+                err(c, "doing a branch from a F_SYNC packet\n");
+                pc = decoded.target;
+            }
+            break;
+        case dis_dref: /* TODO: is this useful? */
+            break;
+        case dis_dref2:
+        case dis_condjsr:
+        case dis_noninsn:
+            err(c, "invalid insn_type: %d\n", decoded.insn_type);
+            status = -trdb_bad_instr;
+            goto fail;
+        }
+    } else if (packet->format == F_ADDR_ONLY) {
+        /* Thoughts on F_ADDR_ONLY packets:
+         *
+         * We have to find the instruction where we can apply the address
+         * information to. This might either be a "discontinuity
+         * information", that is the target address of e.g. a jalr, or a the
+         * address itself. The latter case e.g. happens when we get a packet
+         * due to stopping the tracing, kind of a delimiter packet. So what
+         * we do is we stop either at the given address or use it on a
+         * discontinuity, whichever comes first. This means there can be an
+         * ambiguity between whether a packet is meant for an address or
+         * for a jump target. This could happen if we have jr infinite loop
+         * with the only way out being exception.
+         *
+         * Resync packets have that issue too, namely that we can't
+         * distinguishing between address sync and unpredictable
+         * discontinuities.
+         */
+        bool hit_address       = false;
+        bool hit_discontinuity = false;
 
-                    /* this should never happen */
-                    if (dec_ctx->branch_map.cnt > 1 && dinfo.target == 0)
-                        err(c, "can't predict the jump target\n");
+        addr_t absolute_addr = 0;
+        if (full_address) {
+            absolute_addr = packet->address;
+        } else {
+            /* absolute_addr = dec_ctx->last_packet_addr - sext_addr; */
+            absolute_addr = dec_ctx->last_packet_addr - packet->address;
+        }
 
-                    if (dec_ctx->branch_map.cnt == 1 && dinfo.target == 0) {
-                        if (!dec_ctx->branch_map.full) {
-                            info(
-                                c,
-                                "we hit the not-full branch_map + address edge case, "
-                                "(branch following discontinuity is included in this "
-                                "packet)\n");
-                            /* TODO: should I poison addr? */
-                            pc = absolute_addr;
-                        } else {
-                            info(
-                                c,
-                                "we hit the full branch_map + address edge case\n");
-                            pc = absolute_addr;
-                        }
-                        hit_discontinuity = true;
-                    } else if (dec_ctx->branch_map.cnt > 0 ||
-                               dinfo.target != 0) {
-                        /* we should not hit unpredictable discontinuities */
-                        pc = dinfo.target;
-                    } else {
-                        /* we finally hit a jump with unknown destination, thus
-                         * the information in this packet is used up
-                         */
-                        pc                = absolute_addr;
-                        hit_discontinuity = true;
-                        info(c, "found discontinuity\n");
-                    }
-                    break;
+        dbg(c,
+            "F_ADDR_ONLY resolved address:%" PRIxADDR " from %" PRIxADDR
+            " - %" PRIxADDR "\n",
+            absolute_addr, dec_ctx->last_packet_addr, packet->address);
 
-                case dis_condbranch:
-                    /* this case allows us to exhaust the branch bits */
-                    {
-                        /* 32 would be undefined */
-                        bool branch_taken = !(dec_ctx->branch_map.bits & 1);
-                        dec_ctx->branch_map.bits >>= 1;
-                        dec_ctx->branch_map.cnt--;
-                        /* this should never happen */
-                        if (dinfo.target == 0)
-                            err(c, "can't predict the jump target\n");
-                        /* go to new address */
-                        if (branch_taken)
-                            pc = dinfo.target;
-                        /* When dealing with exceptions, a "flush" packet can
-                         * have its address set to a branch. The branchmap
-                         * counter will be incremented in that case. The
-                         * behaviour we want is that we want to consume a
-                         * branchmap entry and the address entry at the same
-                         * time. This we have to check here.
-                         *
-                         * Example:
-                         * 0x3c  [...]
-                         * [...] assume 3 branches seen
-                         * 0x40  bneq a0, a1, somewhere <- F_BRANCH_*
-                         *       with branchmap count = 3 + 1 and addr = 0x40
-                         * 0x100 first instruction of trap handler <- F_SYNC
-                         */
-                        if (dec_ctx->branch_map.cnt == 0 &&
-                            ((pc - size) == absolute_addr))
-                            hit_address = true;
-                        break;
-                    }
-                case dis_dref:
-                    /* err(c, "Don't know what to do with this type\n"); */
-                    break;
+        /* Remember last packet address to be able to compute differential
+         * addresses
+         */
+        dec_ctx->last_packet_addr = absolute_addr;
 
-                case dis_dref2:
-                case dis_condjsr:
-                case dis_noninsn:
-                    err(c, "invalid insn_type: %d\n", dinfo.insn_type);
-                    status = -trdb_bad_instr;
-                    goto fail;
-                }
-            }
+        while (!(hit_address || hit_discontinuity)) {
+            if ((status = load_section_for_pc(c, dec_ctx, pc)) < 0)
+                goto fail;
 
-        } else if (packet->format == F_SYNC) {
-            /* Sync pc. */
-            dec_ctx->privilege = packet->privilege;
-            pc                 = packet->address;
+            int run = emit_straight_run(c, dec_ctx, &pc, absolute_addr,
+                                        instr_fn, data);
+            if (run < 0) {
+                status = run;
+                goto fail;
+            }
+            if (run > 0)
+                continue;
 
-            /* Remember last packet address to be able to compute differential
-             * addresses
-             */
-            dec_ctx->last_packet_addr = packet->address;
+            int size =
+                decode_at_pc(c, pc, dis_instr, dunit, &decoded, &status);
+            if (status < 0)
+                goto fail;
 
-            /* since we are abruptly changing the pc we have to check if we
-             * leave the section before we can disassemble. This is really ugly
-             * TODO: fix
-             */
-            if (pc >= section->vma + stop_offset || pc < section->vma) {
-                section = trdb_get_section_for_vma(abfd, pc);
-                if (!section) {
-                    err(c, "VMA (PC) not pointing to any section\n");
-                    status = -trdb_bad_vma;
-                    goto fail;
-                }
-                stop_offset = bfd_section_size(section) / dinfo.octets_per_byte;
+            if (pc == absolute_addr)
+                hit_address = true;
 
-                free_section_for_debugging(&dinfo);
-                if ((status = alloc_section_for_debugging(c, abfd, section,
-                                                          &dinfo)) < 0)
-                    goto fail;
+            /* handle decoding RAS */
+            addr_t ret_addr = 0;
 
-                info(c, "switched to section:%s\n", section->name);
+            int ras_ret = update_ras(c, dis_instr->instr, dis_instr->iaddr,
+                                     decoded.ras, ras, &ret_addr);
+            if (ras_ret < 0) {
+                status = ras_ret;
+                err(c, "return address stack in bad state: %s\n",
+                    trdb_errstr(trdb_errcode(status)));
+                goto fail;
             }
+            enum trdb_ras instr_ras_type = ras_ret;
 
-            int status = 0;
-            int size   = disassemble_at_pc(c, pc, dis_instr, &dunit, &status);
-            if (status < 0)
+            if (instr_ras_type == coret) {
+                err(c, "coret not implemented yet\n");
+                status = -trdb_unimplemented;
                 goto fail;
+            }
 
-            /* TODO: warning, RAS handling is missing here */
+            /* generate decoded trace */
             dis_instr->priv = dec_ctx->privilege;
-            if ((status = add_trace(c, instr_list, dis_instr)) < 0)
+            if ((status = emit_instr(c, dis_instr, instr_fn, data)) < 0)
                 goto fail;
 
+            /* advance pc */
             pc += size;
 
-            switch (dinfo.insn_type) {
+            switch (decoded.insn_type) {
             case dis_nonbranch:
                 /* TODO: we need this hack since {m,s,u} ret are not
-                 * "classified"" in libopcodes
+                 * "classified" by libopcodes
                  */
-                if (!is_unpred_discontinuity(dis_instr->instr, implicit_ret)) {
+                if (!is_unpred_discontinuity(dis_instr->instr,
+                                             implicit_ret)) {
                     break;
                 }
                 dbg(c, "detected mret, uret or sret\n");
+
                 /* fall through */
             case dis_jsr: /* There is not real difference ... */
 
                 /* fall through */
             case dis_branch: /* ... between those two */
-                             /* this should never happen */
-                if (dinfo.target == 0)
-                    err(c, "can't predict the jump target\n");
-                pc = dinfo.target;
+                if (implicit_ret && instr_ras_type == ret) {
+                    dbg(c, "returning with stack value %" PRIxADDR "\n",
+                        ret_addr);
+                    pc = ret_addr;
+                    break;
+                }
+
+                if (decoded.target) {
+                    pc = decoded.target;
+                } else {
+                    info(c, "found the discontinuity\n");
+                    pc                = absolute_addr;
+                    hit_discontinuity = true;
+                }
                 break;
 
             case dis_condbranch:
-                /* this should never happen */
-                if (dinfo.target == 0)
-                    err(c, "can't predict the jump target\n");
-                if (packet->branch == 0) {
-                    err(c, "doing a branch from a F_SYNC packet\n");
-                    pc = dinfo.target;
-                }
+                err(c,
+                    "we shouldn't hit conditional branches with F_ADDRESS_ONLY\n");
                 break;
+
             case dis_dref: /* TODO: is this useful? */
                 break;
             case dis_dref2:
             case dis_condjsr:
             case dis_noninsn:
-                err(c, "invalid insn_type: %d\n", dinfo.insn_type);
+                err(c, "invalid insn_type: %d\n", decoded.insn_type);
                 status = -trdb_bad_instr;
                 goto fail;
             }
-        } else if (packet->format == F_ADDR_ONLY) {
-            /* Thoughts on F_ADDR_ONLY packets:
-             *
-             * We have to find the instruction where we can apply the address
-             * information to. This might either be a "discontinuity
-             * information", that is the target address of e.g. a jalr, or a the
-             * address itself. The latter case e.g. happens when we get a packet
-             * due to stopping the tracing, kind of a delimiter packet. So what
-             * we do is we stop either at the given address or use it on a
-             * discontinuity, whichever comes first. This means there can be an
-             * ambiguity between whether a packet is meant for an address or
-             * for a jump target. This could happen if we have jr infinite loop
-             * with the only way out being exception.
-             *
-             * Resync packets have that issue too, namely that we can't
-             * distinguishing between address sync and unpredictable
-             * discontinuities.
-             */
-            bool hit_address       = false;
-            bool hit_discontinuity = false;
+        }
+    }
 
-            addr_t absolute_addr = 0;
-            if (full_address) {
-                absolute_addr = packet->address;
-            } else {
-                /* absolute_addr = dec_ctx->last_packet_addr - sext_addr; */
-                absolute_addr = dec_ctx->last_packet_addr - packet->address;
-            }
+    dec_ctx->pc = pc;
+    return status;
 
-            dbg(c,
-                "F_ADDR_ONLY resolved address:%" PRIxADDR " from %" PRIxADDR
-                " - %" PRIxADDR "\n",
-                absolute_addr, dec_ctx->last_packet_addr, packet->address);
+fail:
+    dec_ctx->pc = pc;
+    return status;
+}
 
-            /* Remember last packet address to be able to compute differential
-             * addresses
-             */
-            dec_ctx->last_packet_addr = absolute_addr;
+int trdb_decompress_packet_blocks(
+    struct trdb_ctx *c, const struct trdb_cfg *cfg, struct tr_packet *packet,
+    int (*block_fn)(struct trdb_ctx *c, const struct trdb_block *block,
+                    size_t instrs, void *data),
+    void *data)
+{
+    int status = 0;
+    if (!c || !cfg || !packet || !block_fn)
+        return -trdb_invalid;
 
-            while (!(hit_address || hit_discontinuity)) {
-                int status = 0;
+    struct trdb_decompress *dec_ctx = c->dec;
+    if (dec_ctx->abfd && dec_ctx->abfd != cfg->image->abfd) {
+        err(c, "control flow graph belongs to a different program\n");
+        return -trdb_invalid;
+    }
 
-                if (pc >= section->vma + stop_offset || pc < section->vma) {
-                    section = trdb_get_section_for_vma(abfd, pc);
-                    if (!section) {
-                        err(c, "VMA (PC) not pointing to any section\n");
-                        status = -trdb_bad_vma;
-                        goto fail;
-                    }
-                    stop_offset =
-                        bfd_section_size(section) / dinfo.octets_per_byte;
+    dec_ctx->cfg        = cfg;
+    dec_ctx->block_fn   = block_fn;
+    dec_ctx->block_data = data;
 
-                    free_section_for_debugging(&dinfo);
-                    if ((status = alloc_section_for_debugging(c, abfd, section,
-                                                              &dinfo)) < 0)
-                        goto fail;
+    status = trdb_decompress_packet(c, packet, visit_instr, NULL);
+    if (status >= 0)
+        status = flush_block(c, dec_ctx);
 
-                    info(c, "switched to section:%s\n", section->name);
-                }
+    dec_ctx->cfg          = NULL;
+    dec_ctx->block        = NULL;
+    dec_ctx->block_instrs = 0;
+    dec_ctx->block_fn     = NULL;
+    dec_ctx->block_data   = NULL;
+    return status;
+}
 
-                int size = disassemble_at_pc(c, pc, dis_instr, &dunit, &status);
-                if (status < 0)
-                    goto fail;
-
-                if (pc == absolute_addr)
-                    hit_address = true;
-
-                /* handle decoding RAS */
-                addr_t ret_addr              = 0;
-                enum trdb_ras instr_ras_type = update_ras(
-                    c, dis_instr->instr, dis_instr->iaddr, ras, &ret_addr);
-                if (instr_ras_type < 0) {
-                    err(c, "return address stack in bad state: %s\n",
-                        trdb_errstr(trdb_errcode(status)));
-                    goto fail;
-                }
-                if (instr_ras_type == coret) {
-                    err(c, "coret not implemented yet\n");
-                    goto fail;
-                }
+void trdb_decompress_close(struct trdb_ctx *c)
+{
+    if (!c || !c->dec)
+        return;
+
+    struct trdb_decompress *dec_ctx = c->dec;
+    use_code_section(&dec_ctx->dinfo, NULL);
+    free(dec_ctx->dinfo.private_data);
+    dec_ctx->dinfo.private_data = NULL;
+
+    dec_ctx->abfd        = NULL;
+    dec_ctx->sections    = NULL;
+    dec_ctx->code        = NULL;
+    dec_ctx->section     = NULL;
+    dec_ctx->stop_offset = 0;
+
+    /* once the bfd is closed another one can get its address, so neither the
+     * section table nor the decode cache could tell it apart
+     */
+    free_section_table(c->stable);
+    c->stable = NULL;
+    free_decode_cache(c->dcache);
+    c->dcache = NULL;
+}
 
-                /* generate decoded trace */
-                dis_instr->priv = dec_ctx->privilege;
-                if ((status = add_trace(c, instr_list, dis_instr)) < 0)
-                    goto fail;
+/* trdb_decompress_packet() callback appending to a trdb_instr_head */
+static int append_instr(struct trdb_ctx *c, const struct tr_instr *instr,
+                        void *data)
+{
+    return add_trace(c, data, instr);
+}
 
-                /* advance pc */
-                pc += size;
+int trdb_decompress_trace(struct trdb_ctx *c, bfd *abfd,
+                          struct trdb_packet_head *packet_list,
+                          struct trdb_instr_head *instr_list)
+{
+    int status = 0;
+    if (!c || !abfd || !packet_list || !instr_list)
+        return -trdb_invalid;
 
-                switch (dinfo.insn_type) {
-                case dis_nonbranch:
-                    /* TODO: we need this hack since {m,s,u} ret are not
-                     * "classified" by libopcodes
-                     */
-                    if (!is_unpred_discontinuity(dis_instr->instr,
-                                                 implicit_ret)) {
-                        break;
-                    }
-                    dbg(c, "detected mret, uret or sret\n");
-
-                    /* fall through */
-                case dis_jsr: /* There is not real difference ... */
-
-                    /* fall through */
-                case dis_branch: /* ... between those two */
-                    if (implicit_ret && instr_ras_type == ret) {
-                        dbg(c, "returning with stack value %" PRIxADDR "\n",
-                            ret_addr);
-                        pc = ret_addr;
-                        break;
-                    }
+    if ((status = trdb_decompress_open(c, abfd)) < 0)
+        return status;
 
-                    if (dinfo.target) {
-                        pc = dinfo.target;
-                    } else {
-                        info(c, "found the discontinuity\n");
-                        pc                = absolute_addr;
-                        hit_discontinuity = true;
-                    }
-                    break;
+    struct tr_packet *packet = NULL;
+    TAILQ_FOREACH (packet, packet_list, list) {
+        status = trdb_decompress_packet(c, packet, append_instr, instr_list);
+        if (status < 0)
+            break;
+    }
 
-                case dis_condbranch:
-                    err(c,
-                        "we shouldn't hit conditional branches with F_ADDRESS_ONLY\n");
-                    break;
+    trdb_decompress_close(c);
+    return status;
+}
 
-                case dis_dref: /* TODO: is this useful? */
-                    break;
-                case dis_dref2:
-                case dis_condjsr:
-                case dis_noninsn:
-                    err(c, "invalid insn_type: %d\n", dinfo.insn_type);
-                    status = -trdb_bad_instr;
-                    goto fail;
-                }
+/* trdb_decompress_packet() callback appending to a trdb_instr_vec */
+static int push_instr(struct trdb_ctx *c, const struct tr_instr *instr,
+                      void *data)
+{
+    (void)c;
+    return trdb_instr_vec_push(data, instr);
+}
+
+int trdb_decompress_trace_vec(struct trdb_ctx *c, bfd *abfd,
+                              struct trdb_packet_vec *packets,
+                              struct trdb_instr_vec *instrs)
+{
+    int status = 0;
+    if (!c || !abfd || !packets || !instrs)
+        return -trdb_invalid;
+
+    if ((status = trdb_decompress_open(c, abfd)) < 0)
+        return status;
+
+    struct tr_packet *packet = NULL;
+    size_t i                 = 0;
+    TRDB_VEC_FOREACH (packet, i, packets) {
+        status = trdb_decompress_packet(c, packet, push_instr, instrs);
+        if (status < 0)
+            break;
+    }
+
+    trdb_decompress_close(c);
+    return status;
+}
+
+/* An event of a chunk, held back until the chunk is stitched. Instructions are
+ * referred to by index since the vector they end up in still grows.
+ */
+struct chunk_event {
+    enum trdb_event_kind kind;
+    const struct tr_packet *packet;
+    size_t instr;
+};
+
+/* A piece of the packet stream starting at a sync packet. With ras_tracking
+ * sync packets empty the return address stack, so a chunk decompresses the
+ * same on its own. Otherwise we decompress it speculatively with an empty one.
+ */
+struct decompress_chunk {
+    size_t begin; /* index of first packet */
+    size_t end;   /* index past last packet */
+    int status;
+    struct trdb_instr_vec instrs;
+    struct chunk_event *events;
+    size_t nevents;
+    size_t events_cap;
+    bool events_lost; /* out of memory, redo the chunk to report them */
+    /* decompression state after the last packet */
+    struct trdb_stack call_stack;
+    uint32_t underflows;
+    uint32_t privilege;
+    addr_t last_packet_addr;
+    struct branch_map_state branch_map;
+    bfd_vma pc;
+};
+
+struct decompress_pool {
+    struct trdb_ctx *c; /* only the configuration is read */
+    bfd *abfd;
+    struct trdb_packet_vec *packets;
+    struct decompress_chunk *chunks;
+    size_t nchunks;
+    size_t next; /* next chunk to hand out */
+    pthread_mutex_t bfd_lock;
+    pthread_mutex_t hook_lock;   /* the hooks of c run one at a time */
+    struct trdb_perf_stats perf; /* summed up by the workers */
+};
+
+/* Feed packets [@p begin, @p end) of @p packets to the open decompression of
+ * @p c.
+ */
+static int decompress_range(struct trdb_ctx *c, struct trdb_packet_vec *packets,
+                            size_t begin, size_t end,
+                            struct trdb_instr_vec *instrs)
+{
+    int status = 0;
+    for (size_t i = begin; i < end; i++) {
+        status = trdb_decompress_packet(c, TRDB_VEC_AT(packets, i), push_instr,
+                                        instrs);
+        if (status < 0)
+            return status;
+    }
+    return 0;
+}
+
+static bool is_restart_packet(const struct tr_packet *packet)
+{
+    return packet->msg_type == W_TRACE && packet->format == F_SYNC &&
+           (packet->subformat == SF_START || packet->subformat == SF_EXCEPTION);
+}
+
+/* Cut @p packets at sync packets into chunks of at least @p min_len packets. */
+static int split_at_syncs(struct trdb_packet_vec *packets, size_t min_len,
+                          struct decompress_chunk **chunks, size_t *nchunks)
+{
+    size_t cap                   = 16;
+    size_t cnt                   = 0;
+    size_t begin                 = 0;
+    struct decompress_chunk *arr = malloc(cap * sizeof(*arr));
+    if (!arr)
+        return -trdb_nomem;
+
+    for (size_t i = 1; i <= packets->size; i++) {
+        if (i < packets->size && (i - begin < min_len ||
+                                  !is_restart_packet(TRDB_VEC_AT(packets, i))))
+            continue;
+
+        if (cnt == cap) {
+            cap *= 2;
+            struct decompress_chunk *grow = realloc(arr, cap * sizeof(*arr));
+            if (!grow) {
+                free(arr);
+                return -trdb_nomem;
             }
+            arr = grow;
         }
+        arr[cnt] = (struct decompress_chunk){.begin = begin, .end = i};
+        cnt++;
+        begin = i;
     }
-    free_section_for_debugging(&dinfo);
-    if ((&dinfo)->private_data)
-        free((&dinfo)->private_data);
 
-    return status;
+    *chunks  = arr;
+    *nchunks = cnt;
+    return 0;
+}
 
-fail:
-    free_section_for_debugging(&dinfo);
-    if ((&dinfo)->private_data)
-        free((&dinfo)->private_data);
+/* event hook of the workers */
+static void record_event(struct trdb_ctx *c, const struct trdb_event *event,
+                         void *data)
+{
+    (void)c;
+    struct decompress_chunk *chunk = data;
+    if (chunk->events_lost)
+        return;
+
+    if (chunk->nevents == chunk->events_cap) {
+        size_t cap = chunk->events_cap ? 2 * chunk->events_cap : 64;
+        struct chunk_event *grow =
+            realloc(chunk->events, cap * sizeof(*chunk->events));
+        if (!grow) {
+            chunk->events_lost = true;
+            return;
+        }
+        chunk->events     = grow;
+        chunk->events_cap = cap;
+    }
+    /* the instruction is appended right after its event */
+    chunk->events[chunk->nevents++] =
+        (struct chunk_event){.kind   = event->kind,
+                             .packet = event->packet,
+                             .instr  = chunk->instrs.size};
+}
+
+static void *decompress_worker(void *arg)
+{
+    struct decompress_pool *pool = arg;
+    struct trdb_ctx *w           = trdb_new();
+
+    for (;;) {
+        size_t k = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (k >= pool->nchunks)
+            break;
+
+        struct decompress_chunk *chunk = &pool->chunks[k];
+        if (!w) {
+            chunk->status = -trdb_nomem;
+            continue;
+        }
+
+        trdb_reset_decompression(w);
+        w->config       = pool->c->config;
+        w->log_fn       = pool->c->log_fn;
+        w->log_priority = pool->c->log_priority;
+        w->event_fn     = pool->c->event_fn ? record_event : NULL;
+        w->event_data   = chunk;
+        w->image        = pool->c->image;
+        w->bfd_lock     = &pool->bfd_lock;
+        w->hook_lock    = &pool->hook_lock;
+
+        /* we start with an empty stack instead of the real one */
+        trdb_decompress_partial_stack(w);
+        chunk->status = trdb_decompress_open(w, pool->abfd);
+        if (chunk->status == 0)
+            chunk->status = decompress_range(w, pool->packets, chunk->begin,
+                                             chunk->end, &chunk->instrs);
+
+        /* remember where we ended up for stitching */
+        struct trdb_decompress *dec = w->dec;
+        chunk->call_stack           = dec->call_stack;
+        chunk->underflows           = dec->underflows;
+        chunk->privilege            = dec->privilege;
+        chunk->last_packet_addr     = dec->last_packet_addr;
+        chunk->branch_map           = dec->branch_map;
+        chunk->pc                   = dec->pc;
+    }
+
+    if (w)
+        add_perf_stats(&pool->perf, &w->perf);
+    trdb_free(w);
+    return NULL;
+}
+
+int trdb_decompress_trace_parallel(struct trdb_ctx *c, bfd *abfd,
+                                   struct trdb_packet_vec *packets,
+                                   struct trdb_instr_vec *instrs,
+                                   unsigned threads)
+{
+    int status = 0;
+    if (!c || !abfd || !packets || !instrs)
+        return -trdb_invalid;
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads     = online > 0 ? online : 1;
+    }
+
+    struct decompress_pool pool = {.c = c, .abfd = abfd, .packets = packets};
+    pthread_t *workers          = NULL;
+    unsigned nworkers           = 0;
+    struct trdb_image *image    = NULL;
+    struct trdb_image *saved    = c->image;
+
+    /* a few chunks per thread so that uneven chunks still balance out */
+    size_t min_len = packets->size / (threads * 4) + 1;
+    if (threads > 1 &&
+        (status = split_at_syncs(packets, min_len, &pool.chunks,
+                                 &pool.nchunks)) < 0)
+        return status;
+
+    if (threads <= 1 || pool.nchunks <= 1) {
+        free(pool.chunks);
+        return trdb_decompress_trace_vec(c, abfd, packets, instrs);
+    }
+
+    info(c, "decompressing %zu chunks with %u threads\n", pool.nchunks,
+         threads);
+
+    pthread_mutex_init(&pool.bfd_lock, NULL);
+    pthread_mutex_init(&pool.hook_lock, NULL);
+
+    /* the threads share the code instead of loading it for each chunk */
+    if (!c->image || c->image->abfd != abfd) {
+        if ((status = trdb_image_new(c, abfd, &image)) < 0)
+            goto fail;
+        c->image = image;
+    }
+
+    /* we decompress the first chunk ourselves, so it starts with our state,
+     * and are one of the threads
+     */
+    pool.next = 1;
+    workers   = malloc((threads - 1) * sizeof(*workers));
+    if (!workers) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+    for (; nworkers < threads - 1; nworkers++) {
+        if (pthread_create(&workers[nworkers], NULL, decompress_worker, &pool))
+            break;
+    }
+    if (nworkers == 0) {
+        err(c, "failed to spawn decompression threads\n");
+        status = -trdb_internal;
+        goto fail;
+    }
+
+    c->bfd_lock  = &pool.bfd_lock;
+    c->hook_lock = &pool.hook_lock;
+    status       = trdb_decompress_open(c, abfd);
+    if (status == 0)
+        status = decompress_range(c, packets, pool.chunks[0].begin,
+                                  pool.chunks[0].end, instrs);
+
+    for (unsigned i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    c->bfd_lock  = NULL;
+    c->hook_lock = NULL;
+    add_perf_stats(&c->perf, &pool.perf);
+
+    /* Stitch the chunks in order and continue with the state of the last.
+     * Without ras_tracking a chunk is exact unless an implicit return
+     * underflowed the return address stack, then we redo it now that we know
+     * the real stack. Otherwise its pops below its start take entries off ours
+     * and its stack sits on top. The held back events are reported now, so
+     * they come in order and only once.
+     */
+    struct trdb_decompress *dec = c->dec;
+    size_t redone               = 0;
+    for (size_t k = 1; k < pool.nchunks && status == 0; k++) {
+        struct decompress_chunk *chunk = &pool.chunks[k];
+
+        if ((chunk->status == -trdb_bad_ras && !c->config.ras_tracking) ||
+            chunk->events_lost) {
+            redone++;
+            status = decompress_range(c, packets, chunk->begin, chunk->end,
+                                      instrs);
+            continue;
+        }
+
+        for (size_t e = 0; e < chunk->nevents; e++) {
+            struct chunk_event *event = &chunk->events[e];
+            struct tr_instr *decoded  = NULL;
+            if (!event->packet)
+                decoded = TRDB_VEC_AT(&chunk->instrs, event->instr);
+            fire_event(c, event->kind, event->packet, decoded);
+        }
+
+        size_t i               = 0;
+        struct tr_instr *instr = NULL;
+        TRDB_VEC_FOREACH (instr, i, &chunk->instrs) {
+            if ((status = trdb_instr_vec_push(instrs, instr)) < 0)
+                goto fail;
+        }
+
+        if (c->config.ras_tracking) {
+            dec->call_stack = chunk->call_stack;
+        } else {
+            uint32_t depth           = c->config.ras_depth;
+            struct trdb_stack *stack = &chunk->call_stack;
+            addr_t popped;
+            for (uint32_t j = 0; j < chunk->underflows; j++)
+                ras_pop(&dec->call_stack, depth, &popped);
+            for (uint32_t j = 0; j < stack->len; j++)
+                ras_push(&dec->call_stack, depth,
+                         stack->addrs[(stack->top + depth - stack->len + j) %
+                                      depth]);
+        }
+        dec->privilege        = chunk->privilege;
+        dec->last_packet_addr = chunk->last_packet_addr;
+        dec->branch_map       = chunk->branch_map;
+        dec->pc               = chunk->pc;
+
+        status = chunk->status;
+    }
+    dbg(c, "redid %zu chunks due to return address stack underflow\n", redone);
 
+fail:
+    trdb_decompress_close(c);
+    c->image = saved;
+    trdb_image_free(image);
+    for (size_t k = 0; k < pool.nchunks; k++) {
+        trdb_free_instr_vec(&pool.chunks[k].instrs);
+        free(pool.chunks[k].events);
+    }
+    free(pool.chunks);
+    free(workers);
+    pthread_mutex_destroy(&pool.bfd_lock);
+    pthread_mutex_destroy(&pool.hook_lock);
     return status;
 }
 
@@ -2148,7 +4236,7 @@ void trdb_dump_instr_list(FILE *stream,
 
 void trdb_log_packet(struct trdb_ctx *c, const struct tr_packet *packet)
 {
-    if (!c)
+    if (!c || !trdb_debug_enabled(c))
         return;
 
     if (!packet) {
@@ -2387,3 +4475,75 @@ void trdb_free_instr_list(struct trdb_instr_head *instr_list)
         free(instr);
     }
 }
+
+int trdb_instr_vec_push(struct trdb_instr_vec *vec,
+                        const struct tr_instr *instr)
+{
+    if (!vec || !instr)
+        return -trdb_invalid;
+
+    /* all blocks full, add another one */
+    if (vec->size == vec->nblocks * TRDB_VEC_BLOCK) {
+        struct tr_instr **blocks =
+            realloc(vec->blocks, (vec->nblocks + 1) * sizeof(*blocks));
+        if (!blocks)
+            return -trdb_nomem;
+        vec->blocks = blocks;
+
+        blocks[vec->nblocks] = malloc(TRDB_VEC_BLOCK * sizeof(**blocks));
+        if (!blocks[vec->nblocks])
+            return -trdb_nomem;
+        vec->nblocks++;
+    }
+
+    *TRDB_VEC_AT(vec, vec->size) = *instr;
+    vec->size++;
+    return 0;
+}
+
+int trdb_packet_vec_push(struct trdb_packet_vec *vec,
+                         const struct tr_packet *packet)
+{
+    if (!vec || !packet)
+        return -trdb_invalid;
+
+    /* all blocks full, add another one */
+    if (vec->size == vec->nblocks * TRDB_VEC_BLOCK) {
+        struct tr_packet **blocks =
+            realloc(vec->blocks, (vec->nblocks + 1) * sizeof(*blocks));
+        if (!blocks)
+            return -trdb_nomem;
+        vec->blocks = blocks;
+
+        blocks[vec->nblocks] = malloc(TRDB_VEC_BLOCK * sizeof(**blocks));
+        if (!blocks[vec->nblocks])
+            return -trdb_nomem;
+        vec->nblocks++;
+    }
+
+    *TRDB_VEC_AT(vec, vec->size) = *packet;
+    vec->size++;
+    return 0;
+}
+
+void trdb_free_instr_vec(struct trdb_instr_vec *vec)
+{
+    if (!vec)
+        return;
+
+    for (size_t i = 0; i < vec->nblocks; i++)
+        free(vec->blocks[i]);
+    free(vec->blocks);
+    *vec = (struct trdb_instr_vec){0};
+}
+
+void trdb_free_packet_vec(struct trdb_packet_vec *vec)
+{
+    if (!vec)
+        return;
+
+    for (size_t i = 0; i < vec->nblocks; i++)
+        free(vec->blocks[i]);
+    free(vec->blocks);
+    *vec = (struct trdb_packet_vec){0};
+}
@@ -29,21 +29,39 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
 #include "config.h"
 #include "bfd.h"
 #include "utils.h"
 #include "trace_debugger.h"
 #include "disassembly.h"
 #include "serialize.h"
+#include "generator.h"
+#include "server.h"
+#include "profile.h"
 
 #define TRDB_NUM_ARGS 1
 
 const char *argp_program_version     = PACKAGE_STRING;
 const char *argp_program_bug_address = PACKAGE_BUGREPORT;
 
-static char doc[]      = "trdb -- Trace Debugger Tools for RISC-V E-Trace";
-static char args_doc[] = "TRACE-OR-PACKETS";
+static char doc[] =
+    "trdb -- Trace Debugger Tools for RISC-V E-Trace\v"
+    "Given several inputs, directories of inputs or an output (-o) that is a "
+    "directory, trdb runs in batch mode: each input is processed on its own by "
+    "a pool of -j threads and written to the output directory under its name, "
+    "or its path if several inputs share the name, plus the suffix of the "
+    "command, followed by a summary.";
+static char args_doc[] = "TRACE-OR-PACKETS...";
 
 #define TRDB_OPT_DEMANGLE 1
 #define TRDB_OPT_NO_ALIASES 2
@@ -51,6 +69,25 @@ static char args_doc[] = "TRACE-OR-PACKETS";
 #define TRDB_OPT_INLINES 4
 #define TRDB_OPT_FULL_ADDR 5
 #define TRDB_OPT_CVS 6
+#define TRDB_OPT_RESYNC 7
+#define TRDB_OPT_BLOCK_SIZE 8
+#define TRDB_OPT_WINDOW 9
+#define TRDB_OPT_TRACE_FORMAT 10
+#define TRDB_OPT_GENERATE 11
+#define TRDB_OPT_SEED 12
+#define TRDB_OPT_BRANCH_TAKEN 13
+#define TRDB_OPT_CALL_DEPTH 14
+#define TRDB_OPT_EXCEPTION_RATE 15
+#define TRDB_OPT_INTERRUPT_RATE 16
+#define TRDB_OPT_BLOCKS 17
+#define TRDB_OPT_SERVE 18
+#define TRDB_OPT_RING_SIZE 19
+#define TRDB_OPT_DROP 20
+#define TRDB_OPT_FOLLOW 21
+#define TRDB_OPT_STATS 22
+#define TRDB_OPT_PROFILE 23
+#define TRDB_OPT_SNAPSHOTS 24
+#define TRDB_OPT_RESUME 25
 
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output"},
@@ -61,8 +98,12 @@ static struct argp_option options[] = {
     {"compress", 'c', 0, 0, "Take a stimuli file and compress to packets"},
     {"cvs", TRDB_OPT_CVS, 0, 0, "Set TRACE-OR-PACKETS file type to cvs"},
     {"binary-format", 'p', "FORMAT", 0,
-     "Specify binary input/output format, by default like the pulp trace debugger"},
+     "Specify binary input/output format: pulp, like the pulp trace debugger "
+     "(default), or container, which is seekable through a block index"},
     {"trace-file", 't', 0, 0, "Input file is a trace file"},
+    {"trace-format", TRDB_OPT_TRACE_FORMAT, "FORMAT", 0,
+     "Write instruction traces as text (default) or binary, binary traces are "
+     "recognized on input"},
     {"dump", 'h', 0, 0, "Dump trace or packets in human readable format"},
     {"extract", 'x', 0, 0, "Take a packet file and produce a stimuli file"},
     {"full-address", TRDB_OPT_FULL_ADDR, 0, 0,
@@ -83,28 +124,97 @@ static struct argp_option options[] = {
     {"inlines", TRDB_OPT_INLINES, 0, 0,
      "Print all inlines for source line (with -l)"},
     {"output", 'o', "FILE", 0, "Write to FILE instead of stdout"},
+    {"jobs", 'j', "N", 0,
+     "Parse stimuli and decompress with N threads, splitting at lines and "
+     "sync packets respectively (0 for all cpus)"},
+    {"resync", TRDB_OPT_RESYNC, "N", 0,
+     "Emit a sync packet at least every N instructions when compressing"},
+    {"block-size", TRDB_OPT_BLOCK_SIZE, "N", 0,
+     "Start a new container block after at least N instructions"},
+    {"snapshots", TRDB_OPT_SNAPSHOTS, 0, 0,
+     "Store the compression state with each container block, so --window "
+     "and --resume can start there"},
+    {"resume", TRDB_OPT_RESUME, "CONTAINER", 0,
+     "Continue CONTAINER from its last block with the rest of TRACE-OR-PACKETS "
+     "instead of compressing all of it, written to --output"},
+    {"window", TRDB_OPT_WINDOW, "BEGIN[:END]", 0,
+     "Only decompress instructions BEGIN up to excluding END of a container"},
+    {"blocks", TRDB_OPT_BLOCKS, 0, 0,
+     "Decompress to the visited basic blocks, one line of start, last "
+     "instruction and executed instructions per visit"},
+    {"profile", TRDB_OPT_PROFILE, "FORMAT", OPTION_ARG_OPTIONAL,
+     "Decompress to a profile of the executed functions, calls and branches "
+     "as flat (default), callgrind or folded call stacks"},
+    {"generate", TRDB_OPT_GENERATE, "N", 0,
+     "Instead of reading TRACE-OR-PACKETS generate a trace of N instructions "
+     "by walking the control flow of the ELF (with -c compress it)"},
+    {"seed", TRDB_OPT_SEED, "N", 0, "Seed of the generated trace"},
+    {"branch-taken", TRDB_OPT_BRANCH_TAKEN, "P", 0,
+     "Probability that a generated forward branch is taken"},
+    {"call-depth", TRDB_OPT_CALL_DEPTH, "N", 0,
+     "Maximum call nesting of the generated trace"},
+    {"exception-rate", TRDB_OPT_EXCEPTION_RATE, "P", 0,
+     "Per instruction probability of an exception in the generated trace"},
+    {"interrupt-rate", TRDB_OPT_INTERRUPT_RATE, "P", 0,
+     "Per instruction probability of an interrupt in the generated trace"},
+    {"serve", TRDB_OPT_SERVE, "ADDRESS", 0,
+     "Instead of reading TRACE-OR-PACKETS compress binary instruction records "
+     "as they arrive at ADDRESS (shm:PATH, unix:PATH, tcp:[HOST:]PORT or - for "
+     "stdin) into a container, until the producer is done"},
+    {"ring-size", TRDB_OPT_RING_SIZE, "N", 0,
+     "Number of instructions the shm:PATH ring of --serve holds"},
+    {"drop", TRDB_OPT_DROP, 0, 0,
+     "Let the producer drop instructions when the shm:PATH ring of --serve is "
+     "full instead of waiting"},
+    {"follow", TRDB_OPT_FOLLOW, 0, 0,
+     "Decompress pulp packets as they arrive in a growing file, from stdin "
+     "(-), unix:PATH or tcp:[HOST:]PORT until interrupted or the input is "
+     "closed"},
+    {"stats", TRDB_OPT_STATS, "FORMAT", OPTION_ARG_OPTIONAL,
+     "Print the time spent in each stage, cache hits and allocations to stderr "
+     "at the end, as text (default) or json"},
     {0}};
 
 struct arguments {
     char *args[TRDB_NUM_ARGS];
+    char **inputs; /* all positional arguments, args[0] is the first */
+    size_t ninputs;
     bool silent, verbose, compress, has_elf, disassemble, decompress,
-        trace_file, binary_output, human, full_address, cvs;
+        trace_file, binary_output, human, full_address, cvs, binary_trace,
+        generate, blocks, drop, follow, profile, snapshots;
     uint32_t settings_disasm;
+    unsigned jobs;
+    uint64_t resync;
+    uint64_t block_size;
+    uint64_t window_begin, window_end;
+    uint64_t generate_len;
+    uint64_t ring_size;
+    struct trdb_gen_config gen;
+    enum trdb_profile_format profile_format;
     char *binary_format;
     char *output_file;
     char *elf_file;
+    char *serve_address;
+    char *stats_format;
+    char *resume_file;
 };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
     struct arguments *arguments = state->input;
     switch (key) {
+    case 'v':
+        arguments->verbose = true;
+        break;
     case 'q':
         arguments->silent = true;
         break;
     case 'o':
         arguments->output_file = arg;
         break;
+    case 'j':
+        arguments->jobs = strtoul(arg, NULL, 0);
+        break;
     case 'b':
         arguments->has_elf  = true;
         arguments->elf_file = arg;
@@ -122,6 +232,14 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 't':
         arguments->trace_file = true;
         break;
+    case TRDB_OPT_TRACE_FORMAT:
+        if (!strcmp(arg, "binary"))
+            arguments->binary_trace = true;
+        else if (!strcmp(arg, "text"))
+            arguments->binary_trace = false;
+        else
+            argp_error(state, "unknown trace format %s", arg);
+        break;
     case 'h':
         arguments->human = true;
         break;
@@ -134,6 +252,80 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case TRDB_OPT_FULL_ADDR:
         arguments->full_address = true;
         break;
+    case TRDB_OPT_RESYNC:
+        arguments->resync = strtoull(arg, NULL, 0);
+        break;
+    case TRDB_OPT_BLOCK_SIZE:
+        arguments->block_size = strtoull(arg, NULL, 0);
+        break;
+    case TRDB_OPT_SNAPSHOTS:
+        arguments->snapshots = true;
+        break;
+    case TRDB_OPT_RESUME:
+        arguments->resume_file = arg;
+        break;
+    case TRDB_OPT_WINDOW: {
+        char *end               = NULL;
+        arguments->window_begin = strtoull(arg, &end, 0);
+        if (*end == ':')
+            arguments->window_end = strtoull(end + 1, NULL, 0);
+        else
+            arguments->window_end = UINT64_MAX;
+        break;
+    }
+    case TRDB_OPT_GENERATE:
+        arguments->generate     = true;
+        arguments->generate_len = strtoull(arg, NULL, 0);
+        break;
+    case TRDB_OPT_SEED:
+        arguments->gen.seed = strtoull(arg, NULL, 0);
+        break;
+    case TRDB_OPT_BRANCH_TAKEN:
+        arguments->gen.branch_taken = strtod(arg, NULL);
+        break;
+    case TRDB_OPT_CALL_DEPTH:
+        arguments->gen.max_call_depth = strtoul(arg, NULL, 0);
+        break;
+    case TRDB_OPT_EXCEPTION_RATE:
+        arguments->gen.exception_rate = strtod(arg, NULL);
+        break;
+    case TRDB_OPT_INTERRUPT_RATE:
+        arguments->gen.interrupt_rate = strtod(arg, NULL);
+        break;
+    case TRDB_OPT_BLOCKS:
+        arguments->blocks = true;
+        break;
+    case TRDB_OPT_PROFILE:
+        arguments->profile = true;
+        if (!arg || !strcmp(arg, "flat"))
+            arguments->profile_format = TRDB_PROFILE_FLAT;
+        else if (!strcmp(arg, "callgrind"))
+            arguments->profile_format = TRDB_PROFILE_CALLGRIND;
+        else if (!strcmp(arg, "folded"))
+            arguments->profile_format = TRDB_PROFILE_FOLDED;
+        else
+            argp_error(state, "unknown profile format %s", arg);
+        break;
+    case TRDB_OPT_SERVE:
+        arguments->serve_address = arg;
+        break;
+    case TRDB_OPT_RING_SIZE:
+        arguments->ring_size = strtoull(arg, NULL, 0);
+        break;
+    case TRDB_OPT_DROP:
+        arguments->drop = true;
+        break;
+    case TRDB_OPT_FOLLOW:
+        arguments->follow = true;
+        break;
+    case TRDB_OPT_STATS:
+        if (!arg || !strcmp(arg, "text"))
+            arguments->stats_format = "text";
+        else if (!strcmp(arg, "json"))
+            arguments->stats_format = "json";
+        else
+            argp_error(state, "unknown stats format %s", arg);
+        break;
     case TRDB_OPT_NO_ALIASES:
         arguments->settings_disasm |= TRDB_NO_ALIASES;
         break;
@@ -158,13 +350,21 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case TRDB_OPT_INLINES:
         arguments->settings_disasm |= TRDB_INLINES;
         break;
-    case ARGP_KEY_ARG:
-        if (state->arg_num >= TRDB_NUM_ARGS)
-            argp_usage(state);
-        arguments->args[state->arg_num] = arg;
+    case ARGP_KEY_ARG: {
+        char **inputs = realloc(arguments->inputs, (arguments->ninputs + 1) *
+                                                       sizeof(*inputs));
+        if (!inputs)
+            argp_failure(state, EXIT_FAILURE, errno, "realloc");
+        inputs[arguments->ninputs++] = arg;
+        arguments->inputs            = inputs;
+        if (state->arg_num < TRDB_NUM_ARGS)
+            arguments->args[state->arg_num] = arg;
         break;
+    }
     case ARGP_KEY_END:
-        if (state->arg_num < TRDB_NUM_ARGS)
+        /* generated and served traces need no input file */
+        if (state->arg_num < TRDB_NUM_ARGS && !arguments->generate &&
+            !arguments->serve_address)
             argp_usage(state);
         break;
     default:
@@ -190,6 +390,49 @@ static int dump_packets(struct trdb_ctx *c, FILE *output_fp,
 static int dump_trace(struct trdb_ctx *c, FILE *output_fp,
                       struct arguments *arguments);
 
+static int generate_trace(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
+                          struct arguments *arguments);
+
+static int serve_trace(struct trdb_ctx *c, FILE *output_fp,
+                       struct arguments *arguments);
+
+static bool is_batch(struct arguments *arguments);
+
+static int run_batch(struct trdb_ctx *c, bfd *abfd,
+                     struct arguments *arguments);
+
+static void print_stats(FILE *fp, const char *format, int available,
+                        const struct trdb_perf_stats *perf, size_t instrs,
+                        size_t packets);
+
+/* settings shared by all commands */
+static void configure_ctx(struct trdb_ctx *c, struct arguments *arguments)
+{
+    trdb_set_full_address(c, arguments->full_address);
+    trdb_set_compress_branch_map(c, false);
+    trdb_set_resync_interval(c, arguments->resync);
+    /* trdb_set_implicit_ret(c, true); */
+    /* trdb_set_pulp_extra_packet(c, true); */
+}
+
+/* run the command selected by @p arguments on arguments->args[0] */
+static int run_command(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
+                       struct arguments *arguments)
+{
+    if (arguments->decompress)
+        return decompress_packets(c, output_fp, abfd, arguments);
+    if (arguments->compress)
+        return compress_trace(c, output_fp, arguments);
+    if (arguments->human && arguments->trace_file)
+        return dump_trace(c, output_fp, arguments);
+    if (arguments->human)
+        return dump_packets(c, output_fp, arguments);
+    if (arguments->trace_file)
+        return disassemble_trace(c, output_fp, abfd, arguments);
+    /* by default we decompress */
+    return decompress_packets(c, output_fp, abfd, arguments);
+}
+
 int main(int argc, char *argv[argc + 1])
 {
     int status = EXIT_SUCCESS;
@@ -207,8 +450,16 @@ int main(int argc, char *argv[argc + 1])
     arguments.disassemble     = false;
     arguments.decompress      = false;
     arguments.settings_disasm = 0;
+    arguments.jobs            = 1;
+    arguments.resync          = 0;
+    arguments.block_size      = 65536;
+    arguments.window_begin    = 0;
+    arguments.window_end      = UINT64_MAX;
     arguments.output_file     = "-";
     arguments.binary_format   = "";
+    arguments.generate        = false;
+    arguments.ring_size       = 1 << 20;
+    trdb_gen_default_config(&arguments.gen);
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
@@ -224,13 +475,15 @@ int main(int argc, char *argv[argc + 1])
     }
 
     /* general settings */
-    trdb_set_full_address(ctx, arguments.full_address);
-    trdb_set_compress_branch_map(ctx, false);
-    /* trdb_set_implicit_ret(ctx, true); */
-    /* trdb_set_pulp_extra_packet(ctx, true); */
+    configure_ctx(ctx, &arguments);
 
-    /* prepare output */
-    if (arguments.output_file[0] != '-') {
+    bool batch = !arguments.generate && !arguments.serve_address &&
+                 !arguments.follow && is_batch(&arguments);
+
+    /* prepare output, batches write a file per input */
+    if (batch) {
+        output_fp = NULL;
+    } else if (arguments.output_file[0] != '-') {
         output_fp = fopen(arguments.output_file, "w");
         if (!output_fp) {
             fprintf(stderr, "fopen: %s", strerror(errno));
@@ -252,20 +505,21 @@ int main(int argc, char *argv[argc + 1])
         }
     }
 
-    if (arguments.decompress) {
-        status = decompress_packets(ctx, output_fp, abfd, &arguments);
-    } else if (arguments.compress) {
-        status = compress_trace(ctx, output_fp, &arguments);
-    } else if (arguments.human) {
-        if (arguments.trace_file)
-            status = dump_trace(ctx, output_fp, &arguments);
-        else
-            status = dump_packets(ctx, output_fp, &arguments);
-    } else if (arguments.trace_file) {
-        status = disassemble_trace(ctx, output_fp, abfd, &arguments);
-    } else {
-        /* by default we decompress */
-        status = decompress_packets(ctx, output_fp, abfd, &arguments);
+    if (arguments.serve_address)
+        status = serve_trace(ctx, output_fp, &arguments);
+    else if (arguments.generate)
+        status = generate_trace(ctx, output_fp, abfd, &arguments);
+    else if (batch)
+        status = run_batch(ctx, abfd, &arguments);
+    else
+        status = run_command(ctx, output_fp, abfd, &arguments);
+
+    /* batches sum up the stats of their workers */
+    if (arguments.stats_format && !batch) {
+        struct trdb_perf_stats perf;
+        int available = trdb_get_perf_stats(ctx, &perf);
+        print_stats(stderr, arguments.stats_format, available, &perf,
+                    trdb_get_instrcnt(ctx), trdb_get_packetcnt(ctx));
     }
 
 fail:
@@ -274,6 +528,7 @@ fail:
         fclose(output_fp);
     if (abfd)
         bfd_close(abfd);
+    free(arguments.inputs);
     return status;
 }
 
@@ -295,9 +550,13 @@ static int compress_trace(struct trdb_ctx *c, FILE *output_fp,
     if (arguments->cvs) {
         success = trdb_cvs_to_trace_list(c, arguments->args[0], &instr_list,
                                          &samplecnt);
-    } else {
+    } else if (trdb_is_binary_trace(arguments->args[0])) {
         success =
-            trdb_stimuli_to_trace(c, arguments->args[0], samples, &samplecnt);
+            trdb_binary_to_trace(c, arguments->args[0], samples, &samplecnt);
+    } else {
+        success = trdb_stimuli_to_trace_parallel(c, arguments->args[0],
+                                                 samples, &samplecnt,
+                                                 arguments->jobs);
     }
 
     if (success < 0) {
@@ -309,6 +568,120 @@ static int compress_trace(struct trdb_ctx *c, FILE *output_fp,
 
     struct tr_instr *instr;
 
+    /* containers are written as we compress, their blocks can only start at
+     * sync packets so make sure there are some
+     */
+    if (arguments->binary_output &&
+        !strcmp(arguments->binary_format, "container")) {
+        struct trdb_container_writer w = {0};
+        struct trdb_container ct       = {0};
+        uint64_t skip                  = 0;
+
+        if (arguments->resync == 0)
+            trdb_set_resync_interval(c, arguments->block_size);
+
+        /* the input up to the last block is in there already */
+        if (arguments->resume_file) {
+            status = trdb_container_open(c, arguments->resume_file, &ct);
+            if (status == 0 && ct.nblocks == 0)
+                status = -trdb_bad_container;
+            if (status == 0) {
+                trdb_set_full_address(c, ct.full_address);
+                trdb_set_ras_tracking(c, ct.ras_tracking);
+                status = trdb_container_resume(c, &ct, ct.nblocks - 1,
+                                               output_fp,
+                                               arguments->block_size, &w);
+            }
+            if (status == 0)
+                skip = ct.blocks[ct.nblocks - 1].steps;
+            trdb_container_close(&ct);
+        } else {
+            status =
+                trdb_container_create(c, output_fp, arguments->block_size, &w);
+            trdb_container_set_snapshots(&w, arguments->snapshots);
+        }
+        if (arguments->cvs) {
+            TAILQ_FOREACH (instr, &instr_list, list) {
+                if (status < 0)
+                    break;
+                if (skip > 0) {
+                    skip--;
+                    continue;
+                }
+                status = trdb_container_compress_step(c, &w, instr);
+            }
+        } else {
+            for (size_t i = skip; i < samplecnt && status >= 0; i++)
+                status = trdb_container_compress_step(c, &w, &(*samples)[i]);
+        }
+        if (w.fp) {
+            int finish = trdb_container_finish(c, &w);
+            if (status >= 0)
+                status = finish;
+        }
+        if (status < 0) {
+            fprintf(stderr, "failed to write container: %s\n",
+                    trdb_errstr(trdb_errcode(status)));
+            status = EXIT_FAILURE;
+            goto fail;
+        }
+        status = EXIT_SUCCESS;
+        goto fail;
+    }
+
+    /* stimuli are already in an array, which we can compress and serialize
+     * in large blocks
+     */
+    if (arguments->binary_output && !arguments->cvs &&
+        !strcmp(arguments->binary_format, "pulp")) {
+        uint8_t buf[4096];
+        size_t done = 0;
+        while (done < samplecnt) {
+            size_t consumed = 0;
+            size_t written  = 0;
+            status          = trdb_pulp_compress_trace_block(
+                c, samplecnt - done, *samples + done, sizeof(buf), buf,
+                &consumed, &written);
+            if (status < 0) {
+                fprintf(stderr, "compress trace failed: %s\n",
+                        trdb_errstr(trdb_errcode(status)));
+                status = EXIT_FAILURE;
+                goto fail;
+            }
+            if (fwrite(buf, 1, written, output_fp) != written) {
+                fprintf(stderr, "failed to serialize packets: %s\n",
+                        trdb_errstr(trdb_errcode(-trdb_file_write)));
+                status = EXIT_FAILURE;
+                goto fail;
+            }
+            done += consumed;
+        }
+        goto fail;
+    }
+
+    /* packets of cvs traces are serialized as soon as they are generated */
+    if (arguments->binary_output && !strcmp(arguments->binary_format, "pulp")) {
+        struct trdb_bit_sink sink = {0};
+
+        status = trdb_bit_sink_open(&sink, output_fp, 0, false);
+        TAILQ_FOREACH (instr, &instr_list, list) {
+            if (status < 0)
+                break;
+            status = trdb_compress_trace_step_sink(c, &sink, instr);
+        }
+        int close = trdb_bit_sink_close(&sink);
+        if (status >= 0)
+            status = close;
+        if (status < 0) {
+            fprintf(stderr, "compress trace failed: %s\n",
+                    trdb_errstr(trdb_errcode(status)));
+            status = EXIT_FAILURE;
+            goto fail;
+        }
+        status = EXIT_SUCCESS;
+        goto fail;
+    }
+
     /* step by step compression */
     if (arguments->cvs) {
         TAILQ_FOREACH (instr, &instr_list, list) {
@@ -356,17 +729,189 @@ fail:
     return status;
 }
 
+/* set by SIGINT and SIGTERM to let --serve finish the container and --follow
+ * stop
+ */
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/* no SA_RESTART, blocking reads and accepts return to check stop_requested */
+static void catch_stop_signals()
+{
+    struct sigaction sa = {.sa_handler = request_stop};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+/* where decompress_packets() sends the reconstructed instructions */
+struct decompress_output {
+    FILE *output_fp;
+    bfd *abfd;
+    struct disassembler_unit *dunit;
+    bool disassemble;
+    struct trdb_disasm_cache *cache; /* memoized disassembly, if any */
+    struct trdb_trace_writer *trace; /* write a binary trace instead */
+};
+
+static int print_decompressed_instr(struct trdb_ctx *c,
+                                    const struct tr_instr *instr, void *data)
+{
+    struct decompress_output *out = data;
+    if (out->trace) {
+        return trdb_trace_write_instr(out->trace, instr);
+    } else if (out->cache) {
+        return trdb_disasm_cache_instr(out->cache, instr);
+    } else if (out->disassemble) {
+        struct tr_instr tmp = *instr;
+        trdb_disassemble_instr_with_bfd(c, &tmp, out->abfd, out->dunit);
+    } else {
+        trdb_print_instr(out->output_fp, instr);
+    }
+    return 0;
+}
+
+/* trdb_decompress_packet_blocks() callback printing a block visit */
+static int print_block_visit(struct trdb_ctx *c, const struct trdb_block *block,
+                             size_t instrs, void *data)
+{
+    (void)c;
+    FILE *output_fp = data;
+    fprintf(output_fp, "0x%08" PRIxADDR " 0x%08" PRIxADDR " %zu\n",
+            block->start, block->last, instrs);
+    return 0;
+}
+
+/* Decompress @p map to the visited basic blocks, with an image of @p abfd,
+ * and print them or with --profile their profile
+ */
+static int decompress_blocks(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
+                             struct trdb_packet_map *map,
+                             struct arguments *arguments)
+{
+    int status                     = 0;
+    struct trdb_packet_vec packets = {0};
+    struct trdb_image *image       = NULL;
+    struct trdb_cfg *cfg           = NULL;
+    struct trdb_profile *profile   = NULL;
+
+    if (!trdb_get_image(c)) {
+        if ((status = trdb_image_new(c, abfd, &image)) < 0)
+            goto fail;
+        trdb_set_image(c, image);
+    }
+    if ((status = trdb_cfg_new(c, trdb_get_image(c), &cfg)) < 0)
+        goto fail;
+    if (arguments->profile &&
+        (status = trdb_profile_new(c, cfg, &profile)) < 0)
+        goto fail;
+    if ((status = trdb_pulp_read_mapped_packets(c, map, 0, map->size,
+                                                &packets)) < 0)
+        goto fail;
+
+    if ((status = trdb_decompress_open(c, abfd)) < 0)
+        goto fail;
+    size_t i                 = 0;
+    struct tr_packet *packet = NULL;
+    TRDB_VEC_FOREACH (packet, i, &packets) {
+        if (profile)
+            status = trdb_profile_packet(c, profile, packet);
+        else
+            status = trdb_decompress_packet_blocks(
+                c, cfg, packet, print_block_visit, output_fp);
+        if (status < 0)
+            break;
+    }
+    trdb_decompress_close(c);
+
+    /* a profile of what could be decompressed is still useful */
+    if (profile) {
+        int written = trdb_profile_write(profile, arguments->profile_format,
+                                         output_fp);
+        if (written < 0 && status == 0)
+            status = written;
+    }
+
+fail:
+    trdb_free_packet_vec(&packets);
+    trdb_profile_free(profile);
+    trdb_cfg_free(cfg);
+    if (image) {
+        trdb_set_image(c, NULL);
+        trdb_image_free(image);
+    }
+    return status;
+}
+
+/* Open the live packet input of --follow at @p path */
+static int open_follow_input(struct trdb_ctx *c, const char *path, int *fd)
+{
+    if (!strcmp(path, "-")) {
+        *fd = STDIN_FILENO;
+        return 0;
+    }
+    if (!strncmp(path, "unix:", 5) || !strncmp(path, "tcp:", 4))
+        return trdb_serve_accept(c, path, fd);
+
+    *fd = open(path, O_RDONLY);
+    if (*fd < 0) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return -trdb_file_open;
+    }
+    return 0;
+}
+
+/* Decompress the packets arriving at @p fd until the input is closed or we
+ * are interrupted
+ */
+static int follow_packets(struct trdb_ctx *c, int fd, FILE *output_fp,
+                          struct decompress_output *out,
+                          struct arguments *arguments)
+{
+    struct trdb_follow_stats stats = {0};
+
+    catch_stop_signals();
+    int status = trdb_follow_fd(c, fd, true, output_fp, &stop_requested,
+                                print_decompressed_instr, out, &stats);
+
+    /* stdout is busy with the instructions */
+    if (!arguments->silent) {
+        fprintf(stderr,
+                "followed:     %" PRIu64 " bytes, %" PRIu64
+                " packets to %" PRIu64 " instructions\n",
+                stats.bytes, stats.packets, stats.instrs);
+        if (stats.packets)
+            fprintf(stderr, "latency:      %.1f us mean, %.1f us max\n",
+                    stats.total_latency_ns / 1e3 / stats.packets,
+                    stats.max_latency_ns / 1e3);
+    }
+    return status;
+}
+
 static int decompress_packets(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
                               struct arguments *arguments)
 {
-    int status       = EXIT_SUCCESS;
-    const char *path = arguments->args[0];
+    int status                      = EXIT_SUCCESS;
+    const char *path                = arguments->args[0];
+    struct trdb_packet_map map      = {0};
+    struct trdb_packet_vec packets  = {0};
+    struct trdb_instr_vec instrs    = {0};
+    struct trdb_container ct        = {0};
+    struct trdb_trace_writer trace  = {0};
+    struct trdb_image *image        = NULL;
+    struct trdb_disasm_cache *cache = NULL;
+    struct trdb_line_index *lines   = NULL;
+    bool shared_dinfo               = false;
+    int follow_fd                   = -1;
     struct disassemble_info dinfo;
     struct disassembler_unit dunit;
-    struct trdb_packet_head packet_list;
-    TAILQ_INIT(&packet_list);
-    struct trdb_instr_head instr_list;
-    TAILQ_INIT(&instr_list);
+
+    bool container = !strcmp(arguments->binary_format, "container");
 
     if (!abfd) {
         fprintf(stderr, "need to provide a binary (--bfd) for decompression\n");
@@ -374,21 +919,37 @@ static int decompress_packets(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
         goto fail;
     }
 
-    /* by default we parse assuming data is generated from PULP */
-    if ((status = trdb_pulp_read_all_packets(c, path, &packet_list)) < 0) {
-        fprintf(stderr, "failed to parse packets: %s\n",
-                trdb_errstr(trdb_errcode(status)));
+    if (container && (arguments->blocks || arguments->profile)) {
+        fprintf(stderr, "--blocks and --profile need pulp packets\n");
         status = EXIT_FAILURE;
         goto fail;
     }
 
-    /* reconstruct the original instruction sequence */
-    status = trdb_decompress_trace(c, abfd, &packet_list, &instr_list);
+    if (arguments->follow &&
+        (container || arguments->blocks || arguments->profile)) {
+        fprintf(stderr,
+                "--follow needs pulp packets and no --blocks or --profile\n");
+        status = EXIT_FAILURE;
+        goto fail;
+    }
+
+    /* by default we parse assuming data is generated from PULP */
+    if (arguments->follow) {
+        status = open_follow_input(c, path, &follow_fd);
+    } else if (container) {
+        status = trdb_container_open(c, path, &ct);
+        if (status == 0) {
+            trdb_set_full_address(c, ct.full_address);
+            trdb_set_ras_tracking(c, ct.ras_tracking);
+        }
+    } else {
+        status = trdb_pulp_map_packets(c, path, &map);
+    }
     if (status < 0) {
-        fprintf(stderr, "decompressing trace failed: %s\n",
+        fprintf(stderr, "failed to parse packets: %s\n",
                 trdb_errstr(trdb_errcode(status)));
-        fprintf(stderr, "possible causes: corrupt packets or wrong bfd\n");
-        fprintf(stderr, "continuing anyway...\n");
+        status = EXIT_FAILURE;
+        goto fail;
     }
 
     /* setup the disassembler to consider data from the bfd */
@@ -396,7 +957,11 @@ static int decompress_packets(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
     dunit = (struct disassembler_unit){0};
 
     dunit.dinfo = &dinfo;
-    status      = trdb_alloc_dinfo_with_bfd(c, abfd, &dunit);
+    if (trdb_get_image(c))
+        status = trdb_alloc_dinfo_with_image(c, trdb_get_image(c), &dunit);
+    else
+        status = trdb_alloc_dinfo_with_bfd(c, abfd, &dunit);
+    shared_dinfo = status == 0 && trdb_get_image(c);
     if (status < 0) {
         fprintf(stderr, "failed to configure bfd: %s\n",
                 trdb_errstr(trdb_errcode(status)));
@@ -409,19 +974,124 @@ static int decompress_packets(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
     dinfo.fprintf_func = (fprintf_ftype)fprintf;
     dinfo.stream       = output_fp;
 
-    struct tr_instr *instr;
-    TAILQ_FOREACH (instr, &instr_list, list) {
-        if (arguments->disassemble)
-            trdb_disassemble_instr_with_bfd(c, instr, abfd, &dunit);
-        /* trdb_disassemble_instr(instr, &dunit); */
-        else
-            trdb_print_instr(output_fp, instr);
+    /* read the line of every address once instead of for each instruction */
+    if (arguments->disassemble &&
+        (arguments->settings_disasm & (TRDB_LINE_NUMBERS | TRDB_SOURCE_CODE))) {
+        status = trdb_line_index_new(c, abfd, &lines);
+        if (status < 0) {
+            fprintf(stderr, "failed to read line information: %s\n",
+                    trdb_errstr(trdb_errcode(status)));
+            status = EXIT_FAILURE;
+            goto fail;
+        }
+        trdb_set_line_index(&dunit, lines);
+    }
+
+    struct decompress_output out = {.output_fp   = output_fp,
+                                    .abfd        = abfd,
+                                    .dunit       = &dunit,
+                                    .disassemble = arguments->disassemble};
+
+    if (arguments->binary_trace) {
+        status = trdb_trace_writer_open(c, output_fp, 0, &trace);
+        if (status < 0) {
+            fprintf(stderr, "failed to write trace: %s\n",
+                    trdb_errstr(trdb_errcode(status)));
+            status = EXIT_FAILURE;
+            goto fail;
+        }
+        out.trace = &trace;
+    } else if (arguments->disassemble && !arguments->follow) {
+        /* traces revisit the same few pcs over and over, only render them
+         * once. Following needs every instruction out immediately.
+         */
+        status = trdb_disasm_cache_new(c, abfd, &dunit, &cache);
+        if (status < 0) {
+            fprintf(stderr, "failed to set up disassembly: %s\n",
+                    trdb_errstr(trdb_errcode(status)));
+            status = EXIT_FAILURE;
+            goto fail;
+        }
+        out.cache = cache;
+    }
+
+    /* reconstruct the original instruction sequence packet by packet and
+     * print it as we go, each distinct pc only needs to be decoded once
+     */
+    trdb_set_decode_cache(c, true);
+    if (arguments->follow) {
+        /* decode the program before the first packet arrives */
+        if (!trdb_get_image(c) && trdb_image_new(c, abfd, &image) == 0)
+            trdb_set_image(c, image);
+        status = trdb_decompress_open(c, abfd);
+        if (status == 0)
+            status = follow_packets(c, follow_fd, output_fp, &out, arguments);
+        trdb_decompress_close(c);
+    } else if (arguments->blocks || arguments->profile) {
+        status = decompress_blocks(c, output_fp, abfd, &map, arguments);
+    } else if (container) {
+        /* blocks are found through the index, no need for threads */
+        status = trdb_decompress_open(c, abfd);
+        if (status == 0)
+            status = trdb_container_decompress_window(
+                c, &ct, arguments->window_begin, arguments->window_end,
+                print_decompressed_instr, &out);
+        trdb_decompress_close(c);
+    } else if (arguments->jobs == 1) {
+        status = trdb_decompress_open(c, abfd);
+        if (status == 0)
+            status = trdb_pulp_decompress_mapped_packets(
+                c, &map, 0, map.size, print_decompressed_instr, &out);
+        trdb_decompress_close(c);
+    } else {
+        /* the threads need random access to the packets and their results
+         * are only final after stitching, so here we keep everything
+         */
+        status = trdb_pulp_read_mapped_packets(c, &map, 0, map.size, &packets);
+        /* the threads share the decoded program instead of each loading it,
+         * without the image they just do that
+         */
+        if (status == 0 && !trdb_get_image(c) &&
+            trdb_image_new(c, abfd, &image) == 0)
+            trdb_set_image(c, image);
+        if (status == 0)
+            status = trdb_decompress_trace_parallel(c, abfd, &packets, &instrs,
+                                                    arguments->jobs);
+
+        size_t i               = 0;
+        struct tr_instr *instr = NULL;
+        TRDB_VEC_FOREACH (instr, i, &instrs) {
+            print_decompressed_instr(c, instr, &out);
+        }
+    }
+    if (status < 0) {
+        fprintf(stderr, "decompressing trace failed: %s\n",
+                trdb_errstr(trdb_errcode(status)));
+        fprintf(stderr, "possible causes: corrupt packets or wrong bfd\n");
+        fprintf(stderr, "continuing anyway...\n");
+        status = EXIT_SUCCESS;
     }
 
 fail:
+    if (trace.fp && trdb_trace_writer_close(&trace) < 0) {
+        fprintf(stderr, "failed to write trace\n");
+        status = EXIT_FAILURE;
+    }
+    trdb_disasm_cache_free(cache);
+    trdb_line_index_free(lines);
     /* trdb_free_dinfo_with_bfd(c, abfd, &dunit); */
-    trdb_free_packet_list(&packet_list);
-    trdb_free_instr_list(&instr_list);
+    if (shared_dinfo)
+        trdb_free_dinfo_with_bfd(c, abfd, &dunit);
+    trdb_pulp_unmap_packets(&map);
+    trdb_container_close(&ct);
+    if (follow_fd > STDIN_FILENO)
+        close(follow_fd);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&instrs);
+    if (image) {
+        trdb_set_image(c, NULL);
+        trdb_image_free(image);
+    }
     return status;
 }
 
@@ -434,26 +1104,28 @@ static int disassemble_trace(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
     struct disassembler_unit dunit;
 
     /* read stimuli file and convert to internal data structure */
-    struct tr_instr *tmp;
+    struct tr_instr *tmp      = NULL;
     struct tr_instr **samples = &tmp;
     size_t samplecnt          = 0;
     int success               = 0;
 
+    dinfo       = (struct disassemble_info){0};
+    dunit       = (struct disassembler_unit){0};
+    dunit.dinfo = &dinfo;
+
     success = trdb_stimuli_to_trace(c, arguments->args[0], samples, &samplecnt);
     if (success < 0) {
         fprintf(stderr, "reading stimuli file failed: %s\n",
-                trdb_errstr(trdb_errcode(status)));
+                trdb_errstr(trdb_errcode(success)));
         status = EXIT_FAILURE;
         goto fail;
     }
 
-    dinfo       = (struct disassemble_info){0};
-    dunit       = (struct disassembler_unit){0};
-    dunit.dinfo = &dinfo;
-
     /* setup the disassembler to consider data from the bfd */
     if (abfd) {
-        if (trdb_alloc_dinfo_with_bfd(c, abfd, &dunit)) {
+        if (trdb_get_image(c)
+                ? trdb_alloc_dinfo_with_image(c, trdb_get_image(c), &dunit)
+                : trdb_alloc_dinfo_with_bfd(c, abfd, &dunit)) {
             fprintf(stderr, "failed to configure bfd: %s\n",
                     trdb_errstr(trdb_errcode(status)));
             status = EXIT_FAILURE;
@@ -471,7 +1143,17 @@ static int disassemble_trace(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
             disassembler(bfd_arch_riscv, false, bfd_mach_riscv32, NULL);
     }
 
-    trdb_disassemble_trace(samplecnt, *samples, &dunit);
+    /* each distinct instruction is only disassembled once */
+    struct trdb_disasm_cache *cache = NULL;
+    success = trdb_disasm_cache_new(c, NULL, &dunit, &cache);
+    if (success == 0)
+        success = trdb_disasm_cache_trace(cache, samplecnt, *samples);
+    trdb_disasm_cache_free(cache);
+    if (success < 0) {
+        fprintf(stderr, "disassembling trace failed: %s\n",
+                trdb_errstr(trdb_errcode(success)));
+        status = EXIT_FAILURE;
+    }
 
 fail:
     if (abfd)
@@ -522,27 +1204,731 @@ static int dump_trace(struct trdb_ctx *c, FILE *output_fp,
 {
     int status = EXIT_SUCCESS;
 
-    const char *path = arguments->args[0];
-    struct trdb_instr_head instr_list;
-    size_t instrcnt = 0;
-    TAILQ_INIT(&instr_list);
+    const char *path               = arguments->args[0];
+    struct tr_instr *samples       = NULL;
+    size_t instrcnt                = 0;
+    struct trdb_trace_writer trace = {0};
 
     if (arguments->cvs) {
-        status = trdb_cvs_to_trace_list(c, path, &instr_list, &instrcnt);
+        status = trdb_cvs_to_trace_parallel(c, path, &samples, &instrcnt,
+                                            arguments->jobs);
+    } else if (trdb_is_binary_trace(path)) {
+        status = trdb_binary_to_trace(c, path, &samples, &instrcnt);
+    } else {
+        status = trdb_stimuli_to_trace_parallel(c, path, &samples, &instrcnt,
+                                                arguments->jobs);
+    }
+    if (status < 0) {
+        fprintf(stderr, "failed to parse trace file: %s\n",
+                trdb_errstr(trdb_errcode(status)));
+        status = EXIT_FAILURE;
+        goto fail;
+    }
+
+    /* this converts between the trace formats */
+    if (arguments->binary_trace) {
+        status = trdb_trace_writer_open(c, output_fp, 0, &trace);
+        for (size_t i = 0; i < instrcnt && status == 0; i++)
+            status = trdb_trace_write_instr(&trace, &samples[i]);
+        if (status == 0)
+            status = trdb_trace_writer_close(&trace);
         if (status < 0) {
-            fprintf(stderr, "failed to parse cvs file: %s\n",
+            fprintf(stderr, "failed to write trace: %s\n",
                     trdb_errstr(trdb_errcode(status)));
             status = EXIT_FAILURE;
             goto fail;
         }
-        trdb_dump_instr_list(output_fp, &instr_list);
     } else {
-        fprintf(stderr, "dump trace for non cvs file not implemented yet");
+        for (size_t i = 0; i < instrcnt; i++)
+            trdb_print_instr(output_fp, &samples[i]);
+    }
+
+fail:
+    free(samples);
+    return status;
+}
+
+/* the generated trace is compressed or written chunk by chunk, so that it
+ * never has to be held in memory as a whole
+ */
+static int generate_trace(struct trdb_ctx *c, FILE *output_fp, bfd *abfd,
+                          struct arguments *arguments)
+{
+    int status                     = EXIT_SUCCESS;
+    int err                        = 0;
+    struct trdb_gen *gen           = NULL;
+    struct trdb_trace_writer trace = {0};
+    struct trdb_container_writer w = {0};
+    struct trdb_packet_head packet_list;
+    struct tr_instr *chunk = NULL;
+    size_t chunklen        = 4096;
+    uint8_t buf[4096];
+
+    TAILQ_INIT(&packet_list);
+
+    const char *format = arguments->binary_output ? arguments->binary_format
+                                                  : "";
+    bool pulp          = !strcmp(format, "pulp");
+    bool container     = !strcmp(format, "container");
+
+    if (!abfd) {
+        fprintf(stderr, "need to provide a binary (--bfd) to generate a "
+                        "trace\n");
+        return EXIT_FAILURE;
+    }
+
+    chunk = malloc(chunklen * sizeof(*chunk));
+    if (!chunk) {
+        err = -trdb_nomem;
+        goto fail;
+    }
+
+    err = trdb_gen_new(c, abfd, &arguments->gen, &gen);
+    if (err < 0)
+        goto fail;
+
+    if (arguments->compress && container) {
+        if (arguments->resync == 0)
+            trdb_set_resync_interval(c, arguments->block_size);
+        err = trdb_container_create(c, output_fp, arguments->block_size, &w);
+        trdb_container_set_snapshots(&w, arguments->snapshots);
+    } else if (!arguments->compress && arguments->binary_trace) {
+        err = trdb_trace_writer_open(c, output_fp, 0, &trace);
+    }
+
+    for (uint64_t done = 0; done < arguments->generate_len && err >= 0;) {
+        size_t len = arguments->generate_len - done < chunklen
+                         ? arguments->generate_len - done
+                         : chunklen;
+        err = trdb_gen_next(gen, len, chunk);
+        if (err < 0)
+            break;
+        done += len;
+
+        if (!arguments->compress) {
+            for (size_t i = 0; i < len && err >= 0; i++) {
+                if (arguments->binary_trace)
+                    err = trdb_trace_write_instr(&trace, &chunk[i]);
+                else
+                    trdb_print_instr(output_fp, &chunk[i]);
+            }
+        } else if (container) {
+            for (size_t i = 0; i < len && err >= 0; i++)
+                err = trdb_container_compress_step(c, &w, &chunk[i]);
+        } else if (pulp) {
+            for (size_t off = 0; off < len && err >= 0;) {
+                size_t consumed = 0;
+                size_t written  = 0;
+                err = trdb_pulp_compress_trace_block(c, len - off, chunk + off,
+                                                     sizeof(buf), buf,
+                                                     &consumed, &written);
+                if (err >= 0 && fwrite(buf, 1, written, output_fp) != written)
+                    err = -trdb_file_write;
+                off += consumed;
+            }
+        } else {
+            for (size_t i = 0; i < len && err >= 0; i++)
+                err = trdb_compress_trace_step_add(c, &packet_list, &chunk[i]);
+            if (err >= 0)
+                trdb_dump_packet_list(output_fp, &packet_list);
+            trdb_free_packet_list(&packet_list);
+            TAILQ_INIT(&packet_list);
+        }
+    }
+
+    if (w.fp) {
+        int finish = trdb_container_finish(c, &w);
+        if (err >= 0)
+            err = finish;
+    }
+    if (trace.fp) {
+        int close = trdb_trace_writer_close(&trace);
+        if (err >= 0)
+            err = close;
+    }
+
+    if (arguments->verbose && gen) {
+        struct trdb_gen_stats stats;
+        trdb_gen_get_stats(gen, &stats);
+        fprintf(stderr,
+                "generated %zu instructions (%zu compressed), %zu branches "
+                "(%zu taken), %zu calls, %zu returns, %zu exceptions, "
+                "%zu interrupts, %zu restarts\n",
+                stats.instrs, stats.compressed, stats.branches, stats.taken,
+                stats.calls, stats.returns, stats.exceptions,
+                stats.interrupts, stats.restarts);
+    }
+
+fail:
+    if (err < 0) {
+        fprintf(stderr, "failed to generate trace: %s\n",
+                trdb_errstr(trdb_errcode(err)));
         status = EXIT_FAILURE;
+    }
+    trdb_free_packet_list(&packet_list);
+    trdb_gen_free(gen);
+    free(chunk);
+    return status;
+}
+
+static int serve_trace(struct trdb_ctx *c, FILE *output_fp,
+                       struct arguments *arguments)
+{
+    int status                     = EXIT_SUCCESS;
+    int err                        = 0;
+    int fd                         = -1;
+    struct trdb_ring *ring         = NULL;
+    struct trdb_container_writer w = {0};
+    struct trdb_server_stats stats = {0};
+    const char *address            = arguments->serve_address;
+    const char *ring_path          = NULL;
+
+    catch_stop_signals();
+
+    if (arguments->resync == 0)
+        trdb_set_resync_interval(c, arguments->block_size);
+
+    if (!strncmp(address, "shm:", 4)) {
+        ring_path = address + 4;
+        err = trdb_ring_create(c, ring_path, arguments->ring_size,
+                               arguments->drop, &ring);
+        if (err < 0)
+            goto fail;
+        if (!arguments->silent)
+            fprintf(stderr, "waiting for instructions in %s\n", ring_path);
+    } else if (!strcmp(address, "-")) {
+        fd = STDIN_FILENO;
+    } else {
+        if (!arguments->silent)
+            fprintf(stderr, "waiting for a connection on %s\n", address);
+        err = trdb_serve_accept(c, address, &fd);
+        if (err < 0)
+            goto fail;
+    }
+
+    err = trdb_container_create(c, output_fp, arguments->block_size, &w);
+    if (err < 0)
         goto fail;
+    trdb_container_set_snapshots(&w, arguments->snapshots);
+
+    if (ring)
+        err = trdb_serve_ring(c, ring, &w, &stop_requested, &stats);
+    else
+        err = trdb_serve_fd(c, fd, &w, &stop_requested, &stats);
+
+    int finish = trdb_container_finish(c, &w);
+    if (err >= 0)
+        err = finish;
+
+    /* stdout might be the container */
+    if (!arguments->silent) {
+        double secs = stats.elapsed_ns / 1e9;
+        fprintf(stderr, "compressed:   %" PRIu64 " instructions to %" PRIu64
+                        " packets, %" PRIu64 " bytes\n",
+                stats.instrs, stats.packets, stats.bytes);
+        if (ring)
+            fprintf(stderr,
+                    "dropped:      %" PRIu64 " instructions, %" PRIu64
+                    " producer stalls\n",
+                    stats.dropped, stats.stalls);
+        if (stats.batches)
+            fprintf(stderr,
+                    "latency:      %.1f us mean, %.1f us max over %" PRIu64
+                    " batches\n",
+                    stats.total_latency_ns / 1e3 / stats.batches,
+                    stats.max_latency_ns / 1e3, stats.batches);
+        fprintf(stderr, "throughput:   %.3f s, %.1f instructions/s\n", secs,
+                secs > 0 ? stats.instrs / secs : 0);
     }
 
 fail:
-    trdb_free_instr_list(&instr_list);
+    if (err < 0) {
+        fprintf(stderr, "failed to serve %s: %s\n", address,
+                trdb_errstr(trdb_errcode(err)));
+        status = EXIT_FAILURE;
+    }
+    if (ring) {
+        trdb_ring_free(ring);
+        unlink(ring_path);
+    }
+    if (fd > STDIN_FILENO)
+        close(fd);
+    return status;
+}
+
+static void add_perf_stats(struct trdb_perf_stats *to,
+                           const struct trdb_perf_stats *from)
+{
+    for (size_t i = 0; i < TRDB_PERF_STAGES; i++) {
+        to->stages[i].calls += from->stages[i].calls;
+        to->stages[i].ns += from->stages[i].ns;
+    }
+    to->decode_hits += from->decode_hits;
+    to->decode_misses += from->decode_misses;
+    to->section_loads += from->section_loads;
+    to->allocs += from->allocs;
+}
+
+/* Print what --stats asked for. @p available is the status of
+ * trdb_get_perf_stats(), without instrumentation only the counts of compressed
+ * instructions and packets are known.
+ */
+static void print_stats(FILE *fp, const char *format, int available,
+                        const struct trdb_perf_stats *perf, size_t instrs,
+                        size_t packets)
+{
+    bool json = !strcmp(format, "json");
+
+    if (json) {
+        fprintf(fp, "{\"instrs\": %zu, \"packets\": %zu, \"perf\": ", instrs,
+                packets);
+        if (available < 0) {
+            fprintf(fp, "null}\n");
+            return;
+        }
+        fprintf(fp, "{\"stages\": {");
+        for (size_t i = 0; i < TRDB_PERF_STAGES; i++)
+            fprintf(fp,
+                    "%s\"%s\": {\"calls\": %" PRIu64 ", \"ns\": %" PRIu64 "}",
+                    i ? ", " : "", trdb_perf_stage_name(i),
+                    perf->stages[i].calls, perf->stages[i].ns);
+        fprintf(fp,
+                "}, \"decode_hits\": %" PRIu64 ", \"decode_misses\": %" PRIu64
+                ", \"section_loads\": %" PRIu64 ", \"allocs\": %" PRIu64
+                "}}\n",
+                perf->decode_hits, perf->decode_misses, perf->section_loads,
+                perf->allocs);
+        return;
+    }
+
+    if (instrs)
+        fprintf(fp, "compressed:   %zu instructions to %zu packets\n", instrs,
+                packets);
+    if (available < 0) {
+        fprintf(fp, "perf stats:   not compiled in, configure with "
+                    "--enable-perf-stats\n");
+        return;
+    }
+    fprintf(fp, "%-12s %12s %16s %12s\n", "stage", "calls", "total ns",
+            "ns/call");
+    for (size_t i = 0; i < TRDB_PERF_STAGES; i++) {
+        const struct trdb_perf_timer *timer = &perf->stages[i];
+        fprintf(fp, "%-12s %12" PRIu64 " %16" PRIu64 " %12.1f\n",
+                trdb_perf_stage_name(i), timer->calls, timer->ns,
+                timer->calls ? (double)timer->ns / timer->calls : 0);
+    }
+    fprintf(fp, "decode cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+            perf->decode_hits, perf->decode_misses);
+    fprintf(fp, "sections:     %" PRIu64 " loaded\n", perf->section_loads);
+    fprintf(fp, "allocations:  %" PRIu64 "\n", perf->allocs);
+}
+
+/* Batch mode. The inputs are handed out to a pool of threads, each with its
+ * own context but sharing the image of the bfd.
+ */
+struct batch_pool {
+    struct arguments *arguments;
+    bfd *abfd;
+    struct trdb_image *image;
+    char **paths;
+    char **outs; /* where the output of each input goes */
+    size_t npaths;
+    size_t next; /* next input to hand out */
+    /* commands that print disassembly use the bfd and libopcodes directly */
+    pthread_mutex_t bfd_lock;
+    bool needs_bfd_lock;
+};
+
+/* what a worker did, summed up at the end */
+struct batch_stats {
+    size_t files;
+    size_t failed;
+    size_t input_bytes;
+    size_t output_bytes;
+    size_t instrs;
+    size_t packets;
+    struct trdb_perf_stats perf;
+};
+
+static bool is_directory(const char *path)
+{
+    struct stat st;
+    return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+static bool is_batch(struct arguments *arguments)
+{
+    if (arguments->ninputs > 1 || is_directory(arguments->output_file))
+        return true;
+    for (size_t i = 0; i < arguments->ninputs; i++) {
+        if (is_directory(arguments->inputs[i]))
+            return true;
+    }
+    return false;
+}
+
+static const char *decompress_suffix(struct arguments *arguments)
+{
+    if (arguments->profile)
+        return ".profile";
+    return arguments->blocks ? ".blocks" : ".trace";
+}
+
+/* the name of a command's output is the input's plus this */
+static const char *batch_suffix(struct arguments *arguments)
+{
+    if (arguments->decompress)
+        return decompress_suffix(arguments);
+    if (arguments->compress)
+        return ".packets";
+    if (arguments->human)
+        return ".dump";
+    if (arguments->trace_file)
+        return ".dis";
+    return decompress_suffix(arguments);
+}
+
+static int push_path(char ***paths, size_t *npaths, const char *path)
+{
+    char *copy = strdup(path);
+    char **tmp = realloc(*paths, (*npaths + 1) * sizeof(*tmp));
+    if (!copy || !tmp) {
+        free(copy);
+        if (tmp)
+            *paths = tmp;
+        return -trdb_nomem;
+    }
+    tmp[(*npaths)++] = copy;
+    *paths           = tmp;
+    return 0;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static const char *path_base(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    return base ? base + 1 : path;
+}
+
+/* an output name and the input it belongs to, sorted to find duplicates */
+struct output_name {
+    const char *name;
+    size_t index;
+};
+
+static int compare_output_names(const void *a, const void *b)
+{
+    return strcmp(((const struct output_name *)a)->name,
+                  ((const struct output_name *)b)->name);
+}
+
+/* Name the output of each of the @p npaths inputs after its file name. Inputs
+ * with the same file name, e.g. from different directories, are named after
+ * their whole path with the slashes replaced instead. Fails if that still
+ * doesn't tell them apart, e.g. for an input given twice.
+ */
+static int name_outputs(struct arguments *arguments, char **paths,
+                        size_t npaths, char ***outs)
+{
+    int status                = 0;
+    const char *dir           = arguments->output_file;
+    const char *suffix        = batch_suffix(arguments);
+    struct output_name *names = malloc((npaths ? npaths : 1) * sizeof(*names));
+    char **out                = calloc(npaths ? npaths : 1, sizeof(*out));
+    if (!names || !out) {
+        status = -trdb_nomem;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < npaths; i++)
+        names[i] = (struct output_name){.name  = path_base(paths[i]),
+                                        .index = i};
+    qsort(names, npaths, sizeof(*names), compare_output_names);
+
+    for (size_t i = 0; i < npaths; i++) {
+        size_t k         = names[i].index;
+        const char *base = names[i].name;
+        bool shared      = (i > 0 && !strcmp(names[i - 1].name, base)) ||
+                      (i + 1 < npaths && !strcmp(names[i + 1].name, base));
+        const char *name = shared ? paths[k] : base;
+        while (shared && name[0] == '.' && name[1] == '/')
+            name += 2;
+
+        size_t len = strlen(dir) + strlen(name) + strlen(suffix) + 2;
+        if (!(out[k] = malloc(len))) {
+            status = -trdb_nomem;
+            goto fail;
+        }
+        snprintf(out[k], len, "%s/%s%s", dir, name, suffix);
+        for (char *c = out[k] + strlen(dir) + 1; shared && *c; c++) {
+            if (*c == '/')
+                *c = '_';
+        }
+    }
+
+    for (size_t i = 0; i < npaths; i++)
+        names[i] = (struct output_name){.name = out[i], .index = i};
+    qsort(names, npaths, sizeof(*names), compare_output_names);
+    for (size_t i = 1; i < npaths; i++) {
+        if (!strcmp(names[i - 1].name, names[i].name)) {
+            fprintf(stderr, "%s and %s would both be written to %s\n",
+                    paths[names[i - 1].index], paths[names[i].index],
+                    names[i].name);
+            status = -trdb_invalid;
+            goto fail;
+        }
+    }
+
+    free(names);
+    *outs = out;
+    return 0;
+
+fail:
+    for (size_t i = 0; out && i < npaths; i++)
+        free(out[i]);
+    free(out);
+    free(names);
+    return status;
+}
+
+/* Expand the inputs of @p arguments into the files to process. Directories
+ * contribute their regular files, not recursively and in sorted order. @p outs
+ * is written with the output of each, see name_outputs().
+ */
+static int collect_inputs(struct arguments *arguments, char ***paths,
+                          char ***outs, size_t *npaths)
+{
+    int status = 0;
+    char buf[4096];
+
+    for (size_t i = 0; i < arguments->ninputs && status == 0; i++) {
+        const char *input = arguments->inputs[i];
+        if (!is_directory(input)) {
+            status = push_path(paths, npaths, input);
+            continue;
+        }
+
+        DIR *dir = opendir(input);
+        if (!dir) {
+            fprintf(stderr, "opendir %s: %s\n", input, strerror(errno));
+            return -trdb_file_open;
+        }
+        size_t first = *npaths;
+        struct dirent *entry;
+        while (status == 0 && (entry = readdir(dir))) {
+            struct stat st;
+            if (entry->d_name[0] == '.')
+                continue;
+            snprintf(buf, sizeof(buf), "%s/%s", input, entry->d_name);
+            if (stat(buf, &st) || !S_ISREG(st.st_mode))
+                continue;
+            status = push_path(paths, npaths, buf);
+        }
+        closedir(dir);
+        qsort(*paths + first, *npaths - first, sizeof(**paths), compare_paths);
+    }
+    if (status == 0)
+        status = name_outputs(arguments, *paths, *npaths, outs);
+    return status;
+}
+
+/* Process the input @p path into @p out_path with the worker context @p c */
+static int batch_file(struct trdb_ctx *c, struct batch_pool *pool,
+                      const char *path, const char *out_path,
+                      struct batch_stats *stats)
+{
+    int status                = EXIT_SUCCESS;
+    struct arguments per_file = *pool->arguments;
+    struct stat st;
+
+    /* every input starts from scratch and is processed with a single thread,
+     * the pool already keeps all of them busy
+     */
+    per_file.args[0] = (char *)path;
+    per_file.jobs    = 1;
+    trdb_reset_compression(c);
+    trdb_reset_decompression(c);
+    configure_ctx(c, &per_file);
+
+    FILE *fp = fopen(out_path, "w");
+    if (!fp) {
+        fprintf(stderr, "fopen %s: %s\n", out_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (pool->needs_bfd_lock)
+        pthread_mutex_lock(&pool->bfd_lock);
+    status = run_command(c, fp, pool->abfd, &per_file);
+    if (pool->needs_bfd_lock)
+        pthread_mutex_unlock(&pool->bfd_lock);
+
+    long written = ftell(fp);
+    if (fclose(fp) && status == EXIT_SUCCESS)
+        status = EXIT_FAILURE;
+
+    if (!stat(path, &st))
+        stats->input_bytes += st.st_size;
+    stats->output_bytes += written > 0 ? written : 0;
+    stats->instrs += trdb_get_instrcnt(c);
+    stats->packets += trdb_get_packetcnt(c);
+    return status;
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch_pool *pool   = arg;
+    struct batch_stats *stats = calloc(1, sizeof(*stats));
+    struct trdb_ctx *c        = trdb_new();
+
+    for (;;) {
+        size_t k = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (k >= pool->npaths)
+            break;
+
+        int status = EXIT_FAILURE;
+        if (c && stats) {
+            trdb_set_image(c, pool->image);
+            status =
+                batch_file(c, pool, pool->paths[k], pool->outs[k], stats);
+        }
+        if (stats)
+            stats->files++;
+        if (status != EXIT_SUCCESS) {
+            fprintf(stderr, "%s: failed\n", pool->paths[k]);
+            if (stats)
+                stats->failed++;
+        }
+    }
+
+    if (c && stats)
+        trdb_get_perf_stats(c, &stats->perf);
+    trdb_free(c);
+    return stats;
+}
+
+static int run_batch(struct trdb_ctx *c, bfd *abfd,
+                     struct arguments *arguments)
+{
+    int status               = EXIT_SUCCESS;
+    struct batch_pool pool   = {.arguments = arguments, .abfd = abfd};
+    struct batch_stats total = {0};
+    pthread_t *workers       = NULL;
+    unsigned nworkers        = 0;
+    unsigned threads         = arguments->jobs;
+    struct timespec start    = {0};
+    struct timespec end      = {0};
+
+    if (arguments->output_file[0] == '-' && !arguments->output_file[1]) {
+        fprintf(stderr, "batch mode needs an output directory (-o DIR)\n");
+        return EXIT_FAILURE;
+    }
+    if (!is_directory(arguments->output_file) &&
+        mkdir(arguments->output_file, 0777)) {
+        fprintf(stderr, "mkdir %s: %s\n", arguments->output_file,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (collect_inputs(arguments, &pool.paths, &pool.outs, &pool.npaths) < 0) {
+        status = EXIT_FAILURE;
+        goto fail;
+    }
+
+    /* everything the workers need from the bfd is read once up front */
+    if (abfd && trdb_image_new(c, abfd, &pool.image) < 0) {
+        fprintf(stderr, "failed to read %s\n", arguments->elf_file);
+        status = EXIT_FAILURE;
+        goto fail;
+    }
+    pool.needs_bfd_lock =
+        arguments->disassemble ||
+        (arguments->trace_file && !arguments->human && !arguments->compress &&
+         !arguments->decompress);
+    pthread_mutex_init(&pool.bfd_lock, NULL);
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads     = online > 0 ? online : 1;
+    }
+    if (threads > pool.npaths)
+        threads = pool.npaths ? pool.npaths : 1;
+
+    workers = malloc(threads * sizeof(*workers));
+    if (!workers) {
+        status = EXIT_FAILURE;
+        goto fail_lock;
+    }
+    for (; nworkers < threads; nworkers++) {
+        if (pthread_create(&workers[nworkers], NULL, batch_worker, &pool))
+            break;
+    }
+    if (nworkers == 0) {
+        fprintf(stderr, "failed to spawn batch threads\n");
+        status = EXIT_FAILURE;
+        goto fail_lock;
+    }
+
+    for (unsigned i = 0; i < nworkers; i++) {
+        struct batch_stats *stats = NULL;
+        pthread_join(workers[i], (void **)&stats);
+        if (!stats) {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        total.files += stats->files;
+        total.failed += stats->failed;
+        total.input_bytes += stats->input_bytes;
+        total.output_bytes += stats->output_bytes;
+        total.instrs += stats->instrs;
+        total.packets += stats->packets;
+        add_perf_stats(&total.perf, &stats->perf);
+        free(stats);
+    }
+    if (total.failed || total.files != pool.npaths)
+        status = EXIT_FAILURE;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (!arguments->silent) {
+        printf("files:        %zu processed, %zu failed, %u threads\n",
+               total.files, total.failed, nworkers);
+        printf("input:        %zu bytes\n", total.input_bytes);
+        printf("output:       %zu bytes\n", total.output_bytes);
+        if (total.instrs)
+            printf("compressed:   %zu instructions to %zu packets\n",
+                   total.instrs, total.packets);
+        printf("time:         %.3f s, %.1f files/s\n", secs,
+               secs > 0 ? total.files / secs : 0);
+    }
+
+    if (arguments->stats_format) {
+        /* the image was loaded by us */
+        struct trdb_perf_stats own;
+        int available = trdb_get_perf_stats(c, &own);
+        add_perf_stats(&total.perf, &own);
+        print_stats(stderr, arguments->stats_format, available, &total.perf,
+                    total.instrs, total.packets);
+    }
+
+fail_lock:
+    pthread_mutex_destroy(&pool.bfd_lock);
+fail:
+    for (size_t i = 0; i < pool.npaths; i++) {
+        free(pool.paths[i]);
+        if (pool.outs)
+            free(pool.outs[i]);
+    }
+    free(pool.paths);
+    free(pool.outs);
+    free(workers);
+    trdb_image_free(pool.image);
     return status;
 }
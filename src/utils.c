@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <time.h>
 #include "utils.h"
 
 void trdb_log_null(struct trdb_ctx *ctx, const char *format, ...)
@@ -32,22 +33,18 @@ void trdb_log_null(struct trdb_ctx *ctx, const char *format, ...)
     (void)format;
 }
 
+/* A bit of addr ^ (addr << 1) is set where addr changes its value going from
+ * the msb down, so its leading zeros plus one are the leading bits equal to the
+ * msb. The or'ed in one bounds the result for 0 and all ones.
+ */
 uint32_t sign_extendable_bits(uint32_t addr)
 {
-    if (addr == 0 || addr == UINT32_MAX)
-        return 32;
-    int clz = __builtin_clz(addr);
-    int clo = __builtin_clz(~addr);
-    return clz > clo ? clz : clo;
+    return __builtin_clz((addr ^ (addr << 1)) | 1) + 1;
 }
 
 uint32_t sign_extendable_bits64(uint64_t addr)
 {
-    if (addr == 0 || addr == UINT64_MAX)
-        return 64;
-    int clz = __builtin_clzll(addr);
-    int clo = __builtin_clzll(~addr);
-    return clz > clo ? clz : clo;
+    return __builtin_clzll((addr ^ (addr << 1)) | 1) + 1;
 }
 
 uint32_t sign_extendable_bits128(__uint128_t addr)
@@ -94,3 +91,12 @@ int clz_u128(__uint128_t u)
     int idx       = !hi + ((!lo) & (!hi));
     return retval[idx];
 }
+
+#ifdef ENABLE_PERF_STATS
+uint64_t trdb_perf_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
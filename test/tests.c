@@ -28,6 +28,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <argp.h>
 #include <libgen.h>
@@ -35,10 +36,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <linux/limits.h>
+#include <pthread.h>
 #include "trace_debugger.h"
 #include "disassembly.h"
 #include "utils.h"
 #include "serialize.h"
+#include "generator.h"
+#include "server.h"
+#include "profile.h"
 #include "workaround.h"
 
 #define TRDB_SUCCESS 0
@@ -207,6 +212,210 @@ fail:
     return status;
 }
 
+static int test_parse_packets_vec(const char *path)
+{
+    int status         = TRDB_SUCCESS;
+    struct trdb_ctx *c = trdb_new();
+    struct trdb_packet_head packet_list;
+    TAILQ_INIT(&packet_list);
+    struct trdb_packet_vec packets = {0};
+
+    if (trdb_pulp_read_all_packets(c, path, &packet_list) ||
+        trdb_pulp_read_all_packets_vec(c, path, &packets)) {
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (packets.size == 0) {
+        LOG_ERRT("packet vector empty\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t i                 = 0;
+    struct tr_packet *packet = TAILQ_FIRST(&packet_list);
+    struct tr_packet *record;
+    TRDB_VEC_FOREACH (record, i, &packets) {
+        if (!packet || packet->length != record->length ||
+            packet->msg_type != record->msg_type ||
+            packet->format != record->format ||
+            packet->branches != record->branches ||
+            packet->branch_map != record->branch_map ||
+            packet->address != record->address) {
+            LOG_ERRT("packet %zu differs from list\n", i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        packet = TAILQ_NEXT(packet, list);
+    }
+    if (packet) {
+        LOG_ERRT("packet vector shorter than list\n");
+        status = TRDB_FAIL;
+    }
+
+fail:
+    trdb_free(c);
+    trdb_free_packet_list(&packet_list);
+    trdb_free_packet_vec(&packets);
+    return status;
+}
+
+static int test_parse_packets_mapped(const char *trace_path)
+{
+    int status                     = TRDB_SUCCESS;
+    struct trdb_ctx *c             = trdb_new();
+    struct tr_instr *samples       = NULL;
+    size_t samplecnt               = 0;
+    struct trdb_packet_map map     = {0};
+    struct trdb_packet_vec packets = {0};
+    size_t *offsets                = NULL;
+    size_t cnt                     = 0;
+    struct trdb_packet_head packet_list;
+    TAILQ_INIT(&packet_list);
+    struct trdb_packet_head read_list;
+    TAILQ_INIT(&read_list);
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    if (trdb_stimuli_to_trace(c, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_add(c, &packet_list, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* byte aligned like the PULP hardware emits them */
+    FILE *fp = fopen("tmp_mapped", "wb");
+    if (!fp) {
+        perror("fopen");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    struct tr_packet *packet;
+    TAILQ_FOREACH (packet, &packet_list, list) {
+        if (trdb_pulp_write_single_packet(c, packet, fp)) {
+            LOG_ERRT("Writing packet failed\n");
+            status = TRDB_FAIL;
+            break;
+        }
+    }
+    fclose(fp);
+    if (status == TRDB_FAIL)
+        goto fail;
+
+    if (trdb_pulp_read_all_packets(c, "tmp_mapped", &read_list) ||
+        trdb_pulp_map_packets(c, "tmp_mapped", &map) ||
+        trdb_pulp_index_packets(c, &map, &offsets, &cnt) ||
+        trdb_pulp_read_mapped_packets(c, &map, 0, map.size, &packets)) {
+        LOG_ERRT("Reading back packets failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (packets.size == 0 || packets.size != cnt) {
+        LOG_ERRT("packet count mismatch: %zu decoded, %zu indexed\n",
+                 packets.size, cnt);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t i = 0;
+    packet   = TAILQ_FIRST(&read_list);
+    struct tr_packet *record;
+    TRDB_VEC_FOREACH (record, i, &packets) {
+        if (!packet || packet->length != record->length ||
+            packet->msg_type != record->msg_type ||
+            packet->format != record->format ||
+            packet->branches != record->branches ||
+            packet->branch_map != record->branch_map ||
+            packet->address != record->address) {
+            LOG_ERRT("mapped packet %zu differs from stdio packet\n", i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        packet = TAILQ_NEXT(packet, list);
+    }
+    if (packet) {
+        LOG_ERRT("fewer mapped packets than stdio packets\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* seek into the middle using the index */
+    size_t offset        = offsets[cnt / 2];
+    struct tr_packet tmp = {0};
+    record               = TRDB_VEC_AT(&packets, cnt / 2);
+    if (trdb_pulp_next_mapped_packet(c, &map, &offset, &tmp) ||
+        tmp.address != record->address || tmp.length != record->length ||
+        (cnt / 2 + 1 < cnt && offset != offsets[cnt / 2 + 1])) {
+        LOG_ERRT("seeking to packet %zu failed\n", cnt / 2);
+        status = TRDB_FAIL;
+    }
+
+fail:
+    remove("tmp_mapped");
+    free(offsets);
+    free(samples);
+    trdb_pulp_unmap_packets(&map);
+    trdb_free_packet_vec(&packets);
+    trdb_free_packet_list(&packet_list);
+    trdb_free_packet_list(&read_list);
+    trdb_free(c);
+    return status;
+}
+
+static int test_instr_vec(void)
+{
+    int status                = TRDB_SUCCESS;
+    struct trdb_instr_vec vec = {0};
+    const size_t cnt          = 2 * TRDB_VEC_BLOCK + 3;
+    struct tr_instr *first    = NULL;
+    struct tr_instr *instr    = NULL;
+    size_t i                  = 0;
+
+    for (i = 0; i < cnt; i++) {
+        struct tr_instr tmp = {.iaddr = i * 2, .instr = i};
+        if (trdb_instr_vec_push(&vec, &tmp)) {
+            LOG_ERRT("push failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        if (i == 0)
+            first = TRDB_VEC_AT(&vec, 0);
+    }
+
+    if (vec.size != cnt || vec.nblocks != 3 || first != TRDB_VEC_AT(&vec, 0)) {
+        LOG_ERRT("bad vector layout\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    TRDB_VEC_FOREACH (instr, i, &vec) {
+        if (instr->iaddr != i * 2 || instr->instr != i) {
+            LOG_ERRT("record %zu corrupted\n", i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    trdb_free_instr_vec(&vec);
+    if (vec.size || vec.nblocks || vec.blocks) {
+        LOG_ERRT("vector not empty after free\n");
+        status = TRDB_FAIL;
+    }
+
+fail:
+    trdb_free_instr_vec(&vec);
+    return status;
+}
+
 /* static int test_trdb_serialize_packet(uint32_t shift) */
 /* { */
 /*     int status = TRDB_SUCCESS; */
@@ -391,6 +600,43 @@ static int test_parse_stimuli_line()
                : TRDB_FAIL;
 }
 
+/* count the leading bits equal to the msb one by one */
+static uint32_t naive_sign_extendable_bits(uint64_t addr, unsigned width)
+{
+    uint32_t cnt = 1;
+    uint64_t msb = (addr >> (width - 1)) & 1;
+    while (cnt < width && ((addr >> (width - 1 - cnt)) & 1) == msb)
+        cnt++;
+    return cnt;
+}
+
+static int test_sign_extendable_bits()
+{
+    uint64_t state = 0x2545f4914f6cdd1d;
+
+    for (unsigned i = 0; i < 200000; i++) {
+        /* xorshift, shifted and inverted to get all lengths of leading bits */
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint64_t v = state >> (i % 64);
+        if (i & 64)
+            v = ~v;
+        if (i < 8)
+            v = (uint64_t[]){0, 1, 2, UINT64_MAX, UINT64_MAX - 1, INT64_MAX,
+                             INT64_MIN, UINT32_MAX}[i];
+
+        uint32_t want32 = naive_sign_extendable_bits((uint32_t)v, 32);
+        uint32_t want64 = naive_sign_extendable_bits(v, 64);
+        if (sign_extendable_bits((uint32_t)v) != want32 ||
+            sign_extendable_bits64(v) != want64) {
+            LOG_ERRT("Sign extendable bits of %" PRIx64 " wrong\n", v);
+            return TRDB_FAIL;
+        }
+    }
+    return TRDB_SUCCESS;
+}
+
 static int test_stimuli_to_tr_instr(const char *path)
 {
     struct trdb_ctx *c = trdb_new();
@@ -470,122 +716,572 @@ fail:
     return status;
 }
 
-static int test_stimuli_to_packet_dump(const char *path)
+static bool same_sample(const struct tr_instr *a, const struct tr_instr *b)
 {
-    struct tr_instr *tmp      = NULL;
-    struct tr_instr **samples = &tmp;
-    int status                = TRDB_SUCCESS;
-    struct trdb_ctx *c        = trdb_new();
-    if (!c) {
-        LOG_ERRT("Library context allocation failed.\n");
+    return a->valid == b->valid && a->exception == b->exception &&
+           a->interrupt == b->interrupt && a->cause == b->cause &&
+           a->tval == b->tval && a->priv == b->priv && a->iaddr == b->iaddr &&
+           a->instr == b->instr && a->compressed == b->compressed;
+}
+
+static int test_parse_traces_parallel(const char *path)
+{
+    struct trdb_ctx *c           = NULL;
+    struct tr_instr *samples     = NULL;
+    struct tr_instr *parsed      = NULL;
+    struct trdb_instr_vec instrs = {0};
+    size_t samplecnt             = 0;
+    size_t cnt                   = 0;
+    char *text                   = NULL;
+    FILE *fp                     = NULL;
+    int status                   = TRDB_SUCCESS;
+    const size_t reps            = 8;
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", path);
+
+    c = trdb_new();
+    if (!c || trdb_stimuli_to_trace(c, path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Reading stimuli failed\n");
         status = TRDB_FAIL;
         goto fail;
     }
 
-    size_t samplecnt = 0;
-    status           = trdb_stimuli_to_trace(c, path, samples, &samplecnt);
-    if (status != 0) {
-        LOG_ERRT("Stimuli to tr_instr failed\n");
+    /* big enough to be cut into a few pieces */
+    fp = fopen(path, "rb");
+    if (!fp) {
+        perror("fopen");
         status = TRDB_FAIL;
         goto fail;
     }
-    status = TRDB_SUCCESS;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    rewind(fp);
+    text = malloc(len);
+    if (!text || fread(text, 1, len, fp) != (size_t)len) {
+        LOG_ERRT("Reading stimuli file failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    fclose(fp);
 
-    struct trdb_packet_head head;
-    TAILQ_INIT(&head);
+    fp = fopen("tmp_stimuli", "wb");
+    for (size_t r = 0; fp && r < reps; r++)
+        fwrite(text, 1, len, fp);
+    if (!fp || fclose(fp)) {
+        perror("fopen");
+        fp     = NULL;
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    fp = NULL;
+
+    unsigned jobs[] = {1, 3, 0};
+    for (size_t j = 0; j < sizeof(jobs) / sizeof(jobs[0]); j++) {
+        if (trdb_stimuli_to_trace_parallel(c, "tmp_stimuli", &parsed, &cnt,
+                                           jobs[j]) < 0 ||
+            cnt != reps * samplecnt) {
+            LOG_ERRT("Parallel stimuli parsing with %u threads failed\n",
+                     jobs[j]);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        for (size_t i = 0; i < cnt; i++) {
+            if (!same_sample(&parsed[i], &samples[i % samplecnt])) {
+                LOG_ERRT("Sample %zu differs with %u threads\n", i, jobs[j]);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+        free(parsed);
+        parsed = NULL;
+    }
 
-    /* step by step compression */
-    for (size_t i = 0; i < samplecnt; i++) {
-        int step = trdb_compress_trace_step_add(c, &head, &(*samples)[i]);
-        if (step < 0) {
-            LOG_ERRT("Compress trace failed.\n");
+    /* the same trace as cvs, with the odd spacing and prefix thrown in */
+    fp = fopen("tmp_cvs", "w");
+    if (!fp) {
+        perror("fopen");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    fprintf(fp, "VALID,ADDRESS,INSN,PRIVILEGE,EXCEPTION,ECAUSE,TVAL,"
+                "INTERRUPT\n");
+    for (size_t r = 0; r < 4 * reps; r++) {
+        for (size_t i = 0; i < samplecnt; i++) {
+            struct tr_instr *s = &samples[i];
+            fprintf(fp, i % 3 ? "%d,%" PRIxADDR : " %d, 0x%" PRIxADDR,
+                    s->valid, (addr_t)s->iaddr);
+            fprintf(fp, ",%" PRIxINSN ",%x,%d,%x,%" PRIxADDR ",%d%s\n",
+                    (insn_t)s->instr, s->priv, s->exception, s->cause,
+                    (addr_t)s->tval, s->interrupt, i % 3 ? "" : "\r");
+        }
+        fprintf(fp, "\n");
+    }
+    if (fclose(fp)) {
+        fp     = NULL;
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    fp = NULL;
+
+    if (trdb_cvs_to_trace_vec(c, "tmp_cvs", &instrs, &cnt) < 0 ||
+        cnt != 4 * reps * samplecnt) {
+        LOG_ERRT("Reading cvs failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t j = 0; j < sizeof(jobs) / sizeof(jobs[0]); j++) {
+        if (trdb_cvs_to_trace_parallel(c, "tmp_cvs", &parsed, &cnt, jobs[j]) <
+                0 ||
+            cnt != instrs.size) {
+            LOG_ERRT("Parallel cvs parsing with %u threads failed\n", jobs[j]);
             status = TRDB_FAIL;
             goto fail;
         }
+        for (size_t i = 0; i < cnt; i++) {
+            struct tr_instr expected = samples[i % samplecnt];
+            expected.compressed      = (expected.instr & 3) != 3;
+            if (!same_sample(&parsed[i], TRDB_VEC_AT(&instrs, i)) ||
+                !same_sample(&parsed[i], &expected)) {
+                LOG_ERRT("Cvs sample %zu differs with %u threads\n", i,
+                         jobs[j]);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+        free(parsed);
+        parsed = NULL;
     }
 
-    if (TRDB_VERBOSE_TESTS)
-        trdb_dump_packet_list(stdout, &head);
+    /* broken records are refused */
+    fp = fopen("tmp_stimuli", "w");
+    if (!fp) {
+        perror("fopen");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    fprintf(fp, "valid=1 exception=0 interrupt=0 cause=00 tval=0 priv=7 "
+                "compressed=0 addr=1c008080 instr=0180006f\n"
+                "valid=1 exception=zero\n");
+    fclose(fp);
+    fp = NULL;
+    if (trdb_stimuli_to_trace(c, "tmp_stimuli", &parsed, &cnt) !=
+        -trdb_scan_file) {
+        LOG_ERRT("Broken stimuli file was accepted\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
 
 fail:
+    if (fp)
+        fclose(fp);
+    remove("tmp_stimuli");
+    remove("tmp_cvs");
+    free(text);
+    free(samples);
+    free(parsed);
+    trdb_free_instr_vec(&instrs);
     trdb_free(c);
-    free(*samples);
-    trdb_free_packet_list(&head);
     return status;
 }
 
-static int test_disassemble_trace(const char *bin_path, const char *trace_path)
+static int test_binary_trace(const char *path)
 {
-    struct trdb_ctx *c = trdb_new();
-    struct tr_instr *tmp;
-    struct tr_instr **samples = &tmp;
-    size_t samplecnt          = 0;
-    int status                = 0;
-    status = trdb_stimuli_to_trace(c, trace_path, samples, &samplecnt);
-    if (status < 0) {
-        LOG_ERRT("Stimuli to tr_instr failed\n");
-        return TRDB_FAIL;
+    struct trdb_ctx *c             = NULL;
+    struct tr_instr *samples       = NULL;
+    struct tr_instr *parsed        = NULL;
+    struct trdb_trace_writer trace = {0};
+    size_t samplecnt               = 0;
+    size_t cnt                     = 0;
+    FILE *fp                       = NULL;
+    int status                     = TRDB_SUCCESS;
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", path);
+
+    c = trdb_new();
+    if (!c || trdb_stimuli_to_trace(c, path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Reading stimuli failed\n");
+        status = TRDB_FAIL;
+        goto fail;
     }
 
-    status = TRDB_SUCCESS;
+    uint32_t flags[] = {0, TRDB_TRACE_DELTA_IADDR};
+    for (size_t f = 0; f < 2; f++) {
+        fp = fopen("tmp_trace", "wb");
+        if (!fp || trdb_trace_writer_open(c, fp, flags[f], &trace) < 0) {
+            LOG_ERRT("Opening trace writer failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        for (size_t i = 0; i < samplecnt; i++) {
+            if (trdb_trace_write_instr(&trace, &samples[i]) < 0) {
+                LOG_ERRT("Writing instruction failed\n");
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+        if (trace.count != samplecnt || trdb_trace_writer_close(&trace) < 0) {
+            LOG_ERRT("Closing trace writer failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        fclose(fp);
+        fp = NULL;
 
-    bfd_init();
-    bfd *abfd = bfd_openr(bin_path, NULL);
+        if (!trdb_is_binary_trace("tmp_trace") ||
+            trdb_binary_to_trace(c, "tmp_trace", &parsed, &cnt) < 0 ||
+            cnt != samplecnt) {
+            LOG_ERRT("Reading binary trace failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        for (size_t i = 0; i < cnt; i++) {
+            if (!same_sample(&parsed[i], &samples[i]) ||
+                parsed[i].cause != samples[i].cause ||
+                parsed[i].tval != samples[i].tval) {
+                LOG_ERRT("Instruction %zu differs after round trip\n", i);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+        free(parsed);
+        parsed = NULL;
+    }
 
-    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
-        bfd_perror("test_decompress_trace");
+    /* a truncated record and a stimuli file are refused */
+    if (truncate("tmp_trace", 16 + 3) < 0 ||
+        trdb_binary_to_trace(c, "tmp_trace", &parsed, &cnt) !=
+            -trdb_bad_trace_file ||
+        trdb_is_binary_trace(path) ||
+        trdb_binary_to_trace(c, path, &parsed, &cnt) != -trdb_bad_trace_file) {
+        LOG_ERRT("Bad binary trace was accepted\n");
         status = TRDB_FAIL;
         goto fail;
     }
 
-    struct disassembler_unit dunit = {0};
-    struct disassemble_info dinfo  = {0};
-    dunit.dinfo                    = &dinfo;
-    trdb_init_disassembler_unit(&dunit, abfd, NULL);
-
-    if (TRDB_VERBOSE_TESTS)
-        trdb_disassemble_trace(samplecnt, *samples, &dunit);
-
 fail:
+    trdb_trace_writer_close(&trace);
+    if (fp)
+        fclose(fp);
+    remove("tmp_trace");
+    free(samples);
+    free(parsed);
     trdb_free(c);
-    free(*samples);
-    bfd_close(abfd);
     return status;
 }
 
-static int test_disassemble_trace_with_bfd(const char *bin_path,
-                                           const char *trace_path)
+/* the producer side of test_server() */
+struct server_feed {
+    struct trdb_ring *ring;
+    int fd;
+    struct tr_instr *samples;
+    size_t samplecnt;
+    size_t pushed;
+};
+
+static void *feed_ring(void *arg)
 {
-    bfd *abfd = bfd_openr(bin_path, NULL);
-    if (!(abfd && bfd_check_format(abfd, bfd_object)))
-        return TRDB_FAIL;
+    struct server_feed *feed = arg;
 
-    struct trdb_ctx *c = trdb_new();
-    struct tr_instr *tmp;
-    struct tr_instr **samples = &tmp;
-    size_t samplecnt          = 0;
-    int status                = 0;
-    status = trdb_stimuli_to_trace(c, trace_path, samples, &samplecnt);
-    if (status < 0) {
-        LOG_ERRT("Stimuli to tr_instr failed\n");
-        return TRDB_FAIL;
+    /* uneven pieces that are larger than the ring */
+    for (size_t i = 0; i < feed->samplecnt; i += 100) {
+        size_t len = feed->samplecnt - i < 100 ? feed->samplecnt - i : 100;
+        feed->pushed += trdb_ring_push(feed->ring, len, &feed->samples[i]);
     }
+    trdb_ring_close(feed->ring);
+    return NULL;
+}
 
-    struct disassemble_info dinfo  = {0};
-    struct disassembler_unit dunit = {0};
+static void *feed_fd(void *arg)
+{
+    struct server_feed *feed = arg;
+    uint8_t rec[TRDB_TRACE_RECORD_LEN];
+    uint8_t header[TRDB_TRACE_HEADER_LEN] = "TRDBINST";
+
+    header[8]  = TRDB_TRACE_VERSION;
+    header[10] = XLEN;
+    if (write(feed->fd, header, sizeof(header)) != sizeof(header))
+        goto out;
+
+    /* records split over several writes */
+    for (size_t i = 0; i < feed->samplecnt; i++) {
+        trdb_trace_encode_instr(&feed->samples[i], rec);
+        if (write(feed->fd, rec, 5) != 5 ||
+            write(feed->fd, rec + 5, sizeof(rec) - 5) != sizeof(rec) - 5)
+            goto out;
+        feed->pushed++;
+    }
+out:
+    close(feed->fd);
+    return NULL;
+}
 
-    dunit.dinfo = &dinfo;
+/* compress @p samples into the container at @p path, online if @p mode is
+ * "ring" or "fd"
+ */
+static int serve_container(const char *path, const char *mode,
+                           struct tr_instr *samples, size_t samplecnt,
+                           struct trdb_server_stats *stats)
+{
+    struct trdb_ctx *c             = trdb_new();
+    struct trdb_container_writer w = {0};
+    struct server_feed feed = {.samples = samples, .samplecnt = samplecnt};
+    pthread_t producer;
+    int pipefd[2] = {-1, -1};
+    bool started  = false;
+    int status    = -trdb_nomem;
+    FILE *fp      = fopen(path, "wb");
+
+    if (!c || !fp)
+        goto fail;
 
-    if (trdb_alloc_dinfo_with_bfd(c, abfd, &dunit)) {
-        status = TRDB_FAIL;
+    trdb_set_resync_interval(c, 64);
+    if ((status = trdb_container_create(c, fp, 128, &w)) < 0)
         goto fail;
+
+    if (!strcmp(mode, "ring")) {
+        status = trdb_ring_create(c, "tmp_ring", 64, false, &feed.ring);
+        if (status < 0)
+            goto fail;
+        started = !pthread_create(&producer, NULL, feed_ring, &feed);
+        if (started)
+            status = trdb_serve_ring(c, feed.ring, &w, NULL, stats);
+    } else if (!strcmp(mode, "fd")) {
+        if (pipe(pipefd))
+            goto fail;
+        feed.fd = pipefd[1];
+        started = !pthread_create(&producer, NULL, feed_fd, &feed);
+        if (started)
+            status = trdb_serve_fd(c, pipefd[0], &w, NULL, stats);
+    } else {
+        for (size_t i = 0; i < samplecnt && status >= 0; i++)
+            status = trdb_container_compress_step(c, &w, &samples[i]);
+        feed.pushed = samplecnt;
+    }
+    if (started)
+        pthread_join(producer, NULL);
+    if (!started && strcmp(mode, "offline"))
+        status = -trdb_internal;
+    if (feed.pushed != samplecnt)
+        status = -trdb_internal;
+
+    int finish = trdb_container_finish(c, &w);
+    if (status >= 0)
+        status = finish;
+
+fail:
+    if (pipefd[0] >= 0)
+        close(pipefd[0]);
+    trdb_ring_free(feed.ring);
+    remove("tmp_ring");
+    if (fp)
+        fclose(fp);
+    trdb_free(c);
+    return status;
+}
+
+static int test_server(const char *path)
+{
+    struct trdb_ctx *c             = NULL;
+    struct tr_instr *samples       = NULL;
+    struct trdb_ring *ring         = NULL;
+    struct trdb_ring *other        = NULL;
+    struct trdb_packet_map ref     = {0};
+    struct trdb_packet_map served  = {0};
+    struct trdb_server_stats stats = {0};
+    struct trdb_container_writer w = {0};
+    size_t samplecnt               = 0;
+    FILE *fp                       = NULL;
+    int status                     = TRDB_SUCCESS;
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", path);
+
+    c = trdb_new();
+    if (!c || trdb_stimuli_to_trace(c, path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Reading stimuli failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (serve_container("tmp_container_ref", "offline", samples, samplecnt,
+                        NULL) < 0 ||
+        trdb_pulp_map_packets(c, "tmp_container_ref", &ref) < 0) {
+        LOG_ERRT("Compressing the reference container failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* whatever way the instructions arrive, the container is the same */
+    const char *modes[] = {"ring", "fd"};
+    for (size_t m = 0; m < TRDB_ARRAY_SIZE(modes); m++) {
+        stats = (struct trdb_server_stats){0};
+        if (serve_container("tmp_container", modes[m], samples, samplecnt,
+                            &stats) < 0 ||
+            trdb_pulp_map_packets(c, "tmp_container", &served) < 0) {
+            LOG_ERRT("Serving over %s failed\n", modes[m]);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        if (served.size != ref.size ||
+            memcmp(served.data, ref.data, ref.size) ||
+            stats.instrs != samplecnt || stats.bytes >= ref.size ||
+            stats.dropped || !stats.batches ||
+            stats.max_latency_ns > stats.total_latency_ns) {
+            LOG_ERRT("Container served over %s differs\n", modes[m]);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        trdb_pulp_unmap_packets(&served);
+    }
+
+    /* a full dropping ring discards and counts the excess */
+    fp = fopen("tmp_container", "wb");
+    if (!fp || trdb_ring_create(c, "tmp_ring", 8, true, &ring) < 0 ||
+        trdb_ring_push(ring, 20, samples) != 8 ||
+        trdb_ring_attach(c, path, &other) != -trdb_bad_ring) {
+        LOG_ERRT("Dropping ring failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    trdb_ring_close(ring);
+    if (trdb_container_create(c, fp, 128, &w) < 0 ||
+        trdb_serve_ring(c, ring, &w, NULL, &stats) < 0 ||
+        trdb_container_finish(c, &w) < 0 || stats.instrs != 8 ||
+        stats.dropped != 12 || !trdb_ring_finished(ring)) {
+        LOG_ERRT("Serving dropping ring failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+fail:
+    trdb_pulp_unmap_packets(&ref);
+    trdb_pulp_unmap_packets(&served);
+    trdb_ring_free(ring);
+    if (fp)
+        fclose(fp);
+    remove("tmp_ring");
+    remove("tmp_container");
+    remove("tmp_container_ref");
+    free(samples);
+    trdb_free(c);
+    return status;
+}
+
+static int test_stimuli_to_packet_dump(const char *path)
+{
+    struct tr_instr *tmp      = NULL;
+    struct tr_instr **samples = &tmp;
+    int status                = TRDB_SUCCESS;
+    struct trdb_ctx *c        = trdb_new();
+    if (!c) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t samplecnt = 0;
+    status           = trdb_stimuli_to_trace(c, path, samples, &samplecnt);
+    if (status != 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    status = TRDB_SUCCESS;
+
+    struct trdb_packet_head head;
+    TAILQ_INIT(&head);
+
+    /* step by step compression */
+    for (size_t i = 0; i < samplecnt; i++) {
+        int step = trdb_compress_trace_step_add(c, &head, &(*samples)[i]);
+        if (step < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    if (TRDB_VERBOSE_TESTS)
+        trdb_dump_packet_list(stdout, &head);
+
+fail:
+    trdb_free(c);
+    free(*samples);
+    trdb_free_packet_list(&head);
+    return status;
+}
+
+static int test_disassemble_trace(const char *bin_path, const char *trace_path)
+{
+    struct trdb_ctx *c = trdb_new();
+    struct tr_instr *tmp;
+    struct tr_instr **samples = &tmp;
+    size_t samplecnt          = 0;
+    int status                = 0;
+    status = trdb_stimuli_to_trace(c, trace_path, samples, &samplecnt);
+    if (status < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        return TRDB_FAIL;
+    }
+
+    status = TRDB_SUCCESS;
+
+    bfd_init();
+    bfd *abfd = bfd_openr(bin_path, NULL);
+
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_decompress_trace");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    struct disassembler_unit dunit = {0};
+    struct disassemble_info dinfo  = {0};
+    dunit.dinfo                    = &dinfo;
+    trdb_init_disassembler_unit(&dunit, abfd, NULL);
+
+    if (TRDB_VERBOSE_TESTS)
+        trdb_disassemble_trace(samplecnt, *samples, &dunit);
+
+fail:
+    trdb_free(c);
+    free(*samples);
+    bfd_close(abfd);
+    return status;
+}
+
+static int test_disassemble_trace_with_bfd(const char *bin_path,
+                                           const char *trace_path)
+{
+    bfd *abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object)))
+        return TRDB_FAIL;
+
+    struct trdb_ctx *c = trdb_new();
+    struct tr_instr *tmp;
+    struct tr_instr **samples = &tmp;
+    size_t samplecnt          = 0;
+    int status                = 0;
+    status = trdb_stimuli_to_trace(c, trace_path, samples, &samplecnt);
+    if (status < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        return TRDB_FAIL;
+    }
+
+    struct disassemble_info dinfo  = {0};
+    struct disassembler_unit dunit = {0};
+
+    dunit.dinfo = &dinfo;
+
+    if (trdb_alloc_dinfo_with_bfd(c, abfd, &dunit)) {
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    if (TRDB_VERBOSE_TESTS) {
+        trdb_disassemble_trace(samplecnt, *samples, &dunit);
+        trdb_set_disassembly_conf(&dunit, TRDB_LINE_NUMBERS | TRDB_SOURCE_CODE |
+                                              TRDB_FUNCTION_CONTEXT);
+        trdb_disassemble_trace_with_bfd(c, samplecnt, *samples, abfd, &dunit);
     }
-    if (TRDB_VERBOSE_TESTS) {
-        trdb_disassemble_trace(samplecnt, *samples, &dunit);
-        trdb_set_disassembly_conf(&dunit, TRDB_LINE_NUMBERS | TRDB_SOURCE_CODE |
-                                              TRDB_FUNCTION_CONTEXT);
-        trdb_disassemble_trace_with_bfd(c, samplecnt, *samples, abfd, &dunit);
-    }
 
 fail:
     trdb_free_dinfo_with_bfd(c, abfd, &dunit);
@@ -595,6 +1291,212 @@ fail:
     return status;
 }
 
+/* the memoized disassembly has to print exactly what the plain one does */
+static int test_disasm_cache(const char *bin_path, const char *trace_path)
+{
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", bin_path);
+
+    bfd *abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object)))
+        return TRDB_FAIL;
+
+    struct trdb_ctx *c              = trdb_new();
+    struct tr_instr *samples        = NULL;
+    size_t samplecnt                = 0;
+    struct disassemble_info dinfo   = {0};
+    struct disassembler_unit dunit  = {0};
+    struct trdb_disasm_cache *cache = NULL;
+    char *plain                     = NULL;
+    char *cached                    = NULL;
+    size_t plain_len                = 0;
+    size_t cached_len               = 0;
+    FILE *fp                        = NULL;
+    int status                      = TRDB_SUCCESS;
+
+    dunit.dinfo = &dinfo;
+
+    if (trdb_stimuli_to_trace(c, trace_path, &samples, &samplecnt) < 0 ||
+        trdb_alloc_dinfo_with_bfd(c, abfd, &dunit)) {
+        LOG_ERRT("Setting up the disassembly failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    trdb_set_disassembly_conf(&dunit, TRDB_FUNCTION_CONTEXT);
+    dinfo.fprintf_func = (fprintf_ftype)fprintf;
+
+    for (int with_bfd = 0; with_bfd < 2; with_bfd++) {
+        fp           = open_memstream(&plain, &plain_len);
+        dinfo.stream = fp;
+        if (with_bfd)
+            trdb_disassemble_trace_with_bfd(c, samplecnt, samples, abfd,
+                                            &dunit);
+        else
+            trdb_disassemble_trace(samplecnt, samples, &dunit);
+        fclose(fp);
+
+        fp           = open_memstream(&cached, &cached_len);
+        dinfo.stream = fp;
+        if (trdb_disasm_cache_new(c, with_bfd ? abfd : NULL, &dunit, &cache) ||
+            trdb_disasm_cache_trace(cache, samplecnt, samples)) {
+            LOG_ERRT("Cached disassembly failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        size_t unique = trdb_disasm_cache_size(cache);
+        trdb_disasm_cache_free(cache);
+        cache = NULL;
+        fclose(fp);
+        fp = NULL;
+
+        if (plain_len == 0 || plain_len != cached_len ||
+            memcmp(plain, cached, plain_len)) {
+            LOG_ERRT("Cached disassembly differs, with bfd: %d\n", with_bfd);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        if (unique == 0 || unique >= samplecnt) {
+            LOG_ERRT("Expected a few distinct pcs but got %zu of %zu\n",
+                     unique, samplecnt);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        free(plain);
+        free(cached);
+        plain  = NULL;
+        cached = NULL;
+    }
+
+fail:
+    trdb_disasm_cache_free(cache);
+    if (fp)
+        fclose(fp);
+    free(plain);
+    free(cached);
+    trdb_free_dinfo_with_bfd(c, abfd, &dunit);
+    trdb_free(c);
+    free(samples);
+    bfd_close(abfd);
+    return status;
+}
+
+static bool same_name(const char *a, const char *b)
+{
+    if (a && *a == '\0')
+        a = NULL;
+    if (b && *b == '\0')
+        b = NULL;
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/* Disassemble @p trace through a cache and return what was printed */
+static char *disassemble_cached(struct trdb_ctx *c, bfd *abfd,
+                                struct disassembler_unit *dunit, size_t len,
+                                struct tr_instr *trace, size_t *size)
+{
+    char *buf                       = NULL;
+    struct trdb_disasm_cache *cache = NULL;
+    FILE *fp                        = open_memstream(&buf, size);
+    if (!fp)
+        return NULL;
+
+    dunit->dinfo->stream = fp;
+    int status           = trdb_disasm_cache_new(c, abfd, dunit, &cache);
+    if (status == 0)
+        status = trdb_disasm_cache_trace(cache, len, trace);
+    trdb_disasm_cache_free(cache);
+    fclose(fp);
+    if (status < 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* the line index has to answer what the debug information does */
+static int test_line_index(const char *bin_path, const char *trace_path)
+{
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", bin_path);
+
+    bfd *abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object)))
+        return TRDB_FAIL;
+
+    struct trdb_ctx *c             = trdb_new();
+    struct tr_instr *samples       = NULL;
+    size_t samplecnt               = 0;
+    struct disassemble_info dinfo  = {0};
+    struct disassembler_unit dunit = {0};
+    struct trdb_line_index *lines  = NULL;
+    char *plain                    = NULL;
+    char *indexed                  = NULL;
+    size_t plain_len               = 0;
+    size_t indexed_len             = 0;
+    int status                     = TRDB_SUCCESS;
+
+    dunit.dinfo = &dinfo;
+
+    if (trdb_stimuli_to_trace(c, trace_path, &samples, &samplecnt) < 0 ||
+        trdb_alloc_dinfo_with_bfd(c, abfd, &dunit) ||
+        trdb_line_index_new(c, abfd, &lines)) {
+        LOG_ERRT("Setting up the line index failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    struct trdb_disasm_aux *aux = dinfo.application_data;
+    for (size_t i = 0; i < samplecnt; i++) {
+        bfd_vma pc        = samples[i].iaddr;
+        asection *section = trdb_get_section_for_vma(abfd, pc);
+        if (!section)
+            continue;
+
+        const char *file, *func, *ifile, *ifunc;
+        unsigned int line, disc, iline, idisc;
+        int found = bfd_find_nearest_line_discriminator(
+            abfd, section, aux->symbols, pc - section->vma, &file, &func,
+            &line, &disc);
+        int ifound =
+            trdb_line_index_lookup(lines, pc, &ifile, &ifunc, &iline, &idisc);
+        if (!found != !ifound ||
+            (found && (line != iline || disc != idisc ||
+                       !same_name(file, ifile) || !same_name(func, ifunc)))) {
+            LOG_ERRT("Line index differs at 0x%08" PRIxADDR "\n",
+                     samples[i].iaddr);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* what is printed depends on what was printed before, so we compare
+     * against a second run that starts where the first ended
+     */
+    trdb_set_disassembly_conf(&dunit, TRDB_LINE_NUMBERS | TRDB_INLINES);
+    dinfo.fprintf_func = (fprintf_ftype)fprintf;
+    free(disassemble_cached(c, abfd, &dunit, samplecnt, samples, &plain_len));
+    plain = disassemble_cached(c, abfd, &dunit, samplecnt, samples, &plain_len);
+    trdb_set_line_index(&dunit, lines);
+    indexed =
+        disassemble_cached(c, abfd, &dunit, samplecnt, samples, &indexed_len);
+    trdb_set_line_index(&dunit, NULL);
+
+    if (!plain || !indexed || plain_len != indexed_len ||
+        memcmp(plain, indexed, plain_len)) {
+        LOG_ERRT("Disassembly with the line index differs\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+fail:
+    free(plain);
+    free(indexed);
+    trdb_line_index_free(lines);
+    trdb_free_dinfo_with_bfd(c, abfd, &dunit);
+    trdb_free(c);
+    free(samples);
+    bfd_close(abfd);
+    return status;
+}
+
 static int test_compress_trace(const char *trace_path, const char *packets_path)
 {
     struct trdb_ctx *ctx = NULL;
@@ -712,39 +1614,505 @@ fail:
     return status;
 }
 
-static int test_compress_cvs_trace(const char *trace_path)
+/* serialize packets back to back the way trdb_pulp_write_single_packet() does */
+static size_t serialize_packets(struct trdb_ctx *ctx, size_t len,
+                                struct tr_packet packets[len], uint8_t *buf)
 {
-    int status           = TRDB_SUCCESS;
-    struct trdb_ctx *ctx = trdb_new();
+    size_t off = 0;
+    for (size_t i = 0; i < len; i++) {
+        size_t bitcnt = 0;
+        if (trdb_pulp_serialize_packet(ctx, &packets[i], &bitcnt, 0,
+                                       buf + off))
+            return SIZE_MAX;
+        off += bitcnt / 8 + (bitcnt % 8 != 0);
+    }
+    return off;
+}
 
-    struct disassembler_unit dunit = {0};
-    struct disassemble_info dinfo  = {0};
-    dunit.dinfo                    = &dinfo;
+static int test_compress_trace_block(const char *trace_path)
+{
+    struct trdb_ctx *ctx = NULL;
 
-    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+    struct tr_instr *tmp      = NULL;
+    struct tr_instr **samples = &tmp;
+    size_t samplecnt          = 0;
+    int status                = TRDB_SUCCESS;
 
-    trdb_init_disassembler_unit_for_pulp(&dunit, NULL);
+    struct trdb_packet_vec expected = {0};
+    uint8_t *expected_bin           = NULL;
+    uint8_t *bin                    = NULL;
 
-    struct trdb_packet_head packet_list;
-    TAILQ_INIT(&packet_list);
-    struct trdb_instr_head instr_list;
-    TAILQ_INIT(&instr_list);
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
 
+    ctx = trdb_new();
     if (!ctx) {
         LOG_ERRT("Library context allocation failed.\n");
         status = TRDB_FAIL;
         goto fail;
     }
 
-    ctx->dunit                           = &dunit;
-    ctx->config.full_address             = false;
-    ctx->config.pulp_vector_table_packet = false;
-    ctx->config.implicit_ret             = true;
-    /* ctx->config.compress_full_branch_map = true; */
-    size_t instrcnt = 0;
-
-    status = trdb_cvs_to_trace_list(ctx, trace_path, &instr_list, &instrcnt);
-    if (status < 0) {
+    if (trdb_stimuli_to_trace(ctx, trace_path, samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* reference is the step by step compression */
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &expected, &(*samples)[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    size_t cnt   = expected.size;
+    expected_bin = malloc(cnt * sizeof(union trdb_pack));
+    bin          = malloc(cnt * sizeof(union trdb_pack));
+    if (!expected_bin || !bin) {
+        LOG_ERRT("Out of memory\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t expected_len = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        size_t len = serialize_packets(ctx, 1, TRDB_VEC_AT(&expected, i),
+                                       expected_bin + expected_len);
+        if (len == SIZE_MAX) {
+            LOG_ERRT("Serializing packets failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        expected_len += len;
+    }
+
+    /* a tiny packet buffer so that we have to resume often */
+    struct tr_packet packets[3];
+    size_t done = 0;
+    size_t off  = 0;
+
+    trdb_reset_compression(ctx);
+    while (done < samplecnt) {
+        size_t consumed = 0;
+        size_t produced = 0;
+        if (trdb_compress_trace_block(ctx, samplecnt - done, *samples + done,
+                                      3, packets, &consumed,
+                                      &produced) < 0) {
+            LOG_ERRT("Block compression failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        if (consumed == 0 || produced > 3) {
+            LOG_ERRT("Block compression made no progress\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        done += consumed;
+        off += serialize_packets(ctx, produced, packets, bin + off);
+    }
+
+    if (off != expected_len || memcmp(bin, expected_bin, off)) {
+        LOG_ERRT("Block compression differs from step compression\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* same for the serializing variant, which has to leave room for the
+     * largest packet
+     */
+    uint8_t buf[40];
+    done = 0;
+    off  = 0;
+
+    trdb_reset_compression(ctx);
+    while (done < samplecnt) {
+        size_t consumed = 0;
+        size_t written  = 0;
+        if (trdb_pulp_compress_trace_block(ctx, samplecnt - done,
+                                           *samples + done, sizeof(buf), buf,
+                                           &consumed, &written) < 0) {
+            LOG_ERRT("Serializing block compression failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        if (consumed == 0 || written > sizeof(buf) ||
+            off + written > expected_len) {
+            LOG_ERRT("Serializing block compression made no progress\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        memcpy(bin + off, buf, written);
+        done += consumed;
+        off += written;
+    }
+
+    if (off != expected_len || memcmp(bin, expected_bin, off)) {
+        LOG_ERRT("Serializing block compression differs from step "
+                 "compression\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* a buffer too small for any packet consumes nothing */
+    size_t consumed = 1;
+    size_t written  = 1;
+    trdb_reset_compression(ctx);
+    if (trdb_pulp_compress_trace_block(ctx, samplecnt, *samples, 4, buf,
+                                       &consumed, &written) < 0 ||
+        consumed != 0 || written != 0) {
+        LOG_ERRT("Too small buffer was not refused\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+fail:
+    trdb_free(ctx);
+    free(*samples);
+    free(expected_bin);
+    free(bin);
+    trdb_free_packet_vec(&expected);
+    return status;
+}
+
+/* the batch routines have to be bit exact with the single packet ones */
+static int test_serialize_packets(const char *trace_path)
+{
+    struct trdb_ctx *ctx = NULL;
+
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    int status               = TRDB_SUCCESS;
+
+    struct tr_packet *packets  = NULL;
+    struct tr_packet *decoded  = NULL;
+    size_t *offsets            = NULL;
+    size_t *decoded_offsets    = NULL;
+    struct trdb_packet_vec vec = {0};
+    uint8_t *expected_bin      = NULL;
+    uint8_t *bin               = NULL;
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &vec, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    size_t cnt   = vec.size;
+    packets      = malloc(cnt * sizeof(*packets));
+    decoded      = malloc(cnt * sizeof(*decoded));
+    offsets         = malloc(cnt * sizeof(*offsets));
+    decoded_offsets = malloc(cnt * sizeof(*decoded_offsets));
+    expected_bin    = malloc(cnt * sizeof(union trdb_pack));
+    bin             = malloc(cnt * sizeof(union trdb_pack));
+    if (!packets || !decoded || !offsets || !decoded_offsets ||
+        !expected_bin || !bin) {
+        LOG_ERRT("Out of memory\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < cnt; i++)
+        packets[i] = *TRDB_VEC_AT(&vec, i);
+
+    size_t expected_len = serialize_packets(ctx, cnt, packets, expected_bin);
+    if (expected_len == SIZE_MAX) {
+        LOG_ERRT("Serializing packets failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* in one go into a buffer of exactly the right size */
+    size_t consumed = 0;
+    size_t written  = 0;
+    if (trdb_pulp_serialize_packets(ctx, cnt, packets, expected_len, bin,
+                                    offsets, &consumed, &written) < 0 ||
+        consumed != cnt || written != expected_len ||
+        memcmp(bin, expected_bin, expected_len)) {
+        LOG_ERRT("Batch serialization differs\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* in pieces through a buffer that often can't hold the next packet */
+    uint8_t buf[20];
+    size_t done = 0;
+    size_t off  = 0;
+    while (done < cnt) {
+        if (trdb_pulp_serialize_packets(ctx, cnt - done, packets + done,
+                                        sizeof(buf), buf, NULL, &consumed,
+                                        &written) < 0 ||
+            consumed == 0 || off + written > expected_len) {
+            LOG_ERRT("Batch serialization made no progress\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        memcpy(bin + off, buf, written);
+        done += consumed;
+        off += written;
+    }
+    if (off != expected_len || memcmp(bin, expected_bin, off)) {
+        LOG_ERRT("Resumed batch serialization differs\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* decoding gives back the packets at the offsets we serialized them to,
+     * which serialize to the same bytes again
+     */
+    size_t ndecoded = 0;
+    if (trdb_pulp_decode_packets(ctx, expected_len, expected_bin, cnt,
+                                 decoded, decoded_offsets, &ndecoded,
+                                 &consumed) < 0 ||
+        ndecoded != cnt || consumed != expected_len ||
+        memcmp(offsets, decoded_offsets, cnt * sizeof(*offsets)) ||
+        serialize_packets(ctx, cnt, decoded, bin) != expected_len ||
+        memcmp(bin, expected_bin, expected_len)) {
+        LOG_ERRT("Batch decoding differs\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* the same as decoding one by one, and an incomplete packet is left */
+    struct trdb_packet_map map = {.data = expected_bin,
+                                  .size = expected_len - 1};
+    size_t map_off             = 0;
+    size_t one                 = 0;
+    struct tr_packet single    = {0};
+    while (trdb_pulp_next_mapped_packet(ctx, &map, &map_off, &single) == 0)
+        one++;
+    if (trdb_pulp_decode_packets(ctx, map.size, map.data, cnt, decoded, NULL,
+                                 &ndecoded, &consumed) < 0 ||
+        ndecoded != one || ndecoded != cnt - 1 || consumed != map_off) {
+        LOG_ERRT("Batch decoding of a truncated stream differs\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    free(packets);
+    free(decoded);
+    free(offsets);
+    free(decoded_offsets);
+    free(expected_bin);
+    free(bin);
+    trdb_free_packet_vec(&vec);
+    return status;
+}
+
+static int test_bit_sink(const char *trace_path)
+{
+    struct trdb_ctx *ctx = NULL;
+
+    struct tr_instr *tmp      = NULL;
+    struct tr_instr **samples = &tmp;
+    size_t samplecnt          = 0;
+    int status                = TRDB_SUCCESS;
+
+    struct trdb_packet_vec packets = {0};
+    struct trdb_bit_sink sink      = {0};
+    FILE *fp                       = NULL;
+    uint8_t *expected              = NULL;
+    uint8_t *bin                   = NULL;
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &(*samples)[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* write the reference the slow way */
+    fp = fopen("tmp_sink", "w+b");
+    if (!fp) {
+        perror("fopen");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < packets.size; i++) {
+        if (trdb_pulp_write_single_packet(ctx, TRDB_VEC_AT(&packets, i), fp)) {
+            LOG_ERRT("Writing packet failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    long expected_len = ftell(fp);
+    expected          = malloc(expected_len);
+    bin               = malloc(expected_len);
+    rewind(fp);
+    if (!expected || !bin ||
+        fread(expected, 1, expected_len, fp) != (size_t)expected_len) {
+        LOG_ERRT("Reading back packets failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* compress again straight into a byte aligned sink, which is small
+     * enough to be flushed many times
+     */
+    rewind(fp);
+    trdb_reset_compression(ctx);
+    if (trdb_bit_sink_open(&sink, fp, 20, false)) {
+        LOG_ERRT("Opening sink failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_sink(ctx, &sink, &(*samples)[i]) < 0) {
+            LOG_ERRT("Compressing into sink failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    if (sink.written == 0 || trdb_bit_sink_close(&sink)) {
+        LOG_ERRT("Closing sink failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    if (ftell(fp) != expected_len) {
+        LOG_ERRT("Sink wrote %ld bytes, expected %ld\n", ftell(fp),
+                 expected_len);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    rewind(fp);
+    if (fread(bin, 1, expected_len, fp) != (size_t)expected_len ||
+        memcmp(bin, expected, expected_len)) {
+        LOG_ERRT("Sink output differs from trdb_pulp_write_single_packet\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* packed: every packet has to show up at its bit offset */
+    rewind(fp);
+    if (trdb_bit_sink_open(&sink, fp, 20, true)) {
+        LOG_ERRT("Opening sink failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < packets.size; i++) {
+        if (trdb_bit_sink_put_packet(ctx, &sink, TRDB_VEC_AT(&packets, i))) {
+            LOG_ERRT("Putting packet failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    if (trdb_bit_sink_close(&sink)) {
+        LOG_ERRT("Closing sink failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    long packed_len = ftell(fp);
+    rewind(fp);
+    if (packed_len > expected_len ||
+        fread(bin, 1, packed_len, fp) != (size_t)packed_len) {
+        LOG_ERRT("Reading back packed packets failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t pos = 0;
+    for (size_t i = 0; i < packets.size; i++) {
+        uint8_t single[sizeof(union trdb_pack)] = {0};
+        size_t bitcnt                           = 0;
+        trdb_pulp_serialize_packet(ctx, TRDB_VEC_AT(&packets, i), &bitcnt, 0,
+                                   single);
+        for (size_t j = 0; j < bitcnt; j++, pos++) {
+            bool want = (single[j / 8] >> (j % 8)) & 1;
+            bool got  = (bin[pos / 8] >> (pos % 8)) & 1;
+            if (want != got) {
+                LOG_ERRT("Packed packet %zu differs at bit %zu\n", i, j);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+    }
+    if ((size_t)packed_len != pos / 8 + (pos % 8 != 0)) {
+        LOG_ERRT("Packed stream has the wrong length\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+fail:
+    trdb_bit_sink_close(&sink);
+    trdb_free(ctx);
+    if (fp)
+        fclose(fp);
+    remove("tmp_sink");
+    free(*samples);
+    free(expected);
+    free(bin);
+    trdb_free_packet_vec(&packets);
+    return status;
+}
+
+static int test_compress_cvs_trace(const char *trace_path)
+{
+    int status           = TRDB_SUCCESS;
+    struct trdb_ctx *ctx = trdb_new();
+
+    struct disassembler_unit dunit = {0};
+    struct disassemble_info dinfo  = {0};
+    dunit.dinfo                    = &dinfo;
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    trdb_init_disassembler_unit_for_pulp(&dunit, NULL);
+
+    struct trdb_packet_head packet_list;
+    TAILQ_INIT(&packet_list);
+    struct trdb_instr_head instr_list;
+    TAILQ_INIT(&instr_list);
+
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    ctx->dunit                           = &dunit;
+    ctx->config.full_address             = false;
+    ctx->config.pulp_vector_table_packet = false;
+    ctx->config.implicit_ret             = true;
+    /* ctx->config.compress_full_branch_map = true; */
+    size_t instrcnt = 0;
+
+    status = trdb_cvs_to_trace_list(ctx, trace_path, &instr_list, &instrcnt);
+    if (status < 0) {
         LOG_ERRT("CVS to tr_instr failed\n");
         status = TRDB_FAIL;
         goto fail;
@@ -1150,6 +2518,2807 @@ fail:
     return status;
 }
 
+/* compare two reconstructed instruction lists entry by entry */
+static int compare_instr_lists(struct trdb_instr_head *expected,
+                               struct trdb_instr_head *actual)
+{
+    struct tr_instr *a = TAILQ_FIRST(expected);
+    struct tr_instr *b = TAILQ_FIRST(actual);
+    int cnt            = 0;
+
+    for (; a && b; a = TAILQ_NEXT(a, list), b = TAILQ_NEXT(b, list), cnt++) {
+        if (a->iaddr != b->iaddr || a->instr != b->instr ||
+            a->compressed != b->compressed || a->priv != b->priv) {
+            LOG_ERRT("Mismatch at instruction number: %d\n", cnt);
+            LOG_ERRT("expected: %" PRIxADDR " %" PRIxINSN "\n", a->iaddr,
+                     a->instr);
+            LOG_ERRT("actual:   %" PRIxADDR " %" PRIxINSN "\n", b->iaddr,
+                     b->instr);
+            return TRDB_FAIL;
+        }
+    }
+    if (a || b) {
+        LOG_ERRT("Instruction lists differ in length\n");
+        return TRDB_FAIL;
+    }
+    return TRDB_SUCCESS;
+}
+
+/* Decompress the same packets with all combinations of the decode cache and
+ * the native instruction classifier. Everything has to match the plain
+ * libopcodes based decompression.
+ */
+static int test_decompress_decoders(const char *bin_path,
+                                    const char *trace_path, bool differential)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+
+    /* {decode cache, native decode}, the first entry is the reference */
+    const bool modes[][2] = {{false, false}, {true, false}, {true, false},
+                             {false, true},  {true, true},  {true, true}};
+    struct trdb_instr_head heads[TRDB_ARRAY_SIZE(modes)];
+    for (unsigned i = 0; i < TRDB_ARRAY_SIZE(heads); i++)
+        TAILQ_INIT(&heads[i]);
+
+    struct trdb_packet_head packet_head;
+    TAILQ_INIT(&packet_head);
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s, differential: %s",
+             trace_path, differential ? "true" : "false");
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_decompress_decoders");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_set_full_address(ctx, !differential);
+    ctx->config.use_pulp_sext = true;
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_add(ctx, &packet_head, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* each decompression starts with a cold decode cache */
+    for (unsigned i = 0; i < TRDB_ARRAY_SIZE(modes); i++) {
+        trdb_reset_decompression(ctx);
+        trdb_set_full_address(ctx, !differential);
+        ctx->config.use_pulp_sext = true;
+        trdb_set_decode_cache(ctx, modes[i][0]);
+        trdb_set_native_decode(ctx, modes[i][1]);
+
+        status = trdb_decompress_trace(ctx, abfd, &packet_head, &heads[i]);
+        if (status < 0) {
+            LOG_ERRT("Decompression failed: %s\n",
+                     trdb_errstr(trdb_errcode(status)));
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    if (TAILQ_EMPTY(&heads[0])) {
+        LOG_ERRT("Empty instruction list.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (unsigned i = 1; i < TRDB_ARRAY_SIZE(heads); i++) {
+        if (compare_instr_lists(&heads[0], &heads[i])) {
+            LOG_ERRT("Decode cache: %d, native decode: %d\n", modes[i][0],
+                     modes[i][1]);
+            status = TRDB_FAIL;
+        }
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_list(&packet_head);
+    for (unsigned i = 0; i < TRDB_ARRAY_SIZE(heads); i++)
+        trdb_free_instr_list(&heads[i]);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+static int test_decompress_trace_vec(const char *bin_path,
+                                     const char *trace_path, bool differential)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+
+    struct trdb_packet_head packet_head;
+    TAILQ_INIT(&packet_head);
+    struct trdb_instr_head instr_head;
+    TAILQ_INIT(&instr_head);
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec instrs   = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s, differential: %s",
+             trace_path, differential ? "true" : "false");
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_decompress_trace_vec");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* compress the same trace into a list and a vector */
+    for (unsigned run = 0; run < 2; run++) {
+        trdb_reset_compression(ctx);
+        trdb_set_full_address(ctx, !differential);
+        ctx->config.use_pulp_sext = true;
+
+        for (size_t i = 0; i < samplecnt; i++) {
+            int step =
+                run == 0
+                    ? trdb_compress_trace_step_add(ctx, &packet_head,
+                                                   &samples[i])
+                    : trdb_compress_trace_step_vec(ctx, &packets, &samples[i]);
+            if (step < 0) {
+                LOG_ERRT("Compress trace failed.\n");
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+    }
+
+    trdb_reset_decompression(ctx);
+    trdb_set_full_address(ctx, !differential);
+    ctx->config.use_pulp_sext = true;
+
+    status = trdb_decompress_trace(ctx, abfd, &packet_head, &instr_head);
+    if (status < 0) {
+        LOG_ERRT("Decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_reset_decompression(ctx);
+    trdb_set_full_address(ctx, !differential);
+    ctx->config.use_pulp_sext = true;
+
+    status = trdb_decompress_trace_vec(ctx, abfd, &packets, &instrs);
+    if (status < 0) {
+        LOG_ERRT("Vector decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t i               = 0;
+    struct tr_instr *instr = TAILQ_FIRST(&instr_head);
+    struct tr_instr *record;
+    TRDB_VEC_FOREACH (record, i, &instrs) {
+        if (!instr || instr->iaddr != record->iaddr ||
+            instr->instr != record->instr || instr->priv != record->priv) {
+            LOG_ERRT("Instruction %zu differs from list decompression\n", i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        instr = TAILQ_NEXT(instr, list);
+    }
+    if (instr || instrs.size == 0) {
+        LOG_ERRT("Vector decompression produced %zu instructions\n",
+                 instrs.size);
+        status = TRDB_FAIL;
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_list(&packet_head);
+    trdb_free_instr_list(&instr_head);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&instrs);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+/* Decompressing on the same context keeps the code sections loaded, which must
+ * not leak into a decompression with a different bfd of the same program
+ */
+static int test_decompress_sections(const char *bin_path,
+                                    const char *trace_path)
+{
+    bfd *abfd[2]                    = {NULL, NULL};
+    struct tr_instr *samples        = NULL;
+    size_t samplecnt                = 0;
+    int status                      = TRDB_SUCCESS;
+    struct trdb_ctx *ctx            = NULL;
+    struct trdb_packet_vec packets  = {0};
+    struct trdb_instr_vec instrs[3] = {{0}};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    for (unsigned j = 0; j < 2; j++) {
+        abfd[j] = bfd_openr(bin_path, NULL);
+        if (!(abfd[j] && bfd_check_format(abfd[j], bfd_object))) {
+            bfd_perror("test_decompress_sections");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* twice with the first bfd, then with the second one */
+    for (unsigned run = 0; run < 3; run++) {
+        trdb_reset_decompression(ctx);
+        status = trdb_decompress_trace_vec(ctx, abfd[run / 2], &packets,
+                                           &instrs[run]);
+        if (status < 0) {
+            LOG_ERRT("Decompression failed: %s\n",
+                     trdb_errstr(trdb_errcode(status)));
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* the trace has to switch between .vectors and .text to be of interest */
+    asection *first    = NULL;
+    size_t switches    = 0;
+    struct tr_instr *a = NULL;
+    size_t i           = 0;
+    TRDB_VEC_FOREACH (a, i, &instrs[0]) {
+        asection *section = trdb_get_section_for_vma(abfd[0], a->iaddr);
+        if (i == 0)
+            first = section;
+        else if (section != first)
+            switches++;
+        for (unsigned run = 1; run < 3; run++) {
+            if (i >= instrs[run].size ||
+                a->iaddr != TRDB_VEC_AT(&instrs[run], i)->iaddr ||
+                a->instr != TRDB_VEC_AT(&instrs[run], i)->instr) {
+                LOG_ERRT("Run %u differs at instruction %zu\n", run, i);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+    }
+    if (instrs[0].size == 0 || instrs[1].size != instrs[0].size ||
+        instrs[2].size != instrs[0].size || switches == 0) {
+        LOG_ERRT("Decompressed %zu, %zu and %zu instructions with %zu "
+                 "section switches\n",
+                 instrs[0].size, instrs[1].size, instrs[2].size, switches);
+        status = TRDB_FAIL;
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_vec(&packets);
+    for (unsigned run = 0; run < 3; run++)
+        trdb_free_instr_vec(&instrs[run]);
+    for (unsigned j = 0; j < 2; j++)
+        if (abfd[j])
+            bfd_close(abfd[j]);
+
+    return status;
+}
+
+/* one of the contexts decompressing concurrently with the same image */
+struct image_user {
+    pthread_t thread;
+    struct trdb_image *image;
+    bfd *abfd;
+    struct trdb_packet_vec *packets;
+    struct trdb_instr_vec instrs;
+    int status;
+};
+
+static void *decompress_with_image(void *arg)
+{
+    struct image_user *u = arg;
+    struct trdb_ctx *ctx = trdb_new();
+
+    if (!ctx) {
+        u->status = -trdb_nomem;
+        return NULL;
+    }
+    trdb_set_image(ctx, u->image);
+    u->status = trdb_decompress_trace_vec(ctx, u->abfd, u->packets, &u->instrs);
+    trdb_free(ctx);
+    return NULL;
+}
+
+static int test_image(const char *bin_path, const char *trace_path)
+{
+    bfd *abfd                      = NULL;
+    struct tr_instr *samples       = NULL;
+    size_t samplecnt               = 0;
+    int status                     = TRDB_SUCCESS;
+    struct trdb_ctx *ctx           = NULL;
+    struct trdb_image *image       = NULL;
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec expected = {0};
+    struct trdb_instr_vec parallel = {0};
+    struct image_user users[4]     = {{0}};
+    unsigned started               = 0;
+    struct disassemble_info dinfo  = {0};
+    struct disassembler_unit dunit = {.dinfo = &dinfo};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_image");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* what we get without an image */
+    trdb_reset_decompression(ctx);
+    if (trdb_decompress_trace_vec(ctx, abfd, &packets, &expected) < 0 ||
+        expected.size == 0) {
+        LOG_ERRT("Decompression failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_image_new(ctx, abfd, &image) < 0) {
+        LOG_ERRT("Creating the image failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_alloc_dinfo_with_image(ctx, image, &dunit) < 0) {
+        LOG_ERRT("Disassembler with image failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (; started < TRDB_ARRAY_SIZE(users); started++) {
+        users[started] = (struct image_user){
+            .image = image, .abfd = abfd, .packets = &packets};
+        if (pthread_create(&users[started].thread, NULL, decompress_with_image,
+                           &users[started])) {
+            LOG_ERRT("Failed to spawn thread\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* the image is also shared with the workers of a parallel decompression */
+    trdb_reset_decompression(ctx);
+    trdb_set_image(ctx, image);
+    if (trdb_decompress_trace_parallel(ctx, abfd, &packets, &parallel, 4) < 0) {
+        LOG_ERRT("Parallel decompression with image failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (unsigned k = 0; k <= TRDB_ARRAY_SIZE(users); k++) {
+        struct trdb_instr_vec *instrs = &parallel;
+        if (k < TRDB_ARRAY_SIZE(users)) {
+            pthread_join(users[k].thread, NULL);
+            started--;
+            instrs = &users[k].instrs;
+            if (users[k].status < 0) {
+                LOG_ERRT("Decompression with image failed: %s\n",
+                         trdb_errstr(trdb_errcode(users[k].status)));
+                status = TRDB_FAIL;
+                continue;
+            }
+        }
+        if (instrs->size != expected.size) {
+            LOG_ERRT("Decompressed %zu instead of %zu instructions\n",
+                     instrs->size, expected.size);
+            status = TRDB_FAIL;
+            continue;
+        }
+        size_t i               = 0;
+        struct tr_instr *instr = NULL;
+        TRDB_VEC_FOREACH (instr, i, &expected) {
+            struct tr_instr *other = TRDB_VEC_AT(instrs, i);
+            if (instr->iaddr != other->iaddr || instr->instr != other->instr ||
+                instr->priv != other->priv) {
+                LOG_ERRT("Instruction %zu differs\n", i);
+                status = TRDB_FAIL;
+                break;
+            }
+        }
+    }
+
+fail:
+    for (unsigned k = 0; k < started; k++)
+        pthread_join(users[k].thread, NULL);
+    for (unsigned k = 0; k < TRDB_ARRAY_SIZE(users); k++)
+        trdb_free_instr_vec(&users[k].instrs);
+    trdb_free_dinfo_with_bfd(ctx, abfd, &dunit);
+    trdb_free(ctx);
+    trdb_image_free(image);
+    free(samples);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&expected);
+    trdb_free_instr_vec(&parallel);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+struct block_visits {
+    const struct trdb_block **blocks;
+    size_t *instrs;
+    size_t len;
+};
+
+static int record_block_visit(struct trdb_ctx *c,
+                              const struct trdb_block *block, size_t instrs,
+                              void *data)
+{
+    (void)c;
+    struct block_visits *v = data;
+
+    const struct trdb_block **blocks =
+        realloc(v->blocks, (v->len + 1) * sizeof(*blocks));
+    if (blocks)
+        v->blocks = blocks;
+    size_t *counts = realloc(v->instrs, (v->len + 1) * sizeof(*counts));
+    if (counts)
+        v->instrs = counts;
+    if (!blocks || !counts)
+        return -trdb_nomem;
+
+    v->blocks[v->len] = block;
+    v->instrs[v->len] = instrs;
+    v->len++;
+    return 0;
+}
+
+/* Decompress @p packets to the block visits @p v */
+static int decompress_blocks(struct trdb_ctx *ctx, bfd *abfd,
+                             const struct trdb_cfg *cfg,
+                             struct trdb_packet_vec *packets,
+                             struct block_visits *v)
+{
+    int status = 0;
+
+    trdb_reset_decompression(ctx);
+    if ((status = trdb_decompress_open(ctx, abfd)) < 0)
+        return status;
+
+    size_t i                 = 0;
+    struct tr_packet *packet = NULL;
+    TRDB_VEC_FOREACH (packet, i, packets) {
+        status = trdb_decompress_packet_blocks(ctx, cfg, packet,
+                                               record_block_visit, v);
+        if (status < 0)
+            break;
+    }
+    trdb_decompress_close(ctx);
+    return status;
+}
+
+static int test_cfg(const char *bin_path, const char *trace_path)
+{
+    bfd *abfd                      = NULL;
+    struct tr_instr *samples       = NULL;
+    size_t samplecnt               = 0;
+    int status                     = TRDB_SUCCESS;
+    struct trdb_ctx *ctx           = NULL;
+    struct trdb_image *image       = NULL;
+    struct trdb_cfg *cfg           = NULL;
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec expected = {0};
+    struct block_visits visits[2]  = {{0}};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_cfg");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    trdb_reset_decompression(ctx);
+    if (trdb_decompress_trace_vec(ctx, abfd, &packets, &expected) < 0 ||
+        expected.size == 0) {
+        LOG_ERRT("Decompression failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_image_new(ctx, abfd, &image) < 0 ||
+        trdb_cfg_new(ctx, image, &cfg) < 0) {
+        LOG_ERRT("Creating the control flow graph failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t len                     = 0;
+    const struct trdb_block *block = trdb_cfg_blocks(cfg, &len);
+    if (len == 0) {
+        LOG_ERRT("No basic blocks found\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < len; i++) {
+        const struct trdb_block *b = &block[i];
+        if (b->instrs == 0 || b->last < b->start ||
+            (i + 1 < len && b->last >= block[i + 1].start) ||
+            trdb_cfg_find(cfg, b->start) != b ||
+            trdb_cfg_find(cfg, b->last) != b ||
+            (b->kind == TRDB_BLOCK_BRANCH && !(b->taken && b->fallthrough))) {
+            LOG_ERRT("Bad basic block %zu at %" PRIxADDR "\n", i, b->start);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* once skipping over the image's straight runs, once instruction-wise */
+    trdb_set_image(ctx, image);
+    if (decompress_blocks(ctx, abfd, cfg, &packets, &visits[0]) < 0) {
+        LOG_ERRT("Block decompression with image failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    trdb_set_image(ctx, NULL);
+    if (decompress_blocks(ctx, abfd, cfg, &packets, &visits[1]) < 0) {
+        LOG_ERRT("Block decompression without image failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (unsigned k = 0; k < TRDB_ARRAY_SIZE(visits); k++) {
+        struct block_visits *v = &visits[k];
+        size_t j               = 0;
+        for (size_t n = 0; n < v->len && status == TRDB_SUCCESS; n++) {
+            const struct trdb_block *b = v->blocks[n];
+            if (v->instrs[n] > b->instrs) {
+                LOG_ERRT("Visit %zu longer than its block\n", n);
+                status = TRDB_FAIL;
+            }
+            for (size_t m = 0; m < v->instrs[n] && j < expected.size;
+                 m++, j++) {
+                struct tr_instr *instr = TRDB_VEC_AT(&expected, j);
+                if (instr->iaddr < b->start || instr->iaddr > b->last) {
+                    LOG_ERRT("Instruction %zu not in block of visit %zu\n", j,
+                             n);
+                    status = TRDB_FAIL;
+                    break;
+                }
+            }
+        }
+        if (status == TRDB_SUCCESS && j != expected.size) {
+            LOG_ERRT("Blocks cover %zu instead of %zu instructions\n", j,
+                     expected.size);
+            status = TRDB_FAIL;
+        }
+    }
+    if (status == TRDB_SUCCESS &&
+        (visits[0].len != visits[1].len ||
+         memcmp(visits[0].instrs, visits[1].instrs,
+                visits[0].len * sizeof(*visits[0].instrs)))) {
+        LOG_ERRT("Block visits depend on the image\n");
+        status = TRDB_FAIL;
+    }
+
+fail:
+    for (unsigned k = 0; k < TRDB_ARRAY_SIZE(visits); k++) {
+        free(visits[k].blocks);
+        free(visits[k].instrs);
+    }
+    trdb_free(ctx);
+    trdb_cfg_free(cfg);
+    trdb_image_free(image);
+    free(samples);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&expected);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+/* Sum the numbers at the end of the lines of @p text */
+static uint64_t sum_line_ends(const char *text)
+{
+    uint64_t sum = 0;
+    for (const char *l = text; *l; l++) {
+        const char *end = strchr(l, '\n');
+        if (!end)
+            break;
+        const char *num = end;
+        while (num > l && num[-1] >= '0' && num[-1] <= '9')
+            num--;
+        sum += strtoull(num, NULL, 10);
+        l = end;
+    }
+    return sum;
+}
+
+/* the profile has to add up to what the instruction trace says */
+static int test_profile(const char *bin_path, const char *trace_path)
+{
+    bfd *abfd                      = NULL;
+    struct tr_instr *samples       = NULL;
+    size_t samplecnt               = 0;
+    int status                     = TRDB_SUCCESS;
+    struct trdb_ctx *ctx           = NULL;
+    struct trdb_image *image       = NULL;
+    struct trdb_cfg *cfg           = NULL;
+    struct trdb_profile *profile   = NULL;
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec expected = {0};
+    struct trdb_block_profile *sum = NULL;
+    char *text[3]                  = {NULL};
+    size_t text_len[3]             = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_profile");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    trdb_reset_decompression(ctx);
+    if (trdb_decompress_trace_vec(ctx, abfd, &packets, &expected) < 0 ||
+        expected.size == 0) {
+        LOG_ERRT("Decompression failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_image_new(ctx, abfd, &image) < 0 ||
+        trdb_cfg_new(ctx, image, &cfg) < 0 ||
+        trdb_profile_new(ctx, cfg, &profile) < 0) {
+        LOG_ERRT("Creating the profile failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_set_image(ctx, image);
+    trdb_reset_decompression(ctx);
+    if (trdb_decompress_open(ctx, abfd) < 0) {
+        LOG_ERRT("Opening the decompression failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    size_t i                 = 0;
+    struct tr_packet *packet = NULL;
+    TRDB_VEC_FOREACH (packet, i, &packets) {
+        if (trdb_profile_packet(ctx, profile, packet) < 0) {
+            LOG_ERRT("Profiling packet %zu failed\n", i);
+            status = TRDB_FAIL;
+            break;
+        }
+    }
+    trdb_decompress_close(ctx);
+    trdb_set_image(ctx, NULL);
+    if (status != TRDB_SUCCESS)
+        goto fail;
+
+    /* count the instructions and branch outcomes of each block by hand */
+    size_t len                      = 0;
+    const struct trdb_block *blocks = trdb_cfg_blocks(cfg, &len);
+    sum                             = calloc(len, sizeof(*sum));
+    if (!sum) {
+        LOG_ERRT("calloc failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t j = 0; j < expected.size; j++) {
+        struct tr_instr *instr     = TRDB_VEC_AT(&expected, j);
+        const struct trdb_block *b = trdb_cfg_find(cfg, instr->iaddr);
+        if (!b)
+            continue;
+        struct trdb_block_profile *s = &sum[b - blocks];
+        s->instrs++;
+        if (b->kind != TRDB_BLOCK_BRANCH || instr->iaddr != b->last ||
+            j + 1 == expected.size)
+            continue;
+        addr_t next = TRDB_VEC_AT(&expected, j + 1)->iaddr;
+        if (next == b->taken)
+            s->taken++;
+        else if (next == b->fallthrough)
+            s->not_taken++;
+    }
+
+    if (trdb_profile_instrs(profile) != expected.size) {
+        LOG_ERRT("Profiled %" PRIu64 " instead of %zu instructions\n",
+                 trdb_profile_instrs(profile), expected.size);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t j = 0; j < len; j++) {
+        struct trdb_block_profile counts;
+        trdb_profile_get_block(profile, j, &counts);
+        if (counts.instrs != sum[j].instrs || counts.taken != sum[j].taken ||
+            counts.not_taken != sum[j].not_taken ||
+            (counts.visits == 0) != (counts.instrs == 0)) {
+            LOG_ERRT("Bad counts of block at %" PRIxADDR "\n", blocks[j].start);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    for (unsigned k = 0; k < TRDB_ARRAY_SIZE(text); k++) {
+        FILE *fp = open_memstream(&text[k], &text_len[k]);
+        if (!fp || trdb_profile_write(profile, k, fp) < 0) {
+            LOG_ERRT("Writing profile format %u failed\n", k);
+            status = TRDB_FAIL;
+        }
+        if (fp)
+            fclose(fp);
+        if (status != TRDB_SUCCESS)
+            goto fail;
+    }
+
+    /* every instruction is on exactly one call stack */
+    char totals[64];
+    snprintf(totals, sizeof(totals), "\ntotals: %zu ", expected.size);
+    if (strncmp(text[TRDB_PROFILE_FLAT], "Flat profile", 12) ||
+        !strstr(text[TRDB_PROFILE_CALLGRIND], totals) ||
+        sum_line_ends(text[TRDB_PROFILE_FOLDED]) != expected.size) {
+        LOG_ERRT("Profile output does not add up\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_profile_write(profile, TRDB_PROFILE_FOLDED + 1, stderr) !=
+        -trdb_invalid) {
+        LOG_ERRT("Unknown profile format accepted\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+fail:
+    for (unsigned k = 0; k < TRDB_ARRAY_SIZE(text); k++)
+        free(text[k]);
+    free(sum);
+    trdb_profile_free(profile);
+    trdb_free(ctx);
+    trdb_cfg_free(cfg);
+    trdb_image_free(image);
+    free(samples);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&expected);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+static int test_decompress_trace_parallel(const char *bin_path,
+                                          const char *trace_path,
+                                          bool differential, bool implicit_ret)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+
+    const unsigned threads[]       = {2, 3, 0};
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec expected = {0};
+    struct trdb_instr_vec instrs   = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf),
+             "%s, differential: %s, implicit returns: %s", trace_path,
+             differential ? "true" : "false", implicit_ret ? "true" : "false");
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_decompress_trace_parallel");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    ctx->config.full_address  = !differential;
+    ctx->config.use_pulp_sext = true;
+    ctx->config.implicit_ret  = implicit_ret;
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    for (int run = -1; run < (int)TRDB_ARRAY_SIZE(threads); run++) {
+        trdb_reset_decompression(ctx);
+        ctx->config.full_address  = !differential;
+        ctx->config.use_pulp_sext = true;
+        ctx->config.implicit_ret  = implicit_ret;
+
+        /* the first run is the sequential reference */
+        status = run < 0 ? trdb_decompress_trace_vec(ctx, abfd, &packets,
+                                                     &expected)
+                         : trdb_decompress_trace_parallel(
+                               ctx, abfd, &packets, &instrs, threads[run]);
+        if (status < 0) {
+            LOG_ERRT("Decompression failed: %s\n",
+                     trdb_errstr(trdb_errcode(status)));
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        if (run < 0)
+            continue;
+
+        if (instrs.size != expected.size || expected.size == 0) {
+            LOG_ERRT("%u threads produced %zu instead of %zu instructions\n",
+                     threads[run], instrs.size, expected.size);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        size_t i               = 0;
+        struct tr_instr *instr = NULL;
+        TRDB_VEC_FOREACH (instr, i, &instrs) {
+            struct tr_instr *ref = TRDB_VEC_AT(&expected, i);
+            if (instr->iaddr != ref->iaddr || instr->instr != ref->instr ||
+                instr->priv != ref->priv) {
+                LOG_ERRT("%u threads: instruction %zu differs\n", threads[run],
+                         i);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+        trdb_free_instr_vec(&instrs);
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&expected);
+    trdb_free_instr_vec(&instrs);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+static int collect_instr(struct trdb_ctx *c, const struct tr_instr *instr,
+                         void *data)
+{
+    (void)c;
+    return trdb_instr_vec_push(data, instr);
+}
+
+static int test_compress_resync(const char *bin_path, const char *trace_path,
+                                bool differential)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+
+    /* pairs of instruction and packet intervals, the first is the reference */
+    const uint64_t intervals[][2]  = {{0, 0}, {64, 0}, {0, 4}, {16, 2}};
+    size_t ref_starts              = 0;
+    size_t ref_instrs              = 0;
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec expected = {0};
+    struct trdb_instr_vec instrs   = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s, differential: %s",
+             trace_path, differential ? "true" : "false");
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_compress_resync");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (unsigned run = 0; run < TRDB_ARRAY_SIZE(intervals); run++) {
+        trdb_reset_compression(ctx);
+        ctx->config.full_address  = !differential;
+        ctx->config.use_pulp_sext = true;
+        trdb_set_resync_interval(ctx, intervals[run][0]);
+        trdb_set_resync_packet_interval(ctx, intervals[run][1]);
+
+        if (trdb_get_resync_interval(ctx) != intervals[run][0] ||
+            trdb_get_resync_packet_interval(ctx) != intervals[run][1]) {
+            LOG_ERRT("Resync interval getters are inconsistent\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        for (size_t i = 0; i < samplecnt; i++) {
+            if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+                LOG_ERRT("Compress trace failed.\n");
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+
+        struct trdb_packet_stats stats = {0};
+        trdb_get_packet_stats(ctx, &stats);
+        if (run == 0) {
+            ref_starts = stats.start_packets;
+        } else if (stats.start_packets <= ref_starts) {
+            LOG_ERRT("Interval %" PRIu64 "/%" PRIu64 " emitted no resync\n",
+                     intervals[run][0], intervals[run][1]);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        trdb_reset_decompression(ctx);
+        ctx->config.full_address  = !differential;
+        ctx->config.use_pulp_sext = true;
+
+        status = trdb_decompress_trace_vec(ctx, abfd, &packets, &expected);
+        if (status < 0) {
+            LOG_ERRT("Decompression failed: %s\n",
+                     trdb_errstr(trdb_errcode(status)));
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        /* the reconstruction has to match the original sequence, resync
+         * packets are allowed to cover more of its tail
+         */
+        size_t j               = 0;
+        size_t i               = 0;
+        struct tr_instr *instr = NULL;
+        TRDB_VEC_FOREACH (instr, i, &expected) {
+            while (j < samplecnt && (!samples[j].valid || samples[j].exception))
+                j++;
+            if (j == samplecnt || instr->iaddr != samples[j].iaddr) {
+                LOG_ERRT("Instruction %zu differs from original\n", i);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+            j++;
+        }
+        if (run == 0)
+            ref_instrs = expected.size;
+        if (expected.size < ref_instrs || expected.size == 0) {
+            LOG_ERRT("Resync produced %zu instead of %zu instructions\n",
+                     expected.size, ref_instrs);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        if (run == 0) {
+            trdb_free_packet_vec(&packets);
+            trdb_free_instr_vec(&expected);
+            continue;
+        }
+
+        /* seek to the start packet closest to the middle and decode from
+         * there, which has to give us the tail of the full reconstruction
+         */
+        size_t seek = packets.size;
+        for (i = packets.size / 2; i < packets.size; i++) {
+            struct tr_packet *packet = TRDB_VEC_AT(&packets, i);
+            if (packet->format == F_SYNC && packet->subformat == SF_START) {
+                seek = i;
+                break;
+            }
+        }
+
+        trdb_reset_decompression(ctx);
+        ctx->config.full_address  = !differential;
+        ctx->config.use_pulp_sext = true;
+
+        status = trdb_decompress_open(ctx, abfd);
+        for (i = seek; status >= 0 && i < packets.size; i++)
+            status = trdb_decompress_packet(ctx, TRDB_VEC_AT(&packets, i),
+                                            collect_instr, &instrs);
+        trdb_decompress_close(ctx);
+        if (status < 0 || seek == packets.size || instrs.size == 0 ||
+            instrs.size > expected.size) {
+            LOG_ERRT("Decompression from packet %zu failed\n", seek);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        size_t offset = expected.size - instrs.size;
+        TRDB_VEC_FOREACH (instr, i, &instrs) {
+            struct tr_instr *ref = TRDB_VEC_AT(&expected, offset + i);
+            if (instr->iaddr != ref->iaddr || instr->instr != ref->instr ||
+                instr->priv != ref->priv) {
+                LOG_ERRT("Instruction %zu differs after seeking\n",
+                         offset + i);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+
+        trdb_free_instr_vec(&expected);
+        trdb_free_packet_vec(&packets);
+        trdb_free_instr_vec(&instrs);
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&expected);
+    trdb_free_instr_vec(&instrs);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+static int test_container(const char *bin_path, const char *trace_path,
+                          bool differential)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+    const char *path         = "tmp_container";
+    FILE *fp                 = NULL;
+
+    struct trdb_container_writer writer = {0};
+    struct trdb_container ct            = {0};
+    struct trdb_instr_vec retired       = {0};
+    struct trdb_instr_vec instrs        = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s, differential: %s",
+             trace_path, differential ? "true" : "false");
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_container");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* the instructions the decompression is supposed to reproduce */
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (samples[i].valid && !samples[i].exception &&
+            trdb_instr_vec_push(&retired, &samples[i]) < 0) {
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* serialized like the trdb cli does it */
+    trdb_set_full_address(ctx, !differential);
+    trdb_set_resync_interval(ctx, 64);
+
+    fp = fopen(path, "wb");
+    if (!fp || trdb_container_create(ctx, fp, 128, &writer) < 0) {
+        LOG_ERRT("Creating container failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    struct tr_packet timer = {.msg_type = W_TIMER, .time = 1234};
+    if (trdb_container_write_packet(ctx, &writer, &timer, 0) < 0) {
+        LOG_ERRT("Writing timer packet failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_container_compress_step(ctx, &writer, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    status = trdb_container_finish(ctx, &writer);
+    fclose(fp);
+    fp = NULL;
+    if (status < 0) {
+        LOG_ERRT("Finishing container failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_container_open(ctx, path, &ct) < 0) {
+        LOG_ERRT("Opening container failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (ct.nblocks < 2 || ct.full_address != !differential ||
+        ct.blocks[0].first_instr != 0 || ct.blocks[0].timestamp != 1234) {
+        LOG_ERRT("Bad container index with %zu blocks\n", ct.nblocks);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    for (size_t b = 0; b < ct.nblocks; b++) {
+        struct trdb_container_block *block = &ct.blocks[b];
+        if (block->first_instr >= retired.size ||
+            TRDB_VEC_AT(&retired, block->first_instr)->iaddr !=
+                block->first_pc ||
+            trdb_container_find_block(&ct, block->first_instr) != b) {
+            LOG_ERRT("Block %zu doesn't point to its first instruction\n", b);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* the whole trace, then windows inside a block, across blocks and
+     * starting mid block
+     */
+    uint64_t last     = ct.blocks[ct.nblocks - 1].first_instr;
+    uint64_t total    = UINT64_MAX;
+    uint64_t window[] = {0,         UINT64_MAX,   0,    10,       last,
+                         last + 1,  last / 2,     last, last - 3, last + 5};
+
+    for (unsigned w = 0; w < TRDB_ARRAY_SIZE(window); w += 2) {
+        uint64_t begin = window[w];
+        uint64_t end   = window[w + 1];
+
+        trdb_reset_decompression(ctx);
+        trdb_set_full_address(ctx, ct.full_address);
+
+        status = trdb_decompress_open(ctx, abfd);
+        if (status == 0)
+            status = trdb_container_decompress_window(
+                ctx, &ct, begin, end, collect_instr, &instrs);
+        trdb_decompress_close(ctx);
+        if (status < 0) {
+            LOG_ERRT("Window decompression failed: %s\n",
+                     trdb_errstr(trdb_errcode(status)));
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        if (w == 0)
+            total = instrs.size;
+
+        uint64_t expect = (end < total ? end : total) - begin;
+        if (instrs.size != expect || total > retired.size) {
+            LOG_ERRT("Window [%" PRIu64 ", %" PRIu64 ") has %zu instead of "
+                     "%" PRIu64 " instructions\n",
+                     begin, end, instrs.size, expect);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        size_t i               = 0;
+        struct tr_instr *instr = NULL;
+        TRDB_VEC_FOREACH (instr, i, &instrs) {
+            if (instr->iaddr != TRDB_VEC_AT(&retired, begin + i)->iaddr) {
+                LOG_ERRT("Instruction %" PRIu64 " differs\n", begin + i);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+        trdb_free_instr_vec(&instrs);
+    }
+
+    /* a raw packet file is no container */
+    trdb_container_close(&ct);
+    if (trdb_container_open(ctx, "data/trdb_packets", &ct) !=
+        -trdb_bad_container) {
+        LOG_ERRT("Raw packets accepted as container\n");
+        status = TRDB_FAIL;
+    }
+
+fail:
+    if (writer.fp)
+        trdb_container_finish(ctx, &writer);
+    if (fp)
+        fclose(fp);
+    trdb_container_close(&ct);
+    remove(path);
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_instr_vec(&retired);
+    trdb_free_instr_vec(&instrs);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+/* walks the original samples, skipping those the decompression doesn't
+ * reconstruct like test_decompress_trace() does
+ */
+struct stream_check {
+    const struct tr_instr *samples;
+    size_t samplecnt;
+    size_t next; /* index of the expected instruction */
+    size_t cnt;
+    bool mismatch;
+};
+
+static int check_streamed_instr(struct trdb_ctx *c, const struct tr_instr *instr,
+                                void *data)
+{
+    (void)c;
+    struct stream_check *check = data;
+    while (check->next < check->samplecnt &&
+           (!check->samples[check->next].valid ||
+            check->samples[check->next].exception))
+        check->next++;
+
+    if (check->next == check->samplecnt ||
+        check->samples[check->next].iaddr != instr->iaddr ||
+        check->samples[check->next].instr != instr->instr) {
+        check->mismatch = true;
+        return -trdb_internal;
+    }
+    check->next++;
+    check->cnt++;
+    return 0;
+}
+
+static int test_decompress_stream(const char *bin_path, const char *trace_path,
+                                  bool differential)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+
+    struct trdb_packet_head packet_head;
+    TAILQ_INIT(&packet_head);
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s, differential: %s",
+             trace_path, differential ? "true" : "false");
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_decompress_stream");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_set_full_address(ctx, !differential);
+    ctx->config.use_pulp_sext = true;
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_add(ctx, &packet_head, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    trdb_reset_decompression(ctx);
+    trdb_set_full_address(ctx, !differential);
+    ctx->config.use_pulp_sext = true;
+
+    /* trdb_decompress_trace() is built on the streaming decompression, so
+     * compare against the original instead
+     */
+    struct stream_check check = {.samples = samples, .samplecnt = samplecnt};
+
+    if (trdb_decompress_packet(ctx, TAILQ_FIRST(&packet_head),
+                               check_streamed_instr, &check) != -trdb_invalid) {
+        LOG_ERRT("Decompressing without opening should fail\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    status = trdb_decompress_open(ctx, abfd);
+    if (status < 0) {
+        LOG_ERRT("Opening decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    struct tr_packet *packet;
+    TAILQ_FOREACH (packet, &packet_head, list) {
+        status =
+            trdb_decompress_packet(ctx, packet, check_streamed_instr, &check);
+        if (status < 0) {
+            LOG_ERRT("Streaming decompression failed: %s\n",
+                     check.mismatch ? "instruction mismatch"
+                                    : trdb_errstr(trdb_errcode(status)));
+            status = TRDB_FAIL;
+            break;
+        }
+    }
+    trdb_decompress_close(ctx);
+
+    if (status == TRDB_SUCCESS && check.cnt == 0) {
+        LOG_ERRT("Streaming decompression produced no instructions\n");
+        status = TRDB_FAIL;
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_list(&packet_head);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+/* the packet source of test_follow() */
+struct follow_feed {
+    int fd;
+    const uint8_t *data;
+    size_t size;
+    size_t piece;
+    bool slow; /* let the follower catch up in between */
+};
+
+static void *feed_packets(void *arg)
+{
+    struct follow_feed *feed = arg;
+
+    for (size_t off = 0; off < feed->size; off += feed->piece) {
+        size_t len = feed->size - off < feed->piece ? feed->size - off
+                                                    : feed->piece;
+        if (write(feed->fd, feed->data + off, len) != (ssize_t)len)
+            break;
+        if (feed->slow)
+            usleep(1000);
+    }
+    close(feed->fd);
+    return NULL;
+}
+
+/* collects the followed instructions and stops once all of them arrived */
+struct follow_check {
+    struct trdb_instr_vec instrs;
+    size_t expected;
+    volatile sig_atomic_t stop;
+};
+
+static int check_followed_instr(struct trdb_ctx *c,
+                                const struct tr_instr *instr, void *data)
+{
+    struct follow_check *check = data;
+    int status                 = collect_instr(c, instr, &check->instrs);
+
+    if (check->instrs.size == check->expected)
+        check->stop = 1;
+    return status;
+}
+
+static int test_follow(const char *bin_path, const char *trace_path)
+{
+    bfd *abfd                      = NULL;
+    struct tr_instr *samples       = NULL;
+    size_t samplecnt               = 0;
+    int status                     = TRDB_SUCCESS;
+    struct trdb_ctx *ctx           = NULL;
+    const char *path               = "tmp_follow";
+    FILE *fp                       = NULL;
+    struct trdb_packet_map map     = {0};
+    struct trdb_instr_vec expected = {0};
+    struct follow_check check      = {0};
+    struct trdb_follow_stats stats = {0};
+    uint8_t buf[4096];
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_follow");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* serialized like the trdb cli does it */
+    fp = fopen(path, "wb");
+    for (size_t done = 0; fp && done < samplecnt;) {
+        size_t consumed = 0;
+        size_t written  = 0;
+        if (trdb_pulp_compress_trace_block(ctx, samplecnt - done,
+                                           samples + done, sizeof(buf), buf,
+                                           &consumed, &written) < 0 ||
+            fwrite(buf, 1, written, fp) != written) {
+            fclose(fp);
+            fp = NULL;
+        }
+        done += consumed;
+    }
+    if (!fp || fclose(fp)) {
+        LOG_ERRT("Writing packets failed\n");
+        fp     = NULL;
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    fp = NULL;
+
+    /* what the decompression of the whole file gives */
+    trdb_reset_decompression(ctx);
+    if (trdb_pulp_map_packets(ctx, path, &map) < 0 ||
+        trdb_decompress_open(ctx, abfd) < 0 ||
+        trdb_pulp_decompress_mapped_packets(ctx, &map, 0, map.size,
+                                            collect_instr, &expected) < 0 ||
+        expected.size == 0) {
+        LOG_ERRT("Decompressing the packet file failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    trdb_decompress_close(ctx);
+
+    /* a pipe with packets split at odd places and a file that grows */
+    for (unsigned m = 0; m < 2; m++) {
+        struct follow_feed feed = {.data  = map.data,
+                                   .size  = map.size,
+                                   .piece = m ? 1000 : 7,
+                                   .slow  = m};
+        int fds[2]              = {-1, -1};
+        pthread_t producer;
+
+        if (m == 0 && pipe(fds) == 0) {
+            feed.fd = fds[1];
+        } else if (m == 1) {
+            fds[0]  = open("tmp_follow_grow", O_RDONLY | O_CREAT | O_TRUNC,
+                           0600);
+            feed.fd = open("tmp_follow_grow", O_WRONLY);
+        }
+        if (fds[0] < 0 || feed.fd < 0 ||
+            pthread_create(&producer, NULL, feed_packets, &feed)) {
+            LOG_ERRT("Starting packet producer failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+
+        trdb_free_instr_vec(&check.instrs);
+        check = (struct follow_check){.expected = expected.size};
+        trdb_reset_decompression(ctx);
+        int follow = trdb_decompress_open(ctx, abfd);
+        if (follow == 0)
+            follow = trdb_follow_fd(ctx, fds[0], true, NULL, &check.stop,
+                                    check_followed_instr, &check, &stats);
+        trdb_decompress_close(ctx);
+        pthread_join(producer, NULL);
+        close(fds[0]);
+
+        if (follow < 0 || check.instrs.size != expected.size ||
+            stats.instrs != expected.size || stats.bytes != map.size ||
+            !stats.packets ||
+            stats.max_latency_ns * stats.packets < stats.total_latency_ns) {
+            LOG_ERRT("Following %s gave %zu instead of %zu instructions\n",
+                     m ? "a file" : "a pipe", check.instrs.size, expected.size);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        for (size_t i = 0; i < expected.size; i++) {
+            if (!same_sample(TRDB_VEC_AT(&check.instrs, i),
+                             TRDB_VEC_AT(&expected, i))) {
+                LOG_ERRT("Followed instruction %zu differs\n", i);
+                status = TRDB_FAIL;
+                goto fail;
+            }
+        }
+    }
+
+fail:
+    if (fp)
+        fclose(fp);
+    trdb_pulp_unmap_packets(&map);
+    remove(path);
+    remove("tmp_follow_grow");
+    trdb_free_instr_vec(&expected);
+    trdb_free_instr_vec(&check.instrs);
+    trdb_free(ctx);
+    free(samples);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+struct event_count {
+    size_t emit;
+    size_t decode;
+    size_t instr;
+};
+
+static void count_event(struct trdb_ctx *c, const struct trdb_event *event,
+                        void *data)
+{
+    (void)c;
+    struct event_count *cnt = data;
+
+    switch (event->kind) {
+    case TRDB_EVENT_PACKET_EMIT:
+        cnt->emit += event->packet != NULL;
+        break;
+    case TRDB_EVENT_PACKET_DECODE:
+        cnt->decode += event->packet != NULL;
+        break;
+    case TRDB_EVENT_INSTR_DECODE:
+        cnt->instr += event->instr != NULL;
+        break;
+    }
+}
+
+static int test_event_fn(const char *bin_path, const char *trace_path)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+    struct event_count cnt   = {0};
+
+    struct trdb_packet_head packet_head;
+    TAILQ_INIT(&packet_head);
+    struct trdb_instr_head instr_head;
+    TAILQ_INIT(&instr_head);
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_event_fn");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_set_event_fn(ctx, count_event, &cnt);
+    ctx->config.use_pulp_sext = true;
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_add(ctx, &packet_head, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    size_t packetcnt = 0;
+    struct tr_packet *packet;
+    TAILQ_FOREACH (packet, &packet_head, list)
+        packetcnt++;
+
+    if (cnt.emit != packetcnt || cnt.decode != 0 || cnt.instr != 0) {
+        LOG_ERRT("Compression reported %zu packets, produced %zu\n", cnt.emit,
+                 packetcnt);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_reset_decompression(ctx);
+    ctx->config.use_pulp_sext = true;
+
+    status = trdb_decompress_trace(ctx, abfd, &packet_head, &instr_head);
+    if (status < 0) {
+        LOG_ERRT("Decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t instrcnt = 0;
+    struct tr_instr *instr;
+    TAILQ_FOREACH (instr, &instr_head, list)
+        instrcnt++;
+
+    if (cnt.decode != packetcnt || cnt.instr != instrcnt) {
+        LOG_ERRT("Decompression reported %zu packets and %zu instructions, "
+                 "expected %zu and %zu\n",
+                 cnt.decode, cnt.instr, packetcnt, instrcnt);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* unhooking must stop the reports */
+    trdb_set_event_fn(ctx, NULL, NULL);
+    cnt = (struct event_count){0};
+    trdb_reset_compression(ctx);
+    ctx->config.use_pulp_sext = true;
+    trdb_free_packet_list(&packet_head);
+
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_add(ctx, &packet_head, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    if (cnt.emit != 0) {
+        LOG_ERRT("Event function still called after unhooking\n");
+        status = TRDB_FAIL;
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_list(&packet_head);
+    trdb_free_instr_list(&instr_head);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+static int test_perf_stats(const char *bin_path, const char *trace_path)
+{
+    bfd *abfd                   = NULL;
+    struct tr_instr *samples    = NULL;
+    size_t samplecnt            = 0;
+    int status                  = TRDB_SUCCESS;
+    struct trdb_ctx *ctx        = NULL;
+    struct trdb_perf_stats perf = {0};
+
+    struct trdb_packet_head packet_head;
+    TAILQ_INIT(&packet_head);
+    struct trdb_instr_head instr_head;
+    TAILQ_INIT(&instr_head);
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_get_perf_stats(NULL, &perf) != -trdb_invalid ||
+        trdb_get_perf_stats(ctx, NULL) != -trdb_invalid) {
+        LOG_ERRT("Missing arguments not rejected\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_perf_stats");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    ctx->config.use_pulp_sext = true;
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_add(ctx, &packet_head, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    trdb_reset_decompression(ctx);
+    ctx->config.use_pulp_sext = true;
+    status = trdb_decompress_trace(ctx, abfd, &packet_head, &instr_head);
+    if (status < 0) {
+        LOG_ERRT("Decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    status = TRDB_SUCCESS;
+
+    size_t instrcnt = 0;
+    struct tr_instr *instr;
+    TAILQ_FOREACH (instr, &instr_head, list)
+        instrcnt++;
+
+    /* without instrumentation nothing may be counted */
+    if (trdb_get_perf_stats(ctx, &perf) == -trdb_unimplemented) {
+        struct trdb_perf_stats zero = {0};
+        if (memcmp(&perf, &zero, sizeof(perf))) {
+            LOG_ERRT("Stats not zeroed without instrumentation\n");
+            status = TRDB_FAIL;
+        }
+        goto fail;
+    }
+
+    struct trdb_perf_timer *stages = perf.stages;
+    if (stages[trdb_perf_parse].calls != 1 ||
+        stages[trdb_perf_compress].calls != samplecnt ||
+        stages[trdb_perf_decode].calls < instrcnt ||
+        perf.decode_hits + perf.decode_misses !=
+            stages[trdb_perf_decode].calls ||
+        perf.section_loads == 0 || perf.allocs < samplecnt + instrcnt) {
+        LOG_ERRT("Unexpected stats for %zu instructions: %" PRIu64
+                 " parses, %" PRIu64 " compressions, %" PRIu64
+                 " decodes, %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+                 " section loads, %" PRIu64 " allocations\n",
+                 samplecnt, stages[trdb_perf_parse].calls,
+                 stages[trdb_perf_compress].calls,
+                 stages[trdb_perf_decode].calls, perf.decode_hits,
+                 perf.decode_misses, perf.section_loads, perf.allocs);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* the stats span resets of the compression and decompression state */
+    trdb_reset_compression(ctx);
+    struct trdb_perf_stats kept = {0};
+    trdb_get_perf_stats(ctx, &kept);
+    if (memcmp(&perf, &kept, sizeof(perf))) {
+        LOG_ERRT("Stats lost on trdb_reset_compression()\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_reset_perf_stats(ctx);
+    trdb_get_perf_stats(ctx, &perf);
+    if (perf.stages[trdb_perf_compress].calls || perf.allocs) {
+        LOG_ERRT("Stats not reset\n");
+        status = TRDB_FAIL;
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_list(&packet_head);
+    trdb_free_instr_list(&instr_head);
+    if (abfd)
+        bfd_close(abfd);
+    return status;
+}
+
+/* whether @p a and @p b serialize to the same PULP packet */
+static bool same_packet(struct trdb_ctx *c, struct tr_packet *a,
+                        struct tr_packet *b)
+{
+    uint8_t bin_a[16] = {0};
+    uint8_t bin_b[16] = {0};
+    size_t bits_a     = 0;
+    size_t bits_b     = 0;
+
+    if (trdb_pulp_serialize_packet(c, a, &bits_a, 0, bin_a) < 0 ||
+        trdb_pulp_serialize_packet(c, b, &bits_b, 0, bin_b) < 0)
+        return false;
+    return bits_a == bits_b && !memcmp(bin_a, bin_b, sizeof(bin_a));
+}
+
+/* Interrupting compression and decompression at a snapshot and continuing in
+ * another context gives the same result as doing it in one go.
+ */
+/* Whether a return among the retired instructions numbered [@p begin, @p end)
+ * of @p samples goes back to a compressed call made before @p begin. Calls and
+ * returns are the jumps linking through or to ra or t0.
+ */
+static bool returns_to_compressed_call(const struct tr_instr *samples,
+                                       size_t samplecnt, uint64_t begin,
+                                       uint64_t end)
+{
+    struct {
+        uint64_t n;
+        bool compressed;
+    } calls[1024];
+    size_t depth = 0;
+    uint64_t n   = 0;
+
+    for (size_t i = 0; i < samplecnt && n < end; i++) {
+        const struct tr_instr *s = &samples[i];
+        if (!s->valid || s->exception)
+            continue;
+
+        uint32_t op  = s->instr & 0x7f;
+        uint32_t rd  = (s->instr >> 7) & 0x1f;
+        uint32_t rs1 = (s->instr >> 15) & 0x1f;
+        bool link    = rd == 1 || rd == 5;
+        if ((op == 0x6f || op == 0x67) && link) {
+            if (depth == 1024)
+                depth = 0;
+            calls[depth].n          = n;
+            calls[depth].compressed = s->compressed;
+            depth++;
+        } else if (op == 0x67 && rd == 0 && (rs1 == 1 || rs1 == 5) &&
+                   depth > 0) {
+            depth--;
+            if (n >= begin && calls[depth].n < begin &&
+                calls[depth].compressed)
+                return true;
+        }
+        n++;
+    }
+    return false;
+}
+
+static int test_save_state(const char *bin_path, const char *trace_path)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    size_t samplecnt         = 0;
+    size_t *packets_after    = NULL;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+    struct trdb_ctx *cont    = NULL;
+    FILE *fp                 = NULL;
+    const char *path         = "tmp_snapshots";
+    const char *resumed_path = "tmp_snapshots_resumed";
+    uint8_t state[TRDB_STATE_MAX];
+    size_t len = 0;
+
+    struct trdb_container_writer writer = {0};
+    struct trdb_container ct            = {0};
+    struct trdb_container again         = {0};
+    struct trdb_packet_vec packets      = {0};
+    struct trdb_packet_vec resumed      = {0};
+    struct trdb_instr_vec instrs        = {0};
+    struct trdb_instr_vec split         = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", trace_path);
+
+    ctx  = trdb_new();
+    cont = trdb_new();
+    if (!ctx || !cont) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_save_state");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_stimuli_to_trace(ctx, trace_path, &samples, &samplecnt) < 0) {
+        LOG_ERRT("Stimuli to tr_instr failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* number of packets after each step, to find where a resumed compression
+     * has to continue
+     */
+    packets_after = malloc(samplecnt * sizeof(*packets_after));
+    if (!packets_after) {
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t half = samplecnt / 2;
+    trdb_set_implicit_ret(ctx, true);
+    trdb_set_resync_interval(ctx, 64);
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        packets_after[i] = packets.size;
+    }
+
+    if (trdb_save_state(ctx, state, 16, &len) != -trdb_invalid || len < 16 ||
+        trdb_restore_state(cont, state, 16) != -trdb_bad_state) {
+        LOG_ERRT("Truncated snapshot accepted\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    if (trdb_save_state(ctx, state, sizeof(state), &len) ||
+        trdb_restore_state(cont, state, len - 1) != -trdb_bad_state) {
+        LOG_ERRT("Short snapshot accepted\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* continue the compression after the saved step in another context */
+    trdb_reset_compression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_set_resync_interval(ctx, 64);
+    for (size_t i = 0; i <= half; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &resumed, &samples[i]) < 0) {
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    trdb_free_packet_vec(&resumed);
+    trdb_save_state(ctx, state, sizeof(state), &len);
+
+    trdb_set_implicit_ret(cont, true);
+    trdb_set_resync_interval(cont, 64);
+    if (trdb_restore_state(cont, state, len) < 0) {
+        LOG_ERRT("Restoring compression state failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = half + 1; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(cont, &resumed, &samples[i]) < 0) {
+            LOG_ERRT("Resumed compression failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    if (packets_after[half] + resumed.size != packets.size) {
+        LOG_ERRT("Resumed compression produced %zu packets instead of %zu\n",
+                 resumed.size, packets.size - packets_after[half]);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < resumed.size; i++) {
+        if (!same_packet(ctx, TRDB_VEC_AT(&resumed, i),
+                         TRDB_VEC_AT(&packets, packets_after[half] + i))) {
+            LOG_ERRT("Resumed compression differs at packet %zu\n", i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* the same for decompression, split in the middle of the packets */
+    trdb_reset_decompression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    if (trdb_decompress_trace_vec(ctx, abfd, &packets, &instrs) < 0) {
+        LOG_ERRT("Decompression failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t mid = packets.size / 2;
+    trdb_reset_decompression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_reset_decompression(cont);
+    trdb_set_implicit_ret(cont, true);
+    status = trdb_decompress_open(ctx, abfd);
+    if (status == 0)
+        status = trdb_decompress_open(cont, abfd);
+    for (size_t i = 0; i < mid && status == 0; i++)
+        status = trdb_decompress_packet(ctx, TRDB_VEC_AT(&packets, i),
+                                        collect_instr, &split);
+    if (status == 0)
+        status = trdb_save_state(ctx, state, sizeof(state), &len);
+    if (status == 0)
+        status = trdb_restore_state(cont, state, len);
+    for (size_t i = mid; i < packets.size && status == 0; i++)
+        status = trdb_decompress_packet(cont, TRDB_VEC_AT(&packets, i),
+                                        collect_instr, &split);
+    trdb_decompress_close(ctx);
+    trdb_decompress_close(cont);
+    if (status < 0 || split.size != instrs.size) {
+        LOG_ERRT("Resumed decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < split.size; i++) {
+        if (TRDB_VEC_AT(&split, i)->iaddr != TRDB_VEC_AT(&instrs, i)->iaddr) {
+            LOG_ERRT("Resumed decompression differs at %zu\n", i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* a container with snapshots resumes compressing from its last block and
+     * ends up the same as if it was written in one go
+     */
+    trdb_reset_compression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_set_resync_interval(ctx, 64);
+
+    fp = fopen(path, "wb");
+    if (!fp || trdb_container_create(ctx, fp, 128, &writer) < 0) {
+        LOG_ERRT("Creating container failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    trdb_container_set_snapshots(&writer, true);
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_container_compress_step(ctx, &writer, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    status = trdb_container_finish(ctx, &writer);
+    fclose(fp);
+    fp = NULL;
+    if (status < 0 || trdb_container_open(ctx, path, &ct) < 0 ||
+        ct.nblocks < 2) {
+        LOG_ERRT("Writing container failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    size_t last = ct.nblocks - 1;
+    trdb_reset_compression(cont);
+    trdb_set_implicit_ret(cont, true);
+    trdb_set_resync_interval(cont, 64);
+    fp = fopen(resumed_path, "wb");
+    if (!fp ||
+        trdb_container_resume(cont, &ct, ct.nblocks, fp, 128, &writer) !=
+            -trdb_invalid ||
+        trdb_container_resume(cont, &ct, last, fp, 128, &writer) < 0) {
+        LOG_ERRT("Resuming container failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = ct.blocks[last].steps; i < samplecnt; i++) {
+        if (trdb_container_compress_step(cont, &writer, &samples[i]) < 0) {
+            LOG_ERRT("Resumed compression failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    status = trdb_container_finish(cont, &writer);
+    fclose(fp);
+    fp = NULL;
+    if (status < 0 || trdb_container_open(ctx, resumed_path, &again) < 0 ||
+        again.map.size != ct.map.size ||
+        memcmp(again.map.data, ct.map.data, ct.map.size)) {
+        LOG_ERRT("Resumed container differs\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* with the snapshot a window starting at the last block knows the return
+     * addresses of the calls before it
+     */
+    trdb_reset_decompression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_free_instr_vec(&split);
+    uint64_t first = ct.blocks[last].first_instr;
+    status         = trdb_decompress_open(ctx, abfd);
+    if (status == 0)
+        status = trdb_container_decompress_window(ctx, &ct, first, UINT64_MAX,
+                                                  collect_instr, &split);
+    trdb_decompress_close(ctx);
+    if (status < 0 || first + split.size != instrs.size) {
+        LOG_ERRT("Decompressing container with snapshots failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < split.size; i++) {
+        if (TRDB_VEC_AT(&split, i)->iaddr !=
+            TRDB_VEC_AT(&instrs, first + i)->iaddr) {
+            LOG_ERRT("Window from snapshot differs at %zu\n", i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    /* a snapshot holds the right links of compressed calls, which on PULP
+     * are decompressed in the input
+     */
+    size_t k = 1;
+    for (; k < ct.nblocks; k++) {
+        uint64_t end = k + 1 < ct.nblocks ? ct.blocks[k + 1].first_instr
+                                          : instrs.size;
+        if (ct.blocks[k].state_len &&
+            returns_to_compressed_call(samples, samplecnt,
+                                       ct.blocks[k].first_instr, end))
+            break;
+    }
+    if (k == ct.nblocks) {
+        LOG_ERRT("No block returns to a compressed call before it\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    uint64_t end = k + 1 < ct.nblocks ? ct.blocks[k + 1].first_instr
+                                      : instrs.size;
+    trdb_reset_decompression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_free_instr_vec(&split);
+    first  = ct.blocks[k].first_instr;
+    status = trdb_decompress_open(ctx, abfd);
+    if (status == 0)
+        status = trdb_container_decompress_window(ctx, &ct, first, end,
+                                                  collect_instr, &split);
+    trdb_decompress_close(ctx);
+    if (status < 0 || first + split.size != end) {
+        LOG_ERRT("Decompressing block %zu from its snapshot failed\n", k);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < split.size; i++) {
+        if (TRDB_VEC_AT(&split, i)->iaddr !=
+            TRDB_VEC_AT(&instrs, first + i)->iaddr) {
+            LOG_ERRT("Block %zu from snapshot differs at %zu\n", k, i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+fail:
+    if (writer.fp)
+        trdb_container_finish(ctx, &writer);
+    if (fp)
+        fclose(fp);
+    trdb_container_close(&ct);
+    trdb_container_close(&again);
+    remove(path);
+    remove(resumed_path);
+    trdb_free(ctx);
+    trdb_free(cont);
+    free(samples);
+    free(packets_after);
+    trdb_free_packet_vec(&packets);
+    trdb_free_packet_vec(&resumed);
+    trdb_free_instr_vec(&instrs);
+    trdb_free_instr_vec(&split);
+    if (abfd)
+        bfd_close(abfd);
+    return status;
+}
+
+static int test_generate_trace(const char *bin_path, bool differential,
+                               bool implicit_ret)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    struct tr_instr *chunked = NULL;
+    struct trdb_gen *gen     = NULL;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+    const size_t samplecnt   = 50000;
+
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec instrs   = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf),
+             "%s, differential: %s, implicit returns: %s", bin_path,
+             differential ? "true" : "false", implicit_ret ? "true" : "false");
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_generate_trace");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    struct trdb_gen_config config;
+    trdb_gen_default_config(&config);
+    config.seed           = 42;
+    config.max_call_depth = 8;
+    config.exception_rate = 0.001;
+    config.interrupt_rate = 0.002;
+
+    struct trdb_gen_config bad = config;
+    bad.branch_taken           = 1.5;
+    if (trdb_gen_new(ctx, abfd, &bad, &gen) != -trdb_invalid) {
+        LOG_ERRT("Accepted branch probability out of range\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    if (trdb_generate_trace(ctx, abfd, &config, samplecnt, &samples) < 0) {
+        LOG_ERRT("Generating trace failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* the same seed produces the same trace, however it is pulled out */
+    chunked = malloc(samplecnt * sizeof(*chunked));
+    if (!chunked || trdb_gen_new(ctx, abfd, &config, &gen) < 0) {
+        LOG_ERRT("Creating generator failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    for (size_t i = 0; i < samplecnt; i += 777) {
+        size_t len = samplecnt - i < 777 ? samplecnt - i : 777;
+        if (trdb_gen_next(gen, len, &chunked[i]) < 0) {
+            LOG_ERRT("Generating chunk failed\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (!trdb_compare_instr(ctx, &samples[i], &chunked[i])) {
+            LOG_ERRT("Chunked generation differs at %zu\n", i);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    struct trdb_gen_stats stats;
+    trdb_gen_get_stats(gen, &stats);
+    if (stats.instrs != samplecnt || !stats.branches || !stats.calls ||
+        !stats.interrupts || !stats.exceptions || stats.max_depth > 8) {
+        LOG_ERRT("Unexpected generator statistics\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_set_full_address(ctx, !differential);
+    trdb_set_implicit_ret(ctx, implicit_ret);
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    trdb_reset_decompression(ctx);
+    trdb_set_full_address(ctx, !differential);
+    trdb_set_implicit_ret(ctx, implicit_ret);
+    status = trdb_decompress_trace_vec(ctx, abfd, &packets, &instrs);
+    if (status < 0) {
+        LOG_ERRT("Decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* trapped instructions don't retire */
+    size_t i = 0;
+    size_t j;
+    struct tr_instr *instr;
+    TRDB_VEC_FOREACH(instr, j, &instrs)
+    {
+        while (i < samplecnt && samples[i].exception)
+            i++;
+        if (i == samplecnt || instr->iaddr != samples[i].iaddr) {
+            LOG_ERRT("Reconstruction differs at instruction %zu\n", j);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        i++;
+    }
+    /* only the instructions after the last packet are missing */
+    if (i < samplecnt / 2) {
+        LOG_ERRT("Reconstructed only %zu of %zu instructions\n", instrs.size,
+                 samplecnt);
+        status = TRDB_FAIL;
+    }
+
+fail:
+    trdb_gen_free(gen);
+    trdb_free(ctx);
+    free(samples);
+    free(chunked);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&instrs);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+/* Calls nest deeper than the return address stack, so returns that find it
+ * overwritten have to carry their address.
+ */
+static int test_ras_depth(const char *bin_path, uint32_t depth)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+    const size_t samplecnt   = 50000;
+    size_t full_packets      = 0;
+
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec instrs   = {0};
+    struct trdb_instr_vec parallel = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s, depth: %" PRIu32,
+             bin_path, depth);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_set_ras_depth(ctx, 0);
+    if (trdb_get_ras_depth(ctx) != 1) {
+        LOG_ERRT("Depth zero not clamped\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    trdb_set_ras_depth(ctx, TRDB_RAS_MAX + 1);
+    if (trdb_get_ras_depth(ctx) != TRDB_RAS_MAX) {
+        LOG_ERRT("Depth beyond TRDB_RAS_MAX not clamped\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_ras_depth");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    struct trdb_gen_config config;
+    trdb_gen_default_config(&config);
+    config.seed           = 7;
+    config.max_call_depth = 8;
+    config.exception_rate = 0.001;
+
+    if (trdb_generate_trace(ctx, abfd, &config, samplecnt, &samples) < 0) {
+        LOG_ERRT("Generating trace failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* as reference, how many packets a deep enough stack needs */
+    trdb_set_implicit_ret(ctx, true);
+    trdb_set_ras_tracking(ctx, true);
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    full_packets = packets.size;
+    trdb_free_packet_vec(&packets);
+
+    trdb_reset_compression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_set_ras_tracking(ctx, true);
+    trdb_set_ras_depth(ctx, depth);
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+    if (packets.size <= full_packets) {
+        LOG_ERRT("Overflowing stack needs no extra packets: %zu <= %zu\n",
+                 packets.size, full_packets);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_reset_decompression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_set_ras_tracking(ctx, true);
+    trdb_set_ras_depth(ctx, depth);
+    status = trdb_decompress_trace_vec(ctx, abfd, &packets, &instrs);
+    if (status < 0) {
+        LOG_ERRT("Decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* trapped instructions don't retire */
+    size_t i = 0;
+    size_t j;
+    struct tr_instr *instr;
+    TRDB_VEC_FOREACH(instr, j, &instrs)
+    {
+        while (i < samplecnt && samples[i].exception)
+            i++;
+        if (i == samplecnt || instr->iaddr != samples[i].iaddr) {
+            LOG_ERRT("Reconstruction differs at instruction %zu\n", j);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        i++;
+    }
+    if (i < samplecnt / 2) {
+        LOG_ERRT("Reconstructed only %zu of %zu instructions\n", instrs.size,
+                 samplecnt);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* the stacks of the chunks need no fixing up */
+    trdb_reset_decompression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_set_ras_tracking(ctx, true);
+    trdb_set_ras_depth(ctx, depth);
+    status = trdb_decompress_trace_parallel(ctx, abfd, &packets, &parallel, 4);
+    if (status < 0 || parallel.size != instrs.size) {
+        LOG_ERRT("Parallel decompression failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    TRDB_VEC_FOREACH(instr, j, &parallel)
+    {
+        if (instr->iaddr != TRDB_VEC_AT(&instrs, j)->iaddr) {
+            LOG_ERRT("Parallel decompression differs at %zu\n", j);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+fail:
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&instrs);
+    trdb_free_instr_vec(&parallel);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
+/* Events of a decompression have to match the instructions of a sequential
+ * one and come from its context
+ */
+struct event_order {
+    struct trdb_ctx *ctx;
+    const struct trdb_instr_vec *instrs;
+    size_t next;
+    size_t packets;
+    bool mismatch;
+};
+
+static void check_event_order(struct trdb_ctx *c, const struct trdb_event *event,
+                              void *data)
+{
+    struct event_order *order = data;
+    if (c != order->ctx)
+        order->mismatch = true;
+
+    if (event->kind == TRDB_EVENT_PACKET_DECODE) {
+        order->packets++;
+        return;
+    }
+    if (order->next >= order->instrs->size ||
+        event->instr->iaddr != TRDB_VEC_AT(order->instrs, order->next)->iaddr)
+        order->mismatch = true;
+    order->next++;
+}
+
+/* Calls nest deeper than the default return address stack without
+ * ras_tracking, so the returns past it have to carry their address. The walk
+ * starts at the c.jal of __rt_wait_event right before the epilogue of its
+ * caller and traps back there from the prologue, until the traps run out and
+ * the calls unwind.
+ */
+static int test_deep_calls(const char *bin_path)
+{
+    bfd *abfd                = NULL;
+    struct tr_instr *samples = NULL;
+    struct trdb_gen *gen     = NULL;
+    int status               = TRDB_SUCCESS;
+    struct trdb_ctx *ctx     = NULL;
+    const size_t samplecnt   = 50000;
+
+    struct trdb_packet_vec packets = {0};
+    struct trdb_instr_vec instrs   = {0};
+    struct trdb_instr_vec parallel = {0};
+
+    snprintf(func_args_buf, sizeof(func_args_buf), "%s", bin_path);
+
+    ctx = trdb_new();
+    if (!ctx) {
+        LOG_ERRT("Library context allocation failed.\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    bfd_init();
+    abfd = bfd_openr(bin_path, NULL);
+    if (!(abfd && bfd_check_format(abfd, bfd_object))) {
+        bfd_perror("test_deep_calls");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    struct trdb_gen_config config;
+    trdb_gen_default_config(&config);
+    config.seed           = 3;
+    config.start          = 0x1c008f68;
+    config.max_call_depth = 4 * TRDB_RAS_MAX;
+    config.interrupt_rate = 1;
+
+    if (trdb_gen_new(ctx, abfd, &config, &gen) < 0) {
+        LOG_ERRT("Creating generator failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    samples = malloc(samplecnt * sizeof(*samples));
+    if (!samples || trdb_gen_next(gen, samplecnt, samples) < 0) {
+        LOG_ERRT("Generating trace failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    struct trdb_gen_stats stats;
+    trdb_gen_get_stats(gen, &stats);
+    if (stats.max_depth <= TRDB_RAS_MAX || !stats.returns) {
+        LOG_ERRT("Calls nest only %u deep\n", stats.max_depth);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    trdb_set_implicit_ret(ctx, true);
+    for (size_t i = 0; i < samplecnt; i++) {
+        if (trdb_compress_trace_step_vec(ctx, &packets, &samples[i]) < 0) {
+            LOG_ERRT("Compress trace failed.\n");
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+    trdb_reset_decompression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    status = trdb_decompress_trace_vec(ctx, abfd, &packets, &instrs);
+    if (status < 0) {
+        LOG_ERRT("Decompression failed: %s\n",
+                 trdb_errstr(trdb_errcode(status)));
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* trapped instructions don't retire */
+    size_t i = 0;
+    size_t j;
+    struct tr_instr *instr;
+    TRDB_VEC_FOREACH(instr, j, &instrs)
+    {
+        while (i < samplecnt && samples[i].exception)
+            i++;
+        if (i == samplecnt || instr->iaddr != samples[i].iaddr) {
+            LOG_ERRT("Reconstruction differs at instruction %zu\n", j);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+        i++;
+    }
+    if (i < samplecnt / 2) {
+        LOG_ERRT("Reconstructed only %zu of %zu instructions\n", instrs.size,
+                 samplecnt);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+
+    /* chunks returning below their start are redone, without reporting
+     * their events twice
+     */
+    struct event_order order = {.ctx = ctx, .instrs = &instrs};
+    trdb_reset_decompression(ctx);
+    trdb_set_implicit_ret(ctx, true);
+    trdb_set_event_fn(ctx, check_event_order, &order);
+    status = trdb_decompress_trace_parallel(ctx, abfd, &packets, &parallel, 4);
+    if (status < 0 || parallel.size != instrs.size) {
+        LOG_ERRT("Parallel decompression failed\n");
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    if (order.mismatch || order.next != instrs.size ||
+        order.packets != packets.size) {
+        LOG_ERRT("Parallel decompression reported %zu packets and %zu "
+                 "instructions out of order\n",
+                 order.packets, order.next);
+        status = TRDB_FAIL;
+        goto fail;
+    }
+    TRDB_VEC_FOREACH(instr, j, &parallel)
+    {
+        if (instr->iaddr != TRDB_VEC_AT(&instrs, j)->iaddr) {
+            LOG_ERRT("Parallel decompression differs at %zu\n", j);
+            status = TRDB_FAIL;
+            goto fail;
+        }
+    }
+
+fail:
+    trdb_gen_free(gen);
+    trdb_free(ctx);
+    free(samples);
+    trdb_free_packet_vec(&packets);
+    trdb_free_instr_vec(&instrs);
+    trdb_free_instr_vec(&parallel);
+    if (abfd)
+        bfd_close(abfd);
+
+    return status;
+}
+
 /* make any directory in path if it doesn't exist*/
 static int mkdir_p(char *path)
 {
@@ -1481,12 +5650,25 @@ int main(int argc, char *argv[argc + 1])
 
     RUN_TEST(test_disasm_bfd);
     RUN_TEST(test_parse_stimuli_line);
+    RUN_TEST(test_sign_extendable_bits);
 
     RUN_TEST(test_parse_packets, "data/tx_spi");
+    RUN_TEST(test_parse_packets_vec, "data/tx_spi");
+    RUN_TEST(test_parse_packets_mapped, "data/trdb_stimuli");
+    RUN_TEST(test_instr_vec);
     RUN_TEST(test_trdb_dinfo_init, "data/interrupt");
+    RUN_TEST(test_generate_trace, "data/interrupt", false, false);
+    RUN_TEST(test_generate_trace, "data/interrupt", true, false);
+    RUN_TEST(test_generate_trace, "data/interrupt", true, true);
+    RUN_TEST(test_ras_depth, "data/interrupt", 1);
+    RUN_TEST(test_ras_depth, "data/interrupt", 2);
+    RUN_TEST(test_deep_calls, "data/interrupt");
 
     RUN_TEST(test_stimuli_to_tr_instr, "data/trdb_stimuli");
     RUN_TEST(test_stimuli_to_trace_list, "data/trdb_stimuli");
+    RUN_TEST(test_parse_traces_parallel, "data/trdb_stimuli");
+    RUN_TEST(test_binary_trace, "data/trdb_stimuli");
+    RUN_TEST(test_server, "data/trdb_stimuli");
     RUN_TEST(test_stimuli_to_packet_dump, "data/trdb_stimuli");
     /* NOTE: there is a memory leak ~230 bytes in riscv-dis.c with struct
      * riscv_subset for each instantiation of a disassembler.
@@ -1496,8 +5678,13 @@ int main(int argc, char *argv[argc + 1])
      */
     RUN_TEST(test_disassemble_trace_with_bfd, "data/interrupt",
              "data/trdb_stimuli");
+    RUN_TEST(test_disasm_cache, "data/interrupt", "data/trdb_stimuli");
+    RUN_TEST(test_line_index, "data/interrupt", "data/trdb_stimuli");
 
     RUN_TEST(test_compress_trace, "data/trdb_stimuli", "data/trdb_packets");
+    RUN_TEST(test_compress_trace_block, "data/trdb_stimuli");
+    RUN_TEST(test_serialize_packets, "data/trdb_stimuli");
+    RUN_TEST(test_bit_sink, "data/trdb_stimuli");
 
     for (unsigned j = 0; j < TRDB_ARRAY_SIZE(tv_cvs); j++) {
         const char *stim = tv_cvs[j];
@@ -1522,11 +5709,45 @@ int main(int argc, char *argv[argc + 1])
                 "test_compress_trace_differential(%s, true, false)\n", bin);
             record_skipped("test_compress_trace_differential(%s, true, true)\n",
                            bin);
+            record_skipped("test_decompress_decoders(%s)\n", bin);
+            record_skipped("test_decompress_stream(%s)\n", bin);
+            record_skipped("test_follow(%s)\n", bin);
+            record_skipped("test_decompress_trace_vec(%s)\n", bin);
+            record_skipped("test_decompress_sections(%s)\n", bin);
+            record_skipped("test_image(%s)\n", bin);
+            record_skipped("test_cfg(%s)\n", bin);
+            record_skipped("test_profile(%s)\n", bin);
+            record_skipped("test_decompress_trace_parallel(%s)\n", bin);
+            record_skipped("test_compress_resync(%s)\n", bin);
+            record_skipped("test_container(%s)\n", bin);
+            record_skipped("test_event_fn(%s)\n", bin);
+            record_skipped("test_perf_stats(%s)\n", bin);
+            record_skipped("test_save_state(%s)\n", bin);
             continue;
         }
         RUN_TEST(test_decompress_trace, bin, stim);
         RUN_TEST(test_decompress_trace_differential, bin, stim, true, false);
         RUN_TEST(test_decompress_trace_differential, bin, stim, true, true);
+        RUN_TEST(test_decompress_decoders, bin, stim, false);
+        RUN_TEST(test_decompress_decoders, bin, stim, true);
+        RUN_TEST(test_decompress_stream, bin, stim, false);
+        RUN_TEST(test_decompress_stream, bin, stim, true);
+        RUN_TEST(test_follow, bin, stim);
+        RUN_TEST(test_decompress_trace_vec, bin, stim, false);
+        RUN_TEST(test_decompress_trace_vec, bin, stim, true);
+        RUN_TEST(test_decompress_sections, bin, stim);
+        RUN_TEST(test_image, bin, stim);
+        RUN_TEST(test_cfg, bin, stim);
+        RUN_TEST(test_profile, bin, stim);
+        RUN_TEST(test_decompress_trace_parallel, bin, stim, false, false);
+        RUN_TEST(test_decompress_trace_parallel, bin, stim, true, true);
+        RUN_TEST(test_compress_resync, bin, stim, false);
+        RUN_TEST(test_compress_resync, bin, stim, true);
+        RUN_TEST(test_container, bin, stim, false);
+        RUN_TEST(test_container, bin, stim, true);
+        RUN_TEST(test_event_fn, bin, stim);
+        RUN_TEST(test_perf_stats, bin, stim);
+        RUN_TEST(test_save_state, bin, stim);
     }
 
 #endif
@@ -16,6 +16,7 @@ struct trdb_config {
      * set-trace
      */
     uint64_t resync_max;
+    uint64_t resync_packets_max;
     /* bool iaddress_lsb_p; */
     /* bool implicit_except; */
     /* bool set_trace; */
@@ -33,14 +34,20 @@ struct trdb_config {
     bool use_pulp_sext;
     /* Don't regard ret's as unpredictable discontinuity */
     bool implicit_ret;
+    /* entries of the return address stack, see trdb_set_ras_depth() */
+    uint32_t ras_depth;
+    /* the compression follows the return address stack of the decompression
+     * and sync packets empty it, see trdb_set_ras_tracking()
+     */
+    bool ras_tracking;
     /* Use additional packets to jump over vector table */
     bool pulp_vector_table_packet;
     /* whether we compress full branch maps */
     bool compress_full_branch_map;
-
-    /* TODO: move this */
-    /* set to true to always diassemble to most general representation */
-    bool no_aliases;
+    /* remember decoded instructions instead of calling libopcodes each time */
+    bool decode_cache;
+    /* classify instructions ourselves when no disassembly text is needed */
+    bool native_decode;
 };
 
 struct trdb_stats {
@@ -74,8 +81,24 @@ struct trdb_ctx {
     struct disassembler_unit *dunit;
     /* compression statistics */
     struct trdb_stats stats;
+    /* hot path timings and counters, see trdb_get_perf_stats() */
+    struct trdb_perf_stats perf;
     /* desired logging level and custom logging hook*/
     int log_priority;
     void (*log_fn)(struct trdb_ctx *ctx, int priority, const char *file,
                    int line, const char *fn, const char *format, va_list args);
+    /* structured events for tooling, see trdb_set_event_fn() */
+    void (*event_fn)(struct trdb_ctx *ctx, const struct trdb_event *event,
+                     void *data);
+    void *event_data;
+    /* memoized instruction decoding, see trdb_set_decode_cache() */
+    struct trdb_decode_cache *dcache;
+    /* loaded code sections, kept across decompression runs on the same bfd */
+    struct trdb_section_table *stable;
+    /* shared code sections and symbols, see trdb_set_image() */
+    struct trdb_image *image;
+    /* serializes bfd and libopcodes access if we share abfd among threads */
+    pthread_mutex_t *bfd_lock;
+    /* serializes log_fn and event_fn if several threads call them */
+    pthread_mutex_t *hook_lock;
 };